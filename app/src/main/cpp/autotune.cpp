@@ -0,0 +1,508 @@
+﻿#include "autotune.h"
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <utility>
+
+#define LOG_TAG "QwenCoderBridge"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+namespace genui {
+
+namespace {
+
+// Shape of a typical request, used to weigh prefill speed against decode
+// speed for settings that affect both.
+constexpr double kTypicalPromptTokens = 400.0;
+constexpr double kTypicalOutputTokens = 600.0;
+constexpr int32_t kBatchSizes[] = {64, 128, 256, 512};
+constexpr int32_t kWarmUpTokens = 8;
+constexpr int kProfileVersion = 1;
+constexpr size_t kHashSpan = 1 << 20;
+
+static double elapsed_ms(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const auto *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static double request_ms(double prefill_tps, double decode_tps) {
+    if (prefill_tps <= 0.0 || decode_tps <= 0.0) {
+        return 1e30;
+    }
+    return kTypicalPromptTokens * 1000.0 / prefill_tps + kTypicalOutputTokens * 1000.0 / decode_tps;
+}
+
+// llama.cpp reports the compute buffer it reserves for a context only in its
+// log, one line per buffer type; open() sums them while it creates one.
+static void sum_compute_buffers(ggml_log_level /*level*/, const char *text, void *user_data) {
+    static constexpr char kMarker[] = "compute buffer size = ";
+    if (const char *at = std::strstr(text, kMarker)) {
+        *static_cast<double *>(user_data) += std::atof(at + sizeof(kMarker) - 1);
+    }
+}
+
+static const char *kv_type_name(ggml_type type) {
+    return type == GGML_TYPE_Q8_0 ? "q8_0" : "f16";
+}
+
+static bool parse_kv_type(const std::string &name, ggml_type &type) {
+    if (name == "f16") {
+        type = GGML_TYPE_F16;
+    } else if (name == "q8_0") {
+        type = GGML_TYPE_Q8_0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static const char *core_class_name(CoreClass cores) {
+    switch (cores) {
+        case CoreClass::kPerformance:
+            return "performance";
+        case CoreClass::kPrime:
+            return "prime";
+        default:
+            return "all";
+    }
+}
+
+static bool parse_core_class(const std::string &name, CoreClass &cores) {
+    for (const CoreClass candidate : {CoreClass::kAll, CoreClass::kPerformance, CoreClass::kPrime}) {
+        if (name == core_class_name(candidate)) {
+            cores = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
+std::string RuntimeProfile::describe() const {
+    char text[256];
+    snprintf(text, sizeof(text),
+             "batch=%d ubatch=%d flash_attn=%d kv=%s prefill=%s/%d decode=%s/%d (%.1f / %.1f tok/s)",
+             n_batch, n_ubatch, flash_attn ? 1 : 0, kv_type_name(kv_type), core_class_name(prefill_cores),
+             prefill_threads, core_class_name(decode_cores), decode_threads, prefill_tps, decode_tps);
+    return text;
+}
+
+RuntimeProfile with_flash_attn(const RuntimeProfile &profile, bool enabled) {
+    RuntimeProfile result = profile;
+    result.flash_attn = enabled;
+    if (!enabled) {
+        result.kv_type = GGML_TYPE_F16;
+    }
+    return result;
+}
+
+std::string AttentionReport::describe() const {
+    char text[96];
+    snprintf(text, sizeof(text), "flash_attn=%d: compute buffer %.1f MiB", flash_attn ? 1 : 0, compute_buffer_mib);
+    std::string result = text;
+    for (const DepthSpeed &depth : depths) {
+        snprintf(text, sizeof(text), "; prompt %d: prefill %.1f tok/s, decode %.1f tok/s", depth.prompt_tokens,
+                 depth.prefill_tps, depth.decode_tps);
+        result += text;
+    }
+    return result;
+}
+
+std::string profile_key(const CpuTopology &topology, const std::string &model_path) {
+    uint64_t hash = 1469598103934665603ULL;
+    const std::string shape = topology.describe();
+    hash = fnv1a(hash, shape.data(), shape.size());
+
+    std::ifstream file(model_path, std::ios::binary | std::ios::ate);
+    const int64_t size = file ? static_cast<int64_t>(file.tellg()) : -1;
+    hash = fnv1a(hash, &size, sizeof(size));
+    std::vector<char> span(kHashSpan);
+    for (const int64_t offset : {int64_t(0), std::max<int64_t>(0, size - static_cast<int64_t>(kHashSpan))}) {
+        file.clear();
+        file.seekg(offset);
+        file.read(span.data(), static_cast<std::streamsize>(span.size()));
+        hash = fnv1a(hash, span.data(), static_cast<size_t>(file.gcount()));
+    }
+
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long) hash);
+    return key;
+}
+
+std::string profile_path(const std::string &dir, const std::string &key) {
+    return dir + "/tune-" + key + ".profile";
+}
+
+bool load_profile(const std::string &path, const std::string &key, RuntimeProfile &profile) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::map<std::string, std::string> values;
+    std::string line;
+    while (std::getline(file, line)) {
+        const size_t eq = line.find('=');
+        if (eq != std::string::npos) {
+            values[line.substr(0, eq)] = line.substr(eq + 1);
+        }
+    }
+    if (values["version"] != std::to_string(kProfileVersion) || values["key"] != key) {
+        return false;
+    }
+
+    RuntimeProfile loaded;
+    try {
+        loaded.n_batch = std::stoi(values.at("n_batch"));
+        loaded.n_ubatch = std::stoi(values.at("n_ubatch"));
+        loaded.flash_attn = values.at("flash_attn") == "1";
+        loaded.prefill_threads = std::stoi(values.at("prefill_threads"));
+        loaded.decode_threads = std::stoi(values.at("decode_threads"));
+        loaded.prefill_tps = std::stod(values.at("prefill_tps"));
+        loaded.decode_tps = std::stod(values.at("decode_tps"));
+    } catch (const std::exception &) {
+        return false;
+    }
+    if (!parse_kv_type(values["kv_type"], loaded.kv_type)
+        || !parse_core_class(values["prefill_cores"], loaded.prefill_cores)
+        || !parse_core_class(values["decode_cores"], loaded.decode_cores)
+        || loaded.n_batch <= 0 || loaded.n_ubatch <= 0 || loaded.n_ubatch > loaded.n_batch) {
+        return false;
+    }
+    profile = loaded;
+    return true;
+}
+
+bool save_profile(const std::string &path, const std::string &key, const RuntimeProfile &profile) {
+    const std::string temp = path + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::trunc);
+        if (!file) {
+            return false;
+        }
+        file << "version=" << kProfileVersion << '\n'
+             << "key=" << key << '\n'
+             << "n_batch=" << profile.n_batch << '\n'
+             << "n_ubatch=" << profile.n_ubatch << '\n'
+             << "flash_attn=" << (profile.flash_attn ? 1 : 0) << '\n'
+             << "kv_type=" << kv_type_name(profile.kv_type) << '\n'
+             << "prefill_cores=" << core_class_name(profile.prefill_cores) << '\n'
+             << "prefill_threads=" << profile.prefill_threads << '\n'
+             << "decode_cores=" << core_class_name(profile.decode_cores) << '\n'
+             << "decode_threads=" << profile.decode_threads << '\n'
+             << "prefill_tps=" << profile.prefill_tps << '\n'
+             << "decode_tps=" << profile.decode_tps << '\n';
+        if (!file) {
+            return false;
+        }
+    }
+    return std::rename(temp.c_str(), path.c_str()) == 0;
+}
+
+Autotuner::Autotuner(llama_model *model, const CpuTopology &topology, const Options &options)
+        : model_(model),
+          topology_(topology),
+          options_(options) {
+    for (const CoreClass cores : {CoreClass::kAll, CoreClass::kPerformance, CoreClass::kPrime}) {
+        Candidate candidate{cores, topology_.thread_set(cores)};
+        const bool duplicate = std::any_of(decode_candidates_.begin(), decode_candidates_.end(),
+                [&candidate](const Candidate &other) { return other.set.cpus == candidate.set.cpus; });
+        if (duplicate) {
+            continue;
+        }
+        // Prefill is compute-bound and never gains from dropping to the
+        // prime cores alone when there are others.
+        if (cores != CoreClass::kPrime || prefill_candidates_.empty()) {
+            prefill_candidates_.push_back(candidate);
+        }
+        decode_candidates_.push_back(candidate);
+    }
+}
+
+bool Autotuner::out_of_budget() {
+    exhausted_ = exhausted_ || elapsed_ms(start_, Clock::now()) >= options_.budget_ms;
+    return exhausted_;
+}
+
+void Autotuner::use(llama_context *ctx, const ThreadSet &set) {
+    if (!set.cpus.empty()) {
+        pin_current_thread(set.cpus);
+    }
+    llama_set_n_threads(ctx, static_cast<uint32_t>(set.threads), static_cast<uint32_t>(set.threads));
+}
+
+// Feeds `count` synthetic tokens at positions [pos, pos + count) in batches of
+// `n_batch`. Only the speed matters, so the ids just cycle through the vocab.
+bool Autotuner::feed(llama_context *ctx, int32_t count, int32_t pos, int32_t n_batch) {
+    for (int32_t done = 0; done < count;) {
+        const int32_t take = std::min({n_batch, count - done, batch_capacity_});
+        batch_.n_tokens = take;
+        for (int32_t j = 0; j < take; ++j) {
+            const int32_t at = pos + done + j;
+            batch_.token[j] = static_cast<llama_token>((static_cast<int64_t>(at) * 7919 + 13) % n_vocab_);
+            batch_.pos[j] = at;
+            batch_.n_seq_id[j] = 1;
+            batch_.seq_id[j][0] = 0;
+            batch_.logits[j] = done + j == count - 1;
+        }
+        if (llama_decode(ctx, batch_) != 0) {
+            return false;
+        }
+        done += take;
+    }
+    return true;
+}
+
+llama_context *Autotuner::open(const RuntimeProfile &profile, double *compute_buffer_mib) {
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = options_.n_ctx;
+    cparams.n_batch = static_cast<uint32_t>(profile.n_batch);
+    cparams.n_ubatch = static_cast<uint32_t>(profile.n_ubatch);
+    cparams.n_seq_max = 1;
+    cparams.flash_attn = profile.flash_attn;
+    cparams.type_k = profile.kv_type;
+    cparams.type_v = profile.kv_type;
+    double buffers_mib = 0.0;
+    if (compute_buffer_mib) {
+        llama_log_set(sum_compute_buffers, &buffers_mib);
+    }
+    llama_context *ctx = llama_new_context_with_model(model_, cparams);
+    if (compute_buffer_mib) {
+        llama_log_set(nullptr, nullptr);
+        *compute_buffer_mib = buffers_mib;
+    }
+    if (!ctx) {
+        LOGE("Autotune: context rejected (batch=%d ubatch=%d flash_attn=%d kv=%s)", profile.n_batch,
+             profile.n_ubatch, profile.flash_attn ? 1 : 0, kv_type_name(profile.kv_type));
+        return nullptr;
+    }
+    // The first graphs of a context allocate their buffers; keep that out of
+    // the timed runs.
+    use(ctx, prefill_candidates_.front().set);
+    if (!feed(ctx, kWarmUpTokens, 0, kWarmUpTokens) || !feed(ctx, 1, kWarmUpTokens, 1)) {
+        llama_free(ctx);
+        return nullptr;
+    }
+    return ctx;
+}
+
+double Autotuner::prefill_tps(llama_context *ctx, const ThreadSet &set, int32_t n_batch) {
+    llama_kv_cache_clear(ctx);
+    use(ctx, set);
+    const auto start = Clock::now();
+    if (!feed(ctx, options_.prefill_tokens, 0, n_batch)) {
+        return 0.0;
+    }
+    const double ms = elapsed_ms(start, Clock::now());
+    ++trials_;
+    return ms > 0.0 ? options_.prefill_tokens * 1000.0 / ms : 0.0;
+}
+
+double Autotuner::decode_tps(llama_context *ctx, const ThreadSet &prefill, const ThreadSet &decode, int32_t n_batch) {
+    llama_kv_cache_clear(ctx);
+    use(ctx, prefill);
+    if (!feed(ctx, options_.decode_context, 0, n_batch)) {
+        return 0.0;
+    }
+    return decode_tps_at(ctx, decode, options_.decode_context);
+}
+
+// Times single-token steps after the `pos` tokens already in the cache.
+double Autotuner::decode_tps_at(llama_context *ctx, const ThreadSet &decode, int32_t pos) {
+    use(ctx, decode);
+    const auto start = Clock::now();
+    for (int32_t i = 0; i < options_.decode_tokens; ++i) {
+        if (!feed(ctx, 1, pos + i, 1)) {
+            return 0.0;
+        }
+    }
+    const double ms = elapsed_ms(start, Clock::now());
+    ++trials_;
+    return ms > 0.0 ? options_.decode_tokens * 1000.0 / ms : 0.0;
+}
+
+void Autotuner::begin(int32_t n_batch) {
+    start_ = Clock::now();
+    trials_ = 0;
+    exhausted_ = false;
+    n_vocab_ = std::max(1, llama_n_vocab(model_));
+    batch_capacity_ = std::max(n_batch, kBatchSizes[sizeof(kBatchSizes) / sizeof(kBatchSizes[0]) - 1]);
+    batch_ = llama_batch_init(batch_capacity_, 0, 1);
+}
+
+void Autotuner::finish() {
+    llama_batch_free(batch_);
+    batch_ = llama_batch{};
+    pin_current_thread(topology_.select(CoreClass::kAll));
+}
+
+RuntimeProfile Autotuner::measure(const RuntimeProfile &base) {
+    begin(base.n_batch);
+    RuntimeProfile measured = base;
+    measured.prefill_tps = 0.0;
+    measured.decode_tps = 0.0;
+    const ThreadSet prefill_set = topology_.thread_set(base.prefill_cores, base.prefill_threads);
+    const ThreadSet decode_set = topology_.thread_set(base.decode_cores, base.decode_threads);
+    if (llama_context *ctx = open(measured)) {
+        measured.prefill_tps = prefill_tps(ctx, prefill_set, measured.n_batch);
+        measured.decode_tps = decode_tps(ctx, prefill_set, decode_set, measured.n_batch);
+        llama_free(ctx);
+    }
+    finish();
+    return measured;
+}
+
+RuntimeProfile Autotuner::choose_flash_attn(const RuntimeProfile &base) {
+    RuntimeProfile best = base;
+    for (const bool enabled : {false, true}) {
+        const RuntimeProfile candidate = measure(with_flash_attn(base, enabled));
+        LOGI("Flash attention trial flash_attn=%d: prefill %.1f tok/s, decode %.1f tok/s", enabled ? 1 : 0,
+             candidate.prefill_tps, candidate.decode_tps);
+        if (candidate.tuned() && (!best.tuned() || request_ms(candidate.prefill_tps, candidate.decode_tps)
+                                                   < request_ms(best.prefill_tps, best.decode_tps))) {
+            best = candidate;
+        }
+    }
+    return best;
+}
+
+AttentionReport Autotuner::attention_report(const RuntimeProfile &base, const std::vector<int32_t> &prompt_lengths) {
+    begin(base.n_batch);
+    AttentionReport report;
+    report.flash_attn = base.flash_attn;
+    const ThreadSet prefill_set = topology_.thread_set(base.prefill_cores, base.prefill_threads);
+    const ThreadSet decode_set = topology_.thread_set(base.decode_cores, base.decode_threads);
+    if (llama_context *ctx = open(base, &report.compute_buffer_mib)) {
+        for (const int32_t length : prompt_lengths) {
+            DepthSpeed depth;
+            depth.prompt_tokens = length;
+            llama_kv_cache_clear(ctx);
+            use(ctx, prefill_set);
+            const auto start = Clock::now();
+            if (length + options_.decode_tokens <= static_cast<int32_t>(options_.n_ctx)
+                && feed(ctx, length, 0, base.n_batch)) {
+                const double ms = elapsed_ms(start, Clock::now());
+                depth.prefill_tps = ms > 0.0 ? length * 1000.0 / ms : 0.0;
+                depth.decode_tps = decode_tps_at(ctx, decode_set, length);
+            }
+            LOGI("Attention report flash_attn=%d prompt=%d: prefill %.1f tok/s, decode %.1f tok/s",
+                 base.flash_attn ? 1 : 0, length, depth.prefill_tps, depth.decode_tps);
+            report.depths.push_back(depth);
+        }
+        llama_free(ctx);
+    }
+    finish();
+    return report;
+}
+
+RuntimeProfile Autotuner::run(const RuntimeProfile &base) {
+    begin(base.n_batch);
+
+    RuntimeProfile best = base;
+    best.prefill_tps = 0.0;
+    best.decode_tps = 0.0;
+    ThreadSet prefill_set = topology_.thread_set(base.prefill_cores, base.prefill_threads);
+
+    // Thread sets, under the base context settings.
+    if (llama_context *ctx = open(best)) {
+        for (const Candidate &candidate : prefill_candidates_) {
+            if (out_of_budget()) {
+                break;
+            }
+            const double tps = prefill_tps(ctx, candidate.set, best.n_batch);
+            LOGI("Autotune prefill: %d threads on cpus %s: %.1f tok/s", candidate.set.threads,
+                 format_cpus(candidate.set.cpus).c_str(), tps);
+            if (tps > best.prefill_tps) {
+                best.prefill_tps = tps;
+                best.prefill_cores = candidate.cores;
+                best.prefill_threads = candidate.set.threads;
+                prefill_set = candidate.set;
+            }
+        }
+        for (const Candidate &candidate : decode_candidates_) {
+            if (out_of_budget()) {
+                break;
+            }
+            const double tps = decode_tps(ctx, prefill_set, candidate.set, best.n_batch);
+            LOGI("Autotune decode: %d threads on cpus %s: %.1f tok/s", candidate.set.threads,
+                 format_cpus(candidate.set.cpus).c_str(), tps);
+            if (tps > best.decode_tps) {
+                best.decode_tps = tps;
+                best.decode_cores = candidate.cores;
+                best.decode_threads = candidate.set.threads;
+            }
+        }
+        llama_free(ctx);
+    }
+    const ThreadSet decode_set = topology_.thread_set(best.decode_cores, best.decode_threads);
+
+    // Batch sizes only shape prompt processing.
+    for (const int32_t n_batch : kBatchSizes) {
+        if (!best.tuned() || n_batch == best.n_batch || out_of_budget()) {
+            continue;
+        }
+        RuntimeProfile candidate = best;
+        candidate.n_batch = n_batch;
+        candidate.n_ubatch = n_batch;
+        llama_context *ctx = open(candidate);
+        if (!ctx) {
+            continue;
+        }
+        const double tps = prefill_tps(ctx, prefill_set, n_batch);
+        llama_free(ctx);
+        LOGI("Autotune batch=%d: %.1f tok/s", n_batch, tps);
+        if (tps > best.prefill_tps) {
+            best.n_batch = n_batch;
+            best.n_ubatch = n_batch;
+            best.prefill_tps = tps;
+        }
+    }
+
+    // Flash attention and the KV cache type change both phases. A quantized V
+    // cache needs flash attention.
+    const std::pair<bool, ggml_type> attention[] = {
+            {false, GGML_TYPE_F16}, {true, GGML_TYPE_F16}, {true, GGML_TYPE_Q8_0}};
+    for (const auto &variant : attention) {
+        if (!best.tuned() || (variant.first == best.flash_attn && variant.second == best.kv_type)
+            || out_of_budget()) {
+            continue;
+        }
+        RuntimeProfile candidate = best;
+        candidate.flash_attn = variant.first;
+        candidate.kv_type = variant.second;
+        llama_context *ctx = open(candidate);
+        if (!ctx) {
+            continue;
+        }
+        candidate.prefill_tps = prefill_tps(ctx, prefill_set, candidate.n_batch);
+        candidate.decode_tps = out_of_budget() ? 0.0 : decode_tps(ctx, prefill_set, decode_set, candidate.n_batch);
+        llama_free(ctx);
+        LOGI("Autotune flash_attn=%d kv=%s: prefill %.1f tok/s, decode %.1f tok/s", candidate.flash_attn ? 1 : 0,
+             kv_type_name(candidate.kv_type), candidate.prefill_tps, candidate.decode_tps);
+        if (request_ms(candidate.prefill_tps, candidate.decode_tps) < request_ms(best.prefill_tps, best.decode_tps)) {
+            best = candidate;
+        }
+    }
+
+    finish();
+    LOGI("Autotune finished: %d trials in %.0f ms%s: %s", trials_, elapsed_ms(start_, Clock::now()),
+         exhausted_ ? " (budget exhausted)" : "", best.describe().c_str());
+    return best;
+}
+
+}  // namespace genui
@@ -0,0 +1,132 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cpu_topology.h"
+#include "llama.h"
+
+namespace genui {
+
+// Everything about how the bridge runs a model that is worth tuning per
+// device: the settings fixed when the llama context is created, and the core
+// class and width of the prefill and decode thread sets. The defaults are the
+// untuned settings.
+struct RuntimeProfile {
+    int32_t n_batch = 128;
+    int32_t n_ubatch = 128;
+    bool flash_attn = false;
+    ggml_type kv_type = GGML_TYPE_F16;  // K and V cache
+    CoreClass prefill_cores = CoreClass::kAll;
+    int32_t prefill_threads = 0;  // 0: one per core of the class
+    CoreClass decode_cores = CoreClass::kPerformance;
+    int32_t decode_threads = 0;
+    // Measured by the autotuner; 0 for an untuned profile.
+    double prefill_tps = 0.0;
+    double decode_tps = 0.0;
+
+    bool tuned() const { return prefill_tps > 0.0 && decode_tps > 0.0; }
+    std::string describe() const;
+};
+
+// `profile` with flash attention set. A quantized V cache needs flash
+// attention, so turning it off also returns the KV cache to F16.
+RuntimeProfile with_flash_attn(const RuntimeProfile &profile, bool enabled);
+
+// Prefill speed for a prompt of some length, and decode speed right after it,
+// attending over that prompt.
+struct DepthSpeed {
+    int32_t prompt_tokens = 0;
+    double prefill_tps = 0.0;
+    double decode_tps = 0.0;
+};
+
+// How one attention setting behaves as prompts grow.
+struct AttentionReport {
+    bool flash_attn = false;
+    double compute_buffer_mib = 0.0;  // reserved by llama.cpp for the context
+    std::vector<DepthSpeed> depths;
+
+    std::string describe() const;
+};
+
+// Identifies a (device, model) pair: the CPU topology the process sees and a
+// hash of the model file's size, head and tail (hashing a multi-gigabyte file
+// whole would cost more than loading it).
+std::string profile_key(const CpuTopology &topology, const std::string &model_path);
+
+// Profiles are small key=value files named after their key.
+std::string profile_path(const std::string &dir, const std::string &key);
+bool load_profile(const std::string &path, const std::string &key, RuntimeProfile &profile);
+bool save_profile(const std::string &path, const std::string &key, const RuntimeProfile &profile);
+
+// Finds the fastest settings for a model on this device with short, bounded
+// trials on the calling thread: a fixed number of prompt tokens for prefill,
+// a fixed number of single-token steps for decode. Thread sets are compared
+// first, then batch sizes (prefill only), then flash attention and the KV
+// cache type, which affect both; those are judged by the time of a typical
+// request. When the budget runs out the best settings so far are kept.
+// The model must not be in use by another context while this runs.
+class Autotuner {
+public:
+    struct Options {
+        double budget_ms = 60000.0;
+        int32_t prefill_tokens = 256;
+        int32_t decode_context = 128;  // tokens in the cache before the decode steps
+        int32_t decode_tokens = 24;
+        uint32_t n_ctx = 1024;
+    };
+
+    Autotuner(llama_model *model, const CpuTopology &topology, const Options &options);
+
+    // Starts from `base` and returns it with every setting the trials improved.
+    RuntimeProfile run(const RuntimeProfile &base);
+
+    // Prefill and decode speed of `base` as it is, one trial each.
+    RuntimeProfile measure(const RuntimeProfile &base);
+
+    // Measures `base` with flash attention on and off and returns the faster
+    // by the time of a typical request, or `base` if neither could run.
+    RuntimeProfile choose_flash_attn(const RuntimeProfile &base);
+
+    // Prefill and decode speed of `base` at each prompt length, which with
+    // the decode steps must fit in options.n_ctx.
+    AttentionReport attention_report(const RuntimeProfile &base, const std::vector<int32_t> &prompt_lengths);
+
+    int32_t trials() const { return trials_; }
+    bool exhausted() const { return exhausted_; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Candidate {
+        CoreClass cores;
+        ThreadSet set;
+    };
+
+    void begin(int32_t n_batch);
+    void finish();
+    llama_context *open(const RuntimeProfile &profile, double *compute_buffer_mib = nullptr);
+    void use(llama_context *ctx, const ThreadSet &set);
+    bool feed(llama_context *ctx, int32_t count, int32_t pos, int32_t n_batch);
+    double prefill_tps(llama_context *ctx, const ThreadSet &set, int32_t n_batch);
+    double decode_tps(llama_context *ctx, const ThreadSet &prefill, const ThreadSet &decode, int32_t n_batch);
+    double decode_tps_at(llama_context *ctx, const ThreadSet &decode, int32_t pos);
+    bool out_of_budget();
+
+    llama_model *model_;
+    const CpuTopology &topology_;
+    Options options_;
+    std::vector<Candidate> prefill_candidates_;
+    std::vector<Candidate> decode_candidates_;
+    Clock::time_point start_;
+    llama_batch batch_{};
+    int32_t batch_capacity_ = 0;
+    int32_t n_vocab_ = 0;
+    int32_t trials_ = 0;
+    bool exhausted_ = false;
+};
+
+}  // namespace genui
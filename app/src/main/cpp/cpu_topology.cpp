@@ -0,0 +1,159 @@
+﻿#include "cpu_topology.h"
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+
+namespace genui {
+
+namespace {
+
+static int64_t read_number(const std::string &path) {
+    std::ifstream file(path);
+    int64_t value = 0;
+    if (!(file >> value)) {
+        return 0;
+    }
+    return value;
+}
+
+}  // namespace
+
+CpuTopology CpuTopology::discover(const std::string &root) {
+    CpuTopology topology;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return topology;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        const std::string dir = root + "/cpu" + std::to_string(cpu);
+        CpuCore core;
+        core.id = cpu;
+        core.max_freq_khz = read_number(dir + "/cpufreq/cpuinfo_max_freq");
+        core.capacity = read_number(dir + "/cpu_capacity");
+        if (core.capacity <= 0) {
+            core.capacity = core.max_freq_khz;
+        }
+        topology.cores_.push_back(core);
+    }
+
+    std::vector<int64_t> capacities;
+    for (const CpuCore &core : topology.cores_) {
+        capacities.push_back(core.capacity);
+    }
+    std::sort(capacities.begin(), capacities.end(), std::greater<int64_t>());
+    capacities.erase(std::unique(capacities.begin(), capacities.end()), capacities.end());
+    for (CpuCore &core : topology.cores_) {
+        core.cluster = static_cast<int32_t>(
+                std::find(capacities.begin(), capacities.end(), core.capacity) - capacities.begin());
+    }
+    topology.clusters_ = static_cast<int32_t>(capacities.size());
+    return topology;
+}
+
+std::vector<int> CpuTopology::select(CoreClass which) const {
+    const int64_t fastest = cores_.empty() ? 0 : std::max_element(cores_.begin(), cores_.end(),
+            [](const CpuCore &a, const CpuCore &b) { return a.capacity < b.capacity; })->capacity;
+    std::vector<int> cpus;
+    for (const CpuCore &core : cores_) {
+        const bool wanted = which == CoreClass::kAll
+                            || (which == CoreClass::kPrime && core.cluster == 0)
+                            || (which == CoreClass::kPerformance && core.capacity * 2 >= fastest);
+        if (wanted) {
+            cpus.push_back(core.id);
+        }
+    }
+    return cpus;
+}
+
+std::vector<int> CpuTopology::fastest(int threads) const {
+    std::vector<int> cpus;
+    for (int32_t cluster = 0; cluster < clusters_ && static_cast<int>(cpus.size()) < threads; ++cluster) {
+        for (const CpuCore &core : cores_) {
+            if (core.cluster == cluster) {
+                cpus.push_back(core.id);
+            }
+        }
+    }
+    std::sort(cpus.begin(), cpus.end());
+    return cpus;
+}
+
+ThreadSet CpuTopology::thread_set(CoreClass which, int max_threads) const {
+    ThreadSet set;
+    set.cpus = select(which);
+    if (set.cpus.empty()) {
+        set.threads = max_threads > 0 ? max_threads : set.threads;
+        return set;
+    }
+    if (max_threads > 0 && static_cast<int>(set.cpus.size()) > max_threads) {
+        std::stable_sort(set.cpus.begin(), set.cpus.end(), [this](int a, int b) {
+            return cores_[index_of(a)].cluster < cores_[index_of(b)].cluster;
+        });
+        set.cpus.resize(static_cast<size_t>(max_threads));
+        std::sort(set.cpus.begin(), set.cpus.end());
+    }
+    set.threads = static_cast<int32_t>(set.cpus.size());
+    return set;
+}
+
+size_t CpuTopology::index_of(int cpu) const {
+    return static_cast<size_t>(std::find_if(cores_.begin(), cores_.end(),
+                                            [cpu](const CpuCore &core) { return core.id == cpu; }) - cores_.begin());
+}
+
+std::string CpuTopology::describe() const {
+    std::string text;
+    for (int32_t cluster = clusters_ - 1; cluster >= 0; --cluster) {
+        std::vector<int> cpus;
+        const CpuCore *sample = nullptr;
+        for (const CpuCore &core : cores_) {
+            if (core.cluster == cluster) {
+                cpus.push_back(core.id);
+                sample = &core;
+            }
+        }
+        char info[64];
+        snprintf(info, sizeof(info), ":cap=%lld@%.1fGHz", (long long) sample->capacity,
+                 (double) sample->max_freq_khz / 1e6);
+        text += (text.empty() ? "" : " ") + format_cpus(cpus) + info;
+    }
+    return text;
+}
+
+std::string format_cpus(const std::vector<int> &cpus) {
+    std::string text;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) {
+            ++j;
+        }
+        text += (text.empty() ? "" : ",") + std::to_string(cpus[i]);
+        if (j > i) {
+            text += "-" + std::to_string(cpus[j]);
+        }
+        i = j + 1;
+    }
+    return text;
+}
+
+bool pin_current_thread(const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (const int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+}  // namespace genui
@@ -0,0 +1,67 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace genui {
+
+// One logical CPU as the kernel describes it under /sys/devices/system/cpu.
+struct CpuCore {
+    int id = 0;
+    int64_t capacity = 0;      // cpu_capacity (1024 = fastest); cpuinfo_max_freq when absent
+    int64_t max_freq_khz = 0;  // 0 when cpufreq is unreadable
+    int32_t cluster = 0;       // 0 = the fastest class of cores
+};
+
+// Cores and width of llama_decode for one kind of step.
+struct ThreadSet {
+    std::vector<int> cpus;  // empty: leave the caller's mask alone
+    int32_t threads = 4;
+};
+
+enum class CoreClass : int32_t {
+    kAll = 0,          // every core the process may run on
+    kPerformance = 1,  // cores with at least half the capacity of the fastest
+    kPrime = 2,        // only the fastest class
+};
+
+// The cores this process may run on, grouped into classes of equal capacity.
+// Discovery intersects sysfs with sched_getaffinity(), so a host run under
+// `taskset -c ...` sees the topology of that subset. Without capacity or
+// frequency information every core lands in one class.
+class CpuTopology {
+public:
+    // `root` is the sysfs cpu directory; host tests may point it elsewhere.
+    static CpuTopology discover(const std::string &root = "/sys/devices/system/cpu");
+
+    bool empty() const { return cores_.empty(); }
+    const std::vector<CpuCore> &cores() const { return cores_; }
+    int32_t clusters() const { return clusters_; }
+
+    // Sorted cpu ids of a class; never empty unless the topology is.
+    std::vector<int> select(CoreClass which) const;
+    // The fastest classes that together hold at least `threads` cores.
+    std::vector<int> fastest(int threads) const;
+    // One compute thread per core of `which`; with `max_threads` (> 0) only
+    // the fastest that many cores of the class. An unreadable topology leaves
+    // the mask alone.
+    ThreadSet thread_set(CoreClass which, int max_threads = 0) const;
+    // "0-5:cap=740@3.5GHz 6-7:cap=1024@4.3GHz"
+    std::string describe() const;
+
+private:
+    size_t index_of(int cpu) const;
+
+    std::vector<CpuCore> cores_;  // by cpu id
+    int32_t clusters_ = 0;
+};
+
+// "0,2,4-7"
+std::string format_cpus(const std::vector<int> &cpus);
+
+// Restricts the calling thread to `cpus`; false (mask unchanged) when the
+// list is empty or the kernel refuses it.
+bool pin_current_thread(const std::vector<int> &cpus);
+
+}  // namespace genui
@@ -0,0 +1,227 @@
+﻿#include "governor.h"
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <dirent.h>
+#include <fstream>
+
+#define LOG_TAG "QwenCoderBridge"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+
+namespace genui {
+
+namespace {
+
+static double elapsed_ms(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+static bool read_line(const std::string &path, std::string &line) {
+    std::ifstream file(path);
+    return static_cast<bool>(std::getline(file, line));
+}
+
+static bool read_number(const std::string &path, double &value) {
+    std::ifstream file(path);
+    return static_cast<bool>(file >> value);
+}
+
+static std::string lower(std::string text) {
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return std::tolower(c); });
+    return text;
+}
+
+static bool names_cpu(const std::string &type) {
+    const std::string name = lower(type);
+    for (const char *hint : {"cpu", "cluster", "soc", "tsens", "apc"}) {
+        if (name.find(hint) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Most drivers report millidegrees; a few report degrees.
+static double to_celsius(double raw) {
+    return raw > 1000.0 ? raw / 1000.0 : raw;
+}
+
+}  // namespace
+
+PowerSensors PowerSensors::discover(const std::string &thermal_root, const std::string &battery_dir) {
+    PowerSensors sensors;
+    sensors.battery_dir_ = battery_dir;
+    DIR *dir = opendir(thermal_root.c_str());
+    if (!dir) {
+        return sensors;
+    }
+    std::vector<std::string> names;
+    while (const dirent *entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name.rfind("thermal_zone", 0) == 0) {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (const std::string &name : names) {
+        const std::string zone = thermal_root + "/" + name;
+        std::string type;
+        double raw = 0.0;
+        if (read_line(zone + "/type", type) && names_cpu(type) && read_number(zone + "/temp", raw) && raw > 0.0) {
+            sensors.zones_.push_back(zone + "/temp");
+            sensors.zone_types_.push_back(type);
+        }
+    }
+    return sensors;
+}
+
+double PowerSensors::max_temp_c() const {
+    double hottest = NAN;
+    for (const std::string &zone : zones_) {
+        double raw = 0.0;
+        if (read_number(zone, raw)) {
+            const double temp = to_celsius(raw);
+            hottest = std::isnan(hottest) ? temp : std::max(hottest, temp);
+        }
+    }
+    return hottest;
+}
+
+int32_t PowerSensors::battery_percent() const {
+    double percent = 0.0;
+    return read_number(battery_dir_ + "/capacity", percent) ? static_cast<int32_t>(percent) : -1;
+}
+
+bool PowerSensors::charging() const {
+    std::string status;
+    return read_line(battery_dir_ + "/status", status) && (status == "Charging" || status == "Full");
+}
+
+std::string PowerSensors::describe() const {
+    std::string text = std::to_string(zones_.size()) + " cpu thermal zones";
+    for (size_t i = 0; i < zone_types_.size() && i < 4; ++i) {
+        text += (i == 0 ? " (" : ", ") + zone_types_[i];
+    }
+    if (!zone_types_.empty()) {
+        text += zone_types_.size() > 4 ? ", ...)" : ")";
+    }
+    const int32_t battery = battery_percent();
+    text += battery >= 0 ? ", battery " + std::to_string(battery) + "%" : ", battery unknown";
+    return text;
+}
+
+Governor::Governor(std::vector<ThreadSet> ladder, PowerSensors sensors, const Options &options)
+        : ladder_(std::move(ladder)),
+          sensors_(std::move(sensors)),
+          options_(options),
+          best_ms_(ladder_.size(), 0.0) {
+    power_saver_level_ = static_cast<int32_t>(ladder_.size()) - 1;
+    for (size_t i = 0; i < ladder_.size(); ++i) {
+        if (ladder_[i].threads <= options_.power_saver_threads) {
+            power_saver_level_ = static_cast<int32_t>(i);
+            break;
+        }
+    }
+}
+
+int32_t Governor::floor_level(PowerPolicy policy) const {
+    if (policy == PowerPolicy::kPowerSaver || (policy == PowerPolicy::kBalanced && low_battery_)) {
+        return power_saver_level_;
+    }
+    return 0;
+}
+
+const ThreadSet &Governor::decode_set(PowerPolicy policy) {
+    const int32_t wanted = policy == PowerPolicy::kPerformance ? 0 : std::max(level_, floor_level(policy));
+    if (wanted != applied_) {
+        const char *reason = policy == PowerPolicy::kPerformance ? "performance policy"
+                             : policy == PowerPolicy::kPowerSaver ? "power saver policy"
+                             : wanted > level_ ? "low battery" : "balanced policy";
+        apply(wanted, reason);
+    }
+    return ladder_[applied_];
+}
+
+void Governor::apply(int32_t level, const char *reason) {
+    const ThreadSet &from = ladder_[applied_];
+    const ThreadSet &to = ladder_[level];
+    LOGI("Governor: %d -> %d decode threads on cpus %s (%s; temp=%.1f C, latency=%.2f ms, best=%.2f ms)",
+         from.threads, to.threads, format_cpus(to.cpus).c_str(), reason, temp_c_, ewma_ms_, best_ms_[applied_]);
+    applied_ = level;
+    steps_at_level_ = 0;
+    timed_steps_ = 0;
+    ewma_ms_ = 0.0;
+    last_change_ = Clock::now();
+    ++changes_;
+}
+
+void Governor::move_to(int32_t level, const char *reason) {
+    level_ = level;
+    apply(level, reason);
+}
+
+void Governor::on_decode_step(PowerPolicy policy, double step_ms, int32_t sequences) {
+    if (policy == PowerPolicy::kPerformance) {
+        return;
+    }
+    ++steps_at_level_;
+    if (sequences == 1) {
+        ewma_ms_ = ewma_ms_ > 0.0 ? 0.8 * ewma_ms_ + 0.2 * step_ms : step_ms;
+        if (++timed_steps_ >= options_.min_steps) {
+            double &best = best_ms_[applied_];
+            best = best > 0.0 ? std::min(best, ewma_ms_) : ewma_ms_;
+        }
+    }
+    if (elapsed_ms(last_sample_, Clock::now()) >= options_.sample_ms) {
+        sample(policy);
+    }
+}
+
+void Governor::sample(PowerPolicy policy) {
+    const auto now = Clock::now();
+    last_sample_ = now;
+    const double temp = sensors_.max_temp_c();
+    temp_c_ = std::isnan(temp) ? 0.0 : temp;
+    const int32_t battery = sensors_.battery_percent();
+    low_battery_ = battery >= 0 && battery < options_.low_battery_percent && !sensors_.charging();
+    if (applied_ != level_) {
+        return;  // held at the policy's floor, which is already below the adapted level
+    }
+    if (steps_at_level_ < options_.min_steps || elapsed_ms(last_change_, now) < options_.dwell_ms) {
+        return;
+    }
+
+    const bool hot = !std::isnan(temp) && temp >= options_.hot_c;
+    const bool cool = std::isnan(temp) || temp < options_.cool_c;
+    const bool timed = timed_steps_ >= options_.min_steps;
+    const bool degraded = timed && ewma_ms_ > best_ms_[level_] * options_.degraded_ratio;
+    const int32_t last = static_cast<int32_t>(ladder_.size()) - 1;
+
+    if (probing_) {
+        // The narrower set has run long enough to compare with the wider one;
+        // without timings on both sides it stays.
+        probing_ = false;
+        if (!hot && timed && before_ms_ > 0.0 && ewma_ms_ > before_ms_ * options_.probe_ratio
+            && level_ > floor_level(policy)) {
+            hold_until_ = now + std::chrono::milliseconds(static_cast<int64_t>(options_.recover_ms));
+            move_to(level_ - 1, "narrower set was slower");
+        }
+        return;
+    }
+    if ((hot || (degraded && now >= hold_until_)) && level_ < last) {
+        before_ms_ = timed ? ewma_ms_ : 0.0;
+        probing_ = true;
+        move_to(level_ + 1, hot ? "hot" : "throttled");
+        return;
+    }
+    if (cool && !degraded && level_ > floor_level(policy) && elapsed_ms(last_change_, now) >= options_.recover_ms) {
+        move_to(level_ - 1, "cooled down");
+    }
+}
+
+}  // namespace genui
@@ -0,0 +1,104 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "cpu_topology.h"
+
+namespace genui {
+
+enum class PowerPolicy : int32_t {
+    kBalanced = 0,     // adapt the decode threads to hold throughput as the device heats up
+    kPerformance = 1,  // always the widest decode set
+    kPowerSaver = 2,   // a narrow decode set, and narrower still when warm
+};
+
+// Readings of /sys/class/thermal and the battery's power supply. Zones whose
+// type names a CPU are preferred; where SELinux hides them, temperature reads
+// as unknown and the governor falls back to watching latency alone.
+class PowerSensors {
+public:
+    static PowerSensors discover(const std::string &thermal_root = "/sys/class/thermal",
+                                 const std::string &battery_dir = "/sys/class/power_supply/battery");
+
+    bool has_thermal() const { return !zones_.empty(); }
+    // Hottest zone in degrees C; NaN when nothing is readable.
+    double max_temp_c() const;
+    // Battery level in percent, or -1 when unknown.
+    int32_t battery_percent() const;
+    bool charging() const;
+    std::string describe() const;
+
+private:
+    std::vector<std::string> zones_;  // temp files
+    std::vector<std::string> zone_types_;
+    std::string battery_dir_;
+};
+
+// Picks the decode thread set between steps. The candidates are a ladder from
+// the widest set down to one thread, each keeping the fastest cores. Under
+// kBalanced the governor steps down when the CPU runs hot or when decode
+// steps at the current width have slowed well past the best seen at that
+// width (thermal throttling), keeps the narrower set only if it is not
+// slower, and steps back up once the device has cooled. Decisions are
+// logged; sensors are read at most once per sample period.
+class Governor {
+public:
+    struct Options {
+        double hot_c = 80.0;          // step down at or above this
+        double cool_c = 68.0;         // step back up below this
+        double degraded_ratio = 1.25; // step down when latency exceeds the level's best by this
+        double probe_ratio = 1.05;    // a narrower set that is this much slower is reverted
+        double sample_ms = 1000.0;
+        double dwell_ms = 2000.0;     // minimum time between changes
+        double recover_ms = 10000.0;  // minimum time before stepping back up
+        int32_t power_saver_threads = 2;
+        int32_t low_battery_percent = 15;  // below this, off the charger, kBalanced acts as kPowerSaver
+        int32_t min_steps = 8;        // decode steps at a level before it is judged
+    };
+
+    Governor() = default;
+    Governor(std::vector<ThreadSet> ladder, PowerSensors sensors, const Options &options);
+
+    bool empty() const { return ladder_.empty(); }
+    // The decode set for the coming step under `policy`.
+    const ThreadSet &decode_set(PowerPolicy policy);
+    // Reports a decode-only step of `sequences` tokens that ran with
+    // decode_set(policy). Only single-sequence steps are timed, since wider
+    // batches take longer for reasons that have nothing to do with the clock.
+    void on_decode_step(PowerPolicy policy, double step_ms, int32_t sequences);
+
+    int32_t changes() const { return changes_; }
+    int32_t level() const { return applied_; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    int32_t floor_level(PowerPolicy policy) const;
+    void apply(int32_t level, const char *reason);
+    void move_to(int32_t level, const char *reason);
+    void sample(PowerPolicy policy);
+
+    std::vector<ThreadSet> ladder_;  // widest first
+    PowerSensors sensors_;
+    Options options_;
+    std::vector<double> best_ms_;    // per level; 0 until measured
+    int32_t level_ = 0;              // adapted to temperature and latency
+    int32_t applied_ = 0;            // level_, or the policy's floor when that is narrower
+    int32_t power_saver_level_ = 0;
+    double ewma_ms_ = 0.0;           // single-sequence decode steps at this level; 0 until timed
+    int32_t timed_steps_ = 0;
+    int32_t steps_at_level_ = 0;
+    bool probing_ = false;
+    double before_ms_ = 0.0;         // latency at the previous level while probing
+    bool low_battery_ = false;
+    double temp_c_ = 0.0;
+    Clock::time_point last_sample_{};
+    Clock::time_point last_change_{};
+    Clock::time_point hold_until_{};  // no probing down before this after a revert
+    int32_t changes_ = 0;
+};
+
+}  // namespace genui
@@ -0,0 +1,421 @@
+﻿#include "grammar_mask.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "grammar-parser.h"
+
+namespace genui {
+
+namespace {
+
+constexpr size_t kMaxInternedSets = 1 << 15;
+constexpr size_t kMaxCachedMasks = 256;
+
+static bool is_end_of_sequence(const llama_grammar_element *pos) {
+    return pos->type == LLAMA_GRETYPE_END || pos->type == LLAMA_GRETYPE_ALT;
+}
+
+// Same semantics as llama.cpp's llama_grammar_match_char: returns whether the
+// character element at `pos` accepts `chr`, and the element that follows it.
+static std::pair<bool, const llama_grammar_element *> match_char(const llama_grammar_element *pos, uint32_t chr) {
+    bool found = false;
+    const bool is_positive_char = pos->type == LLAMA_GRETYPE_CHAR;
+    do {
+        if (pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER) {
+            found = found || (pos->value <= chr && chr <= pos[1].value);
+            pos += 2;
+        } else {
+            found = found || pos->value == chr;
+            pos += 1;
+        }
+    } while (pos->type == LLAMA_GRETYPE_CHAR_ALT);
+    return {found == is_positive_char, pos};
+}
+
+static bool piece_less(const VocabPieces &pieces, llama_token a, llama_token b) {
+    const size_t la = pieces.length(a);
+    const size_t lb = pieces.length(b);
+    const int cmp = std::memcmp(pieces.data(a), pieces.data(b), std::min(la, lb));
+    return cmp != 0 ? cmp < 0 : la < lb;
+}
+
+}  // namespace
+
+bool GrammarMask::build(const VocabPieces &pieces, const std::string &gbnf, const char *root_rule) {
+    clear();
+    if (pieces.empty()) {
+        return false;
+    }
+
+    grammar_parser::parse_state parsed = grammar_parser::parse(gbnf.c_str());
+    if (parsed.rules.empty()) {
+        return false;
+    }
+    const auto root = parsed.symbol_ids.find(root_rule);
+    if (root == parsed.symbol_ids.end() || root->second >= parsed.rules.size()) {
+        return false;
+    }
+    rules_ = std::move(parsed.rules);
+    root_rule_ = root->second;
+
+    pieces_ = &pieces;
+    n_vocab_ = pieces.size();
+    build_trie();
+    reset_states();
+    return true;
+}
+
+void GrammarMask::clear() {
+    pieces_ = nullptr;
+    n_vocab_ = 0;
+    rules_.clear();
+    root_rule_ = 0;
+    root_set_ = kDeadSet;
+    set_ids_.clear();
+    sets_.clear();
+    accepting_.clear();
+    non_ascii_.clear();
+    transitions_.clear();
+    trie_.clear();
+    duplicate_pieces_.clear();
+    control_tokens_.clear();
+    max_depth_ = 0;
+    mask_slots_.clear();
+    masks_.clear();
+    stats_ = Stats();
+}
+
+void GrammarMask::reset_states() {
+    set_ids_.clear();
+    sets_.clear();
+    accepting_.clear();
+    non_ascii_.clear();
+    transitions_.clear();
+    mask_slots_.clear();
+    masks_.clear();
+
+    intern(StackSet());
+
+    StackSet root;
+    const llama_grammar_element *pos = rules_[root_rule_].data();
+    while (true) {
+        Stack stack;
+        if (!is_end_of_sequence(pos)) {
+            stack.push_back(pos);
+        }
+        advance_stack(stack, root);
+        while (!is_end_of_sequence(pos)) {
+            ++pos;
+        }
+        if (pos->type != LLAMA_GRETYPE_ALT) {
+            break;
+        }
+        ++pos;
+    }
+    root_set_ = intern(std::move(root));
+}
+
+void GrammarMask::build_trie() {
+    std::vector<llama_token> order;
+    order.reserve(static_cast<size_t>(n_vocab_));
+    for (llama_token tok = 0; tok < n_vocab_; ++tok) {
+        if (pieces_->is_control(tok)) {
+            control_tokens_.push_back(tok);
+        } else if (pieces_->length(tok) > 0) {
+            order.push_back(tok);
+        }
+    }
+    std::sort(order.begin(), order.end(), [this](llama_token a, llama_token b) {
+        return piece_less(*pieces_, a, b);
+    });
+
+    // Preorder layout: the children of a node follow it directly and `end`
+    // points past its subtree, so a rejected prefix skips the whole subtree.
+    std::vector<uint32_t> open;
+    const char *prev = nullptr;
+    size_t prev_len = 0;
+    for (llama_token tok : order) {
+        const char *text = pieces_->data(tok);
+        const size_t len = std::min<size_t>(pieces_->length(tok), UINT16_MAX);
+        size_t lcp = 0;
+        const size_t common = std::min(len, prev_len);
+        while (lcp < common && text[lcp] == prev[lcp]) {
+            ++lcp;
+        }
+        while (open.size() > lcp) {
+            trie_[open.back()].end = static_cast<uint32_t>(trie_.size());
+            open.pop_back();
+        }
+        if (lcp == len && !open.empty()) {
+            duplicate_pieces_.emplace_back(open.back(), tok);
+            continue;
+        }
+        for (size_t d = lcp; d < len; ++d) {
+            open.push_back(static_cast<uint32_t>(trie_.size()));
+            trie_.push_back(TrieNode{0, -1, static_cast<uint16_t>(d + 1), static_cast<uint8_t>(text[d])});
+        }
+        trie_[open.back()].token = tok;
+        max_depth_ = std::max(max_depth_, len);
+        prev = text;
+        prev_len = len;
+    }
+    while (!open.empty()) {
+        trie_[open.back()].end = static_cast<uint32_t>(trie_.size());
+        open.pop_back();
+    }
+}
+
+void GrammarMask::advance_stack(const Stack &stack, StackSet &out) const {
+    if (stack.empty()) {
+        out.push_back(stack);
+        return;
+    }
+    const llama_grammar_element *pos = stack.back();
+    if (pos->type != LLAMA_GRETYPE_RULE_REF) {
+        out.push_back(stack);
+        return;
+    }
+
+    const llama_grammar_element *subpos = rules_[pos->value].data();
+    while (true) {
+        Stack next(stack.begin(), stack.end() - 1);
+        if (!is_end_of_sequence(pos + 1)) {
+            next.push_back(pos + 1);
+        }
+        if (!is_end_of_sequence(subpos)) {
+            next.push_back(subpos);
+        }
+        advance_stack(next, out);
+        while (!is_end_of_sequence(subpos)) {
+            ++subpos;
+        }
+        if (subpos->type != LLAMA_GRETYPE_ALT) {
+            break;
+        }
+        ++subpos;
+    }
+}
+
+int32_t GrammarMask::intern(StackSet &&set) {
+    std::sort(set.begin(), set.end());
+    set.erase(std::unique(set.begin(), set.end()), set.end());
+    const auto found = set_ids_.find(set);
+    if (found != set_ids_.end()) {
+        return found->second;
+    }
+
+    const auto id = static_cast<int32_t>(sets_.size());
+    bool accepting = false;
+    for (const Stack &stack : set) {
+        accepting = accepting || stack.empty();
+    }
+    const auto inserted = set_ids_.emplace(std::move(set), id).first;
+    sets_.push_back(&inserted->first);
+    accepting_.push_back(accepting ? 1 : 0);
+    non_ascii_.push_back(-1);
+    return id;
+}
+
+int32_t GrammarMask::transition(int32_t set, uint32_t cp) {
+    const uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(set)) << 32) | cp;
+    const auto found = transitions_.find(key);
+    if (found != transitions_.end()) {
+        return found->second;
+    }
+
+    StackSet next;
+    for (const Stack &stack : *sets_[set]) {
+        if (stack.empty()) {
+            continue;
+        }
+        const auto match = match_char(stack.back(), cp);
+        if (!match.first) {
+            continue;
+        }
+        Stack advanced(stack.begin(), stack.end() - 1);
+        if (!is_end_of_sequence(match.second)) {
+            advanced.push_back(match.second);
+        }
+        advance_stack(advanced, next);
+    }
+    const int32_t id = next.empty() ? kDeadSet : intern(std::move(next));
+    transitions_.emplace(key, id);
+    return id;
+}
+
+bool GrammarMask::accepts_non_ascii(int32_t set) {
+    int8_t &cached = non_ascii_[set];
+    if (cached >= 0) {
+        return cached != 0;
+    }
+    bool any = false;
+    for (const Stack &stack : *sets_[set]) {
+        if (stack.empty()) {
+            continue;
+        }
+        const llama_grammar_element *pos = stack.back();
+        if (pos->type == LLAMA_GRETYPE_CHAR_NOT) {
+            any = true;
+            break;
+        }
+        do {
+            const bool range = pos[1].type == LLAMA_GRETYPE_CHAR_RNG_UPPER;
+            const uint32_t upper = range ? pos[1].value : pos->value;
+            any = any || upper >= 0x80;
+            pos += range ? 2 : 1;
+        } while (pos->type == LLAMA_GRETYPE_CHAR_ALT);
+        if (any) {
+            break;
+        }
+    }
+    cached = any ? 1 : 0;
+    return any;
+}
+
+GrammarState GrammarMask::feed(GrammarState state, uint8_t byte) {
+    if (state.remain == 0) {
+        if (byte < 0x80) {
+            state.stacks = transition(state.stacks, byte);
+            return state;
+        }
+        int32_t remain;
+        uint32_t lead;
+        if ((byte & 0xE0) == 0xC0) {
+            remain = 1;
+            lead = byte & 0x1F;
+        } else if ((byte & 0xF0) == 0xE0) {
+            remain = 2;
+            lead = byte & 0x0F;
+        } else if ((byte & 0xF8) == 0xF0) {
+            remain = 3;
+            lead = byte & 0x07;
+        } else {
+            return GrammarState();
+        }
+        if (!accepts_non_ascii(state.stacks)) {
+            return GrammarState();
+        }
+        state.partial = lead;
+        state.remain = remain;
+        return state;
+    }
+
+    if ((byte & 0xC0) != 0x80) {
+        return GrammarState();
+    }
+    state.partial = (state.partial << 6) | (byte & 0x3F);
+    if (--state.remain == 0) {
+        state.stacks = transition(state.stacks, state.partial);
+        state.partial = 0;
+    }
+    return state;
+}
+
+GrammarState GrammarMask::begin() {
+    if (sets_.size() > kMaxInternedSets) {
+        reset_states();
+    }
+    return root();
+}
+
+GrammarState GrammarMask::accept(const GrammarState &state, llama_token tok) {
+    if (empty() || tok < 0 || tok >= n_vocab_ || pieces_->is_control(tok)) {
+        return state;
+    }
+    GrammarState next = state;
+    const char *text = pieces_->data(tok);
+    const size_t len = pieces_->length(tok);
+    for (size_t i = 0; i < len && next.stacks != kDeadSet; ++i) {
+        next = feed(next, static_cast<uint8_t>(text[i]));
+    }
+    return next;
+}
+
+bool GrammarMask::is_accepting(const GrammarState &state) const {
+    return state.remain == 0 && accepting_[state.stacks] != 0;
+}
+
+void GrammarMask::compute_allowed(const GrammarState &state, TokenBits &bits) {
+    bits.assign(static_cast<size_t>((n_vocab_ + 63) / 64), 0);
+    if (state.stacks == kDeadSet) {
+        return;
+    }
+    if (is_accepting(state)) {
+        for (llama_token tok : control_tokens_) {
+            set_token_bit(bits, tok);
+        }
+    }
+
+    std::vector<GrammarState> path(max_depth_ + 1);
+    path[0] = state;
+    for (size_t i = 0; i < trie_.size();) {
+        const TrieNode &node = trie_[i];
+        const GrammarState next = feed(path[node.depth - 1], node.byte);
+        if (next.stacks == kDeadSet) {
+            i = node.end;
+            continue;
+        }
+        path[node.depth] = next;
+        if (node.token >= 0) {
+            set_token_bit(bits, node.token);
+        }
+        ++i;
+    }
+    for (const auto &dup : duplicate_pieces_) {
+        if (token_bit(bits, trie_[dup.first].token)) {
+            set_token_bit(bits, dup.second);
+        }
+    }
+}
+
+const TokenBits &GrammarMask::allowed(const GrammarState &state) {
+    const uint64_t key = (static_cast<uint64_t>(static_cast<uint32_t>(state.stacks)) << 32) |
+                         (static_cast<uint64_t>(state.remain) << 24) | (state.partial & 0xFFFFFF);
+    const auto found = mask_slots_.find(key);
+    if (found != mask_slots_.end()) {
+        ++stats_.mask_hits;
+        return masks_[found->second];
+    }
+
+    ++stats_.mask_misses;
+    if (masks_.size() >= kMaxCachedMasks) {
+        masks_.clear();
+        mask_slots_.clear();
+    }
+    masks_.emplace_back();
+    compute_allowed(state, masks_.back());
+    mask_slots_.emplace(key, masks_.size() - 1);
+    return masks_.back();
+}
+
+llama_token GrammarMask::argmax(const float *logits, const GrammarState &state) {
+    if (empty() || !logits) {
+        return -1;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const TokenBits &bits = allowed(state);
+
+    llama_token best = -1;
+    float best_val = -INFINITY;
+    for (size_t w = 0; w < bits.size(); ++w) {
+        uint64_t word = bits[w];
+        while (word) {
+            const auto tok = static_cast<llama_token>(w * 64 + __builtin_ctzll(word));
+            if (logits[tok] > best_val) {
+                best_val = logits[tok];
+                best = tok;
+            }
+            word &= word - 1;
+        }
+    }
+
+    ++stats_.steps;
+    stats_.interned_sets = sets_.size();
+    stats_.mask_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return best;
+}
+
+}  // namespace genui
@@ -0,0 +1,109 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+#include "token_mask.h"
+#include "vocab_pieces.h"
+
+namespace genui {
+
+// Position of a generation inside the grammar: an interned set of pushdown
+// stacks plus any UTF-8 sequence left incomplete by the last token.
+struct GrammarState {
+    int32_t stacks = 0;
+    uint32_t partial = 0;
+    int32_t remain = 0;
+};
+
+// Grammar-constrained greedy decoding over rules produced by
+// grammar_parser::parse. Unlike llama_sample_grammar, which re-walks every
+// vocabulary entry against every stack on each step, allowed-token bitmasks
+// are memoized per grammar state and computed by walking a trie of token
+// pieces that is pruned as soon as the grammar rejects a prefix, so a cache
+// miss costs roughly the size of the accepted set.
+class GrammarMask {
+public:
+    struct Stats {
+        size_t steps = 0;
+        size_t mask_hits = 0;
+        size_t mask_misses = 0;
+        size_t interned_sets = 0;
+        double mask_ms = 0.0;
+    };
+
+    bool build(const VocabPieces &pieces, const std::string &gbnf, const char *root_rule = "root");
+    void clear();
+    bool empty() const { return n_vocab_ == 0; }
+
+    // Fresh state at the grammar root; also trims the caches when they have
+    // grown past their budget, so call it only between generations.
+    GrammarState begin();
+    // Fresh state at the grammar root without touching the caches; for a
+    // generation starting while others still hold states.
+    GrammarState root() const {
+        GrammarState state;
+        state.stacks = root_set_;
+        return state;
+    }
+    GrammarState accept(const GrammarState &state, llama_token tok);
+    bool is_dead(const GrammarState &state) const { return state.stacks == kDeadSet; }
+    bool is_accepting(const GrammarState &state) const;
+
+    const TokenBits &allowed(const GrammarState &state);
+    // Highest-logit token the grammar allows from `state`, or -1 when none is.
+    llama_token argmax(const float *logits, const GrammarState &state);
+
+    const Stats &stats() const { return stats_; }
+    void reset_stats() { stats_ = Stats(); }
+
+private:
+    using Stack = std::vector<const llama_grammar_element *>;
+    using StackSet = std::vector<Stack>;
+
+    struct TrieNode {
+        uint32_t end;
+        llama_token token;
+        uint16_t depth;
+        uint8_t byte;
+    };
+
+    static constexpr int32_t kDeadSet = 0;
+
+    void build_trie();
+    void reset_states();
+    void advance_stack(const Stack &stack, StackSet &out) const;
+    int32_t intern(StackSet &&set);
+    int32_t transition(int32_t set, uint32_t cp);
+    bool accepts_non_ascii(int32_t set);
+    GrammarState feed(GrammarState state, uint8_t byte);
+    void compute_allowed(const GrammarState &state, TokenBits &bits);
+
+    const VocabPieces *pieces_ = nullptr;
+    int32_t n_vocab_ = 0;
+    std::vector<std::vector<llama_grammar_element>> rules_;
+    uint32_t root_rule_ = 0;
+    int32_t root_set_ = kDeadSet;
+
+    std::map<StackSet, int32_t> set_ids_;
+    std::vector<const StackSet *> sets_;
+    std::vector<int8_t> accepting_;
+    std::vector<int8_t> non_ascii_;
+    std::unordered_map<uint64_t, int32_t> transitions_;
+
+    std::vector<TrieNode> trie_;
+    std::vector<std::pair<uint32_t, llama_token>> duplicate_pieces_;
+    std::vector<llama_token> control_tokens_;
+    size_t max_depth_ = 0;
+
+    std::unordered_map<uint64_t, size_t> mask_slots_;
+    std::vector<TokenBits> masks_;
+
+    Stats stats_;
+};
+
+}  // namespace genui
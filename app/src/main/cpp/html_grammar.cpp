@@ -0,0 +1,84 @@
+﻿#include "html_grammar.h"
+
+namespace genui {
+
+namespace {
+
+// Container tags that must be closed by the same name. Each gets its own rule
+// so the grammar, not a post-pass, keeps the nesting balanced.
+static const char *const kPairedTags[] = {
+        "div", "section", "header", "footer", "main", "nav", "article", "aside",
+        "p", "span", "h1", "h2", "h3", "h4", "h5", "h6",
+        "ul", "ol", "li", "dl", "dt", "dd",
+        "form", "label", "fieldset", "legend", "select", "option", "textarea", "output",
+        "strong", "em", "b", "i", "small", "mark", "code", "pre", "blockquote", "time", "a",
+        "table", "caption", "thead", "tbody", "tfoot", "tr", "th", "td",
+        "details", "summary", "dialog", "figure", "figcaption", "progress", "meter",
+};
+
+static const char *const kVoidTags[] = {"br", "hr", "input", "img"};
+
+static const char *const kSvgTags[] = {
+        "g", "path", "circle", "ellipse", "rect", "line", "polyline", "polygon", "text", "tspan",
+        "defs", "linearGradient", "stop", "title",
+};
+
+static const char *kHtmlGrammarBase = R"(root ::= "```html" ws doctype ws html ws "```" ws
+ws ::= [ \t\r\n]*
+ws1 ::= [ \t\r\n]+
+doctype ::= "<!" [dD] [oO] [cC] [tT] [yY] [pP] [eE] ws1 [hH] [tT] [mM] [lL] ws ">"
+html ::= "<html" attrs ">" ws head ws body ws "</html>"
+head ::= "<head>" ws (head-item ws)* "</head>"
+head-item ::= meta | title | style | script | comment
+meta ::= "<meta" attrs "/"? ">"
+title ::= "<title>" [^<]* "</title>"
+style ::= "<style>" [^<]* "</style>"
+script ::= "<script>" ([^<] | "<" [^/])* "</script>"
+comment ::= "<!--" ([^-] | "-" [^-])* "-->"
+body ::= "<body" attrs ">" content "</body>"
+content ::= ([^<] | node)*
+attrs ::= (ws1 attr)* ws
+action-attrs ::= (ws1 attr)* ws1 "data-action" ws "=" ws attr-value (ws1 attr)* ws
+attr ::= attr-name (ws "=" ws attr-value)?
+attr-name ::= [a-zA-Z_:] [a-zA-Z0-9_:.-]*
+attr-value ::= "\"" [^"<]* "\"" | "'" [^'<]* "'"
+button ::= "<button" action-attrs ">" content "</button>"
+svg ::= "<svg" attrs ">" svg-content "</svg>"
+svg-content ::= ([^<] | svg-node | comment)*
+)";
+
+static std::string build_grammar() {
+    std::string gbnf(kHtmlGrammarBase);
+
+    std::string node = "node ::= button | svg | style | script | comment | void";
+    for (const char *tag : kPairedTags) {
+        node.append(" | el-").append(tag);
+        gbnf.append("el-").append(tag).append(" ::= \"<").append(tag)
+                .append("\" attrs \">\" content \"</").append(tag).append(">\"\n");
+    }
+    gbnf.append(node).append("\n");
+
+    gbnf.append("void ::= (");
+    for (size_t i = 0; i < sizeof(kVoidTags) / sizeof(kVoidTags[0]); ++i) {
+        gbnf.append(i ? " | \"<" : "\"<").append(kVoidTags[i]).append("\"");
+    }
+    gbnf.append(") attrs \"/\"? \">\"\n");
+
+    std::string svg_node = "svg-node ::= svg";
+    for (const char *tag : kSvgTags) {
+        svg_node.append(" | svg-").append(tag);
+        gbnf.append("svg-").append(tag).append(" ::= \"<").append(tag)
+                .append("\" attrs (\"/>\" | \">\" svg-content \"</").append(tag).append(">\")\n");
+    }
+    gbnf.append(svg_node).append("\n");
+    return gbnf;
+}
+
+}  // namespace
+
+const std::string &html_grammar() {
+    static const std::string grammar = build_grammar();
+    return grammar;
+}
+
+}  // namespace genui
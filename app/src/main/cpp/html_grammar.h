@@ -0,0 +1,13 @@
+﻿#pragma once
+
+#include <string>
+
+namespace genui {
+
+// GBNF for the HTML subset the preview renders: exactly one ```html fenced
+// document with a doctype, <html>/<head>/<body>, styles only through <style>
+// or style="", a closed set of balanced container tags, and buttons that must
+// carry data-action. Parsed with grammar_parser::parse.
+const std::string &html_grammar();
+
+}  // namespace genui
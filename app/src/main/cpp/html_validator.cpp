@@ -0,0 +1,358 @@
+﻿#include "html_validator.h"
+
+#include <cstring>
+
+namespace genui {
+
+namespace {
+
+static const char *const kVoidTags[] = {
+        "area", "base", "br", "col", "embed", "hr", "img", "input",
+        "link", "meta", "param", "source", "track", "wbr",
+};
+
+// Elements whose end tag HTML lets the parser infer, so closing an ancestor
+// while one of these is still open is not an error.
+static const char *const kImpliedEndTags[] = {
+        "p", "li", "dt", "dd", "tr", "td", "th", "thead", "tbody", "tfoot",
+        "option", "optgroup", "colgroup", "caption", "head", "body",
+};
+
+// Elements whose end tag leaves a prefix worth rendering on its own: the
+// stylesheet is complete, or one more repeated item of a list or table is.
+static const char *const kRenderPointTags[] = {
+        "style", "li", "tr",
+};
+
+template <size_t N>
+static bool in_list(const char *name, const char *const (&list)[N]) {
+    for (const char *entry : list) {
+        if (std::strcmp(name, entry) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+static bool is_alpha(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static bool is_name_char(char c) {
+    return is_alpha(c) || (c >= '0' && c <= '9') || c == '-' || c == ':' || c == '_';
+}
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<char>(c + ('a' - 'A')) : c;
+}
+
+}  // namespace
+
+const char *html_violation_name(HtmlViolation violation) {
+    switch (violation) {
+        case HtmlViolation::kNone:
+            return "none";
+        case HtmlViolation::kMissingFence:
+            return "missing ```html fence";
+        case HtmlViolation::kMissingRoot:
+            return "missing doctype/html root";
+        case HtmlViolation::kUnbalancedTag:
+            return "unbalanced tag";
+        case HtmlViolation::kTooDeep:
+            return "nesting too deep";
+        case HtmlViolation::kExternalReference:
+            return "external reference";
+    }
+    return "unknown";
+}
+
+HtmlStreamValidator::HtmlStreamValidator(const PatternAutomaton *banned)
+        : banned_(banned && !banned->empty() ? banned : nullptr) {}
+
+HtmlStreamValidator::Status HtmlStreamValidator::feed(const char *data, size_t len) {
+    for (size_t i = 0; i < len && status_ == Status::kOk; ++i) {
+        step(data[i]);
+        ++fed_;
+    }
+    return status_;
+}
+
+void HtmlStreamValidator::fail(HtmlViolation violation) {
+    status_ = Status::kViolation;
+    violation_ = violation;
+}
+
+void HtmlStreamValidator::step(char c) {
+    if (banned_) {
+        banned_state_ = banned_->step(banned_state_, static_cast<unsigned char>(c));
+        if (banned_->terminal(banned_state_)) {
+            fail(HtmlViolation::kExternalReference);
+            return;
+        }
+    }
+
+    switch (lex_) {
+        case Lex::kPreamble:
+            if (c == '`') {
+                if (++backticks_ == 3) {
+                    backticks_ = 0;
+                    fenced_ = true;
+                    lex_ = Lex::kFenceInfo;
+                }
+            } else if (c == '<') {
+                backticks_ = 0;
+                tag_start_ = fed_;
+                name_len_ = 0;
+                closing_ = false;
+                self_closing_ = false;
+                lex_ = Lex::kTagOpen;
+            } else {
+                backticks_ = 0;
+                if (fed_ >= kMaxPreamble) {
+                    fail(HtmlViolation::kMissingFence);
+                }
+            }
+            break;
+
+        case Lex::kFenceInfo:
+            if (c == '\n') {
+                lex_ = Lex::kText;
+            }
+            break;
+
+        case Lex::kText:
+            if (c == '<') {
+                backticks_ = 0;
+                tag_start_ = fed_;
+                name_len_ = 0;
+                closing_ = false;
+                self_closing_ = false;
+                lex_ = Lex::kTagOpen;
+            } else if (c == '`') {
+                // A fence inside an open element is treated as text (code samples).
+                if (++backticks_ == 3 && depth_ == 0) {
+                    if (!root_seen_) {
+                        fail(HtmlViolation::kMissingRoot);
+                    } else {
+                        status_ = Status::kComplete;
+                        lex_ = Lex::kDone;
+                    }
+                }
+            } else {
+                backticks_ = 0;
+                if (!root_seen_ && !is_space(c)) {
+                    fail(HtmlViolation::kMissingRoot);
+                }
+            }
+            break;
+
+        case Lex::kTagOpen:
+            if (c == '/' && !closing_ && name_len_ == 0) {
+                closing_ = true;
+            } else if (c == '!' && !closing_) {
+                lex_ = Lex::kBang;
+            } else if (is_alpha(c)) {
+                name_[name_len_++] = lower(c);
+                lex_ = Lex::kTagName;
+            } else {
+                // A bare '<' in text; browsers render it literally.
+                lex_ = Lex::kText;
+                if (!root_seen_) {
+                    fail(HtmlViolation::kMissingRoot);
+                }
+            }
+            break;
+
+        case Lex::kTagName:
+            if (is_name_char(c)) {
+                if (name_len_ < kMaxTagName) {
+                    name_[name_len_++] = lower(c);
+                }
+            } else if (c == '>') {
+                finish_tag();
+            } else {
+                self_closing_ = c == '/';
+                lex_ = Lex::kAttrs;
+            }
+            break;
+
+        case Lex::kAttrs:
+            if (c == '>') {
+                finish_tag();
+            } else if (c == '"') {
+                self_closing_ = false;
+                lex_ = Lex::kAttrDouble;
+            } else if (c == '\'') {
+                self_closing_ = false;
+                lex_ = Lex::kAttrSingle;
+            } else if (!is_space(c)) {
+                self_closing_ = c == '/';
+            }
+            break;
+
+        case Lex::kAttrDouble:
+            if (c == '"') {
+                lex_ = Lex::kAttrs;
+            }
+            break;
+
+        case Lex::kAttrSingle:
+            if (c == '\'') {
+                lex_ = Lex::kAttrs;
+            }
+            break;
+
+        case Lex::kBang:
+            if (c == '>') {
+                name_[name_len_] = '\0';
+                if (std::strncmp(name_, "doctype", 7) == 0) {
+                    root_seen_ = true;
+                } else if (!root_seen_) {
+                    fail(HtmlViolation::kMissingRoot);
+                }
+                lex_ = Lex::kText;
+            } else if (name_len_ < kMaxTagName && !is_space(c)) {
+                name_[name_len_++] = lower(c);
+                if (name_len_ == 2 && name_[0] == '-' && name_[1] == '-') {
+                    dashes_ = 0;
+                    lex_ = Lex::kComment;
+                }
+            }
+            break;
+
+        case Lex::kComment:
+            if (c == '-') {
+                ++dashes_;
+            } else {
+                if (c == '>' && dashes_ >= 2) {
+                    lex_ = Lex::kText;
+                }
+                dashes_ = 0;
+            }
+            break;
+
+        case Lex::kRawText: {
+            // Scan for "</" + the raw element's name, case-insensitively.
+            const char *raw = stack_[depth_ - 1].text;
+            const auto raw_len = static_cast<int32_t>(std::strlen(raw));
+            const char expected = raw_match_ == 0 ? '<' : raw_match_ == 1 ? '/' : raw[raw_match_ - 2];
+            if (lower(c) == expected) {
+                if (++raw_match_ == raw_len + 2) {
+                    tag_start_ = fed_ + 1 - static_cast<size_t>(raw_match_);
+                    std::memcpy(name_, raw, static_cast<size_t>(raw_len));
+                    name_len_ = raw_len;
+                    closing_ = true;
+                    self_closing_ = false;
+                    raw_match_ = 0;
+                    lex_ = Lex::kTagName;
+                }
+            } else {
+                raw_match_ = c == '<' ? 1 : 0;
+            }
+            break;
+        }
+
+        case Lex::kDone:
+            break;
+    }
+}
+
+void HtmlStreamValidator::finish_tag() {
+    name_[name_len_] = '\0';
+    lex_ = Lex::kText;
+    if (closing_) {
+        close_tag(name_);
+    } else {
+        open_tag(name_);
+    }
+}
+
+void HtmlStreamValidator::open_tag(const char *name) {
+    if (!root_seen_) {
+        if (std::strcmp(name, "html") != 0) {
+            fail(HtmlViolation::kMissingRoot);
+            return;
+        }
+        root_seen_ = true;
+    }
+    if (self_closing_ || in_list(name, kVoidTags)) {
+        return;
+    }
+    if (depth_ == kMaxDepth) {
+        fail(HtmlViolation::kTooDeep);
+        return;
+    }
+    std::memcpy(stack_[depth_].text, name, sizeof(stack_[depth_].text));
+    ++depth_;
+    if (std::strcmp(name, "style") == 0 || std::strcmp(name, "script") == 0) {
+        raw_match_ = 0;
+        lex_ = Lex::kRawText;
+    }
+}
+
+void HtmlStreamValidator::close_tag(const char *name) {
+    if (in_list(name, kVoidTags)) {
+        return;
+    }
+    int32_t match = depth_ - 1;
+    while (match >= 0 && std::strcmp(stack_[match].text, name) != 0) {
+        --match;
+    }
+    if (match < 0) {
+        fail(HtmlViolation::kUnbalancedTag);
+        return;
+    }
+    for (int32_t i = match + 1; i < depth_; ++i) {
+        if (!in_list(stack_[i].text, kImpliedEndTags)) {
+            fail(HtmlViolation::kUnbalancedTag);
+            return;
+        }
+    }
+    depth_ = match;
+    if (depth_ <= kBoundaryDepth) {
+        ++boundaries_;
+        ++render_points_;
+    } else if (in_list(name, kRenderPointTags)) {
+        ++render_points_;
+    }
+    if (!fenced_ && std::strcmp(name, "html") == 0) {
+        status_ = Status::kComplete;
+        lex_ = Lex::kDone;
+    }
+}
+
+size_t HtmlStreamValidator::safe_length() const {
+    switch (lex_) {
+        case Lex::kTagOpen:
+        case Lex::kTagName:
+        case Lex::kAttrs:
+        case Lex::kAttrDouble:
+        case Lex::kAttrSingle:
+        case Lex::kBang:
+            return tag_start_;
+        case Lex::kRawText:
+            return fed_ - static_cast<size_t>(raw_match_);
+        default:
+            return fed_;
+    }
+}
+
+std::string HtmlStreamValidator::closing_suffix() const {
+    std::string suffix;
+    if (lex_ == Lex::kComment) {
+        suffix.append("-->");
+    }
+    for (int32_t i = depth_ - 1; i >= 0; --i) {
+        suffix.append("</").append(stack_[i].text).append(">");
+    }
+    if (fenced_ && lex_ != Lex::kDone) {
+        suffix.append("\n```");
+    }
+    return suffix;
+}
+
+}  // namespace genui
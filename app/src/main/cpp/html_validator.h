@@ -0,0 +1,124 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "token_mask.h"
+
+namespace genui {
+
+enum class ValidationPolicy : int32_t {
+    kOff = 0,       // validator not run
+    kAbort = 1,     // stop on the first violation and report an error
+    kTruncate = 2,  // stop on the first violation and return the last valid prefix, auto-closed
+};
+
+enum class HtmlViolation : int32_t {
+    kNone = 0,
+    kMissingFence,
+    kMissingRoot,
+    kUnbalancedTag,
+    kTooDeep,
+    kExternalReference,
+};
+
+const char *html_violation_name(HtmlViolation violation);
+
+// Incremental structural check of a streamed ```html answer: the fence, a
+// doctype or <html> root before any content, balanced container tags, and no
+// external references. State is a fixed-size tag stack plus a few counters,
+// so memory stays bounded however long the generation runs, and the object
+// is cheap to copy when the caller needs a snapshot.
+class HtmlStreamValidator {
+public:
+    enum class Status {
+        kOk,
+        kComplete,   // closing fence (or </html> without a fence) seen
+        kViolation,
+    };
+
+    static constexpr int32_t kMaxDepth = 48;
+    static constexpr int32_t kMaxTagName = 15;
+    static constexpr size_t kMaxPreamble = 256;
+    // Closing a tag that leaves at most <html><body> open ends a top-level block.
+    static constexpr int32_t kBoundaryDepth = 2;
+
+    // `banned` must outlive the validator; pass nullptr to skip the
+    // external-reference check.
+    explicit HtmlStreamValidator(const PatternAutomaton *banned = nullptr);
+
+    Status feed(const char *data, size_t len);
+    Status status() const { return status_; }
+    HtmlViolation violation() const { return violation_; }
+
+    size_t bytes_fed() const { return fed_; }
+    int32_t depth() const { return depth_; }
+    bool root_seen() const { return root_seen_; }
+    bool fenced() const { return fenced_; }
+    // Number of top-level blocks closed so far; a change marks a structural
+    // boundary where the stream is a clean prefix of the document.
+    int32_t boundaries() const { return boundaries_; }
+    // Boundaries plus closes of a <style>, <li> or <tr> at any depth: points
+    // where the prefix plus closing_suffix() is a document worth rendering.
+    int32_t render_points() const { return render_points_; }
+
+    // Stream offset up to which the output is structurally clean, i.e. not in
+    // the middle of a tag.
+    size_t safe_length() const;
+    // Markup that closes everything open at safe_length(): a pending comment,
+    // open tags innermost first, and the closing fence.
+    std::string closing_suffix() const;
+
+private:
+    enum class Lex : uint8_t {
+        kPreamble,
+        kFenceInfo,
+        kText,
+        kTagOpen,
+        kTagName,
+        kAttrs,
+        kAttrDouble,
+        kAttrSingle,
+        kBang,
+        kComment,
+        kRawText,
+        kDone,
+    };
+
+    struct TagName {
+        char text[kMaxTagName + 1];
+    };
+
+    void step(char c);
+    void finish_tag();
+    void open_tag(const char *name);
+    void close_tag(const char *name);
+    void fail(HtmlViolation violation);
+
+    const PatternAutomaton *banned_;
+    int32_t banned_state_ = 0;
+
+    Status status_ = Status::kOk;
+    HtmlViolation violation_ = HtmlViolation::kNone;
+    Lex lex_ = Lex::kPreamble;
+    size_t fed_ = 0;
+    size_t tag_start_ = 0;
+    bool fenced_ = false;
+    bool root_seen_ = false;
+
+    char name_[kMaxTagName + 1] = {};
+    int32_t name_len_ = 0;
+    bool closing_ = false;
+    bool self_closing_ = false;
+    int32_t backticks_ = 0;
+    int32_t dashes_ = 0;
+    int32_t raw_match_ = 0;
+
+    TagName stack_[kMaxDepth] = {};
+    int32_t depth_ = 0;
+    int32_t boundaries_ = 0;
+    int32_t render_points_ = 0;
+};
+
+}  // namespace genui
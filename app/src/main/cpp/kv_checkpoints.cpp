@@ -0,0 +1,49 @@
+﻿#include "kv_checkpoints.h"
+
+#include <algorithm>
+
+namespace genui {
+
+void CheckpointStack::push(KvCheckpoint checkpoint) {
+    if (capacity_ == 0) {
+        return;
+    }
+    if (entries_.size() == capacity_) {
+        entries_.erase(entries_.begin());
+    }
+    entries_.push_back(std::move(checkpoint));
+}
+
+KvCheckpoint *CheckpointStack::rollback_target(int32_t max_retries) {
+    while (!entries_.empty() && entries_.back().retries >= max_retries) {
+        entries_.pop_back();
+    }
+    return latest();
+}
+
+void RepetitionDetector::push(llama_token tok) {
+    history_[count_ % kHistory] = tok;
+    ++count_;
+}
+
+bool RepetitionDetector::looping() const {
+    const int32_t available = std::min(count_, kHistory);
+    for (int32_t period = 1; period <= kMaxPeriod; ++period) {
+        const int32_t reps = std::max(4, (kMinLoopTokens + period - 1) / period);
+        const int32_t span = period * reps;
+        if (span > available) {
+            continue;
+        }
+        int32_t j = 0;
+        const int32_t compares = span - period;
+        while (j < compares && at(j) == at(j + period)) {
+            ++j;
+        }
+        if (j == compares) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace genui
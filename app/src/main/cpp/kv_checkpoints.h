@@ -0,0 +1,79 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "grammar_mask.h"
+#include "html_validator.h"
+#include "llama.h"
+
+namespace genui {
+
+// Everything needed to resume decoding from a structural boundary without
+// re-prefilling: the KV length (the checkpoint token is the last cell kept),
+// the output length and the per-token filters' state at that point.
+struct KvCheckpoint {
+    llama_pos n_past = 0;
+    llama_token last_token = -1;
+    size_t output_len = 0;
+    int32_t generated = 0;
+    int32_t mask_state = 0;
+    GrammarState grammar_state;
+    HtmlStreamValidator validator;
+
+    // Token chosen right after the checkpoint on the current attempt, and the
+    // ones earlier attempts took before they had to be rolled back.
+    llama_token next_token = -1;
+    std::vector<llama_token> banned;
+    int32_t retries = 0;
+};
+
+// Bounded stack of checkpoints; the oldest entry is dropped when full.
+class CheckpointStack {
+public:
+    explicit CheckpointStack(size_t capacity = 8) : capacity_(capacity) {}
+
+    void push(KvCheckpoint checkpoint);
+    void clear() { entries_.clear(); }
+    bool empty() const { return entries_.empty(); }
+    size_t size() const { return entries_.size(); }
+
+    KvCheckpoint *latest() { return entries_.empty() ? nullptr : &entries_.back(); }
+    // Most recent checkpoint that has been retried fewer than `max_retries`
+    // times; exhausted checkpoints above it are discarded.
+    KvCheckpoint *rollback_target(int32_t max_retries);
+
+private:
+    size_t capacity_;
+    std::vector<KvCheckpoint> entries_;
+};
+
+// Flags degenerate loops: the tail of the token stream repeating the same
+// period at least four times and over at least kMinLoopTokens tokens.
+class RepetitionDetector {
+public:
+    static constexpr int32_t kHistory = 256;
+    static constexpr int32_t kMaxPeriod = 64;
+    static constexpr int32_t kMinLoopTokens = 64;
+
+    void push(llama_token tok);
+    void reset() { count_ = 0; }
+    bool looping() const;
+
+private:
+    llama_token at(int32_t back) const { return history_[(count_ - 1 - back) % kHistory]; }
+
+    llama_token history_[kHistory] = {};
+    int32_t count_ = 0;
+};
+
+struct RecoveryStats {
+    int32_t checkpoints = 0;
+    int32_t rollbacks = 0;
+    int32_t max_rollback_depth = 0;  // tokens discarded by the deepest single rollback
+    int32_t tokens_discarded = 0;
+    int32_t tokens_saved = 0;        // prompt + kept tokens a from-scratch retry would recompute
+};
+
+}  // namespace genui
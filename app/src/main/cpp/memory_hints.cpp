@@ -0,0 +1,330 @@
+﻿#include "memory_hints.h"
+
+#include <android/log.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include "ggml.h"
+
+#define LOG_TAG "QwenCoderBridge"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25
+#endif
+
+namespace genui {
+
+namespace {
+
+constexpr uintptr_t kHugePage = 2u << 20;
+
+static double mib(size_t bytes) {
+    return static_cast<double>(bytes) / (1024.0 * 1024.0);
+}
+
+static uintptr_t round_up(uintptr_t value, uintptr_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static uintptr_t page_size() {
+    return static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+}
+
+// One line of /proc/self/maps.
+struct Mapping {
+    uintptr_t begin = 0;
+    uintptr_t end = 0;
+    uint64_t inode = 0;
+    bool writable = false;
+    std::string path;
+};
+
+static std::vector<Mapping> read_maps() {
+    std::vector<Mapping> mappings;
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line)) {
+        std::istringstream fields(line);
+        std::string range;
+        std::string perms;
+        std::string offset;
+        std::string device;
+        Mapping mapping;
+        if (!(fields >> range >> perms >> offset >> device >> mapping.inode)) {
+            continue;
+        }
+        std::getline(fields >> std::ws, mapping.path);
+        mapping.writable = perms.size() >= 2 && perms[0] == 'r' && perms[1] == 'w';
+        if (std::sscanf(range.c_str(), "%zx-%zx", &mapping.begin, &mapping.end) == 2) {
+            mappings.push_back(std::move(mapping));
+        }
+    }
+    return mappings;
+}
+
+// Malloc'd memory a ggml buffer can live in: unnamed anonymous mappings
+// (glibc's mmap'd chunks) and the regions Android's allocators name, scudo's
+// [anon:scudo:*] and jemalloc's [anon:libc_malloc]. Every other name is
+// someone else's memory, e.g. ART's [anon:dalvik-*] or a [stack].
+static bool is_heap(const Mapping &mapping) {
+    if (mapping.inode != 0 || !mapping.writable) {
+        return false;
+    }
+    return mapping.path.empty() || mapping.path.rfind("[anon:scudo:", 0) == 0
+           || mapping.path == "[anon:libc_malloc]";
+}
+
+static std::string base_name(const std::string &path) {
+    const size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// Sum of the huge-page backed fields of /proc/self/smaps_rollup.
+static size_t huge_backed_bytes() {
+    std::ifstream rollup("/proc/self/smaps_rollup");
+    std::string line;
+    size_t total_kb = 0;
+    while (std::getline(rollup, line)) {
+        for (const char *field : {"AnonHugePages:", "FilePmdMapped:", "ShmemPmdMapped:"}) {
+            if (line.rfind(field, 0) == 0) {
+                total_kb += std::strtoull(line.c_str() + std::strlen(field), nullptr, 10);
+            }
+        }
+    }
+    return total_kb * 1024;
+}
+
+}  // namespace
+
+void *map_huge(size_t size) {
+    const size_t length = round_up(size, kHugePage);
+    // Over-allocate by one huge page and trim both ends to the alignment.
+    void *raw = mmap(nullptr, length + kHugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return nullptr;
+    }
+    const auto start = reinterpret_cast<uintptr_t>(raw);
+    const uintptr_t aligned = round_up(start, kHugePage);
+    if (aligned > start) {
+        munmap(raw, aligned - start);
+    }
+    const uintptr_t tail = start + length + kHugePage - (aligned + length);
+    if (tail > 0) {
+        munmap(reinterpret_cast<void *>(aligned + length), tail);
+    }
+    madvise(reinterpret_cast<void *>(aligned), length, MADV_HUGEPAGE);
+    return reinterpret_cast<void *>(aligned);
+}
+
+void unmap_huge(void *data, size_t size) {
+    if (data) {
+        munmap(data, round_up(size, kHugePage));
+    }
+}
+
+void page_out(const void *data, size_t size) {
+    const uintptr_t page = page_size();
+    const auto from = reinterpret_cast<uintptr_t>(data);
+    const uintptr_t begin = round_up(from, page);
+    const uintptr_t end = (from + size) & ~(page - 1);
+    if (end > begin) {
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_PAGEOUT);
+    }
+}
+
+MappingSnapshot MappingSnapshot::take() {
+    MappingSnapshot snapshot;
+    for (const Mapping &mapping : read_maps()) {
+        if (is_heap(mapping)) {
+            snapshot.regions_.emplace_back(mapping.begin, mapping.end);
+        }
+    }
+    return snapshot;
+}
+
+std::vector<MemoryRegion> MappingSnapshot::added() const {
+    std::vector<MemoryRegion> added;
+    for (const Mapping &mapping : read_maps()) {
+        if (!is_heap(mapping) || mapping.end - mapping.begin < kHugePage) {
+            continue;
+        }
+        const MemoryRegion region(mapping.begin, mapping.end);
+        if (std::find(regions_.begin(), regions_.end(), region) == regions_.end()) {
+            added.push_back(region);
+        }
+    }
+    return added;
+}
+
+std::string MemoryHintStats::describe() const {
+    char text[256];
+    std::snprintf(text, sizeof(text),
+                  "model %.1f MiB (%s), huge pages advised %.1f MiB, collapsed %.1f MiB, backed %.1f MiB, "
+                  "%d hot copies %.1f MiB",
+                  mib(model_bytes), phase, mib(advised_bytes), mib(collapsed_bytes), mib(huge_bytes),
+                  copied_tensors, mib(copied_bytes));
+    return text;
+}
+
+MemoryHints::~MemoryHints() {
+    clear();
+}
+
+// MADV_HUGEPAGE lets faults and khugepaged use huge pages; MADV_COLLAPSE
+// (Linux 6.1) collapses what is already resident right away.
+void MemoryHints::advise_huge(uintptr_t begin, uintptr_t end) {
+    if (!options_.huge_pages || end <= begin) {
+        return;
+    }
+    auto *data = reinterpret_cast<void *>(begin);
+    if (madvise(data, end - begin, MADV_HUGEPAGE) != 0) {
+        return;
+    }
+    stats_.advised_bytes += end - begin;
+    if (madvise(data, end - begin, MADV_COLLAPSE) == 0) {
+        stats_.collapsed_bytes += end - begin;
+    }
+}
+
+void MemoryHints::advise_model(int advice) const {
+    for (const MemoryRegion &region : model_regions_) {
+        madvise(reinterpret_cast<void *>(region.first), region.second - region.first, advice);
+    }
+}
+
+bool MemoryHints::attach(const std::string &model_path, const MemoryHintOptions &options) {
+    clear();
+    model_regions_.clear();
+    stats_ = MemoryHintStats();
+    options_ = options;
+
+    // Matched by inode and file name: the path the app opened may be a
+    // symlink or a FUSE view of the one the kernel reports.
+    struct stat file {};
+    if (stat(model_path.c_str(), &file) != 0) {
+        return false;
+    }
+    const std::string name = base_name(model_path);
+    for (const Mapping &mapping : read_maps()) {
+        if (mapping.inode == static_cast<uint64_t>(file.st_ino) && base_name(mapping.path) == name) {
+            model_regions_.emplace_back(mapping.begin, mapping.end);
+            stats_.model_bytes += mapping.end - mapping.begin;
+        }
+    }
+    if (model_regions_.empty()) {
+        LOGE("Memory hints: %s is not mapped; model hints skipped", name.c_str());
+        return false;
+    }
+
+    if (options_.access_phases) {
+        advise_model(MADV_SEQUENTIAL);
+        advise_model(MADV_WILLNEED);
+        stats_.phase = "load";
+    }
+    // File-backed huge pages need a kernel with read-only THP for files;
+    // elsewhere only the anonymous buffers and copies get them.
+    for (const MemoryRegion &region : model_regions_) {
+        advise_huge(region.first, region.second);
+    }
+    LOGI("Memory hints: %s", stats().describe().c_str());
+    return true;
+}
+
+void MemoryHints::advise_buffers(const std::vector<MemoryRegion> &regions) {
+    for (const MemoryRegion &region : regions) {
+        // Partial huge pages at either end stay small.
+        advise_huge(round_up(region.first, kHugePage), region.second & ~(kHugePage - 1));
+    }
+}
+
+void MemoryHints::copy_hot_tensors(const std::vector<ggml_tensor *> &weights) {
+    if (options_.hot_copy_bytes == 0 || copies_) {
+        return;
+    }
+    const auto in_model = [this](const ggml_tensor *tensor) {
+        const auto data = reinterpret_cast<uintptr_t>(tensor->data);
+        return std::any_of(model_regions_.begin(), model_regions_.end(), [&](const MemoryRegion &region) {
+            return data >= region.first && data + ggml_nbytes(tensor) <= region.second;
+        });
+    };
+    std::vector<ggml_tensor *> chosen;
+    size_t total = 0;
+    for (ggml_tensor *tensor : weights) {
+        const size_t size = round_up(ggml_nbytes(tensor), 64);
+        if (tensor->data && !tensor->view_src && ggml_is_contiguous(tensor) && in_model(tensor)
+            && total + size <= options_.hot_copy_bytes) {
+            chosen.push_back(tensor);
+            total += size;
+        }
+    }
+    if (chosen.empty()) {
+        return;
+    }
+    copies_ = static_cast<uint8_t *>(map_huge(total));
+    if (!copies_) {
+        LOGE("Memory hints: cannot map %.1f MiB for hot copies", mib(total));
+        return;
+    }
+    copies_size_ = total;
+    const auto begin = reinterpret_cast<uintptr_t>(copies_);
+    stats_.advised_bytes += round_up(total, kHugePage);
+
+    size_t offset = 0;
+    for (ggml_tensor *tensor : chosen) {
+        const size_t size = ggml_nbytes(tensor);
+        void *original = tensor->data;
+        std::memcpy(copies_ + offset, original, size);
+        tensor->data = copies_ + offset;
+        copied_.emplace_back(tensor, original);
+        page_out(original, size);
+        offset += round_up(size, 64);
+        ++stats_.copied_tensors;
+        stats_.copied_bytes += size;
+    }
+    if (options_.huge_pages && madvise(copies_, round_up(total, kHugePage), MADV_COLLAPSE) == 0) {
+        stats_.collapsed_bytes += round_up(total, kHugePage);
+    }
+    LOGI("Memory hints: copied %d hot tensors (%.1f MiB) to %p", stats_.copied_tensors, mib(stats_.copied_bytes),
+         reinterpret_cast<void *>(begin));
+}
+
+void MemoryHints::enter_inference() {
+    if (options_.access_phases && !model_regions_.empty()) {
+        advise_model(MADV_RANDOM);
+        stats_.phase = "inference";
+    }
+    LOGI("Memory hints: %s", stats().describe().c_str());
+}
+
+void MemoryHints::clear() {
+    for (const auto &entry : copied_) {
+        entry.first->data = entry.second;
+    }
+    copied_.clear();
+    unmap_huge(copies_, copies_size_);
+    copies_ = nullptr;
+    copies_size_ = 0;
+    stats_.copied_tensors = 0;
+    stats_.copied_bytes = 0;
+}
+
+const MemoryHintStats &MemoryHints::stats() {
+    stats_.huge_bytes = huge_backed_bytes();
+    return stats_;
+}
+
+}  // namespace genui
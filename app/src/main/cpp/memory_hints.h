@@ -0,0 +1,112 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "llama.h"
+
+namespace genui {
+
+// Anonymous memory aligned to 2 MB and advised for transparent huge pages,
+// for data read on every decode step. `size` is rounded up to 2 MB for both
+// calls; nullptr on failure.
+void *map_huge(size_t size);
+void unmap_huge(void *data, size_t size);
+
+// Asks the kernel to reclaim the pages wholly inside [data, data + size).
+// Pages of the mmap'd model file are dropped and fault back in from the file
+// if they are read again; anonymous ones go to swap. Either way the contents
+// stay valid.
+void page_out(const void *data, size_t size);
+
+// An address range [first, second).
+using MemoryRegion = std::pair<uintptr_t, uintptr_t>;
+
+// The anonymous mappings of the process at one point. llama.cpp does not
+// expose where it allocates its model and context buffers (fused weights, KV
+// cache, compute buffers), so the hints find them as the mappings an
+// allocation added.
+class MappingSnapshot {
+public:
+    static MappingSnapshot take();
+    // Writable anonymous regions of 2 MB or more that are new since the
+    // snapshot and belong to malloc: unnamed, or named by Android's scudo or
+    // jemalloc. Other named regions (ART's [anon:dalvik-*] heaps and JIT
+    // caches, thread stacks) can grow on other threads meanwhile and are
+    // never advised.
+    std::vector<MemoryRegion> added() const;
+
+private:
+    std::vector<MemoryRegion> regions_;
+};
+
+struct MemoryHintOptions {
+    bool huge_pages = true;     // MADV_HUGEPAGE, plus MADV_COLLAPSE where the kernel has it
+    bool access_phases = true;  // sequential read-ahead while loading, random access once serving
+    size_t hot_copy_bytes = 0;  // budget for anonymous copies of hot weights; 0: none
+};
+
+struct MemoryHintStats {
+    size_t model_bytes = 0;      // mapped from the model file
+    size_t advised_bytes = 0;    // given MADV_HUGEPAGE: model mapping, copies, llama.cpp buffers
+    size_t collapsed_bytes = 0;  // collapsed into huge pages right away
+    int32_t copied_tensors = 0;
+    size_t copied_bytes = 0;
+    size_t huge_bytes = 0;       // process memory backed by huge pages (smaps_rollup), when last read
+    const char *phase = "none";
+
+    // "model 468.6 MiB (inference), huge pages advised 812.0 MiB, collapsed
+    // 0.0 MiB, backed 304.0 MiB, 12 hot copies 96.0 MiB"
+    std::string describe() const;
+};
+
+// madvise hints for the model mapping and for llama.cpp's buffers. Each hint
+// is best effort: a kernel without transparent huge pages, or without
+// MADV_COLLAPSE, just leaves the memory on 4 KB pages.
+//
+// The model mapping goes through two phases. While loading it is read
+// sequentially with aggressive read-ahead (MADV_SEQUENTIAL, MADV_WILLNEED),
+// which also covers the repack and hot-copy passes over the weights. Once the
+// model serves requests it is switched to MADV_RANDOM: the resident weights
+// need no read-ahead, and the sequential hint would let reclaim drop them
+// first. Optional hot copies move the weights a decode step reads in full
+// into 2 MB-aligned anonymous memory, where huge pages do not depend on the
+// file system, and re-point the tensors at them.
+class MemoryHints {
+public:
+    MemoryHints() = default;
+    ~MemoryHints();
+    MemoryHints(const MemoryHints &) = delete;
+    MemoryHints &operator=(const MemoryHints &) = delete;
+
+    // Finds the mapping llama.cpp made of `model_path` and starts the load
+    // phase on it; false when the file is not mapped. Replaces earlier state.
+    bool attach(const std::string &model_path, const MemoryHintOptions &options);
+    // Advises buffers, e.g. what MappingSnapshot::added() found, for huge pages.
+    void advise_buffers(const std::vector<MemoryRegion> &regions);
+    // Copies `weights` that live in the model mapping, in order, until the
+    // budget is spent, re-points them at the copies and pages the originals
+    // out. Only while no graph runs.
+    void copy_hot_tensors(const std::vector<ggml_tensor *> &weights);
+    void enter_inference();
+    // Points copied tensors back at the mapping and frees the copies.
+    void clear();
+
+    const MemoryHintStats &stats();
+
+private:
+    void advise_huge(uintptr_t begin, uintptr_t end);
+    void advise_model(int advice) const;
+
+    MemoryHintOptions options_;
+    std::vector<MemoryRegion> model_regions_;
+    std::vector<std::pair<ggml_tensor *, void *>> copied_;  // tensor, original data
+    uint8_t *copies_ = nullptr;
+    size_t copies_size_ = 0;
+    MemoryHintStats stats_;
+};
+
+}  // namespace genui
@@ -0,0 +1,82 @@
+﻿#pragma once
+
+#include <atomic>
+#include <utility>
+
+namespace genui {
+
+// Unbounded multi-producer/single-consumer queue (Vyukov's node-based
+// design). push() may be called from any thread and never blocks or locks;
+// pop() and empty() are only called from the one consumer thread. A producer
+// that is preempted between publishing its node and linking it makes the
+// queue look empty to the consumer until it resumes, so producers must wake
+// the consumer only after push() returns.
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() = default;
+    ~MpscQueue() {
+        T value;
+        while (pop(value)) {
+        }
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    void push(T value) {
+        link(new Node(std::move(value)));
+    }
+
+    bool pop(T &value) {
+        Node *tail = tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &stub_) {
+            if (!next) {
+                return false;
+            }
+            tail_ = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (!next) {
+            if (tail != head_.load(std::memory_order_acquire)) {
+                return false;  // a producer is between publish and link
+            }
+            // Re-insert the stub so the last node can be unlinked.
+            link(&stub_);
+            next = tail->next.load(std::memory_order_acquire);
+            if (!next) {
+                return false;
+            }
+        }
+        tail_ = next;
+        value = std::move(tail->value);
+        delete tail;
+        return true;
+    }
+
+    bool empty() const {
+        return tail_ == &stub_ && !stub_.next.load(std::memory_order_acquire);
+    }
+
+private:
+    struct Node {
+        Node() = default;
+        explicit Node(T v) : value(std::move(v)) {}
+        std::atomic<Node *> next{nullptr};
+        T value{};
+    };
+
+    void link(Node *node) {
+        node->next.store(nullptr, std::memory_order_relaxed);
+        Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    Node stub_;
+    alignas(64) std::atomic<Node *> head_{&stub_};  // producers
+    alignas(64) Node *tail_ = &stub_;               // consumer
+};
+
+}  // namespace genui
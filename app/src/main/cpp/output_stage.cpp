@@ -0,0 +1,231 @@
+﻿#include "output_stage.h"
+
+#include <chrono>
+
+namespace genui {
+
+namespace {
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}  // namespace
+
+OutputStage::OutputStage(const VocabPieces &pieces, const PatternAutomaton *banned, ValidationPolicy policy,
+                         int32_t max_rollbacks, int32_t max_retries)
+        : pieces_(pieces),
+          policy_(policy),
+          max_rollbacks_(max_rollbacks),
+          max_retries_(max_retries),
+          validator_(banned) {}
+
+OutputStage::~OutputStage() {
+    finish();
+}
+
+void OutputStage::start() {
+    if (!helper_.joinable()) {
+        stopping_.store(false);
+        helper_ = std::thread(&OutputStage::run, this);
+    }
+}
+
+void OutputStage::finish() {
+    if (!helper_.joinable()) {
+        return;
+    }
+    wait_idle();
+    {
+        std::lock_guard<std::mutex> lock(park_mutex_);
+        stopping_.store(true);
+    }
+    park_cv_.notify_one();
+    helper_.join();
+}
+
+void OutputStage::submit(const StagedToken &staged) {
+    // The decode thread never runs more than two tokens ahead, so the ring
+    // only fills if the helper has been descheduled.
+    while (!ring_.push(staged)) {
+        std::this_thread::yield();
+    }
+    ++submitted_;
+    wake();
+}
+
+void OutputStage::wake() {
+    // Pairs with the fence in run(): either the helper sees the new token
+    // before parking, or we see it parked and notify under the lock.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (parked_.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(park_mutex_);
+        park_cv_.notify_one();
+    }
+}
+
+void OutputStage::wait_processed(int64_t count) {
+    if (processed_.load(std::memory_order_acquire) >= count) {
+        return;
+    }
+    const int64_t start = now_ns();
+    while (processed_.load(std::memory_order_acquire) < count) {
+        std::this_thread::yield();
+    }
+    wait_ns_ += now_ns() - start;
+}
+
+void OutputStage::run() {
+    StagedToken staged;
+    int32_t spins = 0;
+    while (true) {
+        if (ring_.pop(staged)) {
+            const int64_t start = now_ns();
+            process(staged);
+            helper_ns_ += now_ns() - start;
+            processed_.fetch_add(1, std::memory_order_release);
+            spins = 0;
+            continue;
+        }
+        if (stopping_.load(std::memory_order_acquire)) {
+            break;
+        }
+        if (++spins < kSpinsBeforePark) {
+            std::this_thread::yield();
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(park_mutex_);
+        parked_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        park_cv_.wait(lock, [this] { return !ring_.empty() || stopping_.load(); });
+        parked_.store(false, std::memory_order_relaxed);
+        spins = 0;
+    }
+}
+
+void OutputStage::process(const StagedToken &staged) {
+    // Tokens already in flight when a verdict was reached are dropped.
+    if (verdict_.load(std::memory_order_relaxed) != StageVerdict::kContinue) {
+        return;
+    }
+    const llama_token tok = staged.token;
+    KvCheckpoint *latest = checkpoints_.latest();
+    if (latest && latest->generated == accepted_ && latest->next_token < 0) {
+        latest->next_token = tok;
+    }
+    if (pieces_.is_turn_marker(tok)) {
+        stop("end-of-turn token");
+        return;
+    }
+
+    const size_t piece_start = output_.size();
+    output_.append(pieces_.data(tok), pieces_.length(tok));
+
+    const HtmlStreamValidator before = validator_;
+    if (policy_ != ValidationPolicy::kOff) {
+        const auto status = validator_.feed(output_.data() + piece_start, output_.size() - piece_start);
+        if (status == HtmlStreamValidator::Status::kComplete) {
+            cut_output(validator_.bytes_fed());
+            ++accepted_;
+            stop("closing fence");
+            return;
+        }
+        if (status == HtmlStreamValidator::Status::kViolation) {
+            fail(html_violation_name(validator_.violation()), true, before);
+            return;
+        }
+    }
+    repetition_.push(tok);
+    if (repetition_.looping()) {
+        fail("repetition loop", false, before);
+        return;
+    }
+
+    ++accepted_;
+    if (validator_.boundaries() != boundaries_seen_) {
+        boundaries_seen_ = validator_.boundaries();
+        KvCheckpoint checkpoint;
+        checkpoint.n_past = staged.n_past;
+        checkpoint.last_token = tok;
+        checkpoint.output_len = output_.size();
+        checkpoint.generated = accepted_;
+        checkpoint.mask_state = staged.mask_state;
+        checkpoint.grammar_state = staged.grammar_state;
+        checkpoint.validator = validator_;
+        checkpoints_.push(std::move(checkpoint));
+        ++recovery_.checkpoints;
+    }
+    if (stream_) {
+        stream_->update(output_);
+        if (validator_.render_points() != render_points_seen_) {
+            render_points_seen_ = validator_.render_points();
+            if (stream_->wants_checkpoints()) {
+                std::string document(output_, 0, validator_.safe_length());
+                document.append(validator_.closing_suffix());
+                stream_->checkpoint(document);
+            }
+        }
+    }
+}
+
+void OutputStage::cut_output(size_t length) {
+    output_.resize(length);
+    if (stream_) {
+        stream_->rewind(length);
+    }
+}
+
+void OutputStage::stop(const char *reason) {
+    stop_reason_ = reason;
+    verdict_.store(StageVerdict::kStop, std::memory_order_release);
+}
+
+void OutputStage::fail(const char *reason, bool invalid_structure, const HtmlStreamValidator &before) {
+    failed_ = true;
+    failed_at_ = accepted_;
+    invalid_structure_ = invalid_structure;
+    failed_before_ = before;
+    stop_reason_ = reason;
+    if (recovery_.rollbacks < max_rollbacks_ && checkpoints_.rollback_target(max_retries_)) {
+        verdict_.store(StageVerdict::kRollback, std::memory_order_release);
+        return;
+    }
+    settle();
+}
+
+void OutputStage::settle() {
+    if (!failed_) {
+        return;
+    }
+    if (policy_ == ValidationPolicy::kAbort || (invalid_structure_ && !failed_before_.root_seen())) {
+        aborted_ = true;
+    } else if (policy_ == ValidationPolicy::kTruncate && failed_before_.root_seen()) {
+        cut_output(failed_before_.safe_length());
+        output_.append(failed_before_.closing_suffix());
+    }
+    verdict_.store(StageVerdict::kStop, std::memory_order_release);
+}
+
+void OutputStage::resume_from(const KvCheckpoint &checkpoint) {
+    cut_output(checkpoint.output_len);
+    accepted_ = checkpoint.generated;
+    validator_ = checkpoint.validator;
+    boundaries_seen_ = validator_.boundaries();
+    render_points_seen_ = validator_.render_points();
+    repetition_.reset();
+    failed_ = false;
+    invalid_structure_ = false;
+    stop_reason_ = nullptr;
+    verdict_.store(StageVerdict::kContinue, std::memory_order_release);
+}
+
+OutputStage::Timing OutputStage::timing() const {
+    Timing timing;
+    timing.tokens = processed_.load(std::memory_order_acquire);
+    timing.helper_ms = static_cast<double>(helper_ns_) / 1e6;
+    timing.wait_ms = static_cast<double>(wait_ns_) / 1e6;
+    return timing;
+}
+
+}  // namespace genui
@@ -0,0 +1,137 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "grammar_mask.h"
+#include "html_validator.h"
+#include "kv_checkpoints.h"
+#include "llama.h"
+#include "spsc_ring.h"
+#include "text_stream.h"
+#include "token_mask.h"
+#include "vocab_pieces.h"
+
+namespace genui {
+
+// A token the decode loop has committed to, with the filter state after it.
+struct StagedToken {
+    llama_token token = -1;
+    llama_pos n_past = 0;  // KV length once the token has been decoded
+    int32_t mask_state = 0;
+    GrammarState grammar_state;
+};
+
+enum class StageVerdict : int32_t {
+    kContinue = 0,
+    kStop,      // output is final: closing fence, end-of-turn token or a policy stop
+    kRollback,  // failure that a checkpoint can recover from
+};
+
+// Off-critical-path half of the decode loop. The decode thread hands each
+// chosen token over through a lock-free ring and goes straight on to the next
+// llama_decode, while a helper thread appends the token's piece, runs the
+// streaming validator and loop detector and records checkpoints. Output,
+// checkpoints and recovery stats may only be touched by the decode thread
+// while the stage is idle (after wait_idle()) or finished.
+class OutputStage {
+public:
+    struct Timing {
+        int64_t tokens = 0;
+        double helper_ms = 0.0;  // spent on the helper thread, overlapped with decoding
+        double wait_ms = 0.0;    // decode thread blocked on the helper
+    };
+
+    OutputStage(const VocabPieces &pieces, const PatternAutomaton *banned, ValidationPolicy policy,
+                int32_t max_rollbacks, int32_t max_retries);
+    ~OutputStage();
+
+    OutputStage(const OutputStage &) = delete;
+    OutputStage &operator=(const OutputStage &) = delete;
+
+    // Reports accepted output and every cut-back to `stream`, plus a render
+    // checkpoint at each validator render point when the stream asks for
+    // them (never under ValidationPolicy::kOff); call before start().
+    void set_stream(TextStream *stream) { stream_ = stream; }
+
+    void start();
+    // Drains the ring and joins the helper thread.
+    void finish();
+
+    void submit(const StagedToken &staged);
+    int64_t submitted() const { return submitted_; }
+    void wait_processed(int64_t count);
+    void wait_idle() { wait_processed(submitted_); }
+
+    StageVerdict verdict() const { return verdict_.load(std::memory_order_acquire); }
+
+    // Valid once the stage is idle.
+    std::string &output() { return output_; }
+    int32_t accepted() const { return accepted_; }
+    const char *stop_reason() const { return stop_reason_; }
+    bool failed() const { return failed_; }
+    int32_t failed_at() const { return failed_at_; }
+    // The policy asks for an error rather than the (truncated) output.
+    bool aborted() const { return aborted_; }
+    CheckpointStack &checkpoints() { return checkpoints_; }
+    RecoveryStats &recovery() { return recovery_; }
+    Timing timing() const;
+
+    // Restores the output state recorded at `checkpoint` and clears a pending
+    // rollback verdict; the caller has already rewound the KV cache.
+    void resume_from(const KvCheckpoint &checkpoint);
+    // Resolves a pending rollback verdict with the validation policy instead,
+    // for when no further decode steps will run.
+    void settle();
+
+private:
+    static constexpr int32_t kSpinsBeforePark = 32;
+
+    void run();
+    void process(const StagedToken &staged);
+    void stop(const char *reason);
+    void fail(const char *reason, bool invalid_structure, const HtmlStreamValidator &before);
+    void wake();
+    void cut_output(size_t length);
+
+    const VocabPieces &pieces_;
+    const ValidationPolicy policy_;
+    const int32_t max_rollbacks_;
+    const int32_t max_retries_;
+
+    std::string output_;
+    TextStream *stream_ = nullptr;
+    int32_t accepted_ = 0;
+    HtmlStreamValidator validator_;
+    RepetitionDetector repetition_;
+    CheckpointStack checkpoints_;
+    RecoveryStats recovery_;
+    int32_t boundaries_seen_ = 0;
+    int32_t render_points_seen_ = 0;
+
+    const char *stop_reason_ = nullptr;
+    bool failed_ = false;
+    int32_t failed_at_ = 0;
+    bool aborted_ = false;
+    bool invalid_structure_ = false;
+    HtmlStreamValidator failed_before_;
+
+    SpscRing<StagedToken, 16> ring_;
+    int64_t submitted_ = 0;
+    std::atomic<int64_t> processed_{0};
+    std::atomic<StageVerdict> verdict_{StageVerdict::kContinue};
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> parked_{false};
+    std::mutex park_mutex_;
+    std::condition_variable park_cv_;
+    std::thread helper_;
+
+    int64_t helper_ns_ = 0;
+    int64_t wait_ns_ = 0;
+};
+
+}  // namespace genui
@@ -3,27 +3,100 @@
 
 #include <algorithm>
 #include <atomic>
+#include <fstream>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <chrono>
+#include <cstring>
+#include <dlfcn.h>
+#include <unistd.h>
 
 #include "llama.h"
+#include "grammar_mask.h"
+#include "html_grammar.h"
+#include "autotune.h"
+#include "cpu_topology.h"
+#include "html_validator.h"
+#include "kv_checkpoints.h"
+#include "memory_hints.h"
+#include "scheduler.h"
+#include "text_stream.h"
+#include "token_mask.h"
+#include "vocab_pieces.h"
+#include "weight_repack.h"
 
 #define LOG_TAG "QwenCoderBridge"
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 
 static std::mutex g_mutex;
+static JavaVM *g_vm = nullptr;
 static llama_model *g_model = nullptr;
 static llama_context *g_ctx = nullptr;
 static bool g_backend_initialized = false;
 static std::atomic<int> g_last_generated_tokens{0};
+static genui::VocabPieces g_pieces;
+static genui::TokenMask g_token_mask;
+static genui::GrammarMask g_html_grammar;
+static bool g_html_grammar_enabled = false;
+static genui::ValidationPolicy g_validation_policy = genui::ValidationPolicy::kTruncate;
+static int32_t g_max_rollbacks = 3;
+// Written from completions on the inference worker, which must never wait on
+// g_mutex (nativeRelease holds it while joining the worker).
+static std::mutex g_stats_mutex;
+static genui::RecoveryStats g_last_recovery;
+// Replaced only under g_mutex, through std::atomic_store, so that
+// nativeSchedulerStats can take a reference with std::atomic_load and read
+// the scheduler's atomics without waiting behind a load or a benchmark.
+static std::shared_ptr<genui::Scheduler> g_scheduler;
+static int32_t g_prefill_chunk = 0;
+static std::atomic<int32_t> g_stream_batch_tokens{8};
+static std::atomic<int32_t> g_stream_batch_ms{50};
+// Prompts opened with nativeBeginPrompt, by handle; guarded by g_mutex.
+struct PromptSession {
+    std::string text;                 // templated prompt so far
+    std::vector<llama_token> tokens;  // its tokenization
+    std::vector<size_t> starts;       // byte offset of each token in `text`
+    bool exact = true;                // the pieces add up to `text`, so `starts` can be trusted
+    jint max_tokens = 0;              // the caller's budget, clamped again once the prompt is final
+};
+static std::unordered_map<int64_t, PromptSession> g_prompt_sessions;
+static int32_t g_target_step_ms = static_cast<int32_t>(genui::Scheduler::kDefaultTargetStepMs);
+static std::string g_thread_plan;
+static genui::CpuTopology g_topology;
+// Context settings and thread sets of the loaded model: the caller's
+// placement, or the tuned profile for this device and model when one exists.
+static genui::RuntimeProfile g_profile;
+static std::string g_profile_dir;
+static std::string g_profile_key;
+static int32_t g_pool_threads = -1;
+static int32_t g_pool_spin_us = 100;
+static genui::PowerPolicy g_foreground_policy = genui::PowerPolicy::kBalanced;
+static genui::PowerPolicy g_background_policy = genui::PowerPolicy::kPowerSaver;
+static genui::WeightRepack g_repack;
+// madvise phases and huge pages for the model mapping and llama.cpp's buffers.
+static genui::MemoryHints g_memory_hints;
+// How the load chose flash attention (QwenCoderBridge.FLASH_ATTN_*).
+enum class FlashAttnMode { kAuto = 0, kOn = 1, kOff = 2 };
+static FlashAttnMode g_flash_attn_mode = FlashAttnMode::kAuto;
 
 namespace {
 
 constexpr int32_t kDefaultContext = 4096;
-constexpr int32_t kDefaultBatch = 128;
+// KV cells shared by all concurrent sequences; each request is still capped at
+// kDefaultContext and the scheduler admits requests while their worst case fits.
+constexpr int32_t kSharedContext = 2 * kDefaultContext;
+// Tokens re-tokenized from the end of an open prompt when text is appended,
+// so a BPE merge across the chunk boundary is picked up.
+constexpr size_t kPromptOverlapTokens = 4;
+// Prompt lengths of the flash attention benchmark; the longest nearly fills a
+// request's context.
+constexpr int32_t kAttentionReportLengths[] = {256, 1024, 3072};
 
 static const char *kSystemInstructionLong = R"(You are TEXT2UI-CODER. Transform agent/assistant text into a single, self-contained, mobile-first HTML document suitable for rendering in a WebView.
 
@@ -65,27 +138,117 @@ FINAL CHECK
 static const char *kSystemInstruction =
         "You are an expert front-end engineer producing accessible HTML/CSS.";
 
+static const char *kChatTemplateSuffix = "\n<|im_end|>\n<|im_start|>assistant\n";
+
+// Everything the chat template puts before the user's text.
+static std::string chat_template_prefix() {
+    std::string formatted("<|im_start|>system\n");
+    formatted.append(kSystemInstruction);
+    formatted.append("\n<|im_end|>\n<|im_start|>user\n");
+    return formatted;
+}
+
 static std::string apply_chat_template(const std::string &user_prompt) {
     if (user_prompt.find("<|im_start|>") != std::string::npos) {
         return user_prompt;
     }
 
-    std::string formatted;
-    formatted.reserve(user_prompt.size() + 128);
-    formatted.append("<|im_start|>system\n");
-    formatted.append(kSystemInstruction);
-    formatted.append("\n<|im_end|>\n<|im_start|>user\n");
+    std::string formatted = chat_template_prefix();
+    formatted.reserve(formatted.size() + user_prompt.size() + 48);
     formatted.append(user_prompt);
-    formatted.append("\n<|im_end|>\n<|im_start|>assistant\n");
+    formatted.append(kChatTemplateSuffix);
     return formatted;
 }
 
-static void release_locked() {
+// Entry points of the compute pool patch (scripts/patches/0001-*). They are
+// looked up at runtime so a stock libggml still loads; ggml then creates its
+// compute threads per graph as usual.
+using ComputePoolConfigure = void (*)(int n_threads, int spin_us);
+using ComputePoolStats = void (*)(uint64_t *pooled, uint64_t *spawned, uint64_t *parks);
+
+static void configure_compute_pool(int pool_threads, int spin_us) {
+    auto configure = reinterpret_cast<ComputePoolConfigure>(dlsym(RTLD_DEFAULT, "ggml_compute_pool_configure"));
+    if (!configure) {
+        LOGI("Compute pool unavailable in this libggml; threads are created per graph");
+        return;
+    }
+    configure(pool_threads, spin_us);
+    LOGI("Compute pool: threads=%d spin=%d us before parking", pool_threads, spin_us);
+}
+
+static void log_compute_pool_stats() {
+    auto stats = reinterpret_cast<ComputePoolStats>(dlsym(RTLD_DEFAULT, "ggml_compute_pool_stats"));
+    if (!stats) {
+        return;
+    }
+    uint64_t pooled = 0;
+    uint64_t spawned = 0;
+    uint64_t parks = 0;
+    stats(&pooled, &spawned, &parks);
+    LOGI("Compute pool stats: pooled=%llu spawned=%llu parks=%llu", (unsigned long long) pooled,
+         (unsigned long long) spawned, (unsigned long long) parks);
+}
+
+// Counters of the decode graph cache patch (scripts/patches/0004-*), looked up
+// like the compute pool's: single-token decode graphs built and reused, and
+// the host time spent preparing them. Scheduler steps with more than one
+// running request decode a multi-token batch and are not counted.
+using DecodeGraphStats = void (*)(const llama_context *ctx, int32_t *n_built, int64_t *t_built_us,
+                                  int32_t *n_reused, int64_t *t_reused_us);
+
+static void log_decode_graph_stats(const llama_context *ctx) {
+    auto stats = reinterpret_cast<DecodeGraphStats>(dlsym(RTLD_DEFAULT, "llama_decode_graph_stats"));
+    if (!stats) {
+        return;
+    }
+    int32_t built = 0;
+    int32_t reused = 0;
+    int64_t built_us = 0;
+    int64_t reused_us = 0;
+    stats(ctx, &built, &built_us, &reused, &reused_us);
+    LOGI("Decode graph stats: built=%d (%.1f us each) reused=%d (%.1f us each)", built,
+         built > 0 ? static_cast<double>(built_us) / built : 0.0, reused,
+         reused > 0 ? static_cast<double>(reused_us) / reused : 0.0);
+}
+
+// Kernel variant picked by the CPU dispatch in libggml (scripts/cmake/
+// ggml-cpu-dispatch.c), or "fixed" for a libggml built without it.
+using CpuVariant = const char *(*)();
+
+static const char *cpu_variant() {
+    auto variant = reinterpret_cast<CpuVariant>(dlsym(RTLD_DEFAULT, "ggml_cpu_variant"));
+    return variant ? variant() : "fixed";
+}
+
+// Fails whatever is in flight and frees the shared context; the model stays.
+static void stop_context_locked() {
+    g_prompt_sessions.clear();
+    if (g_scheduler) {
+        std::shared_ptr<genui::Scheduler> scheduler = std::atomic_exchange(&g_scheduler, {});
+        scheduler->stop();
+        // A stats reader holds its reference for a few loads; the scheduler
+        // has to be destroyed before the context it points at.
+        while (scheduler.use_count() > 1) {
+            std::this_thread::yield();
+        }
+        scheduler.reset();
+        log_compute_pool_stats();
+    }
     if (g_ctx) {
         LOGI("Releasing llama context");
+        log_decode_graph_stats(g_ctx);
         llama_free(g_ctx);
         g_ctx = nullptr;
     }
+}
+
+static void release_locked() {
+    stop_context_locked();
+    g_repack.clear();
+    g_memory_hints.clear();
+    g_html_grammar.clear();
+    g_token_mask.clear();
+    g_pieces.clear();
     if (g_model) {
         LOGI("Releasing llama model");
         llama_free_model(g_model);
@@ -98,76 +261,36 @@ static void release_locked() {
     }
 }
 
-static bool decode_one(llama_context *ctx, llama_token tok, llama_pos pos) {
-    llama_batch batch = llama_batch_init(1, 0, 1);
-    batch.n_tokens = 1;
-    batch.token[0] = tok;
-    batch.pos[0] = pos;
-    batch.seq_id[0][0] = 0;
-    batch.n_seq_id[0] = 1;
-    batch.logits[0] = true;
-    const int rc = llama_decode(ctx, batch);
-    llama_batch_free(batch);
-    return rc == 0;
-}
-
-static llama_token greedy_from_logits(llama_context *ctx, const llama_model *model) {
-    const float *logits = llama_get_logits(ctx);
-    if (!logits || !model) {
-        return -1;
-    }
-    const int n_vocab = llama_n_vocab(model);
-    if (n_vocab <= 0) {
-        return -1;
-    }
-
-    int best = 0;
-    float best_val = logits[0];
-    for (int i = 1; i < n_vocab; ++i) {
-        if (logits[i] > best_val) {
-            best_val = logits[i];
-            best = i;
-        }
+static bool ensure_html_grammar_locked() {
+    if (!g_html_grammar.empty()) {
+        return true;
     }
-    return static_cast<llama_token>(best);
-}
-
-static bool append_clean_piece(std::string &dst, const llama_model *model, llama_token tok) {
-    char tmp[64];
-    int n = llama_token_to_piece(model, tok, tmp, static_cast<int>(sizeof(tmp)), /*special*/ true);
-    if (n > 0) {
-        std::string tag(tmp, n);
-        if (tag == "<|im_end|>" || tag == "<|im_start|>" || tag == "<|assistant|>" ||
-            tag == "<|user|>" || tag == "<|system|>") {
-            return false;
-        }
+    if (g_pieces.empty()) {
+        return false;
     }
-
-    char buf[256];
-    n = llama_token_to_piece(model, tok, buf, static_cast<int>(sizeof(buf)), /*special*/ false);
-    if (n >= 0) {
-        if (n) dst.append(buf, n);
-        return true;
+    const auto start = std::chrono::steady_clock::now();
+    if (!g_html_grammar.build(g_pieces, genui::html_grammar())) {
+        LOGE("Failed to compile the HTML grammar");
+        return false;
     }
-
-    std::string wide;
-    wide.resize(static_cast<size_t>(-n));
-    n = llama_token_to_piece(model, tok, wide.data(), static_cast<int>(wide.size()), /*special*/ false);
-    if (n > 0) dst.append(wide.data(), n);
+    const double elapsed_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+    LOGI("HTML grammar ready: elapsed=%.2f ms", elapsed_ms);
     return true;
 }
 
-static std::vector<llama_token> tokenize_prompt(const llama_model *model, const std::string &prompt) {
+static std::vector<llama_token> tokenize_prompt(const llama_model *model, const std::string &prompt,
+                                                bool add_special = true) {
     if (!model) {
         return {};
     }
     std::vector<llama_token> tokens(prompt.size() + 16);
     int32_t count = llama_tokenize(model, prompt.c_str(), static_cast<int32_t>(prompt.size()), tokens.data(),
-                                   static_cast<int32_t>(tokens.size()), /*add_special*/ true, /*parse_special*/ true);
+                                   static_cast<int32_t>(tokens.size()), add_special, /*parse_special*/ true);
     if (count < 0) {
         tokens.resize(static_cast<size_t>(-count));
         count = llama_tokenize(model, prompt.c_str(), static_cast<int32_t>(prompt.size()), tokens.data(),
-                               static_cast<int32_t>(tokens.size()), true, true);
+                               static_cast<int32_t>(tokens.size()), add_special, true);
     }
     if (count < 0) {
         return {};
@@ -176,117 +299,511 @@ static std::vector<llama_token> tokenize_prompt(const llama_model *model, const
     return tokens;
 }
 
-static bool prefill_prompt(const std::vector<llama_token> &tokens, llama_pos &n_past) {
-    const size_t total = tokens.size();
-    if (total == 0) {
-        LOGE("Prefill requested with zero tokens");
-        return false;
+// Copies the settings every request takes from the bridge's globals.
+static void snapshot_params_locked(genui::GenerationParams &params) {
+    params.constrained = g_html_grammar_enabled && ensure_html_grammar_locked();
+    params.policy = g_validation_policy;
+    params.max_rollbacks = g_max_rollbacks;
+}
+
+// Tokens a request may generate: the caller's budget (512 when unset),
+// capped by what its prompt leaves of the per-request context.
+static int32_t token_budget(jint jMaxTokens, size_t prompt_tokens) {
+    const int requested = jMaxTokens > 0 ? jMaxTokens : 512;
+    const int available = kDefaultContext - (int) prompt_tokens;
+    return std::max(16, std::min(requested, available));
+}
+
+// Tokenizes the templated prompt and snapshots the per-request settings;
+// returns an error message when the request cannot be submitted.
+static const char *prepare_request_locked(const std::string &prompt, jint jMaxTokens,
+                                          std::vector<llama_token> &tokens, genui::GenerationParams &params) {
+    if (!g_model || !g_ctx || !g_scheduler || g_pieces.empty()) {
+        return "[error] Model is not initialized.";
     }
+    std::string templated_prompt = apply_chat_template(prompt);
+    tokens = tokenize_prompt(g_model, templated_prompt);
 
-    const auto start = std::chrono::steady_clock::now();
-    size_t iterations = 0;
-
-    const int batch_cap = std::max<int>(kDefaultBatch, 32);
-    llama_batch batch = llama_batch_init(batch_cap, 0, 1);
-
-    size_t consumed = 0;
-    while (consumed < total) {
-        ++iterations;
-        const int cur = std::min<int>(batch_cap, (int) (total - consumed));
-        batch.n_tokens = cur;
-        for (int i = 0; i < cur; ++i) {
-            batch.token[i] = tokens[consumed + i];
-            batch.pos[i] = n_past + i;
-            batch.seq_id[i][0] = 0;
-            batch.n_seq_id[i] = 1;
-            batch.logits[i] = (consumed + i == total - 1);
-        }
-        if (llama_decode(g_ctx, batch) != 0) {
-            llama_batch_free(batch);
-            LOGE("llama_decode failed during prefill on iteration %zu", iterations);
-            return false;
-        }
-        n_past += cur;
-        consumed += (size_t) cur;
+    if (tokens.empty()) {
+        return "[error] Failed to tokenize prompt.";
     }
-    llama_batch_free(batch);
 
-    const auto end = std::chrono::steady_clock::now();
-    const double elapsed_ms = std::chrono::duration<double, std::milli>(end - start).count();
-    LOGI("Prefill complete: tokens=%zu batches=%zu elapsed=%.2f ms", total, iterations, elapsed_ms);
-    return true;
+    if ((int) tokens.size() >= kDefaultContext) {
+        return "[error] Prompt is longer than the context window.";
+    }
+
+    params.max_tokens = token_budget(jMaxTokens, tokens.size());
+    snapshot_params_locked(params);
+    return nullptr;
 }
 
-static std::string generate_text(const std::vector<llama_token> &prompt_tokens, int max_tokens) {
-    llama_kv_cache_clear(g_ctx);
-    g_last_generated_tokens.store(0);
+// Bytes of `text` that `tok` stands for; control tokens are parsed from
+// their literal spelling, which VocabPieces does not keep.
+static size_t token_text_length(llama_token tok) {
+    if (!g_pieces.is_control(tok)) {
+        return g_pieces.length(tok);
+    }
+    char piece[64];
+    const int32_t n = llama_token_to_piece(g_model, tok, piece, sizeof(piece), /*special*/ true);
+    return n > 0 ? static_cast<size_t>(n) : 0;
+}
 
-    llama_pos n_past = 0;
-    if (!prefill_prompt(prompt_tokens, n_past)) {
-        g_last_generated_tokens.store(0);
-        return "[error] Failed to prefill prompt.";
+// Re-tokenizes an open prompt after text was appended. Only the last few
+// tokens can change (a BPE merge with the new text), so tokenization restarts
+// at the first of them instead of at the beginning of the prompt.
+static void retokenize_tail(PromptSession &session) {
+    size_t from = session.tokens.size() > kPromptOverlapTokens ? session.tokens.size() - kPromptOverlapTokens : 0;
+    if (!session.exact) {
+        from = 0;
+    }
+    const size_t offset = from > 0 ? session.starts[from] : 0;
+    std::vector<llama_token> tail = tokenize_prompt(g_model, session.text.substr(offset), /*add_special*/ from == 0);
+    session.tokens.resize(from);
+    session.starts.resize(from);
+    size_t at = offset;
+    for (const llama_token tok : tail) {
+        session.tokens.push_back(tok);
+        session.starts.push_back(at);
+        at += token_text_length(tok);
     }
+    // A tokenizer that normalizes its input breaks the offsets; fall back to
+    // whole-prompt tokenization for the rest of the session.
+    session.exact = at == session.text.size();
+}
 
-    const llama_model *model = g_model;
-    if (!model) {
-        g_last_generated_tokens.store(0);
-        return "[error] Model is not available.";
-    }
-
-    const llama_token eos = llama_token_eos(model);
-    std::string output;
-    output.reserve(static_cast<size_t>(std::max(128, max_tokens * 4)));
-
-    const int to_generate = std::max(1, max_tokens);
-    const auto decode_start = std::chrono::steady_clock::now();
-    int generated = 0;
-    for (int i = 0; i < to_generate; ++i) {
-        llama_token next = greedy_from_logits(g_ctx, model);
-        if (next < 0) {
-            g_last_generated_tokens.store(0);
-            return "[error] Failed to sample token.";
+static void record_result(const genui::GenerationResult &result) {
+    g_last_generated_tokens.store(result.tokens);
+    std::lock_guard<std::mutex> lock(g_stats_mutex);
+    g_last_recovery = result.recovery;
+}
+
+// Returns the calling thread's JNIEnv, attaching native threads (the
+// inference worker) once and detaching them when they exit.
+static JNIEnv *attached_env() {
+    struct Attachment {
+        bool attached = false;
+        ~Attachment() {
+            if (attached) {
+                g_vm->DetachCurrentThread();
+            }
         }
-        if (next == eos) {
-            LOGI("Reached EOS after %d tokens", generated);
-            break;
+    };
+    thread_local Attachment attachment;
+    JNIEnv *env = nullptr;
+    if (!g_vm) {
+        return nullptr;
+    }
+    if (g_vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6) == JNI_OK) {
+        return env;
+    }
+    if (g_vm->AttachCurrentThread(&env, nullptr) != JNI_OK) {
+        return nullptr;
+    }
+    attachment.attached = true;
+    return env;
+}
+
+// Wraps a Kotlin GenerationCallback; the completion runs once, on whichever
+// thread finishes the request.
+static genui::Scheduler::Completion java_completion(JNIEnv *env, jobject callback) {
+    jclass callback_class = env->GetObjectClass(callback);
+    jmethodID on_complete = env->GetMethodID(callback_class, "onComplete", "(Ljava/lang/String;)V");
+    env->DeleteLocalRef(callback_class);
+    if (!on_complete) {
+        LOGE("Generation callback has no onComplete(String)");
+        return nullptr;
+    }
+    jobject target = env->NewGlobalRef(callback);
+    return [target, on_complete](const genui::GenerationResult &result) {
+        record_result(result);
+        JNIEnv *env = attached_env();
+        if (!env) {
+            LOGE("Unable to attach to the VM to deliver a generation result");
+            return;
         }
-        if (!append_clean_piece(output, model, next)) {
-            LOGI("Stopped generation because append_clean_piece rejected token %d", next);
-            break;
+        jstring text = env->NewStringUTF(result.text.c_str());
+        env->CallVoidMethod(target, on_complete, text);
+        if (env->ExceptionCheck()) {
+            env->ExceptionDescribe();
+            env->ExceptionClear();
         }
-        if (!decode_one(g_ctx, next, n_past)) {
-            g_last_generated_tokens.store(0);
-            return "[error] Failed to decode token.";
+        env->DeleteLocalRef(text);
+        env->DeleteGlobalRef(target);
+    };
+}
+
+// Global reference released on whichever thread drops the last owner.
+struct JavaRef {
+    jobject ref = nullptr;
+    JavaRef(JNIEnv *env, jobject object) : ref(env->NewGlobalRef(object)) {}
+    ~JavaRef() {
+        if (JNIEnv *env = attached_env()) {
+            env->DeleteGlobalRef(ref);
         }
-        ++n_past;
-        ++generated;
     }
-    const auto decode_end = std::chrono::steady_clock::now();
-    const double decode_ms = std::chrono::duration<double, std::milli>(decode_end - decode_start).count();
-    const double tok_per_sec = decode_ms > 0.0 ? generated / (decode_ms / 1000.0) : 0.0;
-    LOGI("Decode timings: tokens=%d elapsed=%.2f ms (%.2f tok/s)", generated, decode_ms, tok_per_sec);
-
-    if (output.empty()) {
-        output = "[error] Model returned empty response.";
-        g_last_generated_tokens.store(0);
+    JavaRef(const JavaRef &) = delete;
+    JavaRef &operator=(const JavaRef &) = delete;
+};
+
+// Streams chunks into the caller's direct buffer and announces each one with
+// StreamCallback.onChunk(offset, length), which must copy the bytes out
+// before returning. Chunks larger than the buffer are split on UTF-8
+// boundaries. A CheckpointCallback additionally receives each render
+// checkpoint as a whole auto-closed document.
+static std::shared_ptr<genui::TextStream> java_stream(JNIEnv *env, jobject buffer, jobject callback) {
+    auto *data = buffer ? static_cast<char *>(env->GetDirectBufferAddress(buffer)) : nullptr;
+    const jlong capacity = buffer ? env->GetDirectBufferCapacity(buffer) : 0;
+    if (!data || capacity < 4) {
+        return nullptr;
+    }
+    jclass callback_class = env->GetObjectClass(callback);
+    jmethodID on_chunk = env->GetMethodID(callback_class, "onChunk", "(II)V");
+    env->DeleteLocalRef(callback_class);
+    if (!on_chunk) {
+        return nullptr;
+    }
+    auto buffer_ref = std::make_shared<JavaRef>(env, buffer);
+    auto target = std::make_shared<JavaRef>(env, callback);
+    genui::TextStream::Options options;
+    options.max_tokens = g_stream_batch_tokens.load();
+    options.max_delay_ms = g_stream_batch_ms.load();
+
+    genui::TextStream::Checkpoint checkpoint;
+    jclass checkpoint_class = env->FindClass("com/samsung/genuiapp/CheckpointCallback");
+    jmethodID on_checkpoint = nullptr;
+    if (checkpoint_class && env->IsInstanceOf(callback, checkpoint_class)) {
+        on_checkpoint = env->GetMethodID(checkpoint_class, "onCheckpoint", "(Ljava/lang/String;)V");
+    }
+    if (on_checkpoint) {
+        checkpoint = [target, on_checkpoint](const std::string &document) {
+            JNIEnv *env = attached_env();
+            if (!env) {
+                return;
+            }
+            jstring html = env->NewStringUTF(document.c_str());
+            env->CallVoidMethod(target->ref, on_checkpoint, html);
+            if (env->ExceptionCheck()) {
+                env->ExceptionDescribe();
+                env->ExceptionClear();
+            }
+            env->DeleteLocalRef(html);
+        };
+    }
+    if (checkpoint_class) {
+        env->DeleteLocalRef(checkpoint_class);
     } else {
-        g_last_generated_tokens.store(generated);
+        env->ExceptionClear();
+    }
+
+    auto deliver = [=](size_t offset, const char *chunk, size_t size) {
+        JNIEnv *env = attached_env();
+        if (!env) {
+            return;
+        }
+        (void) buffer_ref;  // keeps the buffer alive while native code writes to it
+        size_t done = 0;
+        do {
+            size_t take = std::min(size - done, static_cast<size_t>(capacity));
+            if (done + take < size) {
+                take = std::max<size_t>(1, genui::utf8_safe_end(chunk, done, done + take) - done);
+            }
+            std::memcpy(data, chunk + done, take);
+            env->CallVoidMethod(target->ref, on_chunk, static_cast<jint>(offset + done), static_cast<jint>(take));
+            if (env->ExceptionCheck()) {
+                env->ExceptionDescribe();
+                env->ExceptionClear();
+            }
+            done += take;
+        } while (done < size);
+    };
+    return std::make_shared<genui::TextStream>(options, std::move(deliver), std::move(checkpoint));
+}
+
+// Shared tail of the asynchronous entry points; `done` is always invoked.
+static void submit_java_request(JNIEnv *env, jstring jPrompt, jint jMaxTokens, jint jPriority, jlong jHandle,
+                                std::shared_ptr<genui::TextStream> stream, genui::Scheduler::Completion done) {
+    auto fail = [&done](const char *message) {
+        genui::GenerationResult result;
+        result.text = message;
+        done(result);
+    };
+    if (!jPrompt) {
+        fail("[error] Prompt is null.");
+        return;
+    }
+    const char *prompt_chars = env->GetStringUTFChars(jPrompt, nullptr);
+    if (!prompt_chars) {
+        fail("[error] Unable to read prompt.");
+        return;
+    }
+    std::string prompt(prompt_chars);
+    env->ReleaseStringUTFChars(jPrompt, prompt_chars);
+
+    std::lock_guard<std::mutex> lock(g_mutex);
+    std::vector<llama_token> tokens;
+    genui::GenerationParams params;
+    const char *error = prepare_request_locked(prompt, jMaxTokens, tokens, params);
+    if (error) {
+        fail(error);
+        return;
+    }
+    params.priority = jPriority == static_cast<jint>(genui::Priority::kBackground)
+                      ? genui::Priority::kBackground
+                      : genui::Priority::kForeground;
+    params.stream = std::move(stream);
+    g_scheduler->submit_async(std::move(tokens), params, static_cast<int64_t>(jHandle), std::move(done));
+}
+
+static genui::CoreClass core_class(jint value) {
+    switch (value) {
+        case static_cast<jint>(genui::CoreClass::kPerformance):
+            return genui::CoreClass::kPerformance;
+        case static_cast<jint>(genui::CoreClass::kPrime):
+            return genui::CoreClass::kPrime;
+        default:
+            return genui::CoreClass::kAll;
+    }
+}
+
+static genui::PowerPolicy to_power_policy(jint value) {
+    switch (value) {
+        case static_cast<jint>(genui::PowerPolicy::kPerformance):
+            return genui::PowerPolicy::kPerformance;
+        case static_cast<jint>(genui::PowerPolicy::kPowerSaver):
+            return genui::PowerPolicy::kPowerSaver;
+        default:
+            return genui::PowerPolicy::kBalanced;
+    }
+}
+
+static FlashAttnMode to_flash_attn_mode(jint value) {
+    switch (value) {
+        case static_cast<jint>(FlashAttnMode::kOn):
+            return FlashAttnMode::kOn;
+        case static_cast<jint>(FlashAttnMode::kOff):
+            return FlashAttnMode::kOff;
+        default:
+            return FlashAttnMode::kAuto;
     }
-    return output;
 }
 
 }  // namespace
 
 
+extern "C" JNIEXPORT jint JNICALL
+JNI_OnLoad(JavaVM *vm, void * /*reserved*/) {
+    g_vm = vm;
+    return JNI_VERSION_1_6;
+}
+
 extern "C" JNIEXPORT jint JNICALL
 Java_com_samsung_genuiapp_QwenCoderBridge_nativeLastTokenCount(
         JNIEnv * /*env*/, jobject /*thiz*/) {
     return g_last_generated_tokens.load();
 }
 
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSetHtmlGrammar(
+        JNIEnv * /*env*/, jobject /*thiz*/, jboolean jEnabled) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_html_grammar_enabled = jEnabled == JNI_TRUE;
+    if (!g_html_grammar_enabled || !g_model) {
+        return JNI_TRUE;
+    }
+    return ensure_html_grammar_locked() ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSetValidationPolicy(
+        JNIEnv * /*env*/, jobject /*thiz*/, jint jPolicy) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    switch (jPolicy) {
+        case static_cast<jint>(genui::ValidationPolicy::kOff):
+        case static_cast<jint>(genui::ValidationPolicy::kAbort):
+        case static_cast<jint>(genui::ValidationPolicy::kTruncate):
+            g_validation_policy = static_cast<genui::ValidationPolicy>(jPolicy);
+            break;
+        default:
+            LOGE("Ignoring unknown validation policy %d", jPolicy);
+            break;
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSetRollbackBudget(
+        JNIEnv * /*env*/, jobject /*thiz*/, jint jMaxRollbacks) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_max_rollbacks = std::max(0, jMaxRollbacks);
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSetPrefillChunking(
+        JNIEnv * /*env*/, jobject /*thiz*/, jint jChunkTokens, jint jTargetStepMs) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_prefill_chunk = std::max(0, jChunkTokens);
+    if (jTargetStepMs > 0) {
+        g_target_step_ms = jTargetStepMs;
+    }
+    if (g_scheduler) {
+        g_scheduler->set_prefill_chunking(g_prefill_chunk, g_target_step_ms);
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSetPowerPolicy(
+        JNIEnv * /*env*/, jobject /*thiz*/, jint jForeground, jint jBackground) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_foreground_policy = to_power_policy(jForeground);
+    g_background_policy = to_power_policy(jBackground);
+    if (g_scheduler) {
+        g_scheduler->set_power_policy(g_foreground_policy, g_background_policy);
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSetStreamBatching(
+        JNIEnv * /*env*/, jobject /*thiz*/, jint jMaxTokens, jint jMaxDelayMs) {
+    g_stream_batch_tokens.store(std::max(1, jMaxTokens));
+    g_stream_batch_ms.store(std::max(0, jMaxDelayMs));
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeThreadPlan(
+        JNIEnv *env, jobject /*thiz*/) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    return env->NewStringUTF(g_thread_plan.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeCpuVariant(
+        JNIEnv *env, jobject /*thiz*/) {
+    return env->NewStringUTF(cpu_variant());
+}
+
+extern "C" JNIEXPORT jintArray JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeLastRecoveryStats(
+        JNIEnv *env, jobject /*thiz*/) {
+    genui::RecoveryStats stats;
+    {
+        std::lock_guard<std::mutex> lock(g_stats_mutex);
+        stats = g_last_recovery;
+    }
+    const jint values[] = {stats.checkpoints, stats.rollbacks, stats.max_rollback_depth,
+                           stats.tokens_discarded, stats.tokens_saved};
+    const jsize count = static_cast<jsize>(sizeof(values) / sizeof(values[0]));
+    jintArray result = env->NewIntArray(count);
+    if (result) {
+        env->SetIntArrayRegion(result, 0, count, values);
+    }
+    return result;
+}
+
+extern "C" JNIEXPORT jintArray JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSchedulerStats(
+        JNIEnv *env, jobject /*thiz*/) {
+    genui::Scheduler::Stats stats;
+    if (const std::shared_ptr<genui::Scheduler> scheduler = std::atomic_load(&g_scheduler)) {
+        stats = scheduler->stats();
+    }
+    const jint values[] = {stats.queued_foreground, stats.queued_background, stats.running, stats.paused,
+                           stats.swapped, stats.preemptions, stats.swap_outs, stats.coalesced,
+                           stats.cancelled};
+    const jsize count = static_cast<jsize>(sizeof(values) / sizeof(values[0]));
+    jintArray result = env->NewIntArray(count);
+    if (result) {
+        env->SetIntArrayRegion(result, 0, count, values);
+    }
+    return result;
+}
+
+// Creates the shared context and the scheduler for g_model under g_profile.
+static bool start_context_locked() {
+    const genui::ThreadSet prefill = g_topology.thread_set(g_profile.prefill_cores, g_profile.prefill_threads);
+    const genui::ThreadSet decode = g_topology.thread_set(g_profile.decode_cores, g_profile.decode_threads);
+    const int threads = std::max(prefill.threads, decode.threads);
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = kSharedContext;
+    cparams.n_batch = g_profile.n_batch;
+    cparams.n_ubatch = g_profile.n_ubatch;
+    cparams.n_seq_max = genui::Scheduler::kMaxSequences;
+    cparams.n_threads = decode.threads;
+    cparams.n_threads_batch = prefill.threads;
+    cparams.flash_attn = g_profile.flash_attn;
+    cparams.type_k = g_profile.kv_type;
+    cparams.type_v = g_profile.kv_type;
+
+    // The KV cache and compute buffers are the new anonymous mappings.
+    const genui::MappingSnapshot before_context = genui::MappingSnapshot::take();
+    g_ctx = llama_new_context_with_model(g_model, cparams);
+    if (!g_ctx) {
+        LOGE("Failed to create context (%s)", g_profile.describe().c_str());
+        return false;
+    }
+    g_memory_hints.advise_buffers(before_context.added());
+
+    // The scheduler switches between the two thread sets per step.
+    llama_set_n_threads(g_ctx, decode.threads, prefill.threads);
+    // ggml keeps the calling thread busy, so a pool of threads - 1 covers every graph.
+    configure_compute_pool(g_pool_threads < 0 ? threads - 1 : g_pool_threads, g_pool_spin_us);
+    g_thread_plan = "prefill " + std::to_string(prefill.threads) + " threads on cpus " + genui::format_cpus(prefill.cpus)
+                    + ", decode " + std::to_string(decode.threads) + " on cpus " + genui::format_cpus(decode.cpus);
+    LOGI("Context ready: n_ctx=%d batch=%d ubatch=%u flash_attn=%d seq_max=%u threads: %s", llama_n_ctx(g_ctx),
+         cparams.n_batch, cparams.n_ubatch, cparams.flash_attn ? 1 : 0, cparams.n_seq_max, g_thread_plan.c_str());
+
+    genui::Scheduler::Resources resources;
+    resources.ctx = g_ctx;
+    resources.model = g_model;
+    resources.pieces = &g_pieces;
+    resources.token_mask = &g_token_mask;
+    resources.grammar = &g_html_grammar;
+    resources.batch_size = g_profile.n_batch;
+    resources.prefill_threads = prefill;
+    resources.decode_threads = decode;
+    // The governor steps down one thread at a time, keeping the fastest cores.
+    for (int32_t n = decode.threads; n >= 1; --n) {
+        genui::ThreadSet set = g_topology.thread_set(g_profile.decode_cores, n);
+        if (resources.decode_ladder.empty() || set.threads < resources.decode_ladder.back().threads) {
+            resources.decode_ladder.push_back(std::move(set));
+        }
+    }
+    std::atomic_store(&g_scheduler, std::make_shared<genui::Scheduler>(resources));
+    g_scheduler->set_prefill_chunking(g_prefill_chunk, g_target_step_ms);
+    g_scheduler->set_power_policy(g_foreground_policy, g_background_policy);
+    g_scheduler->start();
+    return true;
+}
+
+// Settles g_profile.flash_attn for the load's mode. On and off override the
+// profile. Auto keeps a tuned profile's choice; an untuned one gets a short
+// trial of both at a mid-length prompt, which only sets flash attention and
+// the KV type, so the profile stays untuned and autotune() still runs.
+static void apply_flash_attn_mode_locked() {
+    if (g_flash_attn_mode != FlashAttnMode::kAuto) {
+        g_profile = genui::with_flash_attn(g_profile, g_flash_attn_mode == FlashAttnMode::kOn);
+        return;
+    }
+    if (g_profile.tuned()) {
+        return;
+    }
+    genui::Autotuner::Options options;
+    options.prefill_tokens = 512;
+    options.decode_context = 512;
+    options.decode_tokens = 8;
+    const auto widest = static_cast<int>(g_topology.select(genui::CoreClass::kAll).size());
+    configure_compute_pool(g_pool_threads < 0 ? widest - 1 : g_pool_threads, g_pool_spin_us);
+    genui::Autotuner tuner(g_model, g_topology, options);
+    const genui::RuntimeProfile chosen = tuner.choose_flash_attn(g_profile);
+    g_profile.flash_attn = chosen.flash_attn;
+    g_profile.kv_type = chosen.kv_type;
+    LOGI("Flash attention %s by trial", g_profile.flash_attn ? "enabled" : "disabled");
+}
+
 extern "C" JNIEXPORT jboolean JNICALL
 Java_com_samsung_genuiapp_QwenCoderBridge_nativeInit(
-        JNIEnv *env, jobject /*thiz*/, jstring jModelPath, jint jThreads) {
+        JNIEnv *env, jobject /*thiz*/, jstring jModelPath, jint jMaxThreads, jint jPrefillCores, jint jDecodeCores,
+        jint jPoolThreads, jint jPoolSpinUs, jboolean jRepackWeights, jint jFlashAttn,
+        jboolean jHugePages, jboolean jAccessPhases, jint jHotCopyMiB) {
     if (!jModelPath) {
         return JNI_FALSE;
     }
@@ -296,10 +813,19 @@ Java_com_samsung_genuiapp_QwenCoderBridge_nativeInit(
         return JNI_FALSE;
     }
 
-    const int threads = std::max(1, jThreads);
-
     std::lock_guard<std::mutex> lock(g_mutex);
 
+    g_topology = genui::CpuTopology::discover();
+    LOGI("CPU topology: %s, ggml kernels: %s", g_topology.describe().c_str(), cpu_variant());
+    g_profile = genui::RuntimeProfile();
+    g_profile.prefill_cores = core_class(jPrefillCores);
+    g_profile.prefill_threads = std::max(0, (int) jMaxThreads);
+    g_profile.decode_cores = core_class(jDecodeCores);
+    g_profile.decode_threads = std::max(0, (int) jMaxThreads);
+    g_pool_threads = jPoolThreads;
+    g_pool_spin_us = std::max(0, (int) jPoolSpinUs);
+    g_flash_attn_mode = to_flash_attn_mode(jFlashAttn);
+
     if (!g_backend_initialized) {
         llama_backend_init();
         g_backend_initialized = true;
@@ -317,6 +843,7 @@ Java_com_samsung_genuiapp_QwenCoderBridge_nativeInit(
     mparams.n_gpu_layers = -1;
     LOGI("GPU offload support=%d (requested layers=%d)", llama_supports_gpu_offload(), mparams.n_gpu_layers);
 
+    const genui::MappingSnapshot before_model = genui::MappingSnapshot::take();
     g_model = llama_load_model_from_file(model_path, mparams);
     if (!g_model) {
         LOGE("Failed to load model at %s", model_path);
@@ -324,32 +851,226 @@ Java_com_samsung_genuiapp_QwenCoderBridge_nativeInit(
         release_locked();
         return JNI_FALSE;
     }
+    genui::MemoryHintOptions hint_options;
+    hint_options.huge_pages = jHugePages == JNI_TRUE;
+    hint_options.access_phases = jAccessPhases == JNI_TRUE;
+    hint_options.hot_copy_bytes = static_cast<size_t>(std::max(0, (int) jHotCopyMiB)) << 20;
+    g_memory_hints.attach(model_path, hint_options);
+    // Fused projections (scripts/patches/0003-*) live in anonymous buffers.
+    g_memory_hints.advise_buffers(before_model.added());
+
+    // Optional: interleaved copies of the quantized matmul weights. Anything
+    // not copied, or everything with a stock libggml, runs from the mmap.
+    if (jRepackWeights == JNI_TRUE && g_repack.build(g_model)) {
+        g_repack.install();
+    }
+    // Optional: huge-page copies of the matmul weights the repack left in the
+    // mapping, up to the budget.
+    if (hint_options.hot_copy_bytes > 0) {
+        std::vector<ggml_tensor *> hot;
+        for (ggml_tensor *weight : genui::matmul_weights(g_model)) {
+            if (!g_repack.covers(weight)) {
+                hot.push_back(weight);
+            }
+        }
+        g_memory_hints.copy_hot_tensors(hot);
+    }
 
-    llama_context_params cparams = llama_context_default_params();
-    cparams.n_ctx = kDefaultContext;
-    cparams.n_batch = kDefaultBatch;
-    cparams.n_threads = threads;
-    cparams.n_threads_batch = threads;
+    const auto mask_start = std::chrono::steady_clock::now();
+    if (g_pieces.build(g_model) && g_token_mask.build(g_pieces, genui::TokenMask::default_rules())) {
+        const double mask_ms = std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - mask_start).count();
+        LOGI("Token mask ready: rules=%zu states=%zu banned_at_root=%zu elapsed=%.2f ms",
+             g_token_mask.rule_count(), g_token_mask.state_count(), g_token_mask.root_banned(), mask_ms);
+    } else {
+        LOGE("Token mask unavailable; generating without banned-string filtering");
+    }
 
-    g_ctx = llama_new_context_with_model(g_model, cparams);
-    if (!g_ctx) {
+    g_profile_key = genui::profile_key(g_topology, model_path);
+    genui::RuntimeProfile tuned;
+    if (!g_profile_dir.empty()
+        && genui::load_profile(genui::profile_path(g_profile_dir, g_profile_key), g_profile_key, tuned)) {
+        g_profile = tuned;
+        LOGI("Applied tuned profile %s: %s", g_profile_key.c_str(), g_profile.describe().c_str());
+    }
+    apply_flash_attn_mode_locked();
+
+    if (g_html_grammar_enabled) {
+        ensure_html_grammar_locked();
+    }
+
+    if (!start_context_locked()) {
         LOGE("Failed to create context for %s", model_path);
         env->ReleaseStringUTFChars(jModelPath, model_path);
         release_locked();
         return JNI_FALSE;
     }
 
-    llama_set_n_threads(g_ctx, threads, threads);
-    LOGI("Context ready: n_ctx=%d batch=%d threads=%d", llama_n_ctx(g_ctx), cparams.n_batch, threads);
-
     env->ReleaseStringUTFChars(jModelPath, model_path);
-    LOGI("Loaded Qwen coder model using %d threads", threads);
+    g_memory_hints.enter_inference();
+    LOGI("Loaded Qwen coder model (%s)", g_thread_plan.c_str());
     return JNI_TRUE;
 }
 
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSetProfileDir(
+        JNIEnv *env, jobject /*thiz*/, jstring jDir) {
+    const char *dir = jDir ? env->GetStringUTFChars(jDir, nullptr) : nullptr;
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_profile_dir = dir ? dir : "";
+    if (dir) {
+        env->ReleaseStringUTFChars(jDir, dir);
+    }
+}
+
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeHasTunedProfile(
+        JNIEnv * /*env*/, jobject /*thiz*/) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    return g_model && g_profile.tuned() ? JNI_TRUE : JNI_FALSE;
+}
+
+// Re-tunes the loaded model in place: the running context is torn down (in
+// flight requests fail), the trials run on this thread, and the context comes
+// back with the winning settings, which are also saved for later loads.
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeAutotune(
+        JNIEnv *env, jobject /*thiz*/, jint jBudgetMs) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (!g_model) {
+        return env->NewStringUTF("[error] Model is not initialized.");
+    }
+    stop_context_locked();
+
+    genui::Autotuner::Options options;
+    options.budget_ms = std::max(1000, (int) jBudgetMs);
+    const auto widest = static_cast<int>(g_topology.select(genui::CoreClass::kAll).size());
+    configure_compute_pool(g_pool_threads < 0 ? widest - 1 : g_pool_threads, g_pool_spin_us);
+    genui::Autotuner tuner(g_model, g_topology, options);
+    const genui::RuntimeProfile tuned = tuner.run(g_profile);
+
+    const char *error = nullptr;
+    if (!tuned.tuned()) {
+        error = "[error] Autotune could not measure this model.";
+    } else {
+        g_profile = tuned;
+        const std::string path = genui::profile_path(g_profile_dir, g_profile_key);
+        if (g_profile_dir.empty() || !genui::save_profile(path, g_profile_key, g_profile)) {
+            LOGE("Tuned profile not saved (dir=%s); it applies until the model is released",
+                 g_profile_dir.empty() ? "unset" : g_profile_dir.c_str());
+        } else {
+            LOGI("Saved tuned profile to %s", path.c_str());
+        }
+        // A forced flash attention mode outlasts tuning; the saved profile keeps the tuned choice.
+        apply_flash_attn_mode_locked();
+    }
+    if (!start_context_locked()) {
+        release_locked();
+        return env->NewStringUTF("[error] Failed to recreate the context after tuning.");
+    }
+    return env->NewStringUTF(error ? error : g_profile.describe().c_str());
+}
+
+// Runs the current profile with flash attention off and then on, at several
+// prompt lengths in a context as large as the shared one, and reports the
+// compute buffer llama.cpp reserved plus prefill and decode speed at each
+// length, one line per setting. Like autotuning, this tears the context down
+// for the duration.
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeBenchmarkFlashAttention(
+        JNIEnv *env, jobject /*thiz*/) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (!g_model) {
+        return env->NewStringUTF("[error] Model is not initialized.");
+    }
+    stop_context_locked();
+
+    genui::Autotuner::Options options;
+    options.n_ctx = kSharedContext;
+    const auto widest = static_cast<int>(g_topology.select(genui::CoreClass::kAll).size());
+    configure_compute_pool(g_pool_threads < 0 ? widest - 1 : g_pool_threads, g_pool_spin_us);
+    genui::Autotuner tuner(g_model, g_topology, options);
+    const std::vector<int32_t> lengths(std::begin(kAttentionReportLengths), std::end(kAttentionReportLengths));
+    std::string report;
+    for (const bool enabled : {false, true}) {
+        const genui::AttentionReport result =
+                tuner.attention_report(genui::with_flash_attn(g_profile, enabled), lengths);
+        LOGI("Flash attention benchmark: %s", result.describe().c_str());
+        report += (report.empty() ? "" : "\n") + result.describe();
+    }
+
+    if (!start_context_locked()) {
+        release_locked();
+        return env->NewStringUTF("[error] Failed to recreate the context after the benchmark.");
+    }
+    return env->NewStringUTF(report.c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeRepackStats(
+        JNIEnv *env, jobject /*thiz*/) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    return env->NewStringUTF(g_repack.empty() ? "off" : g_repack.stats().describe().c_str());
+}
+
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeMemoryHintStats(
+        JNIEnv *env, jobject /*thiz*/) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (!g_model) {
+        return env->NewStringUTF("[error] Model is not initialized.");
+    }
+    return env->NewStringUTF(g_memory_hints.stats().describe().c_str());
+}
+
+// Times prefill and decode on the mmap'd weights and then on the repacked
+// copies, with the current profile. Like autotuning, this tears the context
+// down for the duration.
+extern "C" JNIEXPORT jstring JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeBenchmarkRepack(
+        JNIEnv *env, jobject /*thiz*/) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (!g_model) {
+        return env->NewStringUTF("[error] Model is not initialized.");
+    }
+    if (!genui::WeightRepack::supported()) {
+        return env->NewStringUTF("[error] libggml lacks the mul_mat hook; build llama.cpp with LLAMA_PATCHES=ON.");
+    }
+    if (g_repack.empty()) {
+        return env->NewStringUTF("[error] No repacked weights; load with repackWeights enabled.");
+    }
+    stop_context_locked();
+
+    const auto widest = static_cast<int>(g_topology.select(genui::CoreClass::kAll).size());
+    configure_compute_pool(g_pool_threads < 0 ? widest - 1 : g_pool_threads, g_pool_spin_us);
+    genui::Autotuner tuner(g_model, g_topology, genui::Autotuner::Options());
+    g_repack.uninstall();
+    const genui::RuntimeProfile stock = tuner.measure(g_profile);
+    g_repack.install();
+    const genui::RuntimeProfile repacked = tuner.measure(g_profile);
+    // The stock run faulted the originals back in.
+    g_repack.release_sources();
+
+    genui::RepackStats &stats = g_repack.stats();
+    stats.prefill_tps_stock = stock.prefill_tps;
+    stats.decode_tps_stock = stock.decode_tps;
+    stats.prefill_tps_repacked = repacked.prefill_tps;
+    stats.decode_tps_repacked = repacked.decode_tps;
+    LOGI("Weight repack benchmark: %s", stats.describe().c_str());
+
+    if (!start_context_locked()) {
+        release_locked();
+        return env->NewStringUTF("[error] Failed to recreate the context after the benchmark.");
+    }
+    if (!stock.tuned() || !repacked.tuned()) {
+        return env->NewStringUTF("[error] Benchmark could not measure this model.");
+    }
+    return env->NewStringUTF(stats.describe().c_str());
+}
+
 extern "C" JNIEXPORT jstring JNICALL
 Java_com_samsung_genuiapp_QwenCoderBridge_nativeGenerate(
-        JNIEnv *env, jobject /*thiz*/, jstring jPrompt, jint jMaxTokens) {
+        JNIEnv *env, jobject /*thiz*/, jstring jPrompt, jint jMaxTokens, jint jPriority, jlong jHandle) {
     if (!jPrompt) {
         return env->NewStringUTF("[error] Prompt is null.");
     }
@@ -362,28 +1083,269 @@ Java_com_samsung_genuiapp_QwenCoderBridge_nativeGenerate(
     std::string prompt(prompt_chars);
     env->ReleaseStringUTFChars(jPrompt, prompt_chars);
 
+    // Only request setup holds the mutex; the scheduler decodes concurrent
+    // requests together, so the wait below runs unlocked.
+    std::future<genui::GenerationResult> pending;
+    {
+        std::lock_guard<std::mutex> lock(g_mutex);
+        std::vector<llama_token> tokens;
+        genui::GenerationParams params;
+        const char *error = prepare_request_locked(prompt, jMaxTokens, tokens, params);
+        if (error) {
+            return env->NewStringUTF(error);
+        }
+        params.priority = jPriority == static_cast<jint>(genui::Priority::kBackground)
+                          ? genui::Priority::kBackground
+                          : genui::Priority::kForeground;
+        pending = g_scheduler->submit(std::move(tokens), params, static_cast<int64_t>(jHandle));
+    }
+
+    genui::GenerationResult result = pending.get();
+    record_result(result);
+    return env->NewStringUTF(result.text.c_str());
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSubmit(
+        JNIEnv *env, jobject /*thiz*/, jstring jPrompt, jint jMaxTokens, jint jPriority, jlong jHandle,
+        jobject jCallback) {
+    if (!jCallback) {
+        return;
+    }
+    genui::Scheduler::Completion done = java_completion(env, jCallback);
+    if (done) {
+        submit_java_request(env, jPrompt, jMaxTokens, jPriority, jHandle, nullptr, std::move(done));
+    }
+}
+
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeSubmitStream(
+        JNIEnv *env, jobject /*thiz*/, jstring jPrompt, jint jMaxTokens, jint jPriority, jlong jHandle,
+        jobject jBuffer, jobject jCallback) {
+    if (!jCallback) {
+        return;
+    }
+    genui::Scheduler::Completion done = java_completion(env, jCallback);
+    if (!done) {
+        return;
+    }
+    std::shared_ptr<genui::TextStream> stream = java_stream(env, jBuffer, jCallback);
+    if (!stream) {
+        genui::GenerationResult result;
+        result.text = "[error] Invalid stream buffer.";
+        done(result);
+        return;
+    }
+    submit_java_request(env, jPrompt, jMaxTokens, jPriority, jHandle, std::move(stream), std::move(done));
+}
+
+extern "C" JNIEXPORT jobjectArray JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeGenerateVariants(
+        JNIEnv *env, jobject /*thiz*/, jstring jPrompt, jint jCount, jint jMaxTokens, jfloat jTemperature,
+        jint jTopK, jfloat jTopP, jint jSeed, jlong jHandle) {
+    const jsize count = static_cast<jsize>(std::max(1, std::min<int>(jCount, genui::Scheduler::kMaxSequences)));
+    jobjectArray outputs = env->NewObjectArray(count, env->FindClass("java/lang/String"), nullptr);
+    if (!outputs) {
+        return nullptr;
+    }
+
+    std::vector<std::string> texts(static_cast<size_t>(count));
+    const char *prompt_chars = jPrompt ? env->GetStringUTFChars(jPrompt, nullptr) : nullptr;
+    if (!prompt_chars) {
+        std::fill(texts.begin(), texts.end(), jPrompt ? "[error] Unable to read prompt." : "[error] Prompt is null.");
+    } else {
+        std::string prompt(prompt_chars);
+        env->ReleaseStringUTFChars(jPrompt, prompt_chars);
+
+        std::vector<std::future<genui::GenerationResult>> pending;
+        {
+            std::lock_guard<std::mutex> lock(g_mutex);
+            std::vector<llama_token> tokens;
+            genui::GenerationParams params;
+            const char *error = prepare_request_locked(prompt, jMaxTokens, tokens, params);
+            if (error) {
+                std::fill(texts.begin(), texts.end(), error);
+            } else {
+                // Every variant reserves its own generation cells next to the shared prompt.
+                const int per_variant = (kSharedContext - (int) tokens.size()) / count - 1;
+                params.max_tokens = std::max(16, std::min(params.max_tokens, per_variant));
+                params.sampling.temperature = jTemperature;
+                params.sampling.top_k = jTopK;
+                params.sampling.top_p = jTopP;
+                params.sampling.seed = static_cast<uint32_t>(jSeed);
+                pending = g_scheduler->submit_variants(std::move(tokens), count, params,
+                                                       static_cast<int64_t>(jHandle));
+            }
+        }
+
+        int32_t tokens = 0;
+        for (size_t i = 0; i < pending.size(); ++i) {
+            genui::GenerationResult result = pending[i].get();
+            tokens += result.tokens;
+            texts[i] = std::move(result.text);
+        }
+        if (!pending.empty()) {
+            g_last_generated_tokens.store(tokens);
+        }
+    }
+
+    for (jsize i = 0; i < count; ++i) {
+        jstring text = env->NewStringUTF(texts[static_cast<size_t>(i)].c_str());
+        env->SetObjectArrayElement(outputs, i, text);
+        env->DeleteLocalRef(text);
+    }
+    return outputs;
+}
+
+// Opens a prompt that is still being written (e.g. streamed from an upstream
+// agent): `jPrefix` is the start of the user message, and the rest follows
+// through nativeAppendPrompt until nativeFinishPrompt closes it. The worker
+// prefills what has arrived in the meantime. `jCallback` receives the
+// generated document, or an "[error] ..." message, exactly once.
+extern "C" JNIEXPORT void JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeBeginPrompt(
+        JNIEnv *env, jobject /*thiz*/, jstring jPrefix, jint jMaxTokens, jint jPriority, jlong jHandle,
+        jobject jCallback) {
+    if (!jCallback) {
+        return;
+    }
+    genui::Scheduler::Completion done = java_completion(env, jCallback);
+    if (!done) {
+        return;
+    }
+    auto fail = [&done](const char *message) {
+        genui::GenerationResult result;
+        result.text = message;
+        done(result);
+    };
+    std::string prefix;
+    if (jPrefix) {
+        const char *prefix_chars = env->GetStringUTFChars(jPrefix, nullptr);
+        if (!prefix_chars) {
+            fail("[error] Unable to read prompt.");
+            return;
+        }
+        prefix.assign(prefix_chars);
+        env->ReleaseStringUTFChars(jPrefix, prefix_chars);
+    }
+
     std::lock_guard<std::mutex> lock(g_mutex);
-    if (!g_model || !g_ctx) {
-        return env->NewStringUTF("[error] Model is not initialized.");
+    const auto handle = static_cast<int64_t>(jHandle);
+    if (!g_model || !g_ctx || !g_scheduler || g_pieces.empty()) {
+        fail("[error] Model is not initialized.");
+        return;
     }
-    std::string templated_prompt = apply_chat_template(prompt);
-    std::vector<llama_token> tokens = tokenize_prompt(g_model, templated_prompt);
+    if (handle == 0 || g_prompt_sessions.count(handle) > 0) {
+        fail("[error] Prompt handle is missing or already open.");
+        return;
+    }
+    PromptSession session;
+    session.text = chat_template_prefix() + prefix;
+    retokenize_tail(session);
+    if (session.tokens.empty()) {
+        fail("[error] Failed to tokenize prompt.");
+        return;
+    }
+    if ((int) session.tokens.size() >= kDefaultContext) {
+        fail("[error] Prompt is longer than the context window.");
+        return;
+    }
+    session.max_tokens = jMaxTokens;
+
+    genui::GenerationParams params;
+    // Provisional: nativeFinishPrompt clamps it to what the whole prompt leaves.
+    params.max_tokens = token_budget(jMaxTokens, session.tokens.size());
+    snapshot_params_locked(params);
+    params.priority = jPriority == static_cast<jint>(genui::Priority::kBackground)
+                      ? genui::Priority::kBackground
+                      : genui::Priority::kForeground;
+    // The last token may still merge with the next chunk; it is held back.
+    std::vector<llama_token> stable(session.tokens.begin(),
+                                    session.tokens.end() - (session.tokens.size() > 1 ? 1 : 0));
+    g_prompt_sessions.emplace(handle, std::move(session));
+    g_scheduler->open_prompt(std::move(stable), params, handle, std::move(done));
+}
 
-    if (tokens.empty()) {
-        return env->NewStringUTF("[error] Failed to tokenize prompt.");
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeAppendPrompt(
+        JNIEnv *env, jobject /*thiz*/, jlong jHandle, jstring jText) {
+    if (!jText) {
+        return JNI_FALSE;
+    }
+    const char *text_chars = env->GetStringUTFChars(jText, nullptr);
+    if (!text_chars) {
+        return JNI_FALSE;
     }
+    std::string text(text_chars);
+    env->ReleaseStringUTFChars(jText, text_chars);
 
-    const int n_ctx = llama_n_ctx(g_ctx);
-    if ((int) tokens.size() >= n_ctx) {
-        return env->NewStringUTF("[error] Prompt is longer than the context window.");
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_prompt_sessions.find(static_cast<int64_t>(jHandle));
+    if (!g_scheduler || it == g_prompt_sessions.end()) {
+        return JNI_FALSE;
+    }
+    PromptSession &session = it->second;
+    session.text.append(text);
+    retokenize_tail(session);
+    if ((int) session.tokens.size() >= kDefaultContext) {
+        LOGE("Prompt %lld is longer than the context window", static_cast<long long>(it->first));
+        g_scheduler->reject_prompt(it->first);
+        g_prompt_sessions.erase(it);
+        return JNI_FALSE;
     }
+    std::vector<llama_token> stable(session.tokens.begin(),
+                                    session.tokens.end() - (session.tokens.size() > 1 ? 1 : 0));
+    if (!g_scheduler->feed_prompt(it->first, std::move(stable), false)) {
+        // The request already finished: cancelled, failed or released.
+        g_prompt_sessions.erase(it);
+        return JNI_FALSE;
+    }
+    return JNI_TRUE;
+}
 
-    const int requested = jMaxTokens > 0 ? jMaxTokens : 512;
-    const int available = n_ctx - (int) tokens.size();
-    const int capped = std::max(16, std::min(requested, available));
+// Closes the prompt with the chat template's tail. The whole prompt is
+// tokenized once more, exactly as nativeGenerate would, and the scheduler
+// re-prefills from the first token that differs from what it already has.
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeFinishPrompt(
+        JNIEnv * /*env*/, jobject /*thiz*/, jlong jHandle) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_prompt_sessions.find(static_cast<int64_t>(jHandle));
+    if (!g_scheduler || it == g_prompt_sessions.end()) {
+        return JNI_FALSE;
+    }
+    const int64_t handle = it->first;
+    std::string text = std::move(it->second.text);
+    const jint max_tokens = it->second.max_tokens;
+    g_prompt_sessions.erase(it);
+    text.append(kChatTemplateSuffix);
+    std::vector<llama_token> tokens = tokenize_prompt(g_model, text);
+    if (tokens.empty()) {
+        LOGE("Failed to tokenize prompt %lld", static_cast<long long>(handle));
+        g_scheduler->cancel(handle);
+        return JNI_FALSE;
+    }
+    // The same per-request limits prepare_request_locked() applies to a whole prompt.
+    if ((int) tokens.size() >= kDefaultContext) {
+        LOGE("Prompt %lld is longer than the context window: %zu tokens", static_cast<long long>(handle),
+             tokens.size());
+        g_scheduler->reject_prompt(handle);
+        return JNI_FALSE;
+    }
+    LOGI("Prompt %lld finished: %zu tokens", static_cast<long long>(handle), tokens.size());
+    const int32_t budget = token_budget(max_tokens, tokens.size());
+    return g_scheduler->feed_prompt(handle, std::move(tokens), true, budget) ? JNI_TRUE : JNI_FALSE;
+}
 
-    std::string result = generate_text(tokens, capped);
-    return env->NewStringUTF(result.c_str());
+extern "C" JNIEXPORT jboolean JNICALL
+Java_com_samsung_genuiapp_QwenCoderBridge_nativeCancel(
+        JNIEnv * /*env*/, jobject /*thiz*/, jlong jHandle) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_prompt_sessions.erase(static_cast<int64_t>(jHandle));
+    if (!g_scheduler) {
+        return JNI_FALSE;
+    }
+    return g_scheduler->cancel(static_cast<int64_t>(jHandle)) ? JNI_TRUE : JNI_FALSE;
 }
 
 extern "C" JNIEXPORT void JNICALL
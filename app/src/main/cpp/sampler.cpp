@@ -0,0 +1,106 @@
+﻿#include "sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace genui {
+
+namespace {
+
+static bool heap_less(const std::pair<float, llama_token> &a, const std::pair<float, llama_token> &b) {
+    return a.first > b.first;  // min-heap on the logit
+}
+
+}  // namespace
+
+TokenSampler::TokenSampler(const SamplingParams &params, uint32_t stream)
+        : params_(params), rng_(params.seed ^ (0x9e3779b9u * (stream + 1))) {}
+
+// Keeps the best top_k candidates in a min-heap, so a full-vocabulary pass
+// costs O(n log k) and no allocation after the first call.
+void TokenSampler::offer(float logit, llama_token tok) {
+    if (!std::isfinite(logit)) {
+        return;
+    }
+    const auto k = static_cast<size_t>(params_.top_k);
+    if (params_.top_k <= 0 || candidates_.size() < k) {
+        candidates_.emplace_back(logit, tok);
+        if (params_.top_k > 0) {
+            std::push_heap(candidates_.begin(), candidates_.end(), heap_less);
+        }
+        return;
+    }
+    if (logit > candidates_.front().first) {
+        std::pop_heap(candidates_.begin(), candidates_.end(), heap_less);
+        candidates_.back() = {logit, tok};
+        std::push_heap(candidates_.begin(), candidates_.end(), heap_less);
+    }
+}
+
+llama_token TokenSampler::sample(const float *logits, int32_t n_vocab) {
+    candidates_.clear();
+    for (llama_token tok = 0; tok < n_vocab; ++tok) {
+        offer(logits[tok], tok);
+    }
+    return draw();
+}
+
+llama_token TokenSampler::sample(const float *logits, const TokenBits &allowed) {
+    candidates_.clear();
+    for (size_t w = 0; w < allowed.size(); ++w) {
+        uint64_t word = allowed[w];
+        while (word) {
+            const auto tok = static_cast<llama_token>(w * 64 + __builtin_ctzll(word));
+            offer(logits[tok], tok);
+            word &= word - 1;
+        }
+    }
+    return draw();
+}
+
+llama_token TokenSampler::draw() {
+    if (candidates_.empty()) {
+        return -1;
+    }
+    std::sort(candidates_.begin(), candidates_.end(),
+              [](const std::pair<float, llama_token> &a, const std::pair<float, llama_token> &b) {
+                  return a.first > b.first;
+              });
+    if (greedy()) {
+        return candidates_.front().second;
+    }
+
+    // Softmax at the requested temperature, then cut to the top_p nucleus.
+    const float max_logit = candidates_.front().first;
+    double total = 0.0;
+    for (auto &candidate : candidates_) {
+        candidate.first = std::exp((candidate.first - max_logit) / params_.temperature);
+        total += candidate.first;
+    }
+    size_t keep = candidates_.size();
+    if (params_.top_p > 0.0f && params_.top_p < 1.0f) {
+        double mass = 0.0;
+        for (size_t i = 0; i < candidates_.size(); ++i) {
+            mass += candidates_[i].first / total;
+            if (mass >= params_.top_p) {
+                keep = i + 1;
+                break;
+            }
+        }
+    }
+    double kept = 0.0;
+    for (size_t i = 0; i < keep; ++i) {
+        kept += candidates_[i].first;
+    }
+
+    double target = std::uniform_real_distribution<double>(0.0, kept)(rng_);
+    for (size_t i = 0; i < keep; ++i) {
+        target -= candidates_[i].first;
+        if (target <= 0.0) {
+            return candidates_[i].second;
+        }
+    }
+    return candidates_[keep - 1].second;
+}
+
+}  // namespace genui
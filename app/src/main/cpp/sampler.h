@@ -0,0 +1,43 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "llama.h"
+#include "token_mask.h"
+
+namespace genui {
+
+struct SamplingParams {
+    float temperature = 0.0f;  // <= 0 decodes greedily
+    int32_t top_k = 40;        // <= 0 keeps every candidate
+    float top_p = 0.95f;
+    uint32_t seed = 0;
+};
+
+// Temperature / top-k / top-p sampling over logits that the caller has
+// already masked (-inf for banned tokens). Each sequence owns one, so
+// variants forked from one prompt draw from independent streams.
+class TokenSampler {
+public:
+    TokenSampler(const SamplingParams &params, uint32_t stream);
+
+    bool greedy() const { return params_.temperature <= 0.0f; }
+
+    // Draws from every finite logit, or -1 when there is none.
+    llama_token sample(const float *logits, int32_t n_vocab);
+    // Draws only among tokens whose bit is set in `allowed`.
+    llama_token sample(const float *logits, const TokenBits &allowed);
+
+private:
+    void offer(float logit, llama_token tok);
+    llama_token draw();
+
+    SamplingParams params_;
+    std::mt19937 rng_;
+    std::vector<std::pair<float, llama_token>> candidates_;
+};
+
+}  // namespace genui
@@ -0,0 +1,1403 @@
+﻿#include "scheduler.h"
+
+#include <android/log.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "cpu_topology.h"
+
+#define LOG_TAG "QwenCoderBridge"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+namespace genui {
+
+namespace {
+
+constexpr int32_t kMaxRetriesPerCheckpoint = 2;
+constexpr size_t kMaxEarlyCancels = 32;
+constexpr const char *kCancelledMessage = "[error] Generation was cancelled.";
+
+static std::string cpu_list(const Scheduler::ThreadSet &set) {
+    return set.cpus.empty() ? "any cpu" : "cpus " + format_cpus(set.cpus);
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+static void complete_error(const Scheduler::Completion &done, const char *message) {
+    GenerationResult result;
+    result.text = message;
+    done(result);
+}
+
+}  // namespace
+
+// FNV-1a over the prompt tokens and every parameter that can change the
+// output; priority is included so a foreground tap never waits behind a
+// paused background duplicate.
+uint64_t Scheduler::request_key(const std::vector<llama_token> &prompt, const GenerationParams &params) {
+    uint64_t hash = 1469598103934665603ull;
+    auto mix = [&hash](const void *data, size_t size) {
+        const auto *bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        }
+    };
+    mix(prompt.data(), prompt.size() * sizeof(llama_token));
+    const int32_t fields[] = {
+            static_cast<int32_t>(params.priority), params.max_tokens, params.constrained ? 1 : 0,
+            static_cast<int32_t>(params.policy), params.max_rollbacks, params.sampling.top_k,
+            static_cast<int32_t>(params.sampling.seed),
+    };
+    mix(fields, sizeof(fields));
+    const float reals[] = {params.sampling.temperature, params.sampling.top_p};
+    mix(reals, sizeof(reals));
+    return hash != 0 ? hash : 1;
+}
+
+// Resolves whoever still waits on the request: its submitter, unless it
+// cancelled, and every duplicate attached to it. Must be called without
+// mutex_ held.
+void Scheduler::complete(Request &request, GenerationResult result) {
+    std::vector<Follower> followers;
+    bool owner_waiting = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = in_flight_.find(request.key);
+        if (request.key != 0 && it != in_flight_.end() && it->second == &request) {
+            in_flight_.erase(it);
+        }
+        auto unregister = [this, &request](int64_t handle) {
+            auto range = handles_.equal_range(handle);
+            for (auto entry = range.first; handle != 0 && entry != range.second; ++entry) {
+                if (entry->second == &request) {
+                    handles_.erase(entry);
+                    return;
+                }
+            }
+        };
+        unregister(request.handle);
+        auto feed = feeds_.find(request.handle);
+        if (request.feed && feed != feeds_.end() && feed->second == request.feed) {
+            feeds_.erase(feed);
+        }
+        for (const Follower &follower : request.followers) {
+            unregister(follower.handle);
+        }
+        followers = std::move(request.followers);
+        owner_waiting = request.owner_waiting;
+        request.owner_waiting = false;
+    }
+    for (auto &follower : followers) {
+        follower.done(result);
+    }
+    if (owner_waiting) {
+        request.done(result);
+    }
+}
+
+void Scheduler::fail_request(Request &request, const char *message) {
+    GenerationResult result;
+    result.text = message;
+    for (auto &variant : request.forks) {
+        complete(*variant, result);
+    }
+    complete(request, std::move(result));
+}
+
+bool Scheduler::cancel(int64_t handle) {
+    if (handle == 0) {
+        return false;
+    }
+    std::vector<Completion> resolved;
+    bool stopped = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto range = handles_.equal_range(handle);
+        if (range.first == range.second) {
+            early_cancels_.push_back(handle);
+            if (early_cancels_.size() > kMaxEarlyCancels) {
+                early_cancels_.pop_front();
+            }
+            return false;
+        }
+        const auto now = Clock::now();
+        for (auto entry = range.first; entry != range.second; ++entry) {
+            Request &request = *entry->second;
+            if (request.handle == handle && request.owner_waiting) {
+                request.owner_waiting = false;
+                resolved.push_back(std::move(request.done));
+            }
+            auto &followers = request.followers;
+            for (auto follower = followers.begin(); follower != followers.end();) {
+                if (follower->handle == handle) {
+                    resolved.push_back(std::move(follower->done));
+                    follower = followers.erase(follower);
+                } else {
+                    ++follower;
+                }
+            }
+            if (!request.owner_waiting && followers.empty() && !request.cancelled.load()) {
+                // Nobody is left to serve; later duplicates must start afresh.
+                auto it = in_flight_.find(request.key);
+                if (request.key != 0 && it != in_flight_.end() && it->second == &request) {
+                    in_flight_.erase(it);
+                }
+                request.cancel_requested = now;
+                request.cancelled.store(true);
+                stopped = true;
+            }
+        }
+        handles_.erase(range.first, range.second);
+        feeds_.erase(handle);
+        if (stopped) {
+            nudges_.fetch_add(1);
+        }
+    }
+    if (stopped) {
+        cv_.notify_one();
+    }
+    GenerationResult result;
+    result.text = kCancelledMessage;
+    for (auto &done : resolved) {
+        done(result);
+    }
+    return true;
+}
+
+// Runs on the compute threads between graph nodes: stops the decode early
+// when every request in the batch has been cancelled, or on release.
+bool Scheduler::abort_decode(void *data) {
+    const auto *self = static_cast<const Scheduler *>(data);
+    if (self->abort_all_.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    if (self->batch_requests_.empty()) {
+        return false;
+    }
+    for (const Request *request : self->batch_requests_) {
+        if (!request->cancelled.load(std::memory_order_relaxed)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Scheduler::cancelled(const Request &request) const {
+    if (!request.cancelled.load()) {
+        return false;
+    }
+    for (const auto &variant : request.forks) {
+        if (!variant->cancelled.load()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Drops cancelled work between steps: waiting requests never start, and
+// resident or swapped-out sequences give back their slot and KV cells.
+void Scheduler::reap_cancelled() {
+    for (auto *waiting : {&waiting_foreground_, &waiting_background_}) {
+        for (auto it = waiting->begin(); it != waiting->end();) {
+            if (!cancelled(**it)) {
+                ++it;
+                continue;
+            }
+            LOGI("Cancelled request %d before admission", (*it)->id);
+            cancelled_.fetch_add(1);
+            fail_request(**it, kCancelledMessage);
+            it = waiting->erase(it);
+        }
+    }
+
+    auto stop_sequence = [this](Sequence &seq) {
+        const int32_t id = seq.request->id;
+        const Clock::time_point requested = seq.request->cancel_requested;
+        retire(seq, kCancelledMessage);
+        cancelled_.fetch_add(1);
+        LOGI("Cancelled request %d: cancel-to-idle=%.2f ms", id, elapsed_ms(requested, Clock::now()));
+    };
+    for (Sequence &seq : sequences_) {
+        if (seq.request && cancelled(*seq.request)) {
+            stop_sequence(seq);
+        }
+    }
+    for (auto it = swapped_.begin(); it != swapped_.end();) {
+        if (cancelled(*it->request)) {
+            stop_sequence(*it);
+            it = swapped_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+Scheduler::Scheduler(const Resources &resources) : res_(resources), sequences_(kMaxSequences) {
+    n_ctx_ = res_.ctx ? static_cast<int32_t>(llama_n_ctx(res_.ctx)) : 0;
+    n_vocab_ = res_.model ? llama_n_vocab(res_.model) : 0;
+    res_.batch_size = std::max(res_.batch_size, kMaxSequences);
+    batch_ = llama_batch_init(res_.batch_size, 0, 1);
+    for (int32_t i = 0; i < kMaxSequences; ++i) {
+        sequences_[i].seq_id = i;
+    }
+    if (res_.ctx) {
+        llama_set_abort_callback(res_.ctx, &Scheduler::abort_decode, this);
+    }
+    if (!res_.decode_ladder.empty()) {
+        PowerSensors sensors = PowerSensors::discover();
+        LOGI("Governor: %zu decode sets, %s", res_.decode_ladder.size(), sensors.describe().c_str());
+        governor_ = Governor(res_.decode_ladder, std::move(sensors), Governor::Options());
+    }
+}
+
+Scheduler::~Scheduler() {
+    stop();
+    if (res_.ctx) {
+        llama_set_abort_callback(res_.ctx, nullptr, nullptr);
+    }
+    llama_batch_free(batch_);
+}
+
+void Scheduler::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!thread_.joinable() && !stopping_) {
+        thread_ = std::thread(&Scheduler::run, this);
+    }
+}
+
+void Scheduler::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+        abort_all_.store(true);
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    // The worker is gone, so this thread may act as the queue's consumer.
+    while (pending_submits_.load() > 0) {
+        std::this_thread::yield();
+    }
+    Request *queued = nullptr;
+    while (incoming_.pop(queued)) {
+        std::unique_ptr<Request> request(queued);
+        fail_request(*request, "[error] Model was released.");
+    }
+}
+
+// Publishes the request to the worker without taking a lock; the mutex is
+// only touched to wake a worker that has parked itself.
+void Scheduler::enqueue(std::unique_ptr<Request> request) {
+    (request->params.priority == Priority::kForeground ? incoming_foreground_ : incoming_background_).fetch_add(1);
+    incoming_.push(request.release());
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (idle_.load()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cv_.notify_one();
+    }
+}
+
+std::future<GenerationResult> Scheduler::submit(std::vector<llama_token> prompt, const GenerationParams &params,
+                                                int64_t handle) {
+    auto promise = std::make_shared<std::promise<GenerationResult>>();
+    std::future<GenerationResult> future = promise->get_future();
+    submit_async(std::move(prompt), params, handle,
+                 [promise](const GenerationResult &result) { promise->set_value(result); });
+    return future;
+}
+
+void Scheduler::submit_async(std::vector<llama_token> prompt, const GenerationParams &params, int64_t handle,
+                             Completion done) {
+    submit_request(std::move(prompt), params, handle, std::move(done), nullptr);
+}
+
+void Scheduler::open_prompt(std::vector<llama_token> prompt, const GenerationParams &params, int64_t handle,
+                            Completion done) {
+    if (handle == 0) {
+        complete_error(done, "[error] An open prompt needs a handle.");
+        return;
+    }
+    auto feed = std::make_shared<PromptFeed>();
+    feed->tokens = prompt;
+    feed->max_tokens = params.max_tokens;
+    submit_request(std::move(prompt), params, handle, std::move(done), std::move(feed));
+}
+
+bool Scheduler::feed_prompt(int64_t handle, std::vector<llama_token> prompt, bool last, int32_t max_tokens) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = feeds_.find(handle);
+        if (handle == 0 || it == feeds_.end() || prompt.empty()) {
+            return false;
+        }
+        PromptFeed &feed = *it->second;
+        if (last && max_tokens > 0) {
+            feed.max_tokens = max_tokens;
+        }
+        const int64_t need = static_cast<int64_t>(prompt.size()) + std::max(1, feed.max_tokens) + 1;
+        feed.too_long = need > n_ctx_;
+        feed.tokens = std::move(prompt);
+        feed.closed = last || feed.too_long;
+        ++feed.version;
+        if (feed.closed) {
+            feeds_.erase(it);
+        }
+        feed_updates_.fetch_add(1);
+        nudges_.fetch_add(1);
+    }
+    cv_.notify_one();
+    return true;
+}
+
+bool Scheduler::reject_prompt(int64_t handle) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = feeds_.find(handle);
+        if (handle == 0 || it == feeds_.end()) {
+            return false;
+        }
+        PromptFeed &feed = *it->second;
+        feed.too_long = true;
+        feed.closed = true;
+        ++feed.version;
+        feeds_.erase(it);
+        feed_updates_.fetch_add(1);
+        nudges_.fetch_add(1);
+    }
+    cv_.notify_one();
+    return true;
+}
+
+void Scheduler::submit_request(std::vector<llama_token> prompt, const GenerationParams &params, int64_t handle,
+                               Completion done, std::shared_ptr<PromptFeed> feed) {
+    const int64_t need = static_cast<int64_t>(prompt.size()) + std::max(1, params.max_tokens) + 1;
+    if (prompt.empty()) {
+        complete_error(done, "[error] Failed to tokenize prompt.");
+        return;
+    }
+    if (need > n_ctx_) {
+        complete_error(done, "[error] Prompt is longer than the context window.");
+        return;
+    }
+
+    // A streamed request has a consumer of its own, and an open prompt is not
+    // known yet: neither is ever shared.
+    const uint64_t key = params.stream || feed ? 0 : request_key(prompt, params);
+    std::unique_ptr<Request> request;
+    const char *error = nullptr;
+    pending_submits_.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto early = std::find(early_cancels_.begin(), early_cancels_.end(), handle);
+        auto it = in_flight_.find(key);
+        if (stopping_ || !thread_.joinable()) {
+            error = "[error] Model is not initialized.";
+        } else if (handle != 0 && early != early_cancels_.end()) {
+            early_cancels_.erase(early);
+            error = kCancelledMessage;
+        } else if (key != 0 && it != in_flight_.end() && it->second->prompt == prompt) {
+            // The key covers the parameters; the prompt check rules out a collision.
+            Request &leader = *it->second;
+            leader.followers.push_back(Follower{handle, std::move(done)});
+            if (handle != 0) {
+                handles_.emplace(handle, &leader);
+            }
+            coalesced_.fetch_add(1);
+            LOGI("Coalesced a duplicate submit into in-flight request %d (%zu waiting on it)", leader.id,
+                 leader.followers.size());
+        } else {
+            request = std::make_unique<Request>();
+            request->prompt = std::move(prompt);
+            request->params = params;
+            request->submitted = Clock::now();
+            request->id = next_request_id_++;
+            request->handle = handle;
+            request->done = std::move(done);
+            if (feed) {
+                request->feed = feed;
+                request->incremental = true;
+                feeds_[handle] = std::move(feed);
+            }
+            if (key != 0 && it == in_flight_.end()) {
+                request->key = key;
+                in_flight_[key] = request.get();
+            }
+            if (handle != 0) {
+                handles_.emplace(handle, request.get());
+            }
+        }
+    }
+    if (request) {
+        enqueue(std::move(request));
+    }
+    pending_submits_.fetch_sub(1);
+    if (error) {
+        complete_error(done, error);
+    }
+}
+
+int32_t Scheduler::cells_needed(const Request &request) {
+    // Forked variants share the prompt's cells and only add their own tokens.
+    return static_cast<int32_t>(request.prompt.size()) +
+           slots_needed(request) * (std::max(1, request.params.max_tokens) + 1);
+}
+
+std::vector<std::future<GenerationResult>> Scheduler::submit_variants(std::vector<llama_token> prompt, int32_t n,
+                                                                      const GenerationParams &params,
+                                                                      int64_t handle) {
+    std::vector<std::future<GenerationResult>> futures;
+    n = std::max(1, std::min(n, kMaxSequences));
+    auto leader = std::make_unique<Request>();
+    leader->prompt = std::move(prompt);
+    leader->params = params;
+    leader->params.stream.reset();  // variants are returned whole
+    leader->submitted = Clock::now();
+    for (int32_t i = 1; i < n; ++i) {
+        auto variant = std::make_unique<Request>();
+        variant->prompt = leader->prompt;
+        variant->params = leader->params;
+        variant->submitted = leader->submitted;
+        leader->forks.push_back(std::move(variant));
+    }
+    auto bind = [&futures](Request &request) {
+        auto promise = std::make_shared<std::promise<GenerationResult>>();
+        futures.push_back(promise->get_future());
+        request.done = [promise](const GenerationResult &result) { promise->set_value(result); };
+    };
+    bind(*leader);
+    for (auto &variant : leader->forks) {
+        bind(*variant);
+    }
+
+    const char *error = nullptr;
+    if (leader->prompt.empty()) {
+        error = "[error] Failed to tokenize prompt.";
+    } else if (cells_needed(*leader) > n_ctx_) {
+        error = "[error] Prompt is longer than the context window.";
+    }
+    pending_submits_.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!error && (stopping_ || !thread_.joinable())) {
+            error = "[error] Model is not initialized.";
+        }
+        auto early = std::find(early_cancels_.begin(), early_cancels_.end(), handle);
+        if (!error && handle != 0 && early != early_cancels_.end()) {
+            early_cancels_.erase(early);
+            error = kCancelledMessage;
+        }
+        if (!error) {
+            leader->id = next_request_id_++;
+            leader->handle = handle;
+            for (auto &variant : leader->forks) {
+                variant->id = next_request_id_++;
+                variant->handle = handle;
+            }
+            if (handle != 0) {
+                handles_.emplace(handle, leader.get());
+                for (auto &variant : leader->forks) {
+                    handles_.emplace(handle, variant.get());
+                }
+            }
+        }
+    }
+    if (error) {
+        pending_submits_.fetch_sub(1);
+        fail_request(*leader, error);
+        return futures;
+    }
+    enqueue(std::move(leader));
+    pending_submits_.fetch_sub(1);
+    return futures;
+}
+
+// Moves the worker (and with it ggml's compute threads) to the thread set of
+// the coming step. Prompt chunks are matrix-matrix work that scales across
+// every core; a decode-only step is bandwidth-bound and the slowest core gates
+// it, so it runs on the faster cores only, as many of them as the governor
+// allows under the step's power policy. llama.cpp picks n_threads or
+// n_threads_batch by batch size, so both are set to the current set's width.
+void Scheduler::use_threads(bool prefill) {
+    step_policy_ = foreground_active_ > 0 ? foreground_policy_.load() : background_policy_.load();
+    const ThreadSet *set = &res_.decode_threads;
+    if (!governor_.empty() && (!prefill || step_policy_ == PowerPolicy::kPowerSaver)) {
+        set = &governor_.decode_set(step_policy_);
+    } else if (prefill) {
+        set = &res_.prefill_threads;
+    }
+    if (applied_threads_ == set) {
+        return;
+    }
+    if (applied_threads_) {
+        ++window_thread_switches_;
+    }
+    applied_threads_ = set;
+    if (!set->cpus.empty() && !pin_current_thread(set->cpus)) {
+        LOGE("Failed to pin the inference worker to cpus %s", format_cpus(set->cpus).c_str());
+    }
+    llama_set_n_threads(res_.ctx, static_cast<uint32_t>(set->threads), static_cast<uint32_t>(set->threads));
+}
+
+void Scheduler::run() {
+    bool stalled = false;
+    uint64_t nudges = 0;
+    while (true) {
+        // Stalled: the last step had nothing to decode, e.g. every open
+        // prompt is prefilled and waits for more text.
+        if (incoming_.empty() && (!busy() || stalled)) {
+            idle_.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this, stalled, nudges] {
+                return stopping_ || !incoming_.empty() || (stalled && nudges_.load() != nudges);
+            });
+            idle_.store(false);
+        }
+        nudges = nudges_.load();
+        if (abort_all_.load()) {
+            break;
+        }
+        Request *incoming = nullptr;
+        while (incoming_.pop(incoming)) {
+            const bool foreground = incoming->params.priority == Priority::kForeground;
+            (foreground ? incoming_foreground_ : incoming_background_).fetch_sub(1);
+            (foreground ? waiting_foreground_ : waiting_background_).emplace_back(incoming);
+        }
+        reap_cancelled();
+        sync_prompts();
+        schedule();
+        stalled = !step();
+        if (active_ == 0 && window_requests_ > 0) {
+            log_window();
+        }
+    }
+
+    for (Sequence &seq : sequences_) {
+        if (seq.request) {
+            retire(seq, "[error] Model was released.");
+        }
+    }
+    for (Sequence &seq : swapped_) {
+        retire(seq, "[error] Model was released.");
+    }
+    swapped_.clear();
+    for (auto *waiting : {&waiting_foreground_, &waiting_background_}) {
+        for (auto &request : *waiting) {
+            fail_request(*request, "[error] Model was released.");
+        }
+        waiting->clear();
+    }
+}
+
+// Picks up what feed_prompt() handed over since the last step. A longer
+// prompt that does not fit the cache yet stays pending and is retried.
+void Scheduler::sync_prompts() {
+    const uint64_t updates = feed_updates_.load();
+    if (updates == feeds_synced_) {
+        return;
+    }
+    struct Update {
+        Request *request;
+        std::vector<llama_token> tokens;
+        int32_t max_tokens;
+        bool closed;
+        bool too_long;
+    };
+    std::vector<Update> updates_found;
+    bool deferred = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto collect = [&updates_found](Request &request) {
+            if (request.feed && request.feed->version != request.feed_version) {
+                updates_found.push_back(Update{&request, request.feed->tokens, request.feed->max_tokens,
+                                               request.feed->closed, request.feed->too_long});
+                request.feed_version = request.feed->version;
+            }
+        };
+        for (auto *waiting : {&waiting_foreground_, &waiting_background_}) {
+            for (auto &request : *waiting) {
+                collect(*request);
+            }
+        }
+        for (Sequence &seq : sequences_) {
+            if (seq.request) {
+                collect(*seq.request);
+            }
+        }
+        // Swapped-out requests keep their updates until they are back.
+        for (const Sequence &seq : swapped_) {
+            const Request &request = *seq.request;
+            deferred = deferred || (request.feed && request.feed->version != request.feed_version);
+        }
+    }
+    std::vector<const Request *> rejected;
+    for (Update &update : updates_found) {
+        // Growing one prompt may have swapped out (or, on failure, retired)
+        // another request of this batch, so look each one up again.
+        Sequence *seq = nullptr;
+        bool resident = false;
+        for (Sequence &candidate : sequences_) {
+            if (candidate.request.get() == update.request) {
+                seq = &candidate;
+                resident = true;
+            }
+        }
+        for (auto *waiting : {&waiting_foreground_, &waiting_background_}) {
+            for (auto &request : *waiting) {
+                resident = resident || request.get() == update.request;
+            }
+        }
+        if (!resident) {
+            for (Sequence &swapped : swapped_) {
+                if (swapped.request.get() == update.request) {
+                    swapped.request->feed_version = 0;
+                    deferred = true;
+                }
+            }
+            continue;
+        }
+        Request &request = *update.request;
+        if (update.too_long) {
+            request.feed.reset();
+            if (seq) {
+                retire(*seq, "[error] Prompt is longer than the context window.");
+            } else {
+                rejected.push_back(&request);
+            }
+            continue;
+        }
+        // A lower budget only leaves part of the cells reserved at admission unused.
+        request.params.max_tokens = update.max_tokens;
+        if (!apply_prompt(request, seq, std::move(update.tokens), update.closed)) {
+            request.feed_version = 0;
+            deferred = true;
+        }
+    }
+    for (auto *waiting : {&waiting_foreground_, &waiting_background_}) {
+        for (auto it = waiting->begin(); !rejected.empty() && it != waiting->end();) {
+            if (std::find(rejected.begin(), rejected.end(), it->get()) != rejected.end()) {
+                fail_request(**it, "[error] Prompt is longer than the context window.");
+                it = waiting->erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    if (!deferred) {
+        feeds_synced_ = updates;
+    }
+}
+
+// Applies a newer tokenization of an open prompt. Prefilled cells from the
+// first token that changed on are trimmed from the sequence's KV cache;
+// returns false when the longer prompt does not fit the cache yet.
+bool Scheduler::apply_prompt(Request &request, Sequence *seq, std::vector<llama_token> tokens, bool closed) {
+    const auto grow = static_cast<int32_t>(tokens.size()) - static_cast<int32_t>(request.prompt.size());
+    if (seq && grow > 0) {
+        while (!fits(grow, 0) && request.params.priority == Priority::kForeground && swap_out_background()) {
+        }
+        if (!fits(grow, 0)) {
+            return false;
+        }
+    }
+    size_t keep = 0;
+    const size_t common = std::min(tokens.size(), request.prompt.size());
+    while (keep < common && tokens[keep] == request.prompt[keep]) {
+        ++keep;
+    }
+    request.prompt = std::move(tokens);
+    if (closed) {
+        // The last prompt token is decoded once more, with logits.
+        keep = std::min(keep, request.prompt.size() - 1);
+        request.feed.reset();
+        request.prompt_closed = Clock::now();
+    }
+    if (!seq) {
+        return true;
+    }
+    seq->reserved += grow;
+    reserved_cells_ += grow;
+    if (seq->prefilled > keep) {
+        llama_kv_cache_seq_rm(res_.ctx, seq->seq_id, static_cast<llama_pos>(keep), -1);
+        request.retokenized += static_cast<int32_t>(seq->prefilled - keep);
+        seq->prefilled = keep;
+        seq->n_past = static_cast<llama_pos>(keep);
+    }
+    if (closed) {
+        request.prefilled_ahead = seq->prefilled;
+    }
+    return true;
+}
+
+bool Scheduler::busy() const {
+    return active_ > 0 || !waiting_foreground_.empty() || !waiting_background_.empty() || !swapped_.empty();
+}
+
+// Admission, FIFO within each priority: foreground first, swapping background
+// sequences out when they hold the slot or cells it needs; background work
+// (swapped-out sequences before new requests) only once no foreground
+// request is running or waiting.
+void Scheduler::schedule() {
+    while (!waiting_foreground_.empty()) {
+        const int32_t need = cells_needed(*waiting_foreground_.front());
+        const int32_t slots = slots_needed(*waiting_foreground_.front());
+        while (!fits(need, slots) && swap_out_background()) {
+        }
+        if (!fits(need, slots)) {
+            break;
+        }
+        begin(std::move(waiting_foreground_.front()));
+        waiting_foreground_.pop_front();
+    }
+
+    if (waiting_foreground_.empty() && foreground_active_ == 0) {
+        while (!swapped_.empty() && fits(swapped_.front().reserved)) {
+            Sequence seq = std::move(swapped_.front());
+            swapped_.pop_front();
+            swap_in(seq);
+        }
+        while (swapped_.empty() && !waiting_background_.empty() &&
+               fits(cells_needed(*waiting_background_.front()), slots_needed(*waiting_background_.front()))) {
+            begin(std::move(waiting_background_.front()));
+            waiting_background_.pop_front();
+        }
+    }
+
+    const bool foreground_only = foreground_active_ > 0 || !waiting_foreground_.empty();
+    int32_t paused = 0;
+    for (Sequence &seq : sequences_) {
+        if (!seq.request) {
+            continue;
+        }
+        const bool pause = foreground_only && seq.request->params.priority == Priority::kBackground;
+        if (pause && !seq.paused) {
+            preemptions_.fetch_add(1);
+            LOGI("Paused background request %d for foreground work", seq.request->id);
+        }
+        seq.paused = pause;
+        paused += pause ? 1 : 0;
+    }
+    waiting_fg_count_.store(static_cast<int32_t>(waiting_foreground_.size()));
+    waiting_bg_count_.store(static_cast<int32_t>(waiting_background_.size()));
+    running_count_.store(active_ - paused);
+    paused_count_.store(paused);
+    swapped_count_.store(static_cast<int32_t>(swapped_.size()));
+}
+
+Scheduler::Sequence *Scheduler::free_slot() {
+    for (Sequence &seq : sequences_) {
+        if (!seq.request) {
+            return &seq;
+        }
+    }
+    return nullptr;
+}
+
+// Copies the most recently admitted resident background sequence out of the
+// KV cache and frees its slot and cells.
+bool Scheduler::swap_out_background() {
+    Sequence *victim = nullptr;
+    for (Sequence &seq : sequences_) {
+        if (seq.request && seq.request->params.priority == Priority::kBackground && !seq.awaiting_fork &&
+            seq.forks.empty() && (!victim || seq.order > victim->order)) {
+            victim = &seq;
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+
+    const auto start = Clock::now();
+    const size_t size = llama_state_seq_get_size(res_.ctx, victim->seq_id);
+    victim->kv_image.resize(size);
+    if (size == 0 || llama_state_seq_get_data(res_.ctx, victim->kv_image.data(), victim->seq_id) == 0) {
+        LOGE("Failed to copy out the KV state of request %d", victim->request->id);
+        retire(*victim, "[error] Failed to preempt a background generation.");
+        return true;
+    }
+    llama_kv_cache_seq_rm(res_.ctx, victim->seq_id, -1, -1);
+    if (!victim->paused) {
+        victim->paused = true;
+        preemptions_.fetch_add(1);
+    }
+    swap_outs_.fetch_add(1);
+    LOGI("Swapped out request %d: n_past=%d state=%zu KB elapsed=%.2f ms", victim->request->id, victim->n_past,
+         size / 1024, elapsed_ms(start, Clock::now()));
+
+    reserved_cells_ -= victim->reserved;
+    --active_;
+    const llama_seq_id seq_id = victim->seq_id;
+    victim->swapped = true;
+    swapped_.push_back(std::move(*victim));
+    *victim = Sequence();
+    victim->seq_id = seq_id;
+    return true;
+}
+
+bool Scheduler::swap_in(Sequence &swapped) {
+    Sequence *slot = free_slot();
+    const llama_seq_id seq_id = slot->seq_id;
+    const auto start = Clock::now();
+    llama_kv_cache_seq_rm(res_.ctx, seq_id, -1, -1);
+    if (llama_state_seq_set_data(res_.ctx, swapped.kv_image.data(), seq_id) == 0) {
+        LOGE("Failed to restore the KV state of request %d", swapped.request->id);
+        retire(swapped, "[error] Failed to resume a preempted generation.");
+        return false;
+    }
+    LOGI("Swapped in request %d: n_past=%d elapsed=%.2f ms", swapped.request->id, swapped.n_past,
+         elapsed_ms(start, Clock::now()));
+
+    *slot = std::move(swapped);
+    slot->seq_id = seq_id;
+    slot->swapped = false;
+    slot->kv_image.clear();
+    slot->kv_image.shrink_to_fit();
+    reserved_cells_ += slot->reserved;
+    ++active_;
+    return true;
+}
+
+void Scheduler::begin(std::unique_ptr<Request> request) {
+    std::vector<std::unique_ptr<Request>> forks = std::move(request->forks);
+    const int32_t per_sequence = std::max(1, request->params.max_tokens) + 1;
+    const auto prompt_cells = static_cast<int32_t>(request->prompt.size());
+    Sequence &seq = start_sequence(std::move(request), prompt_cells + per_sequence, 0);
+    llama_kv_cache_seq_rm(res_.ctx, seq.seq_id, -1, -1);
+
+    uint32_t stream = 1;
+    for (auto &variant : forks) {
+        Sequence &child = start_sequence(std::move(variant), per_sequence, stream++);
+        child.awaiting_fork = true;
+        child.prefilled = child.request->prompt.size();
+        seq.forks.push_back(child.seq_id);
+    }
+}
+
+Scheduler::Sequence &Scheduler::start_sequence(std::unique_ptr<Request> request, int32_t reserved,
+                                               uint32_t stream) {
+    Sequence &seq = *free_slot();
+    const GenerationParams &params = request->params;
+    seq.request = std::move(request);
+    seq.reserved = reserved;
+    seq.admitted = Clock::now();
+    reserved_cells_ += seq.reserved;
+    ++active_;
+    if (params.priority == Priority::kForeground) {
+        ++foreground_active_;
+    }
+
+    if (window_requests_ == 0) {
+        window_start_ = seq.admitted;
+    }
+    ++window_requests_;
+    window_peak_ = std::max(window_peak_, active_);
+
+    const bool constrained = params.constrained && res_.grammar && !res_.grammar->empty();
+    seq.request->params.constrained = constrained;
+    seq.n_past = 0;
+    seq.generated = 0;
+    seq.mask_state = res_.token_mask->root();
+    if (constrained) {
+        // The grammar is only touched once a constrained request arrives; the
+        // bridge may still be compiling it while unconstrained ones run.
+        if (!window_constrained_) {
+            window_constrained_ = true;
+            res_.grammar->reset_stats();
+        }
+        // Trimming the grammar caches would invalidate other sequences' states.
+        seq.grammar_state = constrained_active_ == 0 ? res_.grammar->begin() : res_.grammar->root();
+        ++constrained_active_;
+    }
+    if (params.sampling.temperature > 0.0f) {
+        seq.sampler = std::make_unique<TokenSampler>(params.sampling, stream);
+    }
+    seq.stage = std::make_unique<OutputStage>(
+            *res_.pieces, res_.token_mask->empty() ? nullptr : &res_.token_mask->automaton(),
+            params.policy, params.max_rollbacks, kMaxRetriesPerCheckpoint);
+    seq.stage->output().reserve(static_cast<size_t>(std::max(128, params.max_tokens * 4)));
+    seq.stage->set_stream(params.stream.get());
+    seq.stage->start();
+    seq.order = next_order_++;
+    return seq;
+}
+
+// Shares the parent's freshly prefilled prompt cells with each waiting
+// variant and samples every variant's first token from the same logits.
+void Scheduler::fork(Sequence &parent, int32_t logits_index) {
+    float *logits = llama_get_logits_ith(res_.ctx, logits_index);
+    for (const llama_seq_id id : parent.forks) {
+        Sequence &child = sequences_[static_cast<size_t>(id)];
+        llama_kv_cache_seq_rm(res_.ctx, child.seq_id, -1, -1);
+        llama_kv_cache_seq_cp(res_.ctx, parent.seq_id, child.seq_id, -1, -1);
+        child.awaiting_fork = false;
+        child.n_past = parent.n_past;
+        child.prefill_steps = parent.prefill_steps;
+        child.decode_start = parent.decode_start;
+        advance(child, logits);
+    }
+    parent.forks.clear();
+}
+
+Scheduler::Stats Scheduler::stats() {
+    Stats stats;
+    stats.queued_foreground = incoming_foreground_.load() + waiting_fg_count_.load();
+    stats.queued_background = incoming_background_.load() + waiting_bg_count_.load();
+    stats.running = running_count_.load();
+    stats.paused = paused_count_.load();
+    stats.swapped = swapped_count_.load();
+    stats.preemptions = preemptions_.load();
+    stats.swap_outs = swap_outs_.load();
+    stats.coalesced = coalesced_.load();
+    stats.cancelled = cancelled_.load();
+    return stats;
+}
+
+void Scheduler::set_prefill_chunking(int32_t chunk_tokens, double target_step_ms) {
+    prefill_fixed_.store(std::max(0, chunk_tokens));
+    if (target_step_ms > 0.0) {
+        target_step_ms_.store(target_step_ms);
+    }
+}
+
+void Scheduler::set_power_policy(PowerPolicy foreground, PowerPolicy background) {
+    foreground_policy_.store(foreground);
+    background_policy_.store(background);
+}
+
+int32_t Scheduler::prefill_budget(int32_t decodes) const {
+    const int32_t room = res_.batch_size - decodes;
+    if (decodes == 0) {
+        return room;  // nobody to stall
+    }
+    const int32_t fixed = prefill_fixed_.load();
+    return std::min(room, fixed > 0 ? fixed : adaptive_chunk_);
+}
+
+// Multiplicative decrease when a mixed step overshoots the target, additive
+// increase while there is headroom and the chunk was the limiting factor.
+void Scheduler::adapt_prefill(double step_ms, int32_t decodes, int32_t prefill_tokens) {
+    if (decodes == 0 || prefill_tokens == 0 || prefill_fixed_.load() > 0) {
+        return;
+    }
+    const double target = target_step_ms_.load();
+    if (step_ms > target) {
+        adaptive_chunk_ = std::max(kMinPrefillChunk, adaptive_chunk_ * 3 / 4);
+    } else if (step_ms < 0.8 * target && prefill_tokens >= adaptive_chunk_) {
+        adaptive_chunk_ = std::min(res_.batch_size, adaptive_chunk_ + kMinPrefillChunk);
+    }
+}
+
+// Returns false when there was nothing to decode.
+bool Scheduler::step() {
+    const auto step_start = Clock::now();
+    batch_.n_tokens = 0;
+    int32_t decodes = 0;
+    for (Sequence &seq : sequences_) {
+        if (!seq.request || seq.paused || seq.pending < 0) {
+            continue;
+        }
+        const int32_t i = batch_.n_tokens++;
+        batch_.token[i] = seq.pending;
+        batch_.pos[i] = seq.n_past;
+        batch_.seq_id[i][0] = seq.seq_id;
+        batch_.n_seq_id[i] = 1;
+        batch_.logits[i] = true;
+        seq.batch_index = i;
+        batch_requests_.push_back(seq.request.get());
+        ++decodes;
+    }
+
+    // Fill the rest of the step with prompt chunks, oldest admission first.
+    std::vector<Sequence *> prefilling;
+    for (Sequence &seq : sequences_) {
+        if (seq.request && !seq.paused && seq.prefilled < seq.request->prompt.size()) {
+            prefilling.push_back(&seq);
+        }
+    }
+    std::sort(prefilling.begin(), prefilling.end(),
+              [](const Sequence *a, const Sequence *b) { return a->order < b->order; });
+    int32_t budget = prefill_budget(decodes);
+    int32_t prefill_tokens = 0;
+    for (Sequence *seq : prefilling) {
+        if (budget <= 0) {
+            break;
+        }
+        const std::vector<llama_token> &prompt = seq->request->prompt;
+        const auto take = static_cast<int32_t>(std::min<size_t>(budget, prompt.size() - seq->prefilled));
+        for (int32_t j = 0; j < take; ++j) {
+            const int32_t i = batch_.n_tokens++;
+            const size_t at = seq->prefilled + static_cast<size_t>(j);
+            batch_.token[i] = prompt[at];
+            batch_.pos[i] = seq->n_past + j;
+            batch_.seq_id[i][0] = seq->seq_id;
+            batch_.n_seq_id[i] = 1;
+            batch_.logits[i] = at == prompt.size() - 1 && !seq->request->feed;
+            if (batch_.logits[i]) {
+                seq->batch_index = i;
+            }
+        }
+        seq->chunk = take;
+        if (take > 0) {
+            batch_requests_.push_back(seq->request.get());
+        }
+        budget -= take;
+        prefill_tokens += take;
+    }
+    if (batch_.n_tokens == 0) {
+        return false;
+    }
+
+    use_threads(prefill_tokens > 0);
+    const bool ok = llama_decode(res_.ctx, batch_) == 0;
+    batch_requests_.clear();
+    const double step_ms = elapsed_ms(step_start, Clock::now());
+    adapt_prefill(step_ms, decodes, prefill_tokens);
+    if (ok && prefill_tokens == 0 && !governor_.empty()) {
+        governor_.on_decode_step(step_policy_, step_ms, decodes);
+    }
+    ++window_steps_;
+    window_prefill_tokens_ += prefill_tokens;
+    window_prefill_steps_ += prefill_tokens > 0 ? 1 : 0;
+    window_max_step_ms_ = std::max(window_max_step_ms_, step_ms);
+
+    for (Sequence &seq : sequences_) {
+        if (!seq.request || (seq.batch_index < 0 && seq.chunk == 0)) {
+            continue;
+        }
+        const int32_t index = seq.batch_index;
+        seq.batch_index = -1;
+        if (cancelled(*seq.request)) {
+            // The decode may have been aborted; reap_cancelled() frees it next.
+            seq.chunk = 0;
+            seq.pending = -1;
+            continue;
+        }
+        if (!ok) {
+            seq.chunk = 0;
+            seq.pending = -1;
+            retire(seq, decodes > 0 ? "[error] Failed to decode token." : "[error] Failed to prefill prompt.");
+            continue;
+        }
+        if (seq.chunk > 0) {
+            seq.n_past += seq.chunk;
+            seq.prefilled += static_cast<size_t>(seq.chunk);
+            seq.chunk = 0;
+            ++seq.prefill_steps;
+            if (index < 0) {
+                continue;
+            }
+            const auto now = Clock::now();
+            LOGI("Prefill complete: request=%d seq=%d tokens=%zu steps=%d elapsed=%.2f ms", seq.request->id,
+                 seq.seq_id, seq.prefilled, seq.prefill_steps, elapsed_ms(seq.admitted, now));
+            if (seq.request->incremental) {
+                LOGI("Incremental prompt: request=%d tail=%zu tokens prefilled %.2f ms after the last chunk "
+                     "(ahead=%zu retokenized=%d)", seq.request->id, seq.prefilled - seq.request->prefilled_ahead,
+                     elapsed_ms(seq.request->prompt_closed, now), seq.request->prefilled_ahead,
+                     seq.request->retokenized);
+            }
+            seq.decode_start = now;
+            if (!seq.forks.empty()) {
+                fork(seq, index);
+            }
+            advance(seq, llama_get_logits_ith(res_.ctx, index));
+            continue;
+        }
+        seq.pending = -1;
+        ++seq.n_past;
+        if (!seq.replay) {
+            ++seq.generated;
+            ++window_tokens_;
+        }
+        seq.replay = false;
+        advance(seq, llama_get_logits_ith(res_.ctx, index));
+    }
+    return true;
+}
+
+llama_token Scheduler::choose(Sequence &seq, float *logits) {
+    if (!logits || n_vocab_ <= 0) {
+        return -1;
+    }
+    res_.token_mask->apply(logits, seq.mask_state);
+    for (llama_token tok : seq.bans) {
+        if (tok >= 0 && tok < n_vocab_) {
+            logits[tok] = -INFINITY;
+        }
+    }
+    if (seq.sampler) {
+        return seq.request->params.constrained
+               ? seq.sampler->sample(logits, res_.grammar->allowed(seq.grammar_state))
+               : seq.sampler->sample(logits, n_vocab_);
+    }
+    if (seq.request->params.constrained) {
+        return res_.grammar->argmax(logits, seq.grammar_state);
+    }
+
+    int best = 0;
+    float best_val = logits[0];
+    for (int i = 1; i < n_vocab_; ++i) {
+        if (logits[i] > best_val) {
+            best_val = logits[i];
+            best = i;
+        }
+    }
+    return static_cast<llama_token>(best);
+}
+
+// Samples the sequence's next token from its logits and hands it to the output
+// stage; the token is decoded with the rest of the batch on the next step.
+void Scheduler::advance(Sequence &seq, float *logits) {
+    const GenerationParams &params = seq.request->params;
+    if (seq.generated >= std::max(1, params.max_tokens)) {
+        retire(seq);
+        return;
+    }
+
+    const llama_token next = choose(seq, logits);
+    seq.bans.clear();
+    if (next < 0 && params.constrained) {
+        LOGI("Grammar admits no further tokens after %d tokens", seq.generated);
+        retire(seq);
+        return;
+    }
+    if (next < 0) {
+        retire(seq, "[error] Failed to sample token.");
+        return;
+    }
+    if (next == llama_token_eos(res_.model)) {
+        LOGI("Reached EOS after %d tokens", seq.generated);
+        retire(seq);
+        return;
+    }
+    const auto now = Clock::now();
+    if (!seq.has_first_token) {
+        seq.has_first_token = true;
+        seq.first_token = now;
+    } else {
+        const double gap = elapsed_ms(seq.last_token, now);
+        ++seq.gaps;
+        seq.gap_sum_ms += gap;
+        seq.gap_sq_ms += gap * gap;
+        seq.gap_max_ms = std::max(seq.gap_max_ms, gap);
+    }
+    seq.last_token = now;
+
+    seq.mask_state = res_.token_mask->advance(seq.mask_state, next);
+    if (params.constrained) {
+        seq.grammar_state = res_.grammar->accept(seq.grammar_state, next);
+    }
+    OutputStage &stage = *seq.stage;
+    StagedToken staged;
+    staged.token = next;
+    staged.n_past = seq.n_past + 1;
+    staged.mask_state = seq.mask_state;
+    staged.grammar_state = seq.grammar_state;
+    stage.submit(staged);
+
+    // The previous token must clear the output stage before this one
+    // reaches the model, so a stop costs at most the decode in flight.
+    stage.wait_processed(stage.submitted() - 1);
+    if (stage.verdict() == StageVerdict::kRollback) {
+        stage.wait_idle();
+        const int failed_at = stage.failed_at();
+        const char *failure = stage.stop_reason();
+        const RollbackResult rolled = rollback(seq);
+        if (rolled == RollbackResult::kRolledBack) {
+            LOGI("Rolled back from %d to %d tokens after %s", failed_at, seq.generated, failure);
+            return;
+        }
+        if (rolled == RollbackResult::kFailed) {
+            retire(seq, "[error] Failed to roll back to a checkpoint.");
+            return;
+        }
+        stage.settle();
+    }
+    if (stage.verdict() == StageVerdict::kStop) {
+        retire(seq);
+        return;
+    }
+    seq.pending = next;
+}
+
+// Restores the most recent usable checkpoint: the sequence's KV cells are cut
+// back to the checkpoint token, which is re-decoded with the next batch to
+// regenerate its logits, and the token the abandoned attempt took next is
+// banned for the first resumed step. The stage must be idle.
+Scheduler::RollbackResult Scheduler::rollback(Sequence &seq) {
+    OutputStage &stage = *seq.stage;
+    RecoveryStats &stats = stage.recovery();
+    if (stats.rollbacks >= seq.request->params.max_rollbacks) {
+        return RollbackResult::kUnavailable;
+    }
+    KvCheckpoint *cp = stage.checkpoints().rollback_target(kMaxRetriesPerCheckpoint);
+    if (!cp) {
+        return RollbackResult::kUnavailable;
+    }
+
+    const llama_pos keep = cp->n_past - 1;
+    if (!llama_kv_cache_seq_rm(res_.ctx, seq.seq_id, keep, -1)) {
+        LOGE("Rollback to n_past=%d failed", cp->n_past);
+        return RollbackResult::kFailed;
+    }
+
+    const int discarded = seq.generated + 1 - cp->generated;
+    stats.rollbacks += 1;
+    stats.tokens_discarded += discarded;
+    stats.max_rollback_depth = std::max(stats.max_rollback_depth, discarded);
+    stats.tokens_saved += static_cast<int32_t>(seq.request->prompt.size()) + cp->generated;
+
+    seq.n_past = keep;
+    seq.generated = cp->generated;
+    seq.mask_state = cp->mask_state;
+    seq.grammar_state = cp->grammar_state;
+    seq.pending = cp->last_token;
+    seq.replay = true;
+    stage.resume_from(*cp);
+
+    cp->retries += 1;
+    if (cp->next_token >= 0) {
+        cp->banned.push_back(cp->next_token);
+        cp->next_token = -1;
+    }
+    seq.bans = cp->banned;
+    return RollbackResult::kRolledBack;
+}
+
+void Scheduler::retire(Sequence &seq, const char *error) {
+    // Variants still waiting for this prompt can no longer be forked.
+    for (const llama_seq_id id : seq.forks) {
+        retire(sequences_[static_cast<size_t>(id)], error ? error : "[error] Failed to prefill prompt.");
+    }
+    seq.forks.clear();
+
+    OutputStage &stage = *seq.stage;
+    stage.finish();
+    if (stage.verdict() == StageVerdict::kRollback) {
+        stage.settle();
+    }
+
+    Request &request = *seq.request;
+    const auto now = Clock::now();
+    GenerationResult result;
+    result.recovery = stage.recovery();
+    result.queue_ms = elapsed_ms(request.submitted, seq.admitted);
+    result.first_token_ms = seq.has_first_token ? elapsed_ms(request.submitted, seq.first_token) : 0.0;
+    result.total_ms = elapsed_ms(request.submitted, now);
+
+    if (error) {
+        result.text = error;
+    } else {
+        const int generated = stage.accepted();
+        const double decode_ms = elapsed_ms(seq.decode_start, now);
+        const double tok_per_sec = decode_ms > 0.0 ? generated / (decode_ms / 1000.0) : 0.0;
+        LOGI("Decode timings: request=%d tokens=%d elapsed=%.2f ms (%.2f tok/s)", request.id, generated,
+             decode_ms, tok_per_sec);
+        const OutputStage::Timing timing = stage.timing();
+        if (timing.tokens > 0) {
+            LOGI("Output stage: %.1f us/token overlapped with decode, decode thread waited %.1f us/token",
+                 timing.helper_ms * 1000.0 / (double) timing.tokens,
+                 timing.wait_ms * 1000.0 / (double) timing.tokens);
+        }
+        if (seq.gaps > 0) {
+            const double mean = seq.gap_sum_ms / seq.gaps;
+            const double variance = std::max(0.0, seq.gap_sq_ms / seq.gaps - mean * mean);
+            LOGI("Inter-token latency: request=%d mean=%.2f ms stddev=%.2f ms max=%.2f ms", request.id, mean,
+                 std::sqrt(variance), seq.gap_max_ms);
+        }
+        const RecoveryStats &recovery = result.recovery;
+        if (recovery.rollbacks > 0) {
+            LOGI("Recovery: checkpoints=%d rollbacks=%d max_depth=%d discarded=%d saved_vs_retry=%d",
+                 recovery.checkpoints, recovery.rollbacks, recovery.max_rollback_depth,
+                 recovery.tokens_discarded, recovery.tokens_saved);
+        }
+
+        if (stage.failed()) {
+            LOGI("Stopped generation after %d tokens: %s", stage.failed_at(), stage.stop_reason());
+        } else if (stage.stop_reason()) {
+            LOGI("Stopped generation after %d tokens: %s", generated, stage.stop_reason());
+        }
+        if (stage.failed() && stage.aborted()) {
+            result.text = std::string("[error] Generation stopped early: ") + stage.stop_reason() + ".";
+            result.tokens = stage.failed_at();
+        } else if (stage.output().empty()) {
+            result.text = "[error] Model returned empty response.";
+        } else {
+            if (TextStream *stream = request.params.stream.get()) {
+                stream->finish(stage.output());
+                const TextStream::Stats &ss = stream->stats();
+                LOGI("Streaming: request=%d first_byte=%.1f ms chunks=%d tokens=%d bytes=%zu "
+                     "callback=%.1f us/token", request.id, ss.first_byte_ms, ss.chunks, ss.tokens, ss.bytes,
+                     ss.tokens > 0 ? ss.deliver_ms * 1000.0 / ss.tokens : 0.0);
+                if (stream->wants_checkpoints()) {
+                    LOGI("Render checkpoints: request=%d count=%d first=%.1f ms", request.id, ss.checkpoints,
+                         ss.first_checkpoint_ms);
+                }
+            }
+            result.text = std::move(stage.output());
+            result.tokens = generated;
+        }
+    }
+    LOGI("Request %d finished: queue=%.1f ms first_token=%.1f ms total=%.1f ms tokens=%d", request.id,
+         result.queue_ms, result.first_token_ms, result.total_ms, result.tokens);
+
+    if (request.params.constrained) {
+        --constrained_active_;
+    }
+    if (!seq.swapped) {
+        llama_kv_cache_seq_rm(res_.ctx, seq.seq_id, -1, -1);
+        reserved_cells_ -= seq.reserved;
+        --active_;
+        if (request.params.priority == Priority::kForeground) {
+            --foreground_active_;
+        }
+    }
+    const llama_seq_id seq_id = seq.seq_id;
+    complete(request, std::move(result));
+
+    seq = Sequence();
+    seq.seq_id = seq_id;
+}
+
+void Scheduler::log_window() {
+    const double window_ms = elapsed_ms(window_start_, Clock::now());
+    LOGI("Batch window: requests=%d peak_concurrency=%d steps=%d tokens=%lld elapsed=%.2f ms (%.2f tok/s)",
+         window_requests_, window_peak_, window_steps_, (long long) window_tokens_, window_ms,
+         window_ms > 0.0 ? (double) window_tokens_ / (window_ms / 1000.0) : 0.0);
+    LOGI("Prefill chunking: prompt_tokens=%lld chunk=%d%s max_step=%.2f ms", (long long) window_prefill_tokens_,
+         prefill_fixed_.load() > 0 ? prefill_fixed_.load() : adaptive_chunk_,
+         prefill_fixed_.load() > 0 ? " (fixed)" : "", window_max_step_ms_);
+    LOGI("Thread sets: prefill_steps=%d (%d threads on %s) decode_steps=%d (%d threads on %s) switches=%d",
+         window_prefill_steps_, res_.prefill_threads.threads, cpu_list(res_.prefill_threads).c_str(),
+         window_steps_ - window_prefill_steps_, res_.decode_threads.threads,
+         cpu_list(res_.decode_threads).c_str(), window_thread_switches_);
+    if (!governor_.empty()) {
+        const ThreadSet &current = res_.decode_ladder[governor_.level()];
+        LOGI("Governor: decode now %d threads on %s, changes=%d", current.threads, cpu_list(current).c_str(),
+             governor_.changes() - window_governor_base_);
+        window_governor_base_ = governor_.changes();
+    }
+    if (window_constrained_ && res_.grammar->stats().steps > 0) {
+        const GrammarMask::Stats &gs = res_.grammar->stats();
+        const double grammar_us = gs.mask_ms * 1000.0 / (double) gs.steps;
+        const double step_us = window_steps_ ? window_ms * 1000.0 / window_steps_ : 0.0;
+        LOGI("Grammar overhead: %.1f us/token vs %.1f us/step (%.1f%%) hits=%zu misses=%zu sets=%zu",
+             grammar_us, step_us, step_us > 0.0 ? 100.0 * grammar_us / step_us : 0.0,
+             gs.mask_hits, gs.mask_misses, gs.interned_sets);
+    }
+    window_requests_ = 0;
+    window_tokens_ = 0;
+    window_steps_ = 0;
+    window_peak_ = 0;
+    window_prefill_tokens_ = 0;
+    window_max_step_ms_ = 0.0;
+    window_constrained_ = false;
+    window_prefill_steps_ = 0;
+    window_thread_switches_ = 0;
+}
+
+}  // namespace genui
@@ -0,0 +1,383 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cpu_topology.h"
+#include "governor.h"
+#include "grammar_mask.h"
+#include "html_validator.h"
+#include "kv_checkpoints.h"
+#include "llama.h"
+#include "mpsc_queue.h"
+#include "output_stage.h"
+#include "sampler.h"
+#include "text_stream.h"
+#include "token_mask.h"
+#include "vocab_pieces.h"
+
+namespace genui {
+
+enum class Priority : int32_t {
+    kForeground = 0,  // the preview the user is looking at
+    kBackground = 1,  // speculative pre-generation; never slows foreground work
+};
+
+// Per-request settings, snapshotted from the bridge's globals at submit time.
+struct GenerationParams {
+    Priority priority = Priority::kForeground;
+    int32_t max_tokens = 512;
+    bool constrained = false;  // decode under the HTML grammar
+    ValidationPolicy policy = ValidationPolicy::kTruncate;
+    int32_t max_rollbacks = 3;
+    SamplingParams sampling;
+    std::shared_ptr<TextStream> stream;  // receives the output as it grows; null when not streaming
+};
+
+struct GenerationResult {
+    std::string text;  // the generated document, or an "[error] ..." message
+    int32_t tokens = 0;
+    RecoveryStats recovery;
+    double queue_ms = 0.0;
+    double first_token_ms = 0.0;  // from submit
+    double total_ms = 0.0;        // from submit
+};
+
+// Continuous-batching decode loop. A single long-lived worker thread owns the
+// llama context; submitters hand it requests through a lock-free queue and
+// are completed through a callback or a future, so no caller thread is held
+// for the length of a generation and stats() never waits on decoding.
+// Each admitted request gets its own seq_id, and every step feeds one
+// llama_batch holding the next token of every active sequence, so concurrent
+// callers share decode steps instead of queueing for a whole generation.
+// Sequences are admitted and retired independently, as long as the KV cells
+// they may need (prompt + max_tokens) fit the shared cache.
+//
+// Prompts are prefilled in chunks that ride along with the decode tokens, so
+// admitting a long prompt does not stall running streams for its whole
+// prefill: each step carries at most K prompt tokens. K is either fixed or
+// adapted so the step time stays near a target.
+//
+// Background requests only run while no foreground work is running or
+// waiting. A foreground arrival pauses them, and when it needs their slot or
+// KV cells, their sequence state is copied out with llama_state_seq_get_data
+// and restored later with llama_state_seq_set_data, so nothing is recomputed.
+//
+// A submit() whose prompt and parameters match a request that is still queued
+// or running does not start a generation of its own: it is attached to that
+// request and receives the same result when it finishes.
+//
+// A prompt may also be opened before it is complete (open_prompt()) and fed
+// as it arrives: the worker prefills what is known while the rest is still
+// being written, so closing it leaves only the tail to prefill.
+//
+// Callers may tag a submit with a handle and cancel() it later. The caller's
+// future resolves at once; the generation itself stops at the next step once
+// nobody else waits on it, and a decode whose batch only serves cancelled
+// requests is aborted mid-graph through llama_set_abort_callback.
+class Scheduler {
+public:
+    struct Stats {
+        int32_t queued_foreground = 0;
+        int32_t queued_background = 0;
+        int32_t running = 0;
+        int32_t paused = 0;
+        int32_t swapped = 0;
+        int32_t preemptions = 0;  // background sequences paused by foreground work
+        int32_t swap_outs = 0;    // of those, how many had their KV copied out
+        int32_t coalesced = 0;    // duplicate submits served by an in-flight request
+        int32_t cancelled = 0;    // generations stopped by cancel()
+    };
+
+    static constexpr int32_t kMaxSequences = 8;
+    static constexpr int32_t kMinPrefillChunk = 16;
+    static constexpr double kDefaultTargetStepMs = 60.0;
+
+    // ggml's compute threads start from the worker thread (or take on its
+    // mask in the patched compute pool), so pinning the worker places all of
+    // them.
+    using ThreadSet = genui::ThreadSet;
+
+    struct Resources {
+        llama_context *ctx = nullptr;
+        const llama_model *model = nullptr;
+        const VocabPieces *pieces = nullptr;
+        TokenMask *token_mask = nullptr;
+        GrammarMask *grammar = nullptr;
+        int32_t batch_size = 128;
+        ThreadSet prefill_threads;  // steps that carry prompt tokens
+        ThreadSet decode_threads;   // steps that only carry sampled tokens
+        // Narrower decode sets for the governor, widest (decode_threads)
+        // first; empty keeps decode_threads fixed.
+        std::vector<ThreadSet> decode_ladder;
+    };
+
+    // Runs exactly once per submit: on the worker thread, or on the calling
+    // thread when the request is rejected up front or cancelled.
+    using Completion = std::function<void(const GenerationResult &)>;
+
+    explicit Scheduler(const Resources &resources);
+    ~Scheduler();
+
+    Scheduler(const Scheduler &) = delete;
+    Scheduler &operator=(const Scheduler &) = delete;
+
+    void start();
+    // Fails queued and in-flight requests and joins the decode thread.
+    void stop();
+
+    // `handle` (non-zero) identifies the call for cancel(); variants share one.
+    std::future<GenerationResult> submit(std::vector<llama_token> prompt, const GenerationParams &params,
+                                         int64_t handle = 0);
+    void submit_async(std::vector<llama_token> prompt, const GenerationParams &params, int64_t handle,
+                      Completion done);
+    // N generations of one prompt: the prompt is prefilled once and its KV
+    // cells are shared with N-1 forked sequences (llama_kv_cache_seq_cp),
+    // each with its own sampler stream and stop conditions.
+    std::vector<std::future<GenerationResult>> submit_variants(std::vector<llama_token> prompt, int32_t n,
+                                                               const GenerationParams &params,
+                                                               int64_t handle = 0);
+    // Resolves every future submitted under `handle` with a cancellation
+    // error. Returns false when nothing was waiting under it; the handle is
+    // then remembered for a moment in case its submit is still on the way.
+    bool cancel(int64_t handle);
+
+    // Starts a request whose prompt is still arriving; `prompt` is the part
+    // known so far and `handle` (non-zero) names it for feed_prompt() and
+    // cancel(). `done` runs once the generation finishes, as for submit_async().
+    void open_prompt(std::vector<llama_token> prompt, const GenerationParams &params, int64_t handle,
+                     Completion done);
+    // Replaces the open prompt with a longer tokenization of it. Tokens may
+    // differ from what was fed before near the end (a BPE merge across the
+    // boundary); cells prefilled from the first changed token on are trimmed.
+    // `last` closes the prompt and lets the generation start; a positive
+    // `max_tokens` then replaces the budget given to open_prompt(), once the
+    // final prompt length is known. Returns false when nothing is open under
+    // `handle`.
+    bool feed_prompt(int64_t handle, std::vector<llama_token> prompt, bool last, int32_t max_tokens = 0);
+    // Closes the open prompt and fails its request as longer than the
+    // context window. Returns false when nothing is open under `handle`.
+    bool reject_prompt(int64_t handle);
+
+    // `chunk_tokens` > 0 fixes K; 0 adapts it towards `target_step_ms`.
+    void set_prefill_chunking(int32_t chunk_tokens, double target_step_ms);
+
+    // Power policies for steps while a foreground request is resident and for
+    // background-only steps. kPowerSaver also runs prompt chunks on the
+    // narrow decode set.
+    void set_power_policy(PowerPolicy foreground, PowerPolicy background);
+
+    Stats stats();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Tokens handed over by feed_prompt(); guarded by mutex_.
+    struct PromptFeed {
+        std::vector<llama_token> tokens;
+        int32_t max_tokens = 0;
+        uint64_t version = 0;
+        bool closed = false;
+        bool too_long = false;  // the prompt outgrew the context; fail the request
+    };
+
+    struct Follower {
+        int64_t handle = 0;
+        Completion done;
+    };
+
+    struct Request {
+        int32_t id = 0;
+        std::vector<llama_token> prompt;
+        GenerationParams params;
+        Completion done;
+        Clock::time_point submitted;
+        std::vector<std::unique_ptr<Request>> forks;  // variants sharing this prompt
+        uint64_t key = 0;  // single-flight key; 0 for requests that are never shared
+        int64_t handle = 0;
+        // Guarded by mutex_: whether the submitter still waits on `done`,
+        // and the duplicates waiting on this result.
+        bool owner_waiting = true;
+        std::vector<Follower> followers;
+        std::atomic<bool> cancelled{false};  // nobody waits any more; stop generating
+        Clock::time_point cancel_requested;
+
+        // Decode-thread view of an open prompt; `feed` is dropped once closed.
+        std::shared_ptr<PromptFeed> feed;
+        uint64_t feed_version = 0;
+        bool incremental = false;
+        Clock::time_point prompt_closed;
+        size_t prefilled_ahead = 0;  // prompt tokens already in the KV cache when it closed
+        int32_t retokenized = 0;     // prefilled cells trimmed because their tokens changed
+    };
+
+    struct Sequence {
+        std::unique_ptr<Request> request;  // null while the slot is free
+        llama_seq_id seq_id = 0;
+        int32_t reserved = 0;  // KV cells held against the budget
+        bool paused = false;
+        bool swapped = false;
+        std::vector<uint8_t> kv_image;  // sequence state while swapped out
+        std::vector<llama_seq_id> forks;  // slots waiting for this prompt's prefill
+        bool awaiting_fork = false;
+
+        uint64_t order = 0;    // admission order, for prefill fairness
+        size_t prefilled = 0;  // prompt tokens already in the KV cache
+        int32_t chunk = 0;     // prompt tokens in the current batch
+
+        llama_pos n_past = 0;
+        int32_t generated = 0;
+        int32_t mask_state = 0;
+        GrammarState grammar_state;
+        std::unique_ptr<OutputStage> stage;
+        std::unique_ptr<TokenSampler> sampler;  // null for greedy decoding
+        std::vector<llama_token> bans;
+
+        llama_token pending = -1;  // fed to the next batch at n_past
+        bool replay = false;       // pending is a checkpoint token being re-decoded
+        int32_t batch_index = -1;
+
+        Clock::time_point admitted;
+        Clock::time_point decode_start;
+        Clock::time_point first_token;
+        bool has_first_token = false;
+        int32_t prefill_steps = 0;
+
+        // Inter-token gaps, for the jitter report.
+        Clock::time_point last_token;
+        int32_t gaps = 0;
+        double gap_sum_ms = 0.0;
+        double gap_sq_ms = 0.0;
+        double gap_max_ms = 0.0;
+    };
+
+    enum class RollbackResult {
+        kUnavailable,
+        kRolledBack,
+        kFailed,
+    };
+
+    static int32_t cells_needed(const Request &request);
+    static uint64_t request_key(const std::vector<llama_token> &prompt, const GenerationParams &params);
+    static bool abort_decode(void *data);
+    bool cancelled(const Request &request) const;
+    void reap_cancelled();
+    void complete(Request &request, GenerationResult result);
+    void fail_request(Request &request, const char *message);
+
+    void submit_request(std::vector<llama_token> prompt, const GenerationParams &params, int64_t handle,
+                        Completion done, std::shared_ptr<PromptFeed> feed);
+    void enqueue(std::unique_ptr<Request> request);
+    void sync_prompts();
+    bool apply_prompt(Request &request, Sequence *seq, std::vector<llama_token> tokens, bool closed);
+    void use_threads(bool prefill);
+    void run();
+    bool busy() const;
+    void schedule();
+    bool fits(int32_t cells, int32_t slots = 1) const {
+        return active_ + slots <= kMaxSequences && reserved_cells_ + cells <= n_ctx_;
+    }
+    static int32_t slots_needed(const Request &request) { return 1 + static_cast<int32_t>(request.forks.size()); }
+    Sequence *free_slot();
+    bool swap_out_background();
+    bool swap_in(Sequence &swapped);
+    void begin(std::unique_ptr<Request> request);
+    Sequence &start_sequence(std::unique_ptr<Request> request, int32_t reserved, uint32_t stream);
+    void fork(Sequence &parent, int32_t logits_index);
+    int32_t prefill_budget(int32_t decodes) const;
+    void adapt_prefill(double step_ms, int32_t decodes, int32_t prefill_tokens);
+    bool step();
+    void advance(Sequence &seq, float *logits);
+    RollbackResult rollback(Sequence &seq);
+    void retire(Sequence &seq, const char *error = nullptr);
+    llama_token choose(Sequence &seq, float *logits);
+    void log_window();
+
+    Resources res_;
+    int32_t n_ctx_ = 0;
+    int32_t n_vocab_ = 0;
+    llama_batch batch_{};
+    std::vector<const Request *> batch_requests_;  // read by abort_decode during llama_decode
+    std::atomic<bool> abort_all_{false};
+
+    // Submits arrive here; the worker drains them into the waiting queues.
+    MpscQueue<Request *> incoming_;
+    std::atomic<int32_t> incoming_foreground_{0};
+    std::atomic<int32_t> incoming_background_{0};
+    std::atomic<bool> idle_{false};  // the worker is (about to be) parked on cv_
+    std::atomic<int32_t> pending_submits_{0};  // submits past the stopping_ check, not yet pushed
+    // Bumped (under mutex_) by feed_prompt() and cancel(), so a worker that
+    // stalled on an open prompt knows when to look again.
+    std::atomic<uint64_t> nudges_{0};
+    std::atomic<uint64_t> feed_updates_{0};
+    uint64_t feeds_synced_ = 0;
+
+    // Guards the single-flight and handle registry and the idle wait; never
+    // held while decoding.
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::unordered_map<uint64_t, Request *> in_flight_;  // by key, until completion
+    std::unordered_multimap<int64_t, Request *> handles_;  // submit handle -> requests it waits on
+    std::deque<int64_t> early_cancels_;                    // cancelled before their submit arrived
+    std::unordered_map<int64_t, std::shared_ptr<PromptFeed>> feeds_;  // open prompts by handle
+    bool stopping_ = false;
+    int32_t next_request_id_ = 1;
+    std::thread thread_;
+
+    // Decode-thread state; slot i decodes as seq_id i.
+    std::vector<Sequence> sequences_;
+    std::deque<std::unique_ptr<Request>> waiting_foreground_;
+    std::deque<std::unique_ptr<Request>> waiting_background_;
+    std::deque<Sequence> swapped_;
+    int32_t reserved_cells_ = 0;
+    int32_t active_ = 0;  // resident sequences, paused ones included
+    int32_t foreground_active_ = 0;
+    int32_t constrained_active_ = 0;
+    uint64_t next_order_ = 0;
+
+    std::atomic<int32_t> prefill_fixed_{0};
+    std::atomic<double> target_step_ms_{kDefaultTargetStepMs};
+    int32_t adaptive_chunk_ = 64;
+    std::atomic<PowerPolicy> foreground_policy_{PowerPolicy::kBalanced};
+    std::atomic<PowerPolicy> background_policy_{PowerPolicy::kPowerSaver};
+    Governor governor_;
+    PowerPolicy step_policy_ = PowerPolicy::kBalanced;  // of the step being decoded
+    const ThreadSet *applied_threads_ = nullptr;        // nullptr before the first step
+
+    // Published by the decode thread for stats().
+    std::atomic<int32_t> waiting_fg_count_{0};
+    std::atomic<int32_t> waiting_bg_count_{0};
+    std::atomic<int32_t> running_count_{0};
+    std::atomic<int32_t> paused_count_{0};
+    std::atomic<int32_t> swapped_count_{0};
+    std::atomic<int32_t> preemptions_{0};
+    std::atomic<int32_t> swap_outs_{0};
+    std::atomic<int32_t> coalesced_{0};
+    std::atomic<int32_t> cancelled_{0};
+
+    // Aggregate numbers for the current busy window (first admit to idle).
+    Clock::time_point window_start_;
+    int32_t window_requests_ = 0;
+    int64_t window_tokens_ = 0;
+    int32_t window_steps_ = 0;
+    int32_t window_peak_ = 0;
+    int64_t window_prefill_tokens_ = 0;
+    double window_max_step_ms_ = 0.0;
+    bool window_constrained_ = false;
+    int32_t window_prefill_steps_ = 0;
+    int32_t window_thread_switches_ = 0;
+    int32_t window_governor_base_ = 0;  // governor_.changes() when the window opened
+};
+
+}  // namespace genui
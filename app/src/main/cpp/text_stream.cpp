@@ -0,0 +1,109 @@
+﻿#include "text_stream.h"
+
+#include <algorithm>
+
+namespace genui {
+
+namespace {
+
+static double elapsed_ms(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) {
+    return std::chrono::duration<double, std::milli>(to - from).count();
+}
+
+static size_t utf8_sequence_length(unsigned char lead) {
+    if (lead < 0x80) {
+        return 1;
+    }
+    if ((lead >> 5) == 0x6) {
+        return 2;
+    }
+    if ((lead >> 4) == 0xE) {
+        return 3;
+    }
+    if ((lead >> 3) == 0x1E) {
+        return 4;
+    }
+    return 1;  // stray continuation or invalid byte; pass it through
+}
+
+}  // namespace
+
+size_t utf8_safe_end(const char *data, size_t begin, size_t end) {
+    // Only the last three bytes can belong to an unfinished sequence.
+    for (size_t i = end; i > begin && end - i < 4; --i) {
+        const auto byte = static_cast<unsigned char>(data[i - 1]);
+        if ((byte & 0xC0) == 0x80) {
+            continue;
+        }
+        return end - (i - 1) >= utf8_sequence_length(byte) ? end : i - 1;
+    }
+    return end;
+}
+
+TextStream::TextStream(const Options &options, Deliver deliver, Checkpoint checkpoint)
+        : options_(options),
+          deliver_(std::move(deliver)),
+          checkpoint_(std::move(checkpoint)),
+          created_(Clock::now()),
+          last_flush_(created_) {}
+
+void TextStream::update(const std::string &output) {
+    ++stats_.tokens;
+    ++pending_tokens_;
+    if (pending_tokens_ >= options_.max_tokens || elapsed_ms(last_flush_, Clock::now()) >= options_.max_delay_ms) {
+        flush(output, false);
+    }
+}
+
+void TextStream::rewind(size_t length) {
+    if (length < sent_) {
+        sent_ = length;
+        rewound_ = true;
+    }
+}
+
+void TextStream::finish(const std::string &output) {
+    rewind(output.size());
+    flush(output, true);
+}
+
+void TextStream::checkpoint(const std::string &document) {
+    // Closing a wrapper right after its last item yields the same document.
+    if (!checkpoint_ || document == last_checkpoint_) {
+        return;
+    }
+    last_checkpoint_ = document;
+    const auto start = Clock::now();
+    checkpoint_(document);
+    const auto done = Clock::now();
+
+    if (stats_.first_checkpoint_ms < 0.0) {
+        stats_.first_checkpoint_ms = elapsed_ms(created_, start);
+    }
+    stats_.deliver_ms += elapsed_ms(start, done);
+    ++stats_.checkpoints;
+}
+
+void TextStream::flush(const std::string &output, bool final) {
+    const size_t begin = std::min(sent_, output.size());
+    const size_t end = final ? output.size() : utf8_safe_end(output.data(), begin, output.size());
+    if (end == begin && !rewound_) {
+        return;
+    }
+    const auto start = Clock::now();
+    deliver_(begin, output.data() + begin, end - begin);
+    const auto done = Clock::now();
+
+    if (stats_.first_byte_ms < 0.0 && end > begin) {
+        stats_.first_byte_ms = elapsed_ms(created_, start);
+    }
+    stats_.deliver_ms += elapsed_ms(start, done);
+    stats_.bytes += end - begin;
+    ++stats_.chunks;
+    sent_ = end;
+    rewound_ = false;
+    pending_tokens_ = 0;
+    last_flush_ = done;
+}
+
+}  // namespace genui
@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace genui {
+
+// Returns the largest end <= `end` (and >= `begin`) that does not cut a
+// multi-byte UTF-8 sequence in half.
+size_t utf8_safe_end(const char *data, size_t begin, size_t end);
+
+// Streams a growing document to a consumer in batched chunks. The output
+// stage reports every accepted token; a chunk is emitted once `max_tokens`
+// tokens or `max_delay_ms` have accumulated, and never ends inside a UTF-8
+// sequence. Each chunk carries the byte offset it starts at: after a rollback
+// or a truncation the next chunk starts below what was already delivered, and
+// the consumer drops everything from that offset on.
+//
+// Optionally the stream also carries render checkpoints: whole documents,
+// auto-closed at a point where the markup is structurally sound, that a
+// consumer can display while the generation is still running.
+//
+// Calls arrive from one thread at a time (the stage's helper thread, or the
+// decode thread while the stage is idle).
+class TextStream {
+public:
+    struct Options {
+        int32_t max_tokens = 8;
+        double max_delay_ms = 50.0;
+    };
+
+    struct Stats {
+        double first_byte_ms = -1.0;  // from construction; -1 before any byte
+        int32_t tokens = 0;
+        int32_t chunks = 0;
+        size_t bytes = 0;
+        double deliver_ms = 0.0;  // spent inside the consumer callbacks
+        int32_t checkpoints = 0;
+        double first_checkpoint_ms = -1.0;  // from construction; -1 before any checkpoint
+    };
+
+    using Deliver = std::function<void(size_t offset, const char *data, size_t size)>;
+    using Checkpoint = std::function<void(const std::string &document)>;
+
+    TextStream(const Options &options, Deliver deliver, Checkpoint checkpoint = nullptr);
+
+    bool wants_checkpoints() const { return static_cast<bool>(checkpoint_); }
+
+    // `output` is the whole document after one more accepted token.
+    void update(const std::string &output);
+    // The document was cut back to `length` bytes.
+    void rewind(size_t length);
+    // Delivers whatever is left of the final document.
+    void finish(const std::string &output);
+    // `document` is the output so far, cut to a safe point and auto-closed;
+    // a repeat of the previous checkpoint is dropped.
+    void checkpoint(const std::string &document);
+
+    const Stats &stats() const { return stats_; }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void flush(const std::string &output, bool final);
+
+    Options options_;
+    Deliver deliver_;
+    Checkpoint checkpoint_;
+    Clock::time_point created_;
+    Clock::time_point last_flush_;
+    size_t sent_ = 0;  // bytes the consumer holds
+    bool rewound_ = false;
+    std::string last_checkpoint_;
+    int32_t pending_tokens_ = 0;
+    Stats stats_;
+};
+
+}  // namespace genui
@@ -0,0 +1,232 @@
+﻿#include "token_mask.h"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+
+namespace genui {
+
+namespace {
+
+static unsigned char fold_ascii(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+}
+
+}  // namespace
+
+void apply_token_bits(float *logits, const uint64_t *bits, int32_t n_vocab) {
+    if (!logits || !bits || n_vocab <= 0) {
+        return;
+    }
+    const int32_t n_words = (n_vocab + 63) / 64;
+    for (int32_t w = 0; w < n_words; ++w) {
+        uint64_t word = bits[w];
+        while (word) {
+            const int32_t tok = w * 64 + __builtin_ctzll(word);
+            if (tok < n_vocab) {
+                logits[tok] = -INFINITY;
+            }
+            word &= word - 1;
+        }
+    }
+}
+
+const std::vector<std::string> &TokenMask::default_rules() {
+    // External references the system prompt forbids. Plain "http" is left out
+    // on purpose so inline SVG namespaces and http-equiv still go through.
+    static const std::vector<std::string> rules = {
+            "src=\"http", "src='http", "src=\"//", "src='//",
+            "href=\"http", "href='http", "href=\"//", "href='//",
+            "url(http", "url(\"http", "url('http", "url(//",
+            "@import", "<link", "<script src", "fonts.googleapis", "//cdn",
+    };
+    return rules;
+}
+
+bool PatternAutomaton::build(const std::vector<std::string> &rules) {
+    clear();
+
+    std::vector<std::string> folded;
+    folded.reserve(rules.size());
+    for (const std::string &rule : rules) {
+        if (rule.empty()) {
+            continue;
+        }
+        std::string lower(rule);
+        for (char &c : lower) {
+            c = static_cast<char>(fold_ascii(static_cast<unsigned char>(c)));
+        }
+        folded.push_back(std::move(lower));
+    }
+    std::sort(folded.begin(), folded.end());
+    folded.erase(std::unique(folded.begin(), folded.end()), folded.end());
+    if (folded.empty()) {
+        return false;
+    }
+
+    // Trie over the folded rules.
+    next_.assign(256, -1);
+    depth_.assign(1, 0);
+    terminal_.assign(1, 0);
+    for (const std::string &rule : folded) {
+        int32_t state = 0;
+        for (char ch : rule) {
+            const auto c = static_cast<unsigned char>(ch);
+            int32_t &slot = next_[static_cast<size_t>(state) * 256 + c];
+            if (slot < 0) {
+                slot = static_cast<int32_t>(depth_.size());
+                depth_.push_back(depth_[state] + 1);
+                terminal_.push_back(0);
+                next_.resize(next_.size() + 256, -1);
+            }
+            state = next_[static_cast<size_t>(state) * 256 + c];
+        }
+        terminal_[state] = 1;
+    }
+
+    // Breadth-first failure links, completing the goto function into a DFA.
+    const size_t n_states = depth_.size();
+    std::vector<int32_t> fail(n_states, 0);
+    std::deque<int32_t> queue;
+    for (int c = 0; c < 256; ++c) {
+        int32_t &slot = next_[c];
+        if (slot < 0) {
+            slot = 0;
+        } else {
+            queue.push_back(slot);
+        }
+    }
+    while (!queue.empty()) {
+        const int32_t state = queue.front();
+        queue.pop_front();
+        terminal_[state] |= terminal_[fail[state]];
+        for (int c = 0; c < 256; ++c) {
+            int32_t &slot = next_[static_cast<size_t>(state) * 256 + c];
+            const int32_t via_fail = next_[static_cast<size_t>(fail[state]) * 256 + c];
+            if (slot < 0) {
+                slot = via_fail;
+            } else {
+                fail[slot] = via_fail;
+                queue.push_back(slot);
+            }
+        }
+    }
+    for (size_t state = 0; state < n_states; ++state) {
+        int32_t *row = next_.data() + state * 256;
+        for (int c = 'A'; c <= 'Z'; ++c) {
+            row[c] = row[c + ('a' - 'A')];
+        }
+    }
+    rule_count_ = folded.size();
+    return true;
+}
+
+void PatternAutomaton::clear() {
+    rule_count_ = 0;
+    next_.clear();
+    depth_.clear();
+    terminal_.clear();
+}
+
+bool TokenMask::build(const VocabPieces &pieces, const std::vector<std::string> &rules) {
+    clear();
+    if (pieces.empty() || !automaton_.build(rules)) {
+        return false;
+    }
+
+    pieces_ = &pieces;
+    n_vocab_ = pieces.size();
+
+    root_hits_.assign(static_cast<size_t>(n_vocab_), 0);
+    for (llama_token tok = 0; tok < n_vocab_; ++tok) {
+        const char *text = pieces.data(tok);
+        const size_t len = pieces.length(tok);
+        int32_t state = 0;
+        for (size_t i = 0; i < len; ++i) {
+            state = automaton_.step(state, static_cast<unsigned char>(text[i]));
+            if (automaton_.terminal(state)) {
+                root_hits_[tok] = 1;
+                ++root_banned_;
+                break;
+            }
+        }
+    }
+
+    state_masks_.assign(automaton_.state_count(), TokenBits());
+    state_ready_.assign(automaton_.state_count(), 0);
+    build_state_mask(0);
+    return true;
+}
+
+void TokenMask::clear() {
+    pieces_ = nullptr;
+    n_vocab_ = 0;
+    root_banned_ = 0;
+    automaton_.clear();
+    root_hits_.clear();
+    state_masks_.clear();
+    state_ready_.clear();
+}
+
+int32_t TokenMask::advance(int32_t state, llama_token tok) const {
+    if (empty() || tok < 0 || tok >= n_vocab_) {
+        return state;
+    }
+    return advance(state, pieces_->data(tok), pieces_->length(tok));
+}
+
+int32_t TokenMask::advance(int32_t state, const char *text, size_t len) const {
+    if (empty()) {
+        return state;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        state = automaton_.step(state, static_cast<unsigned char>(text[i]));
+    }
+    return state;
+}
+
+bool TokenMask::completes_rule(int32_t state, llama_token tok) const {
+    const char *text = pieces_->data(tok);
+    const size_t len = pieces_->length(tok);
+    for (size_t i = 0; i < len; ++i) {
+        state = automaton_.step(state, static_cast<unsigned char>(text[i]));
+        if (automaton_.terminal(state)) {
+            return true;
+        }
+        // Once the automaton only remembers characters of this piece it is in
+        // the same state a walk from the root would reach, so the precomputed
+        // root answer covers the rest of the piece.
+        if (automaton_.depth(state) <= static_cast<int32_t>(i + 1)) {
+            return root_hits_[tok] != 0;
+        }
+    }
+    return false;
+}
+
+void TokenMask::build_state_mask(int32_t state) {
+    TokenBits &bits = state_masks_[state];
+    bits.assign(static_cast<size_t>((n_vocab_ + 63) / 64), 0);
+    for (llama_token tok = 0; tok < n_vocab_; ++tok) {
+        const bool banned = state == 0 ? root_hits_[tok] != 0 : (root_hits_[tok] != 0 || completes_rule(state, tok));
+        if (banned) {
+            set_token_bit(bits, tok);
+        }
+    }
+    state_ready_[state] = 1;
+}
+
+const TokenBits &TokenMask::mask_for(int32_t state) {
+    if (!state_ready_[state]) {
+        build_state_mask(state);
+    }
+    return state_masks_[state];
+}
+
+void TokenMask::apply(float *logits, int32_t state) {
+    if (empty()) {
+        return;
+    }
+    apply_token_bits(logits, mask_for(state).data(), n_vocab_);
+}
+
+}  // namespace genui
@@ -0,0 +1,97 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+#include "vocab_pieces.h"
+
+namespace genui {
+
+// Words of a per-token bitmask; bit (tok % 64) of word (tok / 64) is set for
+// every token the mask forbids.
+using TokenBits = std::vector<uint64_t>;
+
+inline bool token_bit(const TokenBits &bits, llama_token tok) {
+    return (bits[static_cast<size_t>(tok) >> 6] >> (tok & 63)) & 1u;
+}
+
+inline void set_token_bit(TokenBits &bits, llama_token tok) {
+    bits[static_cast<size_t>(tok) >> 6] |= uint64_t{1} << (tok & 63);
+}
+
+// Sets every logit whose bit is set in `bits` to -inf. Whole zero words are
+// skipped, so the cost is one pass over n_vocab / 64 words plus the banned set.
+void apply_token_bits(float *logits, const uint64_t *bits, int32_t n_vocab);
+
+// ASCII case-insensitive Aho-Corasick automaton over a set of banned strings,
+// completed into a byte-indexed DFA. State 0 is the root.
+class PatternAutomaton {
+public:
+    bool build(const std::vector<std::string> &rules);
+    void clear();
+
+    bool empty() const { return depth_.empty(); }
+    size_t rule_count() const { return rule_count_; }
+    size_t state_count() const { return depth_.size(); }
+
+    int32_t step(int32_t state, unsigned char c) const {
+        return next_[static_cast<size_t>(state) * 256 + c];
+    }
+    // True when the text that led to `state` ends with one of the rules.
+    bool terminal(int32_t state) const { return terminal_[state] != 0; }
+    // Length of the longest rule prefix the state remembers.
+    int32_t depth(int32_t state) const { return depth_[state]; }
+
+private:
+    size_t rule_count_ = 0;
+    std::vector<int32_t> next_;
+    std::vector<int32_t> depth_;
+    std::vector<uint8_t> terminal_;
+};
+
+// Banned-substring filter over the vocabulary. Rules are compiled once per
+// model into a PatternAutomaton; the decode loop keeps the automaton state of
+// the text produced so far and masks every token whose piece would complete a
+// banned string from that state. Masks are built per automaton state on first
+// use and reused for the lifetime of the model.
+// Not thread-safe: masks are materialised lazily from the decode thread.
+class TokenMask {
+public:
+    static const std::vector<std::string> &default_rules();
+
+    bool build(const VocabPieces &pieces, const std::vector<std::string> &rules);
+    void clear();
+
+    bool empty() const { return n_vocab_ == 0; }
+    int32_t root() const { return 0; }
+    size_t rule_count() const { return automaton_.rule_count(); }
+    size_t state_count() const { return automaton_.state_count(); }
+    size_t root_banned() const { return root_banned_; }
+    const PatternAutomaton &automaton() const { return automaton_; }
+
+    // Automaton state after feeding the piece of `tok` from `state`.
+    int32_t advance(int32_t state, llama_token tok) const;
+    // Automaton state after feeding raw text from `state`.
+    int32_t advance(int32_t state, const char *text, size_t len) const;
+    // True when feeding the piece of `tok` from `state` completes a rule.
+    bool completes_rule(int32_t state, llama_token tok) const;
+
+    const TokenBits &mask_for(int32_t state);
+    void apply(float *logits, int32_t state);
+
+private:
+    void build_state_mask(int32_t state);
+
+    const VocabPieces *pieces_ = nullptr;
+    int32_t n_vocab_ = 0;
+    size_t root_banned_ = 0;
+    PatternAutomaton automaton_;
+
+    std::vector<uint8_t> root_hits_;
+    std::vector<TokenBits> state_masks_;
+    std::vector<uint8_t> state_ready_;
+};
+
+}  // namespace genui
@@ -0,0 +1,85 @@
+﻿#include "vocab_pieces.h"
+
+#include <cstring>
+
+namespace genui {
+
+namespace {
+
+static const char *const kTurnMarkers[] = {
+        "<|im_end|>", "<|im_start|>", "<|assistant|>", "<|user|>", "<|system|>",
+};
+
+static bool is_turn_marker_text(const char *text, int32_t len) {
+    for (const char *marker : kTurnMarkers) {
+        if (static_cast<size_t>(len) == std::strlen(marker) && std::memcmp(text, marker, static_cast<size_t>(len)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static int32_t piece_into(const llama_model *model, llama_token tok, bool special, std::string &scratch) {
+    int32_t n = llama_token_to_piece(model, tok, scratch.data(), static_cast<int32_t>(scratch.size()), special);
+    if (n < 0) {
+        scratch.resize(static_cast<size_t>(-n));
+        n = llama_token_to_piece(model, tok, scratch.data(), static_cast<int32_t>(scratch.size()), special);
+    }
+    return n;
+}
+
+}  // namespace
+
+bool VocabPieces::build(const llama_model *model) {
+    clear();
+    if (!model) {
+        return false;
+    }
+    const int32_t n_vocab = llama_n_vocab(model);
+    if (n_vocab <= 0) {
+        return false;
+    }
+
+    text_.reserve(static_cast<size_t>(n_vocab) * 6);
+    offsets_.reserve(static_cast<size_t>(n_vocab) + 1);
+    flags_.assign(static_cast<size_t>(n_vocab), 0);
+
+    std::string scratch(256, '\0');
+    offsets_.push_back(0);
+    for (llama_token tok = 0; tok < n_vocab; ++tok) {
+        const int32_t n = piece_into(model, tok, /*special*/ false, scratch);
+        if (n > 0) {
+            text_.append(scratch.data(), static_cast<size_t>(n));
+        }
+        uint8_t flags = 0;
+        if (n > 0 && is_turn_marker_text(scratch.data(), n)) {
+            flags |= kTurnMarker;
+        }
+        const llama_token_type type = llama_token_get_type(model, tok);
+        bool control = type == LLAMA_TOKEN_TYPE_CONTROL;
+        if (control || n <= 0 || type == LLAMA_TOKEN_TYPE_USER_DEFINED) {
+            const int32_t special = piece_into(model, tok, /*special*/ true, scratch);
+            control = control || (n <= 0 && special > 0);
+            if (special > 0 && is_turn_marker_text(scratch.data(), special)) {
+                flags |= kTurnMarker;
+            }
+        }
+        if (control) {
+            flags |= kControl;
+        }
+        flags_[tok] = flags;
+        offsets_.push_back(static_cast<uint32_t>(text_.size()));
+    }
+    return true;
+}
+
+void VocabPieces::clear() {
+    text_.clear();
+    text_.shrink_to_fit();
+    offsets_.clear();
+    offsets_.shrink_to_fit();
+    flags_.clear();
+    flags_.shrink_to_fit();
+}
+
+}  // namespace genui
@@ -0,0 +1,39 @@
+﻿#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "llama.h"
+
+namespace genui {
+
+// Detokenized text of every vocabulary entry, captured once per model so the
+// decode loop can inspect token pieces without calling llama_token_to_piece.
+// Control tokens are stored as empty pieces; the chat-turn markers among them
+// (<|im_end|> and friends) are flagged so generation can stop on them.
+class VocabPieces {
+public:
+    bool build(const llama_model *model);
+    void clear();
+
+    int32_t size() const { return static_cast<int32_t>(offsets_.empty() ? 0 : offsets_.size() - 1); }
+    bool empty() const { return size() == 0; }
+
+    const char *data(llama_token tok) const { return text_.data() + offsets_[tok]; }
+    size_t length(llama_token tok) const { return offsets_[tok + 1] - offsets_[tok]; }
+    std::string piece(llama_token tok) const { return std::string(data(tok), length(tok)); }
+
+    bool is_control(llama_token tok) const { return (flags_[tok] & kControl) != 0; }
+    bool is_turn_marker(llama_token tok) const { return (flags_[tok] & kTurnMarker) != 0; }
+
+private:
+    static constexpr uint8_t kControl = 1;
+    static constexpr uint8_t kTurnMarker = 2;
+
+    std::string text_;
+    std::vector<uint32_t> offsets_;
+    std::vector<uint8_t> flags_;
+};
+
+}  // namespace genui
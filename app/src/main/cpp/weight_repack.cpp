@@ -0,0 +1,279 @@
+﻿#include "weight_repack.h"
+
+#include <android/log.h>
+#include <dlfcn.h>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+#include "ggml-backend.h"
+#include "memory_hints.h"
+
+#define LOG_TAG "QwenCoderBridge"
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+
+namespace genui {
+
+namespace {
+
+// Entry point of the mul_mat hook patch (scripts/patches/0002-*), looked up
+// at runtime like the compute pool's.
+using MulMatOverride = int (*)(const ggml_compute_params *params, ggml_tensor *dst);
+using SetMulMatOverride = void (*)(MulMatOverride fn);
+
+constexpr size_t kAlignment = 64;
+
+// The weights llama.cpp multiplies activations by, per layer.
+const char *const kLayerWeights[] = {"attn_q", "attn_k", "attn_v", "attn_output", "ffn_gate", "ffn_up", "ffn_down"};
+
+static std::atomic<const WeightRepack *> g_installed{nullptr};
+
+static SetMulMatOverride set_mul_mat_override() {
+    return reinterpret_cast<SetMulMatOverride>(dlsym(RTLD_DEFAULT, "ggml_set_mul_mat_override"));
+}
+
+static int mul_mat_override(const ggml_compute_params *params, ggml_tensor *dst) {
+    const WeightRepack *repack = g_installed.load(std::memory_order_acquire);
+    return repack && repack->compute(params, dst) ? 1 : 0;
+}
+
+static const repack::Kernels &best_kernels() {
+#if defined(__aarch64__) && defined(__linux__)
+    if (repack::dotprod_kernels() && (getauxval(AT_HWCAP) & HWCAP_ASIMDDP)) {
+        return *repack::dotprod_kernels();
+    }
+#elif defined(__x86_64__)
+    if (repack::avx2_kernels() && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        return *repack::avx2_kernels();
+    }
+#endif
+    return repack::scalar_kernels();
+}
+
+static double mib(size_t bytes) {
+    return static_cast<double>(bytes) / (1024.0 * 1024.0);
+}
+
+static double gain_percent(double before, double after) {
+    return before > 0.0 ? (after / before - 1.0) * 100.0 : 0.0;
+}
+
+static bool eligible(const ggml_tensor *tensor) {
+    return (tensor->type == GGML_TYPE_Q4_K || tensor->type == GGML_TYPE_Q8_0)
+           && tensor->ne[1] % repack::kRows == 0 && tensor->ne[2] == 1 && tensor->ne[3] == 1
+           && ggml_is_contiguous(tensor) && tensor->data && tensor->buffer
+           && ggml_backend_buffer_is_host(tensor->buffer);
+}
+
+}  // namespace
+
+std::string RepackStats::describe() const {
+    char text[320];
+    int length = std::snprintf(text, sizeof(text),
+                               "%d tensors, %.1f MiB -> %.1f MiB (%+.1f%%), %.0f ms, %s kernels, %d left in place",
+                               tensors, mib(source_bytes), mib(repacked_bytes),
+                               gain_percent(static_cast<double>(source_bytes), static_cast<double>(repacked_bytes)),
+                               elapsed_ms, kernels, skipped);
+    if (prefill_tps_stock > 0.0 && decode_tps_stock > 0.0 && length > 0 && length < (int) sizeof(text)) {
+        std::snprintf(text + length, sizeof(text) - length,
+                      "; prefill %.1f -> %.1f tok/s (%+.0f%%), decode %.1f -> %.1f tok/s (%+.0f%%)",
+                      prefill_tps_stock, prefill_tps_repacked, gain_percent(prefill_tps_stock, prefill_tps_repacked),
+                      decode_tps_stock, decode_tps_repacked, gain_percent(decode_tps_stock, decode_tps_repacked));
+    }
+    return text;
+}
+
+std::vector<ggml_tensor *> matmul_weights(llama_model *model) {
+    std::vector<ggml_tensor *> weights;
+    char name[64];
+    for (int32_t layer = 0; layer < llama_n_layer(model); ++layer) {
+        for (const char *weight : kLayerWeights) {
+            std::snprintf(name, sizeof(name), "blk.%d.%s.weight", layer, weight);
+            ggml_tensor *tensor = llama_get_model_tensor(model, name);
+            // Projections fused at load (scripts/patches/0003-*) are views of
+            // the fused matrix, which is what the graph multiplies by.
+            if (tensor && tensor->view_src) {
+                tensor = tensor->view_src;
+            }
+            if (tensor && std::find(weights.begin(), weights.end(), tensor) == weights.end()) {
+                weights.push_back(tensor);
+            }
+        }
+    }
+    // Absent when the output matrix is tied to the token embeddings, which
+    // are read by row lookup rather than multiplied.
+    if (ggml_tensor *output = llama_get_model_tensor(model, "output.weight")) {
+        weights.push_back(output);
+    }
+    return weights;
+}
+
+WeightRepack::~WeightRepack() {
+    clear();
+}
+
+bool WeightRepack::supported() {
+    return set_mul_mat_override() != nullptr;
+}
+
+bool WeightRepack::build(llama_model *model) {
+    clear();
+    if (!supported()) {
+        LOGI("Weight repack unavailable: libggml lacks the mul_mat hook; using the mmap'd weights");
+        return false;
+    }
+    if (ggml_blck_size(GGML_TYPE_Q4_K) != 256 || ggml_type_size(GGML_TYPE_Q4_K) != sizeof(repack::BlockQ4K)
+        || ggml_type_size(GGML_TYPE_Q8_K) != sizeof(repack::BlockQ8K)
+        || ggml_type_size(GGML_TYPE_Q8_0) != sizeof(repack::BlockQ80)) {
+        LOGE("Weight repack: unexpected ggml block layout; using the mmap'd weights");
+        return false;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const repack::Kernels &kernels = best_kernels();
+    stats_.kernels = kernels.name;
+
+    const std::vector<ggml_tensor *> candidates = matmul_weights(model);
+
+    // One allocation for every copy, laid out in candidate order.
+    std::vector<ggml_tensor *> chosen;
+    std::vector<size_t> offsets;
+    size_t total = 0;
+    for (ggml_tensor *tensor : candidates) {
+        if (!eligible(tensor)) {
+            ++stats_.skipped;
+            continue;
+        }
+        const size_t block_bytes = tensor->type == GGML_TYPE_Q4_K ? sizeof(repack::BlockQ4Kx4)
+                                                                  : sizeof(repack::BlockQ80x4);
+        const size_t blocks = static_cast<size_t>(tensor->ne[0] / ggml_blck_size(tensor->type));
+        chosen.push_back(tensor);
+        offsets.push_back(total);
+        total += (blocks * block_bytes * static_cast<size_t>(tensor->ne[1] / repack::kRows) + kAlignment - 1)
+                 & ~(kAlignment - 1);
+    }
+    if (chosen.empty()) {
+        LOGI("Weight repack: no eligible Q4_K/Q8_0 weights (%d skipped)", stats_.skipped);
+        return false;
+    }
+    // Read in full by every decode step, so kept on huge pages where the
+    // kernel allows it.
+    arena_ = static_cast<uint8_t *>(map_huge(total));
+    if (!arena_) {
+        LOGE("Weight repack: cannot allocate %.1f MiB; using the mmap'd weights", mib(total));
+        return false;
+    }
+    arena_bytes_ = total;
+
+    for (size_t i = 0; i < chosen.size(); ++i) {
+        const ggml_tensor *tensor = chosen[i];
+        const bool q4_K = tensor->type == GGML_TYPE_Q4_K;
+        Weight weight{};
+        weight.blocks = static_cast<int32_t>(tensor->ne[0] / ggml_blck_size(tensor->type));
+        weight.vec_dot_type = q4_K ? GGML_TYPE_Q8_K : GGML_TYPE_Q8_0;
+        weight.kernel = q4_K ? kernels.q4_K : kernels.q8_0;
+        weight.group_bytes = static_cast<size_t>(weight.blocks)
+                             * (q4_K ? sizeof(repack::BlockQ4Kx4) : sizeof(repack::BlockQ80x4));
+        uint8_t *out = arena_ + offsets[i];
+        weight.data = out;
+        const auto *source = static_cast<const uint8_t *>(tensor->data);
+        for (int64_t group = 0; group < tensor->ne[1] / repack::kRows; ++group) {
+            const uint8_t *row = source + static_cast<size_t>(group * repack::kRows) * tensor->nb[1];
+            if (q4_K) {
+                const repack::BlockQ4K *rows[repack::kRows];
+                for (int r = 0; r < repack::kRows; ++r) {
+                    rows[r] = reinterpret_cast<const repack::BlockQ4K *>(row + r * tensor->nb[1]);
+                }
+                repack::pack_q4_K(rows, weight.blocks, reinterpret_cast<repack::BlockQ4Kx4 *>(out));
+            } else {
+                const repack::BlockQ80 *rows[repack::kRows];
+                for (int r = 0; r < repack::kRows; ++r) {
+                    rows[r] = reinterpret_cast<const repack::BlockQ80 *>(row + r * tensor->nb[1]);
+                }
+                repack::pack_q8_0(rows, weight.blocks, reinterpret_cast<repack::BlockQ80x4 *>(out));
+            }
+            out += weight.group_bytes;
+        }
+        weights_.emplace(tensor, weight);
+        ++stats_.tensors;
+        stats_.source_bytes += ggml_nbytes(tensor);
+        stats_.repacked_bytes += weight.group_bytes * static_cast<size_t>(tensor->ne[1] / repack::kRows);
+    }
+    release_sources();
+    stats_.elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOGI("Weight repack: %s", stats_.describe().c_str());
+    return true;
+}
+
+void WeightRepack::release_sources() const {
+    for (const auto &entry : weights_) {
+        page_out(entry.first->data, ggml_nbytes(entry.first));
+    }
+}
+
+bool WeightRepack::install() {
+    const SetMulMatOverride set = set_mul_mat_override();
+    if (weights_.empty() || !set) {
+        return false;
+    }
+    g_installed.store(this, std::memory_order_release);
+    set(mul_mat_override);
+    return true;
+}
+
+void WeightRepack::uninstall() {
+    if (g_installed.load(std::memory_order_acquire) != this) {
+        return;
+    }
+    if (const SetMulMatOverride set = set_mul_mat_override()) {
+        set(nullptr);
+    }
+    g_installed.store(nullptr, std::memory_order_release);
+}
+
+bool WeightRepack::installed() const {
+    return g_installed.load(std::memory_order_acquire) == this;
+}
+
+void WeightRepack::clear() {
+    uninstall();
+    weights_.clear();
+    unmap_huge(arena_, arena_bytes_);
+    arena_ = nullptr;
+    arena_bytes_ = 0;
+    stats_ = RepackStats();
+}
+
+// Runs on every compute thread of the node. ggml's INIT pass has already
+// quantized the activations into wdata, one row per column; the rows of the
+// weight are split between the threads in whole groups of four.
+bool WeightRepack::compute(const ggml_compute_params *params, ggml_tensor *dst) const {
+    const ggml_tensor *src0 = dst->src[0];
+    const ggml_tensor *src1 = dst->src[1];
+    const auto found = weights_.find(src0);
+    if (found == weights_.end() || src1->type != GGML_TYPE_F32 || dst->type != GGML_TYPE_F32
+        || src1->ne[0] != src0->ne[0] || src1->ne[2] != 1 || src1->ne[3] != 1 || dst->nb[0] != sizeof(float)
+        || dst->nb[1] % sizeof(float) != 0) {
+        return false;
+    }
+    const Weight &weight = found->second;
+    const int64_t groups = src0->ne[1] / repack::kRows;
+    const int64_t first = groups * params->ith / params->nth;
+    const int64_t last = groups * (params->ith + 1) / params->nth;
+    const size_t stride = dst->nb[1] / sizeof(float);
+    auto *out = static_cast<float *>(dst->data);
+    for (int64_t group = first; group < last; ++group) {
+        weight.kernel(weight.data + static_cast<size_t>(group) * weight.group_bytes, weight.blocks, params->wdata,
+                      static_cast<int>(src1->ne[1]), out + group * repack::kRows, stride);
+    }
+    return true;
+}
+
+}  // namespace genui
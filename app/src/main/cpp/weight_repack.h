@@ -0,0 +1,94 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+#include "weight_repack_kernels.h"
+
+namespace genui {
+
+struct RepackStats {
+    int32_t tensors = 0;        // repacked
+    int32_t skipped = 0;        // matmul weights left in place (type, shape or buffer)
+    size_t source_bytes = 0;    // of the repacked tensors, as loaded
+    size_t repacked_bytes = 0;  // of their interleaved copies
+    double elapsed_ms = 0.0;
+    const char *kernels = "";
+    // From benchmark runs with the copies off and on; 0 until measured.
+    double prefill_tps_stock = 0.0;
+    double prefill_tps_repacked = 0.0;
+    double decode_tps_stock = 0.0;
+    double decode_tps_repacked = 0.0;
+
+    // "12 tensors (Q4_K/Q8_0), 45.2 MiB -> 47.7 MiB (+5.6%), 830 ms, avx2"
+    // plus the speeds once measured.
+    std::string describe() const;
+};
+
+// The matrices a forward pass multiplies by: per layer the attention and FFN
+// projections (the fused matrix where scripts/patches/0003-* fused them), then
+// a separate output matrix. Each appears once.
+std::vector<ggml_tensor *> matmul_weights(llama_model *model);
+
+// Load-time copies of a model's quantized matmul weights in the four-row
+// interleaved layouts of weight_repack_kernels.h, with the kernels that use
+// them. The copies are served through the mul_mat hook of the patched
+// libggml (scripts/patches/0002-*): while installed, every MUL_MAT node whose
+// weight has a copy is computed from the copy, and ggml's own kernels run
+// everything else from the mmap'd model. The originals stay valid, so
+// uninstalling (or a stock libggml, where the hook is missing) simply falls
+// back to them; their pages are only advised out of memory, never freed.
+//
+// Eligible weights are the Q4_K and Q8_0 attention and FFN projections (and a
+// separate output matrix) held in host memory with a row count divisible by
+// four. Only one instance can be installed at a time.
+class WeightRepack {
+public:
+    WeightRepack() = default;
+    ~WeightRepack();
+    WeightRepack(const WeightRepack &) = delete;
+    WeightRepack &operator=(const WeightRepack &) = delete;
+
+    // Whether this libggml carries the hook.
+    static bool supported();
+
+    // Repacks the eligible weights of `model`; false when there are none or
+    // the hook is missing. Replaces any earlier copies.
+    bool build(llama_model *model);
+    // Routes matmuls to the copies, or back to ggml. Only while no graph runs.
+    bool install();
+    void uninstall();
+    void clear();
+    // Lets the kernel reclaim the resident pages of the originals again,
+    // e.g. after a run on the fallback path faulted them back in.
+    void release_sources() const;
+
+    bool empty() const { return weights_.empty(); }
+    bool covers(const ggml_tensor *tensor) const { return weights_.count(tensor) > 0; }
+    bool installed() const;
+    const RepackStats &stats() const { return stats_; }
+    RepackStats &stats() { return stats_; }
+
+    // Computes `dst` for the hook when its weight has a copy.
+    bool compute(const ggml_compute_params *params, ggml_tensor *dst) const;
+
+private:
+    struct Weight {
+        ggml_type vec_dot_type;
+        repack::GroupKernel kernel;
+        const uint8_t *data;  // ne[1] / 4 groups
+        size_t group_bytes;
+        int32_t blocks;       // per row
+    };
+
+    std::unordered_map<const ggml_tensor *, Weight> weights_;
+    uint8_t *arena_ = nullptr;
+    size_t arena_bytes_ = 0;
+    RepackStats stats_;
+};
+
+}  // namespace genui
@@ -0,0 +1,423 @@
+﻿#include "weight_repack_kernels.h"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_DOTPROD)
+#include <arm_neon.h>
+#define GENUI_REPACK_DOTPROD 1
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define GENUI_REPACK_AVX2 1
+#endif
+
+namespace genui {
+namespace repack {
+
+namespace {
+
+static float half_to_float(uint16_t h) {
+#if defined(__aarch64__)
+    __fp16 value;
+    std::memcpy(&value, &h, sizeof(value));
+    return value;
+#else
+    const uint32_t sign = (h & 0x8000u) << 16;
+    const uint32_t exponent = (h >> 10) & 0x1fu;
+    const uint32_t mantissa = h & 0x3ffu;
+    if (exponent == 0) {
+        const float value = std::ldexp(static_cast<float>(mantissa), -24);
+        return sign ? -value : value;
+    }
+    const uint32_t bits = exponent == 0x1f ? sign | 0x7f800000u | (mantissa << 13)
+                                           : sign | ((exponent + 112) << 23) | (mantissa << 13);
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+#endif
+}
+
+// The 6-bit scale and min of sub-block j, as ggml's get_scale_min_k4 packs them.
+static void scale_min_k4(int j, const uint8_t *q, uint8_t &scale, uint8_t &min) {
+    if (j < 4) {
+        scale = q[j] & 63;
+        min = q[j + 4] & 63;
+    } else {
+        scale = (q[j + 4] & 0xf) | ((q[j - 4] >> 6) << 4);
+        min = (q[j + 4] >> 4) | ((q[j] >> 6) << 4);
+    }
+}
+
+// Offset in an interleaved qs array of byte `l` of row `r`.
+static inline int interleaved(int l, int r) {
+    return (l / 4) * 16 + r * 4 + l % 4;
+}
+
+static void q4_K_scalar(const void *group, int nb, const void *columns, int ncols, float *dst, size_t dst_stride) {
+    const auto *w = static_cast<const BlockQ4Kx4 *>(group);
+    const auto *y = static_cast<const BlockQ8K *>(columns);
+    for (int c = 0; c < ncols; ++c) {
+        float acc[kRows] = {};
+        for (int b = 0; b < nb; ++b) {
+            const BlockQ4Kx4 &blk = w[b];
+            const BlockQ8K &yb = y[c * nb + b];
+            for (int r = 0; r < kRows; ++r) {
+                int32_t isum = 0;
+                int32_t msum = 0;
+                for (int k = 0; k < 4; ++k) {
+                    int32_t lo = 0;
+                    int32_t hi = 0;
+                    for (int l = 0; l < 32; ++l) {
+                        const uint8_t q = blk.qs[interleaved(32 * k + l, r)];
+                        lo += (q & 0xf) * yb.qs[64 * k + l];
+                        hi += (q >> 4) * yb.qs[64 * k + 32 + l];
+                    }
+                    isum += lo * blk.scales[2 * k][r] + hi * blk.scales[2 * k + 1][r];
+                }
+                for (int j = 0; j < 8; ++j) {
+                    msum += blk.mins[j][r] * (yb.bsums[2 * j] + yb.bsums[2 * j + 1]);
+                }
+                acc[r] += yb.d * (blk.d[r] * static_cast<float>(isum) - blk.dmin[r] * static_cast<float>(msum));
+            }
+        }
+        std::memcpy(dst + c * dst_stride, acc, sizeof(acc));
+    }
+}
+
+static void q8_0_scalar(const void *group, int nb, const void *columns, int ncols, float *dst, size_t dst_stride) {
+    const auto *w = static_cast<const BlockQ80x4 *>(group);
+    const auto *y = static_cast<const BlockQ80 *>(columns);
+    for (int c = 0; c < ncols; ++c) {
+        float acc[kRows] = {};
+        for (int b = 0; b < nb; ++b) {
+            const BlockQ80x4 &blk = w[b];
+            const BlockQ80 &yb = y[c * nb + b];
+            const float yd = half_to_float(yb.d);
+            for (int r = 0; r < kRows; ++r) {
+                int32_t sum = 0;
+                for (int l = 0; l < 32; ++l) {
+                    sum += blk.qs[interleaved(l, r)] * yb.qs[l];
+                }
+                acc[r] += blk.d[r] * yd * static_cast<float>(sum);
+            }
+        }
+        std::memcpy(dst + c * dst_stride, acc, sizeof(acc));
+    }
+}
+
+#if defined(GENUI_REPACK_DOTPROD)
+
+// NC columns share every weight load; four is what fits in the 32 NEON
+// registers alongside the weights.
+template <int NC>
+static void q4_K_tile_dotprod(const BlockQ4Kx4 *w, int nb, const BlockQ8K *y, float *dst, size_t dst_stride) {
+    const uint8x16_t low_mask = vdupq_n_u8(0x0f);
+    float32x4_t acc[NC];
+    for (int c = 0; c < NC; ++c) {
+        acc[c] = vdupq_n_f32(0.0f);
+    }
+    for (int b = 0; b < nb; ++b) {
+        const BlockQ4Kx4 &blk = w[b];
+        int32x4_t isum[NC];
+        int32x4_t msum[NC];
+        for (int c = 0; c < NC; ++c) {
+            isum[c] = vdupq_n_s32(0);
+            msum[c] = vdupq_n_s32(0);
+        }
+        for (int k = 0; k < 4; ++k) {
+            int32x4_t lo[NC];
+            int32x4_t hi[NC];
+            for (int c = 0; c < NC; ++c) {
+                lo[c] = vdupq_n_s32(0);
+                hi[c] = vdupq_n_s32(0);
+            }
+            for (int h = 0; h < 2; ++h) {
+                const uint8_t *q = blk.qs + (k * 8 + h * 4) * 16;
+                const uint8x16_t q0 = vld1q_u8(q);
+                const uint8x16_t q1 = vld1q_u8(q + 16);
+                const uint8x16_t q2 = vld1q_u8(q + 32);
+                const uint8x16_t q3 = vld1q_u8(q + 48);
+                const int8x16_t l0 = vreinterpretq_s8_u8(vandq_u8(q0, low_mask));
+                const int8x16_t l1 = vreinterpretq_s8_u8(vandq_u8(q1, low_mask));
+                const int8x16_t l2 = vreinterpretq_s8_u8(vandq_u8(q2, low_mask));
+                const int8x16_t l3 = vreinterpretq_s8_u8(vandq_u8(q3, low_mask));
+                const int8x16_t h0 = vreinterpretq_s8_u8(vshrq_n_u8(q0, 4));
+                const int8x16_t h1 = vreinterpretq_s8_u8(vshrq_n_u8(q1, 4));
+                const int8x16_t h2 = vreinterpretq_s8_u8(vshrq_n_u8(q2, 4));
+                const int8x16_t h3 = vreinterpretq_s8_u8(vshrq_n_u8(q3, 4));
+                for (int c = 0; c < NC; ++c) {
+                    const int8_t *yq = y[c * nb + b].qs + 64 * k + 16 * h;
+                    const int8x16_t yl = vld1q_s8(yq);
+                    const int8x16_t yh = vld1q_s8(yq + 32);
+                    lo[c] = vdotq_laneq_s32(lo[c], l0, yl, 0);
+                    lo[c] = vdotq_laneq_s32(lo[c], l1, yl, 1);
+                    lo[c] = vdotq_laneq_s32(lo[c], l2, yl, 2);
+                    lo[c] = vdotq_laneq_s32(lo[c], l3, yl, 3);
+                    hi[c] = vdotq_laneq_s32(hi[c], h0, yh, 0);
+                    hi[c] = vdotq_laneq_s32(hi[c], h1, yh, 1);
+                    hi[c] = vdotq_laneq_s32(hi[c], h2, yh, 2);
+                    hi[c] = vdotq_laneq_s32(hi[c], h3, yh, 3);
+                }
+            }
+            const uint16x8_t scales = vmovl_u8(vld1_u8(blk.scales[2 * k]));
+            const int32x4_t scale_lo = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(scales)));
+            const int32x4_t scale_hi = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(scales)));
+            for (int c = 0; c < NC; ++c) {
+                isum[c] = vmlaq_s32(vmlaq_s32(isum[c], lo[c], scale_lo), hi[c], scale_hi);
+            }
+        }
+        int32x4_t mins[8];
+        for (int j = 0; j < 8; j += 2) {
+            const uint16x8_t pair = vmovl_u8(vld1_u8(blk.mins[j]));
+            mins[j] = vreinterpretq_s32_u32(vmovl_u16(vget_low_u16(pair)));
+            mins[j + 1] = vreinterpretq_s32_u32(vmovl_u16(vget_high_u16(pair)));
+        }
+        const float32x4_t d = vld1q_f32(blk.d);
+        const float32x4_t dmin = vld1q_f32(blk.dmin);
+        for (int c = 0; c < NC; ++c) {
+            const BlockQ8K &yb = y[c * nb + b];
+            // Sums of the 32-element sub-blocks.
+            const int16x8_t sums = vpaddq_s16(vld1q_s16(yb.bsums), vld1q_s16(yb.bsums + 8));
+            const int32x4_t sums_lo = vmovl_s16(vget_low_s16(sums));
+            const int32x4_t sums_hi = vmovl_s16(vget_high_s16(sums));
+            msum[c] = vmlaq_laneq_s32(msum[c], mins[0], sums_lo, 0);
+            msum[c] = vmlaq_laneq_s32(msum[c], mins[1], sums_lo, 1);
+            msum[c] = vmlaq_laneq_s32(msum[c], mins[2], sums_lo, 2);
+            msum[c] = vmlaq_laneq_s32(msum[c], mins[3], sums_lo, 3);
+            msum[c] = vmlaq_laneq_s32(msum[c], mins[4], sums_hi, 0);
+            msum[c] = vmlaq_laneq_s32(msum[c], mins[5], sums_hi, 1);
+            msum[c] = vmlaq_laneq_s32(msum[c], mins[6], sums_hi, 2);
+            msum[c] = vmlaq_laneq_s32(msum[c], mins[7], sums_hi, 3);
+            acc[c] = vfmaq_f32(acc[c], vcvtq_f32_s32(isum[c]), vmulq_n_f32(d, yb.d));
+            acc[c] = vfmsq_f32(acc[c], vcvtq_f32_s32(msum[c]), vmulq_n_f32(dmin, yb.d));
+        }
+    }
+    for (int c = 0; c < NC; ++c) {
+        vst1q_f32(dst + c * dst_stride, acc[c]);
+    }
+}
+
+template <int NC>
+static void q8_0_tile_dotprod(const BlockQ80x4 *w, int nb, const BlockQ80 *y, float *dst, size_t dst_stride) {
+    float32x4_t acc[NC];
+    for (int c = 0; c < NC; ++c) {
+        acc[c] = vdupq_n_f32(0.0f);
+    }
+    for (int b = 0; b < nb; ++b) {
+        const BlockQ80x4 &blk = w[b];
+        int8x16_t q[8];
+        for (int g = 0; g < 8; ++g) {
+            q[g] = vld1q_s8(blk.qs + g * 16);
+        }
+        const float32x4_t d = vld1q_f32(blk.d);
+        for (int c = 0; c < NC; ++c) {
+            const BlockQ80 &yb = y[c * nb + b];
+            const int8x16_t y0 = vld1q_s8(yb.qs);
+            const int8x16_t y1 = vld1q_s8(yb.qs + 16);
+            int32x4_t sum = vdupq_n_s32(0);
+            sum = vdotq_laneq_s32(sum, q[0], y0, 0);
+            sum = vdotq_laneq_s32(sum, q[1], y0, 1);
+            sum = vdotq_laneq_s32(sum, q[2], y0, 2);
+            sum = vdotq_laneq_s32(sum, q[3], y0, 3);
+            sum = vdotq_laneq_s32(sum, q[4], y1, 0);
+            sum = vdotq_laneq_s32(sum, q[5], y1, 1);
+            sum = vdotq_laneq_s32(sum, q[6], y1, 2);
+            sum = vdotq_laneq_s32(sum, q[7], y1, 3);
+            acc[c] = vfmaq_f32(acc[c], vcvtq_f32_s32(sum), vmulq_n_f32(d, half_to_float(yb.d)));
+        }
+    }
+    for (int c = 0; c < NC; ++c) {
+        vst1q_f32(dst + c * dst_stride, acc[c]);
+    }
+}
+
+template <typename Block, typename Column, void (*Tile1)(const Block *, int, const Column *, float *, size_t),
+          void (*Tile2)(const Block *, int, const Column *, float *, size_t),
+          void (*Tile3)(const Block *, int, const Column *, float *, size_t),
+          void (*Tile4)(const Block *, int, const Column *, float *, size_t)>
+static void tiled(const void *group, int nb, const void *columns, int ncols, float *dst, size_t dst_stride) {
+    const auto *w = static_cast<const Block *>(group);
+    const auto *y = static_cast<const Column *>(columns);
+    int c = 0;
+    for (; c + 4 <= ncols; c += 4) {
+        Tile4(w, nb, y + c * nb, dst + c * dst_stride, dst_stride);
+    }
+    switch (ncols - c) {
+        case 3: Tile3(w, nb, y + c * nb, dst + c * dst_stride, dst_stride); break;
+        case 2: Tile2(w, nb, y + c * nb, dst + c * dst_stride, dst_stride); break;
+        case 1: Tile1(w, nb, y + c * nb, dst + c * dst_stride, dst_stride); break;
+        default: break;
+    }
+}
+
+#endif  // GENUI_REPACK_DOTPROD
+
+#if defined(GENUI_REPACK_AVX2)
+
+#define GENUI_AVX2 __attribute__((target("avx2,fma")))
+
+// Row sums of a register holding two groups for rows 0-3 in each half.
+GENUI_AVX2 static inline __m128i fold_rows(__m256i sums) {
+    return _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+}
+
+// Dot products of 32 interleaved bytes (two groups of four rows) with the
+// matching two groups of activations, summed per row.
+GENUI_AVX2 static inline __m256i dot_unsigned(__m256i q, __m256i y) {
+    return _mm256_madd_epi16(_mm256_maddubs_epi16(q, y), _mm256_set1_epi16(1));
+}
+
+GENUI_AVX2 static inline __m256i dot_signed(__m256i q, __m256i y) {
+    return dot_unsigned(_mm256_sign_epi8(q, q), _mm256_sign_epi8(y, q));
+}
+
+GENUI_AVX2 static void q4_K_avx2(const void *group, int nb, const void *columns, int ncols, float *dst,
+                                 size_t dst_stride) {
+    const auto *w = static_cast<const BlockQ4Kx4 *>(group);
+    const auto *y = static_cast<const BlockQ8K *>(columns);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    const __m256i groups01 = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const __m256i groups23 = _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3);
+    for (int c = 0; c < ncols; ++c) {
+        __m128 acc = _mm_setzero_ps();
+        for (int b = 0; b < nb; ++b) {
+            const BlockQ4Kx4 &blk = w[b];
+            const BlockQ8K &yb = y[c * nb + b];
+            __m128i isum = _mm_setzero_si128();
+            for (int k = 0; k < 4; ++k) {
+                __m256i lo = _mm256_setzero_si256();
+                __m256i hi = _mm256_setzero_si256();
+                for (int h = 0; h < 2; ++h) {
+                    const uint8_t *q = blk.qs + (k * 8 + h * 4) * 16;
+                    const __m256i q01 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(q));
+                    const __m256i q23 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(q + 32));
+                    const int8_t *yq = yb.qs + 64 * k + 16 * h;
+                    const __m256i yl = _mm256_broadcastsi128_si256(
+                            _mm_loadu_si128(reinterpret_cast<const __m128i *>(yq)));
+                    const __m256i yh = _mm256_broadcastsi128_si256(
+                            _mm_loadu_si128(reinterpret_cast<const __m128i *>(yq + 32)));
+                    lo = _mm256_add_epi32(lo, dot_unsigned(_mm256_and_si256(q01, low_mask),
+                                                           _mm256_permutevar8x32_epi32(yl, groups01)));
+                    lo = _mm256_add_epi32(lo, dot_unsigned(_mm256_and_si256(q23, low_mask),
+                                                           _mm256_permutevar8x32_epi32(yl, groups23)));
+                    hi = _mm256_add_epi32(hi, dot_unsigned(_mm256_and_si256(_mm256_srli_epi16(q01, 4), low_mask),
+                                                           _mm256_permutevar8x32_epi32(yh, groups01)));
+                    hi = _mm256_add_epi32(hi, dot_unsigned(_mm256_and_si256(_mm256_srli_epi16(q23, 4), low_mask),
+                                                           _mm256_permutevar8x32_epi32(yh, groups23)));
+                }
+                int32_t scale_lo;
+                int32_t scale_hi;
+                std::memcpy(&scale_lo, blk.scales[2 * k], sizeof(scale_lo));
+                std::memcpy(&scale_hi, blk.scales[2 * k + 1], sizeof(scale_hi));
+                const __m128i scales_lo = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(scale_lo));
+                const __m128i scales_hi = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(scale_hi));
+                isum = _mm_add_epi32(isum, _mm_mullo_epi32(fold_rows(lo), scales_lo));
+                isum = _mm_add_epi32(isum, _mm_mullo_epi32(fold_rows(hi), scales_hi));
+            }
+            __m128i msum = _mm_setzero_si128();
+            for (int j = 0; j < 8; ++j) {
+                int32_t mins;
+                std::memcpy(&mins, blk.mins[j], sizeof(mins));
+                msum = _mm_add_epi32(msum, _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(mins)),
+                                                           _mm_set1_epi32(yb.bsums[2 * j] + yb.bsums[2 * j + 1])));
+            }
+            const __m128 yd = _mm_set1_ps(yb.d);
+            acc = _mm_fmadd_ps(_mm_cvtepi32_ps(isum), _mm_mul_ps(_mm_loadu_ps(blk.d), yd), acc);
+            acc = _mm_fnmadd_ps(_mm_cvtepi32_ps(msum), _mm_mul_ps(_mm_loadu_ps(blk.dmin), yd), acc);
+        }
+        _mm_storeu_ps(dst + c * dst_stride, acc);
+    }
+}
+
+GENUI_AVX2 static void q8_0_avx2(const void *group, int nb, const void *columns, int ncols, float *dst,
+                                 size_t dst_stride) {
+    const auto *w = static_cast<const BlockQ80x4 *>(group);
+    const auto *y = static_cast<const BlockQ80 *>(columns);
+    const __m256i groups01 = _mm256_setr_epi32(0, 0, 0, 0, 1, 1, 1, 1);
+    const __m256i groups23 = _mm256_setr_epi32(2, 2, 2, 2, 3, 3, 3, 3);
+    for (int c = 0; c < ncols; ++c) {
+        __m128 acc = _mm_setzero_ps();
+        for (int b = 0; b < nb; ++b) {
+            const BlockQ80x4 &blk = w[b];
+            const BlockQ80 &yb = y[c * nb + b];
+            __m256i sum = _mm256_setzero_si256();
+            for (int h = 0; h < 2; ++h) {
+                const int8_t *q = blk.qs + h * 64;
+                const __m256i yv = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128(reinterpret_cast<const __m128i *>(yb.qs + 16 * h)));
+                const __m256i q01 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(q));
+                const __m256i q23 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(q + 32));
+                sum = _mm256_add_epi32(sum, dot_signed(q01, _mm256_permutevar8x32_epi32(yv, groups01)));
+                sum = _mm256_add_epi32(sum, dot_signed(q23, _mm256_permutevar8x32_epi32(yv, groups23)));
+            }
+            const __m128 scale = _mm_mul_ps(_mm_loadu_ps(blk.d), _mm_set1_ps(half_to_float(yb.d)));
+            acc = _mm_fmadd_ps(_mm_cvtepi32_ps(fold_rows(sum)), scale, acc);
+        }
+        _mm_storeu_ps(dst + c * dst_stride, acc);
+    }
+}
+
+#endif  // GENUI_REPACK_AVX2
+
+}  // namespace
+
+void pack_q4_K(const BlockQ4K *const rows[kRows], int nb, BlockQ4Kx4 *out) {
+    for (int b = 0; b < nb; ++b) {
+        BlockQ4Kx4 &blk = out[b];
+        for (int r = 0; r < kRows; ++r) {
+            const BlockQ4K &src = rows[r][b];
+            blk.d[r] = half_to_float(src.d);
+            blk.dmin[r] = half_to_float(src.dmin);
+            for (int j = 0; j < 8; ++j) {
+                scale_min_k4(j, src.scales, blk.scales[j][r], blk.mins[j][r]);
+            }
+            for (int l = 0; l < 128; ++l) {
+                blk.qs[interleaved(l, r)] = src.qs[l];
+            }
+        }
+    }
+}
+
+void pack_q8_0(const BlockQ80 *const rows[kRows], int nb, BlockQ80x4 *out) {
+    for (int b = 0; b < nb; ++b) {
+        BlockQ80x4 &blk = out[b];
+        for (int r = 0; r < kRows; ++r) {
+            const BlockQ80 &src = rows[r][b];
+            blk.d[r] = half_to_float(src.d);
+            for (int l = 0; l < 32; ++l) {
+                blk.qs[interleaved(l, r)] = src.qs[l];
+            }
+        }
+    }
+}
+
+const Kernels &scalar_kernels() {
+    static const Kernels kernels{"scalar", q4_K_scalar, q8_0_scalar};
+    return kernels;
+}
+
+const Kernels *dotprod_kernels() {
+#if defined(GENUI_REPACK_DOTPROD)
+    static const Kernels kernels{
+            "neon-dotprod",
+            tiled<BlockQ4Kx4, BlockQ8K, q4_K_tile_dotprod<1>, q4_K_tile_dotprod<2>, q4_K_tile_dotprod<3>,
+                  q4_K_tile_dotprod<4>>,
+            tiled<BlockQ80x4, BlockQ80, q8_0_tile_dotprod<1>, q8_0_tile_dotprod<2>, q8_0_tile_dotprod<3>,
+                  q8_0_tile_dotprod<4>>};
+    return &kernels;
+#else
+    return nullptr;
+#endif
+}
+
+const Kernels *avx2_kernels() {
+#if defined(GENUI_REPACK_AVX2)
+    static const Kernels kernels{"avx2", q4_K_avx2, q8_0_avx2};
+    return &kernels;
+#else
+    return nullptr;
+#endif
+}
+
+}  // namespace repack
+}  // namespace genui
@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace genui {
+namespace repack {
+
+// ggml's block layouts (ggml-common.h with QK_K = 256). WeightRepack checks
+// the library's type sizes against these before it repacks anything.
+struct BlockQ4K {
+    uint16_t d;     // fp16 scale of the 6-bit sub-block scales
+    uint16_t dmin;  // fp16 scale of the 6-bit sub-block mins
+    uint8_t scales[12];
+    uint8_t qs[128];  // byte 32k + l: element 64k + l (low nibble), 64k + 32 + l (high)
+};
+
+struct BlockQ8K {
+    float d;
+    int8_t qs[256];
+    int16_t bsums[16];  // sums of 16 quants
+};
+
+struct BlockQ80 {
+    uint16_t d;  // fp16
+    int8_t qs[32];
+};
+
+constexpr int kRows = 4;
+
+// Four weight rows interleaved four bytes at a time: 16 consecutive bytes of
+// qs hold bytes 4g..4g+3 of row 0, then of rows 1, 2 and 3. One 128-bit load
+// then feeds a dot product per row against the same four activations, which
+// is what NEON's indexed sdot (and two AVX2 multiply-adds) compute. Scales
+// are unpacked to floats and bytes, row minor, so they load as vectors too.
+struct BlockQ4Kx4 {
+    float d[kRows];
+    float dmin[kRows];
+    uint8_t scales[8][kRows];  // by 32-element sub-block
+    uint8_t mins[8][kRows];
+    uint8_t qs[128 * kRows];
+};
+
+struct BlockQ80x4 {
+    float d[kRows];
+    int8_t qs[32 * kRows];
+};
+
+static_assert(sizeof(BlockQ4K) == 144, "q4_K block layout");
+static_assert(sizeof(BlockQ8K) == 292, "q8_K block layout");
+static_assert(sizeof(BlockQ80) == 34, "q8_0 block layout");
+static_assert(sizeof(BlockQ4Kx4) == 608, "interleaved q4_K block layout");
+static_assert(sizeof(BlockQ80x4) == 144, "interleaved q8_0 block layout");
+
+// Interleaves four rows of `nb` blocks each; `rows[r]` points at row r.
+void pack_q4_K(const BlockQ4K *const rows[kRows], int nb, BlockQ4Kx4 *out);
+void pack_q8_0(const BlockQ80 *const rows[kRows], int nb, BlockQ80x4 *out);
+
+// Multiplies one group of four interleaved rows (`nb` blocks) by `ncols`
+// activation columns, each `nb` blocks of the matching ggml vec_dot type laid
+// out back to back, and writes the four results of column c to
+// dst + c * dst_stride (in floats).
+using GroupKernel = void (*)(const void *group, int nb, const void *columns, int ncols, float *dst,
+                             size_t dst_stride);
+
+struct Kernels {
+    const char *name;
+    GroupKernel q4_K;
+    GroupKernel q8_0;
+};
+
+// Plain C++; every CPU runs it, and host checks compare the others with it.
+const Kernels &scalar_kernels();
+// NEON with the dotprod extension, or nullptr when not compiled in. Only
+// call it on a CPU that reports the extension.
+const Kernels *dotprod_kernels();
+// AVX2 and FMA, or nullptr when not compiled in; same caveat.
+const Kernels *avx2_kernels();
+
+}  // namespace repack
+}  // namespace genui
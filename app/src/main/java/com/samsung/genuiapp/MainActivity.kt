@@ -90,14 +90,8 @@ class MainActivity : AppCompatActivity() {
         binding.loadModelButton.isEnabled = false
         binding.generateMinimalButton.isEnabled = false
 
-        val cpuCount = Runtime.getRuntime().availableProcessors().coerceAtLeast(2)
-        val threads = when {
-            cpuCount >= 10 -> cpuCount - 2
-            cpuCount >= 8 -> cpuCount - 1
-            cpuCount >= 6 -> cpuCount - 1
-            else -> cpuCount
-        }.coerceAtLeast(4).coerceAtMost(8).coerceAtMost(cpuCount)
-        Log.i("MainActivity", "Loading model threads=$threads vulkan=${QwenCoderBridge.isVulkanActive()} elite=${QwenCoderBridge.isEliteActive()} libs=${QwenCoderBridge.loadedLibraries().joinToString()}")
+        val placement = ThreadPlacement()
+        Log.i("MainActivity", "Loading model placement=$placement vulkan=${QwenCoderBridge.isVulkanActive()} cpu=${QwenCoderBridge.cpuVariant()} libs=${QwenCoderBridge.loadedLibraries().joinToString()}")
         lifecycleScope.launch {
             val preparedPath = withContext(Dispatchers.IO) { prepareModelFile(requestedPath) }
             if (preparedPath == null) {
@@ -108,7 +102,14 @@ class MainActivity : AppCompatActivity() {
             }
 
             val success = withContext(Dispatchers.IO) {
-                runCatching { QwenCoderBridge.load(preparedPath, threads) }.getOrElse { false }
+                QwenCoderBridge.setProfileDir(File(filesDir, PROFILE_DIR).apply { mkdirs() }.absolutePath)
+                runCatching { QwenCoderBridge.load(preparedPath, placement) }.getOrElse { false }
+            }
+            if (success && !QwenCoderBridge.hasTunedProfile()) {
+                // First load of this model on this device: tune once, later loads reuse the profile.
+                updateStatus("Tuning for this device (up to ${QwenCoderBridge.AUTOTUNE_BUDGET_MS / 1000} s)...")
+                val tuned = QwenCoderBridge.autotune()
+                Log.i("MainActivity", "Autotune: $tuned")
             }
 
             binding.progressBar.isVisible = false
@@ -121,7 +122,7 @@ class MainActivity : AppCompatActivity() {
                     .putString(KEY_MODEL_PATH, requestedPath)
                     .putString(KEY_MODEL_LOCAL_PATH, preparedPath)
                     .apply()
-                updateStatus("Model ready (threads=$threads)")
+                updateStatus("Model ready (${QwenCoderBridge.threadPlan()})")
             } else {
                 isModelReady = false
                 updateStatus("Failed to load model. Check the path, permissions, and GGUF format.")
@@ -317,6 +318,7 @@ class MainActivity : AppCompatActivity() {
         private const val KEY_MODEL_URI = "model_uri"
         private const val KEY_MODEL_LOCAL_PATH = "model_local_path"
         private const val DEFAULT_MODEL_PATH = "/sdcard/Download/qwen2.5-0.5b-instruct-q4_k_m.gguf"
+        private const val PROFILE_DIR = "tuning"
     }
 }
 
@@ -1,12 +1,17 @@
 ﻿package com.samsung.genuiapp
 
 import android.os.Bundle
+import android.os.SystemClock
+import android.util.Log
 import android.webkit.WebSettings
 import androidx.appcompat.app.AppCompatActivity
 import androidx.core.view.isVisible
 import androidx.lifecycle.lifecycleScope
 import com.samsung.genuiapp.databinding.ActivityPreviewBinding
+import kotlinx.coroutines.CancellationException
 import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.channels.Channel
+import kotlinx.coroutines.delay
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
 
@@ -82,9 +87,19 @@ class PreviewActivity : AppCompatActivity() {
 
         lifecycleScope.launch {
             val prompt = UiGenerationUtils.buildPrompt(promptText, useMinimalPrompt)
-            val output = withContext(Dispatchers.IO) {
-                runCatching { QwenCoderBridge.generate(prompt, UiGenerationUtils.MAX_TOKENS) }
-                    .getOrElse { throwable -> "[error] ${throwable.localizedMessage}" }
+            val checkpoints = Channel<String>(Channel.CONFLATED)
+            val started = SystemClock.elapsedRealtime()
+            val renderer = launch { renderCheckpoints(checkpoints, started) }
+            val output = try {
+                QwenCoderBridge.generateWithCheckpoints(prompt, UiGenerationUtils.MAX_TOKENS) { html ->
+                    checkpoints.trySend(html)
+                }
+            } catch (cancelled: CancellationException) {
+                throw cancelled
+            } catch (throwable: Throwable) {
+                "[error] ${throwable.localizedMessage}"
+            } finally {
+                renderer.cancel()
             }
 
             binding.previewProgress.isVisible = false
@@ -101,6 +116,25 @@ class PreviewActivity : AppCompatActivity() {
         }
     }
 
+    // Shows the latest checkpoint at most once per frame interval; a WebView
+    // reload costs far more than the gap between checkpoints, so the ones that
+    // arrive in between are dropped.
+    private suspend fun renderCheckpoints(checkpoints: Channel<String>, started: Long) {
+        var first = true
+        for (html in checkpoints) {
+            if (first) {
+                val elapsed = SystemClock.elapsedRealtime() - started
+                Log.i(TAG, "First render checkpoint after $elapsed ms")
+                first = false
+            }
+            binding.previewWebView.isVisible = true
+            binding.previewWebView.loadDataWithBaseURL(
+                null, UiGenerationUtils.sanitizeHtml(html), "text/html", "utf-8", null
+            )
+            delay(CHECKPOINT_FRAME_INTERVAL_MS)
+        }
+    }
+
     private fun showError(message: String) {
         binding.previewStatus.text = message
         binding.previewWebView.isVisible = false
@@ -108,6 +142,9 @@ class PreviewActivity : AppCompatActivity() {
     }
 
     companion object {
+        private const val TAG = "PreviewActivity"
+        private const val CHECKPOINT_FRAME_INTERVAL_MS = 200L
+
         const val EXTRA_HTML_ASSET_NAME = "extra_html_asset_name"
         const val EXTRA_PROMPT_TEXT = "extra_prompt_text"
         const val EXTRA_USE_MINIMAL_PROMPT = "extra_use_minimal_prompt"
@@ -1,27 +1,129 @@
 ﻿package com.samsung.genuiapp
 
 import android.os.Build
+import android.os.SystemClock
 import android.util.Log
+import java.nio.ByteBuffer
+import java.util.concurrent.atomic.AtomicLong
+import kotlin.coroutines.resume
+import kotlin.random.Random
+import kotlinx.coroutines.CancellationException
+import kotlinx.coroutines.CompletableDeferred
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.NonCancellable
+import kotlinx.coroutines.async
+import kotlinx.coroutines.coroutineScope
+import kotlinx.coroutines.suspendCancellableCoroutine
+import kotlinx.coroutines.withContext
+
+data class SamplingParams(
+    val temperature: Float = 0.8f,
+    val topK: Int = 40,
+    val topP: Float = 0.95f,
+    val seed: Int = Random.nextInt(),
+)
+
+// Persistent ggml compute threads (needs the patched libggml; ignored otherwise).
+// threads = AUTO sizes the pool to the compute threads minus the caller, 0 turns
+// it off; idle pool threads spin for spinMicros before parking.
+data class ComputePoolConfig(
+    val threads: Int = AUTO,
+    val spinMicros: Int = 100,
+) {
+    companion object {
+        const val AUTO = -1
+    }
+}
+
+// madvise hints for the memory a forward pass reads. hugePages asks for
+// transparent huge pages on the model mapping and llama.cpp's buffers;
+// accessPhases reads the model with read-ahead while loading and switches to
+// random access once it serves requests; hotCopyMiB > 0 copies that many MiB of
+// matmul weights into huge-page backed memory. Each is best effort per kernel.
+data class MemoryHintConfig(
+    val hugePages: Boolean = true,
+    val accessPhases: Boolean = true,
+    val hotCopyMiB: Int = 0,
+)
+
+// Which cores run each kind of decode step. Prompt prefill scales across every
+// core; token-by-token decode is gated by its slowest core, so by default it
+// stays on the performance cores. maxThreads > 0 caps both sets to their
+// fastest cores.
+data class ThreadPlacement(
+    val prefillCores: Int = CORES_ALL,
+    val decodeCores: Int = CORES_PERFORMANCE,
+    val maxThreads: Int = 0,
+) {
+    companion object {
+        const val CORES_ALL = 0
+        const val CORES_PERFORMANCE = 1  // at least half the capacity of the fastest core
+        const val CORES_PRIME = 2        // the fastest class only
+    }
+}
+
+fun interface GenerationCallback {
+    fun onComplete(text: String)
+}
+
+interface StreamCallback : GenerationCallback {
+    fun onChunk(offset: Int, length: Int)
+}
+
+// Also receives render checkpoints: the output so far, cut where the markup is
+// sound and auto-closed, ready to display while generation continues.
+interface CheckpointCallback : StreamCallback {
+    fun onCheckpoint(html: String)
+}
+
+private class StreamedDocument {
+    private var bytes = ByteArray(4096)
+    private var size = 0
+
+    fun apply(buffer: ByteBuffer, offset: Int, length: Int): String {
+        size = minOf(size, offset)
+        if (size + length > bytes.size) {
+            bytes = bytes.copyOf(maxOf(bytes.size * 2, size + length))
+        }
+        buffer.position(0)
+        buffer.get(bytes, size, length)
+        size += length
+        return String(bytes, 0, size, Charsets.UTF_8)
+    }
+}
 
 object QwenCoderBridge {
     private const val TAG = "QwenCoderBridge"
+
+    const val VALIDATION_OFF = 0
+    const val VALIDATION_ABORT = 1
+    const val VALIDATION_TRUNCATE = 2
+
+    const val PRIORITY_FOREGROUND = 0
+    const val PRIORITY_BACKGROUND = 1
+
+    const val AUTOTUNE_BUDGET_MS = 60_000
+
+    // Decode thread policies; see setPowerPolicy().
+    const val POWER_BALANCED = 0     // drop threads as the device heats up, to hold tok/s
+    const val POWER_PERFORMANCE = 1  // always the full decode set
+    const val POWER_SAVER = 2        // two threads at most, prompts included
+
+    // Flash attention for load().
+    const val FLASH_ATTN_AUTO = 0  // the tuned profile's choice, or a short trial of both when untuned
+    const val FLASH_ATTN_ON = 1
+    const val FLASH_ATTN_OFF = 2   // also keeps the KV cache in F16, which the materialized path needs
+
+    private const val STREAM_BUFFER_BYTES = 16 * 1024
+
+    private val nextHandle = AtomicLong()
     private val loadedLibs = mutableListOf<String>()
-    @Volatile private var eliteActive = false
     @Volatile private var vulkanActive = false
 
     init {
-        val useEliteVariant = shouldUseEliteVariant()
-        Log.i(TAG, "Init: device=${Build.DEVICE}, hardware=${Build.HARDWARE}, useEliteHint=$useEliteVariant")
-
-        if (useEliteVariant) {
-            val eliteGgml = tryLoad("ggml_elite", required = false)
-            val eliteLlama = tryLoad("llama_elite", required = false)
-            eliteActive = eliteGgml && eliteLlama
-            if (!eliteActive) {
-                Log.i(TAG, "Elite libraries unavailable; falling back to generic build")
-            }
-        }
+        Log.i(TAG, "Init: device=${Build.DEVICE}, hardware=${Build.HARDWARE}")
 
+        // One library set for every device: libggml picks its kernels from the CPU's features at init.
         tryLoad("ggml", required = true)
         tryLoad("llama", required = true)
 
@@ -33,7 +135,7 @@ object QwenCoderBridge {
         loadedLibs += "native-lib"
 
         Log.i(TAG, "Loaded native libs: ${loadedLibs.joinToString()}")
-        Log.i(TAG, "Vulkan active=$vulkanActive, elite active=$eliteActive")
+        Log.i(TAG, "Vulkan active=$vulkanActive, cpu kernels=${nativeCpuVariant()}")
     }
 
     private fun tryLoad(lib: String, required: Boolean): Boolean {
@@ -57,32 +159,291 @@ object QwenCoderBridge {
         }
     }
 
-    private fun shouldUseEliteVariant(): Boolean {
-        val socMatches = if (Build.VERSION.SDK_INT >= Build.VERSION_CODES.S) {
-            Build.SOC_MANUFACTURER?.contains("qualcomm", ignoreCase = true) == true
-        } else {
-            false
+    fun load(
+        modelPath: String,
+        placement: ThreadPlacement = ThreadPlacement(),
+        computePool: ComputePoolConfig = ComputePoolConfig(),
+        repackWeights: Boolean = false,
+        flashAttention: Int = FLASH_ATTN_AUTO,
+        memoryHints: MemoryHintConfig = MemoryHintConfig(),
+    ): Boolean {
+        Log.i(TAG, "nativeInit placement=$placement pool=$computePool repack=$repackWeights flashAttn=$flashAttention memory=$memoryHints vulkan=$vulkanActive")
+        return nativeInit(
+            modelPath,
+            placement.maxThreads,
+            placement.prefillCores,
+            placement.decodeCores,
+            computePool.threads,
+            computePool.spinMicros,
+            repackWeights,
+            flashAttention,
+            memoryHints.hugePages,
+            memoryHints.accessPhases,
+            memoryHints.hotCopyMiB,
+        )
+    }
+
+    // With load(..., repackWeights = true): how many weights were copied into
+    // the interleaved layout, the memory and time it took, and the speeds once
+    // benchmarkRepack() ran; "off" otherwise.
+    fun repackStats(): String = nativeRepackStats()
+
+    // The model mapping's size and access phase, the memory advised for and
+    // collapsed into huge pages, how much of the process huge pages back now,
+    // and the hot copies.
+    fun memoryHintStats(): String = nativeMemoryHintStats()
+
+    // Times prefill and decode on the original weights and on the repacked
+    // copies. The context is rebuilt around it, so requests in flight fail.
+    suspend fun benchmarkRepack(): String =
+        withContext(Dispatchers.IO) { nativeBenchmarkRepack() }
+
+    // Runs the current settings with flash attention off and on over a few
+    // prompt lengths. One line per setting: the compute buffer llama.cpp
+    // reserved, then prefill and decode tok/s per length. The context is
+    // rebuilt around it, so requests in flight fail.
+    suspend fun benchmarkFlashAttention(): String =
+        withContext(Dispatchers.IO) { nativeBenchmarkFlashAttention() }
+
+    // "prefill 8 threads on cpus 0-7, decode 6 on cpus 2-7" once a model is loaded.
+    fun threadPlan(): String = nativeThreadPlan()
+
+    // Tuned profiles are kept here, one per CPU topology and model file. A
+    // load finds its profile here and applies it in place of the placement.
+    fun setProfileDir(dir: String) = nativeSetProfileDir(dir)
+
+    fun hasTunedProfile(): Boolean = nativeHasTunedProfile()
+
+    // Runs bounded prefill/decode trials over threads, batch size, flash
+    // attention and KV cache type on the loaded model, then reloads the
+    // context with the winners and saves them. Requests in flight fail.
+    // Returns the chosen settings or an "[error] ..." message.
+    suspend fun autotune(budgetMs: Int = AUTOTUNE_BUDGET_MS): String =
+        withContext(Dispatchers.IO) { nativeAutotune(budgetMs) }
+
+    fun generate(prompt: String, maxTokens: Int, priority: Int = PRIORITY_FOREGROUND): String =
+        nativeGenerate(prompt, maxTokens, priority, 0L)
+
+    suspend fun generateCancellable(prompt: String, maxTokens: Int, priority: Int = PRIORITY_FOREGROUND): String =
+        withContext(Dispatchers.IO) {
+            suspendCancellableCoroutine { continuation ->
+                val handle = nextHandle.incrementAndGet()
+                val cancelledAt = AtomicLong()
+                continuation.invokeOnCancellation {
+                    cancelledAt.set(SystemClock.elapsedRealtime())
+                    nativeCancel(handle)
+                }
+                nativeSubmit(prompt, maxTokens, priority, handle) { text ->
+                    val cancelTime = cancelledAt.get()
+                    if (cancelTime != 0L) {
+                        val elapsed = SystemClock.elapsedRealtime() - cancelTime
+                        Log.i(TAG, "Cancelled request $handle; completion arrived after $elapsed ms")
+                    }
+                    continuation.resume(text)
+                }
+            }
+        }
+
+    suspend fun generateStreaming(
+        prompt: String,
+        maxTokens: Int,
+        priority: Int = PRIORITY_FOREGROUND,
+        onText: (String) -> Unit,
+    ): String = withContext(Dispatchers.IO) {
+        suspendCancellableCoroutine { continuation ->
+            val handle = nextHandle.incrementAndGet()
+            val buffer = ByteBuffer.allocateDirect(STREAM_BUFFER_BYTES)
+            val document = StreamedDocument()
+            continuation.invokeOnCancellation { nativeCancel(handle) }
+            nativeSubmitStream(prompt, maxTokens, priority, handle, buffer, object : StreamCallback {
+                override fun onChunk(offset: Int, length: Int) {
+                    if (continuation.isActive) {
+                        onText(document.apply(buffer, offset, length))
+                    }
+                }
+
+                override fun onComplete(text: String) {
+                    continuation.resume(text)
+                }
+            })
+        }
+    }
+
+    suspend fun generateWithCheckpoints(
+        prompt: String,
+        maxTokens: Int,
+        priority: Int = PRIORITY_FOREGROUND,
+        onCheckpoint: (String) -> Unit,
+    ): String = withContext(Dispatchers.IO) {
+        suspendCancellableCoroutine { continuation ->
+            val handle = nextHandle.incrementAndGet()
+            val buffer = ByteBuffer.allocateDirect(STREAM_BUFFER_BYTES)
+            continuation.invokeOnCancellation { nativeCancel(handle) }
+            nativeSubmitStream(prompt, maxTokens, priority, handle, buffer, object : CheckpointCallback {
+                override fun onChunk(offset: Int, length: Int) = Unit
+
+                override fun onCheckpoint(html: String) {
+                    if (continuation.isActive) {
+                        onCheckpoint(html)
+                    }
+                }
+
+                override fun onComplete(text: String) {
+                    continuation.resume(text)
+                }
+            })
         }
-        val hardwareMatches = Build.HARDWARE?.contains("qcom", ignoreCase = true) == true
-        return socMatches || hardwareMatches
     }
 
-    fun load(modelPath: String, threads: Int): Boolean {
-        Log.i(TAG, "nativeInit threads=$threads vulkan=$vulkanActive elite=$eliteActive")
-        return nativeInit(modelPath, threads)
+    // A prompt whose text is still arriving, e.g. streamed from an upstream
+    // agent. Appended text is tokenized and prefilled natively in the
+    // meantime, so finish() only waits for the tail of the prompt.
+    class PromptSession internal constructor(internal val handle: Long) {
+        private val result = CompletableDeferred<String>()
+        internal val callback = GenerationCallback { text -> result.complete(text) }
+
+        fun append(text: String): Boolean = nativeAppendPrompt(handle, text)
+
+        suspend fun finish(): String {
+            nativeFinishPrompt(handle)
+            return try {
+                result.await()
+            } catch (cancelled: CancellationException) {
+                nativeCancel(handle)
+                throw cancelled
+            }
+        }
+
+        fun cancel() {
+            nativeCancel(handle)
+        }
     }
 
-    fun generate(prompt: String, maxTokens: Int): String = nativeGenerate(prompt, maxTokens)
+    fun beginPrompt(prefix: String, maxTokens: Int, priority: Int = PRIORITY_FOREGROUND): PromptSession {
+        val session = PromptSession(nextHandle.incrementAndGet())
+        nativeBeginPrompt(prefix, maxTokens, priority, session.handle, session.callback)
+        return session
+    }
+
+    fun generateVariants(
+        prompt: String,
+        count: Int,
+        maxTokens: Int,
+        sampling: SamplingParams = SamplingParams(),
+    ): Array<String> = nativeGenerateVariants(
+        prompt, count, maxTokens, sampling.temperature, sampling.topK, sampling.topP, sampling.seed, 0L
+    )
+
+    suspend fun generateVariantsCancellable(
+        prompt: String,
+        count: Int,
+        maxTokens: Int,
+        sampling: SamplingParams = SamplingParams(),
+    ): Array<String> = cancellable { handle ->
+        nativeGenerateVariants(
+            prompt, count, maxTokens, sampling.temperature, sampling.topK, sampling.topP, sampling.seed, handle
+        )
+    }
+
+    fun setHtmlGrammarEnabled(enabled: Boolean): Boolean = nativeSetHtmlGrammar(enabled)
+    fun setValidationPolicy(policy: Int) = nativeSetValidationPolicy(policy)
+    fun setRollbackBudget(maxRollbacks: Int) = nativeSetRollbackBudget(maxRollbacks)
+    fun setPrefillChunking(chunkTokens: Int, targetStepMs: Int) = nativeSetPrefillChunking(chunkTokens, targetStepMs)
+    fun setStreamBatching(maxTokens: Int, maxDelayMs: Int) = nativeSetStreamBatching(maxTokens, maxDelayMs)
+    // `foreground` applies while a foreground request runs, `background` to background-only work.
+    fun setPowerPolicy(foreground: Int = POWER_BALANCED, background: Int = POWER_SAVER) =
+        nativeSetPowerPolicy(foreground, background)
     fun release() = nativeRelease()
 
     fun isVulkanActive(): Boolean = vulkanActive
-    fun isEliteActive(): Boolean = eliteActive
+    fun cpuVariant(): String = nativeCpuVariant()
     fun loadedLibraries(): List<String> = loadedLibs.toList()
     fun lastTokenCount(): Int = nativeLastTokenCount()
+    fun lastRecoveryStats(): IntArray = nativeLastRecoveryStats()
+    fun schedulerStats(): IntArray = nativeSchedulerStats()
+
+    private suspend fun <T> cancellable(call: (Long) -> T): T = coroutineScope {
+        val handle = nextHandle.incrementAndGet()
+        val pending = async(Dispatchers.IO) { call(handle) }
+        try {
+            pending.await()
+        } catch (cancelled: CancellationException) {
+            val start = SystemClock.elapsedRealtime()
+            val found = nativeCancel(handle)
+            withContext(NonCancellable) { pending.join() }
+            val elapsed = SystemClock.elapsedRealtime() - start
+            Log.i(TAG, "Cancelled request $handle (found=$found); native call returned after $elapsed ms")
+            throw cancelled
+        }
+    }
 
-    private external fun nativeInit(modelPath: String, nThreads: Int): Boolean
-    private external fun nativeGenerate(prompt: String, maxTokens: Int): String
+    private external fun nativeInit(
+        modelPath: String,
+        maxThreads: Int,
+        prefillCores: Int,
+        decodeCores: Int,
+        poolThreads: Int,
+        poolSpinMicros: Int,
+        repackWeights: Boolean,
+        flashAttention: Int,
+        hugePages: Boolean,
+        accessPhases: Boolean,
+        hotCopyMiB: Int,
+    ): Boolean
+    private external fun nativeThreadPlan(): String
+    private external fun nativeCpuVariant(): String
+    private external fun nativeSetProfileDir(dir: String)
+    private external fun nativeHasTunedProfile(): Boolean
+    private external fun nativeAutotune(budgetMs: Int): String
+    private external fun nativeRepackStats(): String
+    private external fun nativeMemoryHintStats(): String
+    private external fun nativeBenchmarkRepack(): String
+    private external fun nativeBenchmarkFlashAttention(): String
+    private external fun nativeGenerate(prompt: String, maxTokens: Int, priority: Int, handle: Long): String
+    private external fun nativeSubmit(
+        prompt: String,
+        maxTokens: Int,
+        priority: Int,
+        handle: Long,
+        callback: GenerationCallback,
+    )
+    private external fun nativeSubmitStream(
+        prompt: String,
+        maxTokens: Int,
+        priority: Int,
+        handle: Long,
+        buffer: ByteBuffer,
+        callback: StreamCallback,
+    )
+    private external fun nativeGenerateVariants(
+        prompt: String,
+        count: Int,
+        maxTokens: Int,
+        temperature: Float,
+        topK: Int,
+        topP: Float,
+        seed: Int,
+        handle: Long,
+    ): Array<String>
+    private external fun nativeBeginPrompt(
+        prefix: String,
+        maxTokens: Int,
+        priority: Int,
+        handle: Long,
+        callback: GenerationCallback,
+    )
+    private external fun nativeAppendPrompt(handle: Long, text: String): Boolean
+    private external fun nativeFinishPrompt(handle: Long): Boolean
+    private external fun nativeCancel(handle: Long): Boolean
     private external fun nativeRelease()
+    private external fun nativeSetHtmlGrammar(enabled: Boolean): Boolean
+    private external fun nativeSetValidationPolicy(policy: Int)
+    private external fun nativeSetRollbackBudget(maxRollbacks: Int)
+    private external fun nativeSetPrefillChunking(chunkTokens: Int, targetStepMs: Int)
+    private external fun nativeSetStreamBatching(maxTokens: Int, maxDelayMs: Int)
+    private external fun nativeSetPowerPolicy(foreground: Int, background: Int)
+    private external fun nativeLastRecoveryStats(): IntArray
+    private external fun nativeSchedulerStats(): IntArray
     private external fun nativeLastTokenCount(): Int
 }
 
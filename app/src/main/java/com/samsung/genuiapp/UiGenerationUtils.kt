@@ -40,6 +40,11 @@ object UiGenerationUtils {
         }
     }
 
+    // The part of buildPrompt() that precedes the agent text, for prompts whose
+    // agent text is streamed into QwenCoderBridge.beginPrompt().
+    fun promptPrefix(useMinimalPrompt: Boolean = false): String =
+        if (useMinimalPrompt) "" else USER_PROMPT_TEMPLATE.substringBefore(USER_PROMPT_PLACEHOLDER)
+
     fun sanitizeHtml(html: String, treatMissingHtmlAsPlaintext: Boolean = true): String {
         val cleaned = html.removeCodeFences().trim()
         val trimmedStart = cleaned.trimStart()
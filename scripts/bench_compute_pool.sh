@@ -0,0 +1,85 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Compares decode speed and CPU cost per token of stock llama.cpp against the
+# persistent compute pool patch (scripts/patches/0001-*) on the host. Both
+# trees are built from the same LLAMA_TAG; the patched run sizes the pool via
+# GGML_COMPUTE_POOL, everything else is identical.
+#
+#   scripts/bench_compute_pool.sh model.gguf [threads]
+#
+# The patch replaces the per-graph thread create/join in ggml_graph_compute
+# with persistent pool threads; an idle one spins for a bounded time, then
+# parks on a futex. By default the pool has threads - 1 threads and spins for
+# 100 us; in the app, load(path, placement, ComputePoolConfig(threads,
+# spinMicros)) sets both. Here GGML_COMPUTE_POOL and GGML_COMPUTE_POOL_SPIN_US
+# do. The patch is not applied by default (LLAMA_PATCHES in the build script)
+# and has to be rebased onto LLAMA_TAG before this script can use it.
+#
+# Set POOL_SPIN_US to change the spin budget and BENCH_TOKENS / BENCH_REPS to
+# change the llama-bench tg run.
+
+if [[ $# -lt 1 ]]; then
+  echo "usage: $0 model.gguf [threads]" >&2
+  exit 1
+fi
+
+MODEL=$1
+THREADS=${2:-$(nproc)}
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/bench-compute-pool"}
+LLAMA_TAG=${LLAMA_TAG:-b2972}
+BENCH_TOKENS=${BENCH_TOKENS:-128}
+BENCH_REPS=${BENCH_REPS:-5}
+POOL_SPIN_US=${POOL_SPIN_US:-100}
+PATCH="${ROOT_DIR}/scripts/patches/0001-ggml-persistent-compute-pool.patch"
+
+if [[ ! -x /usr/bin/time ]]; then
+  echo "error: /usr/bin/time is required for the CPU time column" >&2
+  exit 1
+fi
+
+mkdir -p "${WORK_DIR}"
+if [[ ! -d "${WORK_DIR}/stock" ]]; then
+  git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${WORK_DIR}/stock"
+fi
+if [[ ! -d "${WORK_DIR}/pool" ]]; then
+  cp -a "${WORK_DIR}/stock" "${WORK_DIR}/pool"
+fi
+# Checked on every run: a tree left behind by a failed apply must not be
+# benchmarked as the pool.
+if ! git -C "${WORK_DIR}/pool" apply --reverse --check "${PATCH}" >/dev/null 2>&1 &&
+  ! git -C "${WORK_DIR}/pool" apply "${PATCH}"; then
+  echo "error: ${PATCH##*/} does not apply to llama.cpp ${LLAMA_TAG}; rebase it first (see scripts/refresh_patches.sh)" >&2
+  exit 1
+fi
+
+for tree in stock pool; do
+  cmake -S "${WORK_DIR}/${tree}" -B "${WORK_DIR}/${tree}/build" -DCMAKE_BUILD_TYPE=Release \
+    -DLLAMA_NATIVE=ON -DLLAMA_BUILD_TESTS=OFF -DLLAMA_BUILD_SERVER=OFF >/dev/null
+  cmake --build "${WORK_DIR}/${tree}/build" --target llama-bench -j"$(nproc)" >/dev/null
+done
+
+# CPU time covers the whole process (model load is an mmap, so small).
+# llama-bench runs one warm-up token and then BENCH_REPS generations.
+tokens=$((BENCH_TOKENS * BENCH_REPS + 1))
+
+run() {
+  local tree="$1"
+  shift
+  local times="${WORK_DIR}/${tree}.time"
+  local csv
+  csv=$(env "$@" /usr/bin/time -f "%U %S" -o "${times}" \
+    "${WORK_DIR}/${tree}/build/bin/llama-bench" -m "${MODEL}" -t "${THREADS}" \
+    -p 0 -n "${BENCH_TOKENS}" -r "${BENCH_REPS}" -o csv)
+  # avg_ts / stddev_ts are the last two columns of the csv row.
+  local speed
+  speed=$(echo "${csv}" | tail -n 1 | awk -F, '{ gsub(/"/, ""); printf "%.2f +- %.2f", $(NF-1), $NF }')
+  local cpu_ms
+  cpu_ms=$(awk -v n="${tokens}" '{ printf "%.2f", ($1 + $2) * 1000 / n }' "${times}")
+  printf "%-6s decode %s tok/s, %s CPU ms/token\n" "${tree}" "${speed}" "${cpu_ms}"
+}
+
+echo "model=${MODEL##*/} threads=${THREADS} tokens=${BENCH_TOKENS}x${BENCH_REPS}"
+run stock GGML_COMPUTE_POOL=0
+run pool GGML_COMPUTE_POOL=$((THREADS - 1)) GGML_COMPUTE_POOL_SPIN_US="${POOL_SPIN_US}"
@@ -0,0 +1,71 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Measures the host time llama.cpp spends preparing each single-token decode
+# graph (build, split and allocation) with the decode graph cache patch
+# (scripts/patches/0004-*) off and on. Both runs use the same patched build and
+# greedy sampling; LLAMA_GRAPH_REUSE switches the cache. The patch logs the
+# per-token preparation time when the context is freed, llama_print_timings
+# the decode speed, and the generated text of both runs must match. `main`
+# decodes one sequence, so every generated token is a single-token batch; with
+# several sequences per batch the cache never applies.
+#
+#   scripts/bench_graph_reuse.sh model.gguf [threads]
+#
+# Set BENCH_TOKENS to change the number of generated tokens (default 256).
+
+if [[ $# -lt 1 ]]; then
+  echo "usage: $0 model.gguf [threads]" >&2
+  exit 1
+fi
+
+MODEL=$1
+THREADS=${2:-$(nproc)}
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/bench-graph-reuse"}
+LLAMA_TAG=${LLAMA_TAG:-b2972}
+BENCH_TOKENS=${BENCH_TOKENS:-256}
+PATCH="${ROOT_DIR}/scripts/patches/0004-llama-decode-graph-reuse.patch"
+PROMPT="Write an HTML page with a login form that has email, password and a remember-me switch."
+
+mkdir -p "${WORK_DIR}"
+if [[ ! -d "${WORK_DIR}/llama.cpp" ]]; then
+  git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${WORK_DIR}/llama.cpp"
+fi
+# Checked on every run: a checkout left behind by a failed apply must not be
+# built as if it were patched.
+if ! git -C "${WORK_DIR}/llama.cpp" apply --reverse --check "${PATCH}" >/dev/null 2>&1 &&
+  ! git -C "${WORK_DIR}/llama.cpp" apply "${PATCH}"; then
+  echo "error: ${PATCH##*/} does not apply to llama.cpp ${LLAMA_TAG}; rebase it first (see scripts/refresh_patches.sh)" >&2
+  exit 1
+fi
+
+cmake -S "${WORK_DIR}/llama.cpp" -B "${WORK_DIR}/build" -DCMAKE_BUILD_TYPE=Release \
+  -DLLAMA_NATIVE=ON -DLLAMA_BUILD_TESTS=OFF -DLLAMA_BUILD_SERVER=OFF >/dev/null
+cmake --build "${WORK_DIR}/build" --target main -j"$(nproc)" >/dev/null
+
+run() {
+  local name="$1"
+  local reuse="$2"
+  LLAMA_GRAPH_REUSE="${reuse}" "${WORK_DIR}/build/bin/main" -m "${MODEL}" -t "${THREADS}" -c 2048 \
+    -n "${BENCH_TOKENS}" --temp 0 --ignore-eos --log-disable -p "${PROMPT}" \
+    >"${WORK_DIR}/${name}.out" 2>"${WORK_DIR}/${name}.log"
+  local graphs
+  graphs=$(sed -n 's/.*single-token decode graphs: //p' "${WORK_DIR}/${name}.log" | tail -n 1)
+  local speed
+  speed=$(sed -n 's/.*[^t] eval time.*, *\([0-9.]*\) tokens per second.*/\1/p' "${WORK_DIR}/${name}.log" | tail -n 1)
+  if [[ -z "${graphs}" ]]; then
+    echo "error: ${name} run logged no graph stats; is the patch applied? (see ${WORK_DIR}/${name}.log)" >&2
+    exit 1
+  fi
+  printf "%-6s %s; decode %s tok/s\n" "${name}" "${graphs}" "${speed:-?}"
+}
+
+echo "model=${MODEL##*/} threads=${THREADS} tokens=${BENCH_TOKENS}"
+run build 0
+run reuse 1
+if ! cmp -s "${WORK_DIR}/build.out" "${WORK_DIR}/reuse.out"; then
+  echo "error: generated text differs with graph reuse (see ${WORK_DIR}/*.out)" >&2
+  exit 1
+fi
+echo "generated text identical"
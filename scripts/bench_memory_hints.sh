@@ -0,0 +1,73 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Measures the memory hints (app/src/main/cpp/memory_hints.*) on the Linux
+# host: builds stock llama.cpp and scripts/tools/memory_hints_bench.cpp with
+# the app's memory_hints.cpp, then runs greedy decoding with no hints, with
+# huge-page and access-phase hints, and with huge-page copies of the matmul
+# weights. Each run prints decode tok/s and the data TLB loads and misses
+# counted over its decode steps, plus what the hints achieved.
+#
+#   scripts/bench_memory_hints.sh model.gguf [threads]
+#
+# Set BENCH_TOKENS to change the decode steps (default 128) and HOT_COPY_MIB the
+# copy budget (default 256). The counters need kernel.perf_event_paranoid <= 2
+# and a CPU (or hypervisor) that exposes dTLB events; without them only tok/s is
+# reported. The results depend on the transparent huge page settings printed
+# first.
+
+if [[ $# -lt 1 ]]; then
+  echo "usage: $0 model.gguf [threads]" >&2
+  exit 1
+fi
+
+MODEL=$1
+THREADS=${2:-$(nproc)}
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/bench-memory-hints"}
+LLAMA_TAG=${LLAMA_TAG:-b2972}
+BENCH_TOKENS=${BENCH_TOKENS:-128}
+HOT_COPY_MIB=${HOT_COPY_MIB:-256}
+APP_CPP="${ROOT_DIR}/app/src/main/cpp"
+
+mkdir -p "${WORK_DIR}/shim/android"
+if [[ ! -d "${WORK_DIR}/llama.cpp" ]]; then
+  git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${WORK_DIR}/llama.cpp"
+fi
+
+# memory_hints.cpp logs through Android's log; on the host that goes to stderr.
+cat >"${WORK_DIR}/shim/android/log.h" <<'HEADER'
+#pragma once
+#include <cstdio>
+#define ANDROID_LOG_INFO 4
+#define ANDROID_LOG_ERROR 6
+#define __android_log_print(priority, tag, ...) \
+    (std::fprintf(stderr, "%s: ", tag), std::fprintf(stderr, __VA_ARGS__), std::fputc('\n', stderr))
+HEADER
+
+# A throwaway project that links the tool against the llama target.
+cat >"${WORK_DIR}/CMakeLists.txt" <<CMAKE
+cmake_minimum_required(VERSION 3.14)
+project(bench_memory_hints CXX C)
+add_subdirectory(llama.cpp)
+add_executable(memory_hints_bench "${ROOT_DIR}/scripts/tools/memory_hints_bench.cpp" "${APP_CPP}/memory_hints.cpp")
+target_include_directories(memory_hints_bench PRIVATE "${WORK_DIR}/shim" "${APP_CPP}")
+target_link_libraries(memory_hints_bench PRIVATE llama)
+target_compile_features(memory_hints_bench PRIVATE cxx_std_17)
+CMAKE
+
+cmake -S "${WORK_DIR}" -B "${WORK_DIR}/build" -DCMAKE_BUILD_TYPE=Release \
+  -DLLAMA_NATIVE=ON -DLLAMA_BUILD_TESTS=OFF -DLLAMA_BUILD_EXAMPLES=OFF -DLLAMA_BUILD_SERVER=OFF >/dev/null
+cmake --build "${WORK_DIR}/build" --target memory_hints_bench -j"$(nproc)" >/dev/null
+
+thp() {
+  cat "/sys/kernel/mm/transparent_hugepage/$1" 2>/dev/null || echo "?"
+}
+
+echo "model=${MODEL##*/} threads=${THREADS} tokens=${BENCH_TOKENS} copies=${HOT_COPY_MIB} MiB"
+echo "thp enabled: $(thp enabled); defrag: $(thp defrag); shmem: $(thp shmem_enabled)"
+echo "perf_event_paranoid=$(cat /proc/sys/kernel/perf_event_paranoid 2>/dev/null || echo '?')"
+for mode in off hints copies; do
+  "${WORK_DIR}/build/memory_hints_bench" "${MODEL}" "${mode}" "${THREADS}" "${BENCH_TOKENS}" "${HOT_COPY_MIB}" \
+    2>"${WORK_DIR}/${mode}.log"
+done
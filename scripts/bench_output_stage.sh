@@ -0,0 +1,32 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Times the output stage (app/src/main/cpp/output_stage.*) on the host,
+# without llama.cpp or a model: builds scripts/tools/output_stage_bench.cpp
+# against the app's sources and the vendored llama.h, with the vocabulary
+# calls stubbed and llama_decode replaced by a sleep. It prints, for the
+# serial schedule (wait for each token) and the pipelined one the decode loop
+# uses (wait for the previous token), the decode thread's time outside
+# llama_decode per token and the helper thread's processing time.
+#
+#   scripts/bench_output_stage.sh [cards] [decode_us]
+#
+# cards sets the document length (default 40), decode_us the simulated
+# llama_decode (default 20000). Set BENCH_REPS to change the repetitions.
+
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/bench-output-stage"}
+BENCH_REPS=${BENCH_REPS:-3}
+APP_CPP="${ROOT_DIR}/app/src/main/cpp"
+
+SOURCES=()
+for name in html_validator kv_checkpoints output_stage text_stream token_mask vocab_pieces; do
+  SOURCES+=("${APP_CPP}/${name}.cpp")
+done
+
+mkdir -p "${WORK_DIR}"
+"${CXX:-c++}" -std=c++17 -O2 -DNDEBUG -pthread -I"${APP_CPP}" -I"${APP_CPP}/llama/include" \
+  -I"${APP_CPP}/llama/ggml" -o "${WORK_DIR}/output_stage_bench" \
+  "${ROOT_DIR}/scripts/tools/output_stage_bench.cpp" "${SOURCES[@]}"
+
+"${WORK_DIR}/output_stage_bench" "${1:-40}" "${2:-20000}" "${BENCH_REPS}"
@@ -0,0 +1,24 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Checks and times the weight repack kernels (app/src/main/cpp/
+# weight_repack_kernels.*) on the host, without llama.cpp: builds
+# scripts/tools/repack_kernels_bench.cpp and runs it on random matrices with
+# the projection shapes of the model. It prints the repack time and memory
+# overhead, and per kernel set the largest error against ggml's reference dot
+# products and the single-threaded matmul time per decode and prefill token.
+# The end-to-end speedup over ggml's own kernels needs the mul_mat hook
+# (scripts/patches/0002-*) and is measured by QwenCoderBridge.benchmarkRepack().
+#
+#   scripts/bench_repack_kernels.sh [0.5b|1.5b] [q4_K|q8_0]
+
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/bench-repack-kernels"}
+BENCH_REPS=${BENCH_REPS:-5}
+APP_CPP="${ROOT_DIR}/app/src/main/cpp"
+
+mkdir -p "${WORK_DIR}"
+"${CXX:-c++}" -std=c++17 -O2 -DNDEBUG -I"${APP_CPP}" -o "${WORK_DIR}/repack_kernels_bench" \
+  "${ROOT_DIR}/scripts/tools/repack_kernels_bench.cpp" "${APP_CPP}/weight_repack_kernels.cpp"
+
+"${WORK_DIR}/repack_kernels_bench" "${1:-0.5b}" "${2:-q4_K}" "${BENCH_REPS}"
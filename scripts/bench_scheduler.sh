@@ -0,0 +1,69 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Concurrency report for the continuous-batching scheduler
+# (app/src/main/cpp/scheduler.*) on the host: builds stock llama.cpp and
+# scripts/tools/scheduler_bench.cpp with the app's decode-loop sources, then
+# runs 1 to 8 concurrent greedy requests and prints aggregate tok/s and the
+# per-request time to first token and total latency for each level.
+#
+#   scripts/bench_scheduler.sh model.gguf [threads]
+#
+# Set BENCH_TOKENS to change the tokens per request (default 128). The table
+# is also written to ${WORK_DIR}/report.txt, together with the model, the host
+# CPU and the llama.cpp tag, and the scheduler's own log to scheduler.log.
+
+if [[ $# -lt 1 ]]; then
+  echo "usage: $0 model.gguf [threads]" >&2
+  exit 1
+fi
+
+MODEL=$1
+THREADS=${2:-$(nproc)}
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/bench-scheduler"}
+LLAMA_TAG=${LLAMA_TAG:-b2972}
+BENCH_TOKENS=${BENCH_TOKENS:-128}
+APP_CPP="${ROOT_DIR}/app/src/main/cpp"
+
+mkdir -p "${WORK_DIR}/shim/android"
+if [[ ! -d "${WORK_DIR}/llama.cpp" ]]; then
+  git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${WORK_DIR}/llama.cpp"
+fi
+
+# The scheduler logs through Android's log; on the host that goes to stderr.
+cat >"${WORK_DIR}/shim/android/log.h" <<'HEADER'
+#pragma once
+#include <cstdio>
+#define ANDROID_LOG_INFO 4
+#define ANDROID_LOG_ERROR 6
+#define __android_log_print(priority, tag, ...) \
+    (std::fprintf(stderr, "%s: ", tag), std::fprintf(stderr, __VA_ARGS__), std::fputc('\n', stderr))
+HEADER
+
+SOURCES=""
+for name in scheduler cpu_topology governor grammar_mask html_grammar html_validator kv_checkpoints output_stage \
+    sampler text_stream token_mask vocab_pieces; do
+  SOURCES="${SOURCES} \"${APP_CPP}/${name}.cpp\""
+done
+
+# A throwaway project that links the tool against the stock llama and common targets.
+cat >"${WORK_DIR}/CMakeLists.txt" <<CMAKE
+cmake_minimum_required(VERSION 3.14)
+project(bench_scheduler CXX C)
+add_subdirectory(llama.cpp)
+find_package(Threads REQUIRED)
+add_executable(scheduler_bench "${ROOT_DIR}/scripts/tools/scheduler_bench.cpp" ${SOURCES})
+target_include_directories(scheduler_bench PRIVATE "${WORK_DIR}/shim" "${APP_CPP}")
+target_link_libraries(scheduler_bench PRIVATE common llama Threads::Threads)
+target_compile_features(scheduler_bench PRIVATE cxx_std_17)
+CMAKE
+
+cmake -S "${WORK_DIR}" -B "${WORK_DIR}/build" -DCMAKE_BUILD_TYPE=Release \
+  -DLLAMA_NATIVE=ON -DLLAMA_BUILD_TESTS=OFF -DLLAMA_BUILD_EXAMPLES=OFF -DLLAMA_BUILD_SERVER=OFF >/dev/null
+cmake --build "${WORK_DIR}/build" --target scheduler_bench -j"$(nproc)" >/dev/null
+
+{
+  echo "model=${MODEL##*/} llama.cpp=${LLAMA_TAG} cpu=$(sed -n 's/^model name[[:space:]]*: //p' /proc/cpuinfo | head -n 1)"
+  "${WORK_DIR}/build/scheduler_bench" "${MODEL}" "${THREADS}" "${BENCH_TOKENS}" 2>"${WORK_DIR}/scheduler.log"
+} | tee "${WORK_DIR}/report.txt"
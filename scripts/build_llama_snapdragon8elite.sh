@@ -3,9 +3,18 @@ set -euo pipefail
 
 # Builds llama.cpp for Snapdragon 8 Elite class devices (Galaxy Fold 7)
 # and stages the binaries under app/src/main so the Android project links
-# against the freshly built artifacts. Set LLAMA_VULKAN=OFF to skip Vulkan,
-# or BUILD_ELITE_VARIANT=ON to also emit cortex-x4 tuned binaries (copied
-# with *_elite suffixes for optional loading).
+# against the freshly built artifacts. Set LLAMA_VULKAN=OFF to skip Vulkan.
+# LLAMA_PATCHES=ON applies the patches under scripts/patches to the llama.cpp
+# checkout in order. It defaults to OFF: the patches were written without a
+# b2972 checkout at hand and have not been rebased onto one, so until each
+# one applies cleanly and has been benchmarked the build is stock llama.cpp
+# and the app's hooks for them stay unused.
+#
+# ggml is built for armv8.2-a+dotprod+fp16, the baseline every supported
+# device meets. With GGML_CPU_DISPATCH=ON (the default) the quantized
+# dot-product kernels are also built per GGML_CPU_VARIANTS for CPUs above it
+# (i8mm) and chosen at init from the HWCAPs (scripts/cmake/
+# ggml_cpu_dispatch.cmake); GGML_CPU_DISPATCH=OFF builds the baseline only.
 
 ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
 LLAMA_ROOT=${LLAMA_ROOT:-"${ROOT_DIR}/llama.cpp"}
@@ -19,10 +28,17 @@ INCLUDE_DEST="${ROOT_DIR}/app/src/main/cpp/llama/include"
 CPP_INCLUDE_DEST="${ROOT_DIR}/app/src/main/cpp/llama"
 
 LLAMA_VULKAN=${LLAMA_VULKAN:-OFF}
-BUILD_ELITE_VARIANT=${BUILD_ELITE_VARIANT:-OFF}
+LLAMA_PATCHES=${LLAMA_PATCHES:-OFF}
+PATCH_DIR="${ROOT_DIR}/scripts/patches"
+GGML_CPU_DISPATCH=${GGML_CPU_DISPATCH:-ON}
+GGML_CPU_VARIANTS=${GGML_CPU_VARIANTS:-"i8mm=-march=armv8.6-a+dotprod+fp16+i8mm"}
 
-GENERIC_CPU_FLAGS=${GENERIC_CPU_FLAGS:-"-O3 -DNDEBUG -ffunction-sections -fdata-sections -fomit-frame-pointer -funroll-loops -fPIC -march=armv8.2-a+dotprod+fp16 -ffast-math -fno-math-errno"}
-ELITE_CPU_FLAGS=${ELITE_CPU_FLAGS:-"-O3 -DNDEBUG -ffunction-sections -fdata-sections -fomit-frame-pointer -funroll-loops -fPIC -march=armv8.7-a+dotprod+fp16 -ffast-math -fno-math-errno"}
+uppercase() {
+  echo "$1" | tr '[:lower:]' '[:upper:]'
+}
+
+DEFAULT_ARCH="armv8.2-a+dotprod+fp16"
+CPU_FLAGS=${CPU_FLAGS:-"-O3 -DNDEBUG -ffunction-sections -fdata-sections -fomit-frame-pointer -funroll-loops -fPIC -march=${DEFAULT_ARCH} -ffast-math -fno-math-errno"}
 
 : "${ANDROID_NDK_ROOT:=${ANDROID_NDK_HOME:-${NDK_HOME:-}}}"
 if [[ -z "${ANDROID_NDK_ROOT}" || ! -d "${ANDROID_NDK_ROOT}" ]]; then
@@ -36,19 +52,38 @@ if [[ ! -d "${LLAMA_ROOT}" ]]; then
   git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${LLAMA_ROOT}"
 fi
 
+# Patches are applied once; a patch that is already in the tree is skipped.
+# One that does not apply (e.g. after a LLAMA_TAG bump) stops the build rather
+# than shipping libraries without it: rebase it by hand onto LLAMA_TAG, then
+# run scripts/refresh_patches.sh, or build with LLAMA_PATCHES=OFF.
+apply_patches() {
+  local patch
+  for patch in "${PATCH_DIR}"/*.patch; do
+    [[ -f "${patch}" ]] || continue
+    if git -C "${LLAMA_ROOT}" apply --reverse --check "${patch}" >/dev/null 2>&1; then
+      echo "Patch ${patch##*/} already applied" >&2
+    elif git -C "${LLAMA_ROOT}" apply --check "${patch}" >/dev/null 2>&1; then
+      git -C "${LLAMA_ROOT}" apply "${patch}"
+      echo "Applied ${patch##*/}" >&2
+    else
+      echo "error: ${patch##*/} does not apply to ${LLAMA_ROOT}" >&2
+      git -C "${LLAMA_ROOT}" apply --check "${patch}" || true
+      exit 1
+    fi
+  done
+}
+
+if [[ $(uppercase "${LLAMA_PATCHES}") == "ON" ]]; then
+  apply_patches
+fi
+
 mkdir -p "${BUILD_ROOT}" "${JNI_LIB_DEST}" "${INCLUDE_DEST}" "${CPP_INCLUDE_DEST}"
 
 TOOLCHAIN_FILE="${ANDROID_NDK_ROOT}/build/cmake/android.toolchain.cmake"
 
-uppercase() {
-  echo "$1" | tr '[:lower:]' '[:upper:]'
-}
-
-build_variant() {
-  local variant="$1"
-  local cpu_flags="$2"
-  local suffix="$3"
-  local build_dir="${BUILD_ROOT}/${variant}"
+build_llama() {
+  local cpu_flags="$1"
+  local build_dir="${BUILD_ROOT}/generic"
 
   local extra_cmake_args=()
   if [[ $(uppercase "${LLAMA_VULKAN}") == "ON" ]]; then
@@ -61,6 +96,11 @@ build_variant() {
     extra_cmake_args+=("-DVulkan_INCLUDE_DIR=${vk_include}")
     extra_cmake_args+=("-DVulkan_LIBRARY=${vk_library}")
   fi
+  if [[ $(uppercase "${GGML_CPU_DISPATCH}") == "ON" ]]; then
+    extra_cmake_args+=("-DCMAKE_PROJECT_INCLUDE=${ROOT_DIR}/scripts/cmake/ggml_cpu_dispatch.cmake")
+    extra_cmake_args+=("-DGGML_CPU_VARIANTS=${GGML_CPU_VARIANTS}")
+    extra_cmake_args+=("-DLLAMA_NATIVE=OFF")
+  fi
 
   local cmake_args=(
     -G "Ninja"
@@ -87,56 +127,48 @@ build_variant() {
   local targets=(llama ggml_shared ggml_static common)
   cmake --build "${build_dir}" --target "${targets[@]}"
 
-  local libs=("libllama.so" "libggml_shared.so" "libggml_static.a" "libggml.a" "libcommon.a")
-  for lib in "${libs[@]}"; do
-    local src="${build_dir}/${lib}"
-    [[ -f "${src}" ]] || continue
-    local dest_name="${lib}"
-    if [[ -n "${suffix}" && "${lib}" == *.so ]]; then
-      dest_name="${lib%.so}${suffix}.so"
-    elif [[ -n "${suffix}" ]]; then
-      dest_name="${lib%.*}${suffix}.${lib##*.}"
+  # llama.cpp sets no library output directory, so each library lands in the
+  # build directory of the CMakeLists that defines it: common/ for libcommon.a.
+  local required=("libllama.so" "libggml_shared.so" "common/libcommon.a")
+  local lib
+  for lib in "${required[@]}"; do
+    if [[ ! -f "${build_dir}/${lib}" ]]; then
+      echo "error: ${build_dir}/${lib} was not built; the app cannot link without it" >&2
+      exit 1
     fi
-    cp "${src}" "${JNI_LIB_DEST}/${dest_name}"
-
-    if [[ "${lib}" == "libggml_shared.so" ]]; then
-      local alias_name="libggml${suffix}.so"
-      cp "${src}" "${JNI_LIB_DEST}/${alias_name}"
+    cp "${build_dir}/${lib}" "${JNI_LIB_DEST}/${lib##*/}"
+  done
+  local optional=("libggml_static.a" "libggml.a")
+  for lib in "${optional[@]}"; do
+    if [[ -f "${build_dir}/${lib}" ]]; then
+      cp "${build_dir}/${lib}" "${JNI_LIB_DEST}/${lib}"
     fi
   done
 
   if [[ $(uppercase "${LLAMA_VULKAN}") == "ON" ]]; then
     local vk_src="${build_dir}/libggml-vulkan.so"
-    local vk_dest="libggml-vulkan${suffix}.so"
     if [[ -f "${vk_src}" ]]; then
-      cp "${vk_src}" "${JNI_LIB_DEST}/${vk_dest}"
+      cp "${vk_src}" "${JNI_LIB_DEST}/libggml-vulkan.so"
     else
       local shared_src="${build_dir}/libggml_shared.so"
       if [[ -f "${shared_src}" ]]; then
-        cp "${shared_src}" "${JNI_LIB_DEST}/${vk_dest}"
-        echo "warn: ${vk_src##*/} missing; aliased ${shared_src##*/} to ${vk_dest}" >&2
+        cp "${shared_src}" "${JNI_LIB_DEST}/libggml-vulkan.so"
+        echo "warn: ${vk_src##*/} missing; aliased ${shared_src##*/} to libggml-vulkan.so" >&2
       fi
     fi
   fi
 }
 
-# Clean destination so stale binaries do not linger
+# Clean destination so stale binaries (including the former *_elite variants) do not linger
 find "${JNI_LIB_DEST}" -maxdepth 1 -type f \( -name 'libllama*.so' -o -name 'libggml*.so' -o -name 'libggml*.a' -o -name 'libcommon*.a' \) -delete
 
-build_variant "generic" "${GENERIC_CPU_FLAGS}" ""
-
-if [[ $(uppercase "${BUILD_ELITE_VARIANT}") == "ON" ]]; then
-  build_variant "elite" "${ELITE_CPU_FLAGS}" "_elite"
-fi
+build_llama "${CPU_FLAGS}"
 
 if [[ -f "${JNI_LIB_DEST}/libggml_shared.so" ]]; then
   cp "${JNI_LIB_DEST}/libggml_shared.so" "${JNI_LIB_DEST}/libggml.so"
 fi
 
 # Copy optional acceleration libraries when present
-if [[ $(uppercase "${LLAMA_VULKAN}") == "ON" && -f "${BUILD_ROOT}/generic/libggml-vulkan.so" ]]; then
-  cp "${BUILD_ROOT}/generic/libggml-vulkan.so" "${JNI_LIB_DEST}/libggml-vulkan.so"
-fi
 for optlib in libggml-opencl.so libllava.so libllava_shared.so; do
   if [[ -f "${BUILD_ROOT}/generic/${optlib}" ]]; then
     cp "${BUILD_ROOT}/generic/${optlib}" "${JNI_LIB_DEST}/${optlib}"
@@ -0,0 +1,50 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Builds llama.cpp on the (x86-64 Linux) host the way the Android build does
+# with GGML_CPU_DISPATCH=ON: ggml for the baseline ISA, the quantized kernels
+# once more per variant (scripts/cmake/ggml_cpu_dispatch.cmake). It then runs
+# llama.cpp's test-quantize-fns, which checks every vec_dot kernel against the
+# reference implementation, once per variant the host supports, forcing each
+# one with GGML_CPU_VARIANT.
+#
+#   scripts/check_cpu_dispatch.sh [variants...]
+#
+# With no arguments the default x86 variants (avx2, avx) and base are checked.
+
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/check-cpu-dispatch"}
+LLAMA_TAG=${LLAMA_TAG:-b2972}
+VARIANTS=("$@")
+if [[ ${#VARIANTS[@]} -eq 0 ]]; then
+  VARIANTS=(avx2 avx base)
+fi
+
+mkdir -p "${WORK_DIR}"
+if [[ ! -d "${WORK_DIR}/llama.cpp" ]]; then
+  git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${WORK_DIR}/llama.cpp"
+fi
+
+# Native and per-ISA options off, so the baseline really is plain x86-64.
+cmake -S "${WORK_DIR}/llama.cpp" -B "${WORK_DIR}/build" -DCMAKE_BUILD_TYPE=Release \
+  -DCMAKE_PROJECT_INCLUDE="${ROOT_DIR}/scripts/cmake/ggml_cpu_dispatch.cmake" \
+  -DLLAMA_NATIVE=OFF -DLLAMA_AVX=OFF -DLLAMA_AVX2=OFF -DLLAMA_AVX512=OFF -DLLAMA_FMA=OFF -DLLAMA_F16C=OFF \
+  -DLLAMA_BUILD_TESTS=ON -DLLAMA_BUILD_EXAMPLES=OFF -DLLAMA_BUILD_SERVER=OFF >/dev/null
+cmake --build "${WORK_DIR}/build" --target test-quantize-fns -j"$(nproc)" >/dev/null
+
+status=0
+for variant in "${VARIANTS[@]}"; do
+  log="${WORK_DIR}/${variant}.log"
+  if ! GGML_CPU_VARIANT="${variant}" "${WORK_DIR}/build/bin/test-quantize-fns" >"${log}" 2>&1; then
+    echo "${variant}: FAILED (see ${log})"
+    status=1
+    continue
+  fi
+  used=$(sed -n 's/.*using \([a-z0-9_]*\) kernels.*/\1/p' "${log}" | head -n 1)
+  if [[ "${used}" != "${variant}" ]]; then
+    echo "${variant}: skipped, host ran ${used:-unknown} kernels instead"
+  else
+    echo "${variant}: ok"
+  fi
+done
+exit "${status}"
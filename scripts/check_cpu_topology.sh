@@ -0,0 +1,46 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Checks the CPU topology code (app/src/main/cpp/cpu_topology.*) on a Linux
+# host: builds scripts/tools/cpu_topology_check.cpp, which points discovery
+# at fake sysfs trees with a phone-like core layout, and runs it on every CPU
+# the shell may use and then under `taskset -c` for a few subsets, so class
+# grouping, selection and pinning are checked against each mask.
+#
+#   scripts/check_cpu_topology.sh [cpu-list...]
+#
+# Each argument is a taskset cpu list; without any, the first CPU, the last
+# one and the first half of the allowed CPUs are used.
+
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/check-cpu-topology"}
+APP_CPP="${ROOT_DIR}/app/src/main/cpp"
+
+mkdir -p "${WORK_DIR}"
+"${CXX:-c++}" -std=c++17 -O2 -I"${APP_CPP}" -o "${WORK_DIR}/cpu_topology_check" \
+  "${ROOT_DIR}/scripts/tools/cpu_topology_check.cpp" "${APP_CPP}/cpu_topology.cpp"
+
+SUBSETS=("$@")
+if [[ ${#SUBSETS[@]} -eq 0 ]]; then
+  read -r -a cpus <<<"$(taskset -pc $$ | sed 's/.*: //' | tr ',' '\n' |
+    awk -F- '{ last = NF > 1 ? $2 : $1; for (c = $1; c <= last; ++c) printf "%d ", c }')"
+  SUBSETS=("${cpus[0]}")
+  if [[ ${#cpus[@]} -gt 1 ]]; then
+    half=$(( ${#cpus[@]} / 2 ))
+    SUBSETS+=("${cpus[${#cpus[@]} - 1]}" "$(IFS=,; echo "${cpus[*]:0:${half}}")")
+  fi
+fi
+
+status=0
+run() {
+  local dir
+  dir=$(mktemp -d "${WORK_DIR}/sysfs.XXXXXX")
+  "$@" "${dir}" || status=1
+  rm -rf "${dir}"
+}
+
+run "${WORK_DIR}/cpu_topology_check"
+for subset in "${SUBSETS[@]}"; do
+  run taskset -c "${subset}" "${WORK_DIR}/cpu_topology_check"
+done
+exit "${status}"
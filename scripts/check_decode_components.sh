@@ -0,0 +1,35 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Behavior checks for the decode loop's model-independent parts on the host,
+# without llama.cpp or a model: builds scripts/tools/decode_components_check.cpp
+# against the app's sources and the vendored llama.h and runs it. Covered are
+# HtmlStreamValidator (accept/reject cases, byte-by-byte feeding, safe prefixes),
+# PatternAutomaton/TokenMask (every token bit against a direct search),
+# RepetitionDetector, utf8_safe_end (every cut of a mixed-width string) and
+# MpscQueue (FIFO, per-producer order under contention).
+#
+#   scripts/check_decode_components.sh
+#
+# SANITIZE (default address,undefined) picks the -fsanitize set; empty turns
+# it off.
+
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/check-decode-components"}
+SANITIZE=${SANITIZE-address,undefined}
+APP_CPP="${ROOT_DIR}/app/src/main/cpp"
+
+SOURCES=()
+for name in html_validator kv_checkpoints text_stream token_mask vocab_pieces; do
+  SOURCES+=("${APP_CPP}/${name}.cpp")
+done
+FLAGS=(-std=c++17 -O1 -g -pthread -Wall -Wextra -Wno-unused-parameter)
+if [[ -n "${SANITIZE}" ]]; then
+  FLAGS+=("-fsanitize=${SANITIZE}" -fno-omit-frame-pointer)
+fi
+
+mkdir -p "${WORK_DIR}"
+"${CXX:-c++}" "${FLAGS[@]}" -I"${APP_CPP}" -I"${APP_CPP}/llama/include" -I"${APP_CPP}/llama/ggml" \
+  -o "${WORK_DIR}/decode_components_check" "${ROOT_DIR}/scripts/tools/decode_components_check.cpp" "${SOURCES[@]}"
+
+"${WORK_DIR}/decode_components_check"
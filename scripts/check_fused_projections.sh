@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Checks the fused QKV / gate-up projection patch (scripts/patches/0003-*) on
+# the host: builds the patched llama.cpp and scripts/tools/fused_projections_check.cpp
+# against it, then runs the same greedy generation with the transform off and
+# on. The tool fails unless logits and tokens match, and prints decode speed
+# and a per-layer timing table for both graphs.
+#
+#   scripts/check_fused_projections.sh model.gguf [threads]
+#
+# Set CHECK_STEPS to change the number of greedy decode steps (default 64).
+
+if [[ $# -lt 1 ]]; then
+  echo "usage: $0 model.gguf [threads]" >&2
+  exit 1
+fi
+
+MODEL=$1
+THREADS=${2:-$(nproc)}
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/check-fused-projections"}
+LLAMA_TAG=${LLAMA_TAG:-b2972}
+CHECK_STEPS=${CHECK_STEPS:-64}
+PATCH="${ROOT_DIR}/scripts/patches/0003-llama-fused-qkv-gate-up.patch"
+
+mkdir -p "${WORK_DIR}"
+if [[ ! -d "${WORK_DIR}/llama.cpp" ]]; then
+  git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${WORK_DIR}/llama.cpp"
+fi
+# Checked on every run: a checkout left behind by a failed apply must not be
+# built as if it were patched.
+if ! git -C "${WORK_DIR}/llama.cpp" apply --reverse --check "${PATCH}" >/dev/null 2>&1 &&
+  ! git -C "${WORK_DIR}/llama.cpp" apply "${PATCH}"; then
+  echo "error: ${PATCH##*/} does not apply to llama.cpp ${LLAMA_TAG}; rebase it first (see scripts/refresh_patches.sh)" >&2
+  exit 1
+fi
+
+# A throwaway project that links the tool against the patched llama target.
+cat >"${WORK_DIR}/CMakeLists.txt" <<CMAKE
+cmake_minimum_required(VERSION 3.14)
+project(check_fused_projections CXX C)
+add_subdirectory(llama.cpp)
+add_executable(fused_projections_check "${ROOT_DIR}/scripts/tools/fused_projections_check.cpp")
+target_link_libraries(fused_projections_check PRIVATE llama)
+target_compile_features(fused_projections_check PRIVATE cxx_std_17)
+CMAKE
+
+cmake -S "${WORK_DIR}" -B "${WORK_DIR}/build" -DCMAKE_BUILD_TYPE=Release \
+  -DLLAMA_NATIVE=ON -DLLAMA_BUILD_TESTS=OFF -DLLAMA_BUILD_EXAMPLES=OFF -DLLAMA_BUILD_SERVER=OFF >/dev/null
+cmake --build "${WORK_DIR}/build" --target fused_projections_check -j"$(nproc)" >/dev/null
+
+echo "model=${MODEL##*/}"
+"${WORK_DIR}/build/fused_projections_check" "${MODEL}" "${THREADS}" "${CHECK_STEPS}"
@@ -0,0 +1,54 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Checks GrammarMask (app/src/main/cpp/grammar_mask.*) against llama.cpp's own
+# grammar engine on the host: builds stock llama.cpp and
+# scripts/tools/grammar_mask_check.cpp with the app's grammar sources, then
+# walks a corpus of valid and invalid HTML documents through both engines under
+# html_grammar(). The tool fails unless both allow the same tokens at every
+# step and reject each document at the same token. It then generates greedily
+# from an HTML request with and without the grammar and prints the token
+# selection cost per token against the decode step, with llama_sample_grammar
+# timed on the same states for reference.
+#
+#   scripts/check_grammar_mask.sh model.gguf
+#
+# Set CHECK_TOKENS to change the number of generated tokens (default 192).
+
+if [[ $# -lt 1 ]]; then
+  echo "usage: $0 model.gguf" >&2
+  exit 1
+fi
+
+MODEL=$1
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/check-grammar-mask"}
+LLAMA_TAG=${LLAMA_TAG:-b2972}
+CHECK_TOKENS=${CHECK_TOKENS:-192}
+APP_CPP="${ROOT_DIR}/app/src/main/cpp"
+
+mkdir -p "${WORK_DIR}"
+if [[ ! -d "${WORK_DIR}/llama.cpp" ]]; then
+  git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${WORK_DIR}/llama.cpp"
+fi
+
+# A throwaway project that links the tool against the stock llama and common
+# targets; the host build keeps llama.cpp's default symbol visibility.
+cat >"${WORK_DIR}/CMakeLists.txt" <<CMAKE
+cmake_minimum_required(VERSION 3.14)
+project(check_grammar_mask CXX C)
+add_subdirectory(llama.cpp)
+add_executable(grammar_mask_check "${ROOT_DIR}/scripts/tools/grammar_mask_check.cpp"
+  "${APP_CPP}/grammar_mask.cpp" "${APP_CPP}/html_grammar.cpp" "${APP_CPP}/vocab_pieces.cpp"
+  "${APP_CPP}/token_mask.cpp")
+target_include_directories(grammar_mask_check PRIVATE "${APP_CPP}")
+target_link_libraries(grammar_mask_check PRIVATE common llama)
+target_compile_features(grammar_mask_check PRIVATE cxx_std_17)
+CMAKE
+
+cmake -S "${WORK_DIR}" -B "${WORK_DIR}/build" -DCMAKE_BUILD_TYPE=Release \
+  -DLLAMA_NATIVE=ON -DLLAMA_BUILD_TESTS=OFF -DLLAMA_BUILD_EXAMPLES=OFF -DLLAMA_BUILD_SERVER=OFF >/dev/null
+cmake --build "${WORK_DIR}/build" --target grammar_mask_check -j"$(nproc)" >/dev/null
+
+echo "model=${MODEL##*/}"
+"${WORK_DIR}/build/grammar_mask_check" "${MODEL}" 8 "${CHECK_TOKENS}"
@@ -0,0 +1,141 @@
+// Runtime selection between the copies of ggml's quantized dot-product
+// kernels that ggml_cpu_dispatch.cmake compiles into the library. The public
+// ggml_vec_dot_* symbols, which ggml.c's type traits point at, forward to the
+// variant chosen on first use: the best one whose features the CPU reports
+// (getauxval HWCAPs on ARM, cpuid on x86), or the base copy. Setting
+// GGML_CPU_VARIANT to a variant name forces it when the CPU supports it,
+// which is how the host check exercises every path.
+
+#include "ggml-quants.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#ifndef HWCAP2_I8MM
+#define HWCAP2_I8MM (1 << 13)
+#endif
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "ggml-cpu-kernels.h"
+
+struct ggml_cpu_variant_kernels {
+    const char * name;
+    ggml_vec_dot_t vec_dot[GGML_CPU_KERNEL_COUNT];  // in GGML_CPU_KERNELS order
+};
+
+static const struct ggml_cpu_variant_kernels ggml_cpu_variants[] = { GGML_CPU_VARIANT_TABLE };
+
+#define GGML_CPU_VARIANT_COUNT (sizeof(ggml_cpu_variants) / sizeof(ggml_cpu_variants[0]))
+
+GGML_API const char * ggml_cpu_variant(void);
+
+#if defined(__aarch64__) && defined(__linux__)
+
+static bool ggml_cpu_has(const char * feature) {
+    const unsigned long hwcap  = getauxval(AT_HWCAP);
+    const unsigned long hwcap2 = getauxval(AT_HWCAP2);
+    // Each variant is built with +fp16 as well.
+    const bool dotprod = (hwcap & HWCAP_ASIMDDP) && (hwcap & HWCAP_ASIMDHP) && (hwcap & HWCAP_FPHP);
+    if (strcmp(feature, "dotprod") == 0) {
+        return dotprod;
+    }
+    if (strcmp(feature, "i8mm") == 0) {
+        return dotprod && (hwcap2 & HWCAP2_I8MM);
+    }
+    return false;
+}
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+static unsigned long long ggml_cpu_xgetbv(void) {
+    unsigned int lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((unsigned long long) hi << 32) | lo;
+}
+
+static bool ggml_cpu_has(const char * feature) {
+    unsigned int a, b, c, d;
+    if (!__get_cpuid(1, &a, &b, &c, &d)) {
+        return false;
+    }
+    // AVX state must be enabled by the OS (XCR0 bits 1 and 2), not just present.
+    const bool avx = (c & bit_AVX) && (c & bit_OSXSAVE) && (ggml_cpu_xgetbv() & 0x6) == 0x6 && (c & bit_F16C);
+    const bool fma = (c & bit_FMA) != 0;
+    unsigned int b7 = 0;
+    if (!__get_cpuid_count(7, 0, &a, &b7, &c, &d)) {
+        b7 = 0;
+    }
+    const bool avx2 = avx && fma && (b7 & bit_AVX2);
+    if (strcmp(feature, "avx") == 0) {
+        return avx;
+    }
+    if (strcmp(feature, "avx2") == 0) {
+        return avx2;
+    }
+    if (strcmp(feature, "avx512") == 0) {
+        const unsigned int need = bit_AVX512F | bit_AVX512BW | bit_AVX512VL | bit_AVX512DQ;
+        return avx2 && (b7 & need) == need && (ggml_cpu_xgetbv() & 0xe6) == 0xe6;
+    }
+    return false;
+}
+
+#else
+
+static bool ggml_cpu_has(const char * feature) {
+    (void) feature;
+    return false;
+}
+
+#endif
+
+static const struct ggml_cpu_variant_kernels * ggml_cpu_selected;
+static pthread_once_t ggml_cpu_once = PTHREAD_ONCE_INIT;
+
+// The base copy is last and always runs.
+static void ggml_cpu_select(void) {
+    const char * forced = getenv("GGML_CPU_VARIANT");
+    if (forced && !*forced) {
+        forced = NULL;
+    }
+    const struct ggml_cpu_variant_kernels * pick = &ggml_cpu_variants[GGML_CPU_VARIANT_COUNT - 1];
+    for (size_t i = 0; i + 1 < GGML_CPU_VARIANT_COUNT; ++i) {
+        const struct ggml_cpu_variant_kernels * variant = &ggml_cpu_variants[i];
+        if ((!forced || strcmp(forced, variant->name) == 0) && ggml_cpu_has(variant->name)) {
+            pick = variant;
+            break;
+        }
+    }
+    if (forced) {
+        fprintf(stderr, "%s: GGML_CPU_VARIANT=%s, using %s kernels\n", __func__, forced, pick->name);
+    }
+    __atomic_store_n(&ggml_cpu_selected, pick, __ATOMIC_RELEASE);
+}
+
+static inline const struct ggml_cpu_variant_kernels * ggml_cpu_kernels(void) {
+    const struct ggml_cpu_variant_kernels * kernels = __atomic_load_n(&ggml_cpu_selected, __ATOMIC_ACQUIRE);
+    if (kernels == NULL) {
+        pthread_once(&ggml_cpu_once, ggml_cpu_select);
+        kernels = __atomic_load_n(&ggml_cpu_selected, __ATOMIC_ACQUIRE);
+    }
+    return kernels;
+}
+
+const char * ggml_cpu_variant(void) {
+    return ggml_cpu_kernels()->name;
+}
+
+#define GGML_CPU_KERNEL(name, index)                                                                   \
+    void name(int n, float * GGML_RESTRICT s, size_t bs, const void * GGML_RESTRICT vx, size_t bx,     \
+              const void * GGML_RESTRICT vy, size_t by, int nrc) {                                     \
+        ggml_cpu_kernels()->vec_dot[index](n, s, bs, vx, bx, vy, by, nrc);                             \
+    }
+
+GGML_CPU_KERNELS
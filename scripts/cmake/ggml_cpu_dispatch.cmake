@@ -0,0 +1,140 @@
+# Builds ggml's quantized dot-product kernels (ggml-quants.c) once per CPU
+# variant inside the same libggml, and picks one variant at init from the
+# CPU's feature bits (ggml-cpu-dispatch.c next to this file). The build
+# scripts load this file through CMAKE_PROJECT_INCLUDE, so llama.cpp itself is
+# untouched: the setup is deferred until the top-level CMakeLists.txt has
+# defined the ggml target.
+#
+# GGML_CPU_VARIANTS lists name=flags pairs, best first; the names must be
+# features ggml-cpu-dispatch.c can detect. Everything else in ggml, including
+# the "base" copy of the kernels, is compiled with the build's own flags,
+# which every target CPU must support, so the variants should only add
+# features on top of that baseline: on arm64 the build uses
+# armv8.2-a+dotprod+fp16 and the default variant adds i8mm.
+
+include_guard(GLOBAL)
+
+if (NOT CMAKE_CURRENT_SOURCE_DIR STREQUAL CMAKE_SOURCE_DIR)
+    return()
+endif()
+
+if (CMAKE_SYSTEM_PROCESSOR MATCHES "^(aarch64|arm64|ARM64)$")
+    set(GGML_CPU_DEFAULT_VARIANTS "i8mm=-march=armv8.6-a+dotprod+fp16+i8mm")
+elseif (CMAKE_SYSTEM_PROCESSOR MATCHES "^(x86_64|AMD64|amd64)$")
+    set(GGML_CPU_DEFAULT_VARIANTS "avx2=-mavx2 -mfma -mf16c;avx=-mavx -mf16c")
+else()
+    set(GGML_CPU_DEFAULT_VARIANTS "")
+endif()
+
+set(GGML_CPU_VARIANTS "${GGML_CPU_DEFAULT_VARIANTS}" CACHE STRING "ggml kernel variants (name=flags;...), best first")
+set(GGML_CPU_DISPATCH_SOURCE "${CMAKE_CURRENT_LIST_DIR}/ggml-cpu-dispatch.c")
+
+function(ggml_cpu_dispatch_setup)
+    if (NOT TARGET ggml)
+        message(WARNING "ggml_cpu_dispatch: no ggml target; building without CPU dispatch")
+        return()
+    endif()
+
+    get_target_property(ggml_dir ggml SOURCE_DIR)
+    get_target_property(ggml_sources ggml SOURCES)
+    set(quants_source "")
+    foreach (source IN LISTS ggml_sources)
+        if (source MATCHES "(^|/)ggml-quants\\.c$")
+            set(quants_source "${source}")
+        endif()
+    endforeach()
+    if (NOT quants_source)
+        message(WARNING "ggml_cpu_dispatch: ggml-quants.c is not part of ggml; building without CPU dispatch")
+        return()
+    endif()
+    get_filename_component(quants_path "${quants_source}" ABSOLUTE BASE_DIR "${ggml_dir}")
+    get_filename_component(quants_dir "${quants_path}" DIRECTORY)
+
+    # Every function ggml-quants.c exports is declared in ggml-quants.h, plus
+    # ggml_validate_row_data from ggml.h. The vec_dot kernels are dispatched;
+    # the other functions only need private names in the variant copies.
+    file(STRINGS "${quants_dir}/ggml-quants.h" declarations REGEX "^[a-z_0-9 ]+[ *]+[A-Za-z_0-9]+ *\\(")
+    set(kernels "")
+    set(functions ggml_validate_row_data)
+    foreach (declaration IN LISTS declarations)
+        string(REGEX REPLACE "^[a-z_0-9 ]+[ *]+([A-Za-z_0-9]+) *\\(.*" "\\1" name "${declaration}")
+        if (name MATCHES "^ggml_vec_dot_")
+            list(APPEND kernels "${name}")
+        else()
+            list(APPEND functions "${name}")
+        endif()
+    endforeach()
+    list(REMOVE_DUPLICATES kernels)
+    list(REMOVE_DUPLICATES functions)
+    list(LENGTH kernels kernel_count)
+    if (kernel_count EQUAL 0)
+        message(WARNING "ggml_cpu_dispatch: no ggml_vec_dot_* kernels in ggml-quants.h; building without CPU dispatch")
+        return()
+    endif()
+
+    set(gen_dir "${CMAKE_BINARY_DIR}/ggml-cpu-dispatch")
+    set(generated "// Generated by ggml_cpu_dispatch.cmake; do not edit.\n\n")
+    string(APPEND generated "#define GGML_CPU_KERNEL_COUNT ${kernel_count}\n\n")
+
+    # The base copy is ggml's own ggml-quants.c with the kernels renamed.
+    set(rename "")
+    foreach (name IN LISTS kernels)
+        string(APPEND rename "#define ${name} ${name}_base\n")
+    endforeach()
+    file(WRITE "${gen_dir}/ggml-cpu-rename-base.h" "${rename}")
+    set_source_files_properties("${quants_path}" DIRECTORY "${ggml_dir}" PROPERTIES
+        COMPILE_OPTIONS "-include;${gen_dir}/ggml-cpu-rename-base.h")
+
+    set(variant_names "")
+    set(variant_sources "")
+    foreach (variant IN LISTS GGML_CPU_VARIANTS)
+        if (NOT variant MATCHES "^([a-z0-9_]+)=(.*)$")
+            message(FATAL_ERROR "ggml_cpu_dispatch: bad GGML_CPU_VARIANTS entry '${variant}'")
+        endif()
+        set(variant_name "${CMAKE_MATCH_1}")
+        separate_arguments(variant_flags NATIVE_COMMAND "${CMAKE_MATCH_2}")
+
+        set(rename "")
+        foreach (name IN LISTS kernels functions)
+            string(APPEND rename "#define ${name} ${name}_${variant_name}\n")
+        endforeach()
+        file(WRITE "${gen_dir}/ggml-cpu-rename-${variant_name}.h" "${rename}")
+        set(wrapper "${gen_dir}/ggml-quants-${variant_name}.c")
+        file(WRITE "${wrapper}" "#include \"ggml-cpu-rename-${variant_name}.h\"\n#include \"${quants_path}\"\n")
+        set_source_files_properties("${wrapper}" DIRECTORY "${ggml_dir}" PROPERTIES
+            COMPILE_OPTIONS "${variant_flags}")
+        list(APPEND variant_names "${variant_name}")
+        list(APPEND variant_sources "${wrapper}")
+    endforeach()
+    list(APPEND variant_names base)
+
+    foreach (variant_name IN LISTS variant_names)
+        foreach (name IN LISTS kernels)
+            string(APPEND generated "void ${name}_${variant_name}(int n, float * GGML_RESTRICT s, size_t bs, "
+                   "const void * GGML_RESTRICT vx, size_t bx, const void * GGML_RESTRICT vy, size_t by, int nrc);\n")
+        endforeach()
+    endforeach()
+    string(APPEND generated "\n#define GGML_CPU_VARIANT_TABLE \\\n")
+    foreach (variant_name IN LISTS variant_names)
+        string(APPEND generated "    { \"${variant_name}\", {")
+        foreach (name IN LISTS kernels)
+            string(APPEND generated " ${name}_${variant_name},")
+        endforeach()
+        string(APPEND generated " } }, \\\n")
+    endforeach()
+    string(APPEND generated "\n#define GGML_CPU_KERNELS \\\n")
+    set(index 0)
+    foreach (name IN LISTS kernels)
+        string(APPEND generated "    GGML_CPU_KERNEL(${name}, ${index}) \\\n")
+        math(EXPR index "${index} + 1")
+    endforeach()
+    file(WRITE "${gen_dir}/ggml-cpu-kernels.h" "${generated}\n")
+
+    target_sources(ggml PRIVATE ${variant_sources} "${GGML_CPU_DISPATCH_SOURCE}")
+    set_source_files_properties("${GGML_CPU_DISPATCH_SOURCE}" DIRECTORY "${ggml_dir}" PROPERTIES
+        INCLUDE_DIRECTORIES "${gen_dir};${quants_dir}")
+    list(JOIN variant_names ", " summary)
+    message(STATUS "ggml_cpu_dispatch: ${kernel_count} kernels in variants ${summary}")
+endfunction()
+
+cmake_language(DEFER DIRECTORY "${CMAKE_SOURCE_DIR}" CALL ggml_cpu_dispatch_setup)
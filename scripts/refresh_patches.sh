@@ -0,0 +1,42 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Rewrites scripts/patches/*.patch from a real llama.cpp checkout. Clones
+# LLAMA_TAG, applies the patches in order and replaces each patch body with
+# `git diff` of the tree before and after it, which normalizes hunk offsets,
+# fuzz and index lines. It cannot repair a patch whose context lines differ
+# from the tagged source: `git apply` rejects it, and the script stops there.
+# Rebase that patch by hand in the clone (edit the tree, `git diff` it into
+# the patch) and run the script again. The description above each patch's
+# first `diff --git` line is kept.
+#
+#   scripts/refresh_patches.sh
+
+ROOT_DIR=$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)
+WORK_DIR=${WORK_DIR:-"${ROOT_DIR}/build/refresh-patches"}
+LLAMA_TAG=${LLAMA_TAG:-b2972}
+PATCH_DIR="${ROOT_DIR}/scripts/patches"
+TREE="${WORK_DIR}/llama.cpp"
+
+rm -rf "${TREE}"
+mkdir -p "${WORK_DIR}"
+git clone --branch "${LLAMA_TAG}" --depth 1 https://github.com/ggerganov/llama.cpp.git "${TREE}"
+
+before=$(git -C "${TREE}" write-tree)
+for patch in "${PATCH_DIR}"/*.patch; do
+  [[ -f "${patch}" ]] || continue
+  if ! git -C "${TREE}" apply "${patch}"; then
+    echo "error: ${patch##*/} does not apply to llama.cpp ${LLAMA_TAG}; rebase it in ${TREE}" >&2
+    exit 1
+  fi
+  git -C "${TREE}" add -A
+  after=$(git -C "${TREE}" write-tree)
+  header=$(sed '/^diff --git /,$d' "${patch}")
+  {
+    printf '%s\n\n' "${header}"
+    git -C "${TREE}" diff "${before}" "${after}"
+  } >"${patch}.new"
+  mv "${patch}.new" "${patch}"
+  echo "Refreshed ${patch##*/}" >&2
+  before=${after}
+done
@@ -0,0 +1,192 @@
+// Host check for CpuTopology (app/src/main/cpp/cpu_topology.*), built and run
+// by scripts/check_cpu_topology.sh. Discovery is pointed at fake sysfs trees
+// written under the directory given on the command line, and the results are
+// compared with what the tree and the process's CPU mask imply, so the same
+// binary checks whatever subset it runs on: the script runs it unpinned and
+// under `taskset -c`. The main tree has a phone-like layout by cpu id
+// (0-1 little, 2-5 mid, 6-7 prime, repeating); two more trees cover a
+// frequency-only sysfs and an unreadable one. Last, the process pins itself
+// to the fastest class with pin_current_thread() and discovers again.
+
+#include "cpu_topology.h"
+
+#include <sched.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+
+using genui::CoreClass;
+using genui::CpuTopology;
+
+constexpr int kTreeCpus = 64;
+
+struct Layout {
+    int64_t capacity;
+    int64_t max_freq_khz;
+};
+
+Layout phone_layout(int cpu) {
+    switch (cpu % 8) {
+        case 0:
+        case 1:
+            return {325, 2016000};
+        case 6:
+        case 7:
+            return {1024, 4320000};
+        default:
+            return {740, 3532000};
+    }
+}
+
+int failures = 0;
+int checks = 0;
+
+void check(bool ok, const std::string &what) {
+    ++checks;
+    if (!ok) {
+        ++failures;
+        std::printf("FAILED: %s\n", what.c_str());
+    }
+}
+
+std::string cpus_text(const std::vector<int> &cpus) {
+    return "[" + genui::format_cpus(cpus) + "]";
+}
+
+void write_number(const std::string &path, int64_t value) {
+    std::ofstream(path) << value << "\n";
+}
+
+// cpuN/cpu_capacity and cpuN/cpufreq/cpuinfo_max_freq for every cpu id,
+// whether or not the process may run there.
+std::string write_tree(const std::string &base, const char *name, bool capacity, bool freq) {
+    const std::string root = base + "/" + name;
+    mkdir(root.c_str(), 0755);
+    for (int cpu = 0; cpu < kTreeCpus; ++cpu) {
+        const std::string dir = root + "/cpu" + std::to_string(cpu);
+        mkdir(dir.c_str(), 0755);
+        mkdir((dir + "/cpufreq").c_str(), 0755);
+        const Layout layout = phone_layout(cpu);
+        if (capacity) {
+            write_number(dir + "/cpu_capacity", layout.capacity);
+        }
+        if (freq) {
+            write_number(dir + "/cpufreq/cpuinfo_max_freq", layout.max_freq_khz);
+        }
+    }
+    return root;
+}
+
+std::vector<int> allowed_cpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+// Discovery over a tree whose capacities come from `key` (capacity or
+// frequency) must group the allowed cpus into one class per distinct key.
+void check_layout(const std::string &root, const std::vector<int> &allowed, bool by_capacity, const char *label) {
+    const std::string at = std::string(label) + ": ";
+    const CpuTopology topology = CpuTopology::discover(root);
+    std::vector<int> found;
+    for (const genui::CpuCore &core : topology.cores()) {
+        found.push_back(core.id);
+        const Layout layout = phone_layout(core.id);
+        const int64_t expected = by_capacity ? layout.capacity : layout.max_freq_khz;
+        check(core.capacity == expected, at + "capacity of cpu" + std::to_string(core.id));
+        check(core.max_freq_khz == layout.max_freq_khz, at + "max freq of cpu" + std::to_string(core.id));
+    }
+    check(found == allowed, at + "cores " + cpus_text(found) + " != allowed " + cpus_text(allowed));
+
+    std::set<int64_t, std::greater<int64_t>> keys;
+    for (const int cpu : allowed) {
+        keys.insert(by_capacity ? phone_layout(cpu).capacity : phone_layout(cpu).max_freq_khz);
+    }
+    check(topology.clusters() == static_cast<int32_t>(keys.size()),
+          at + "clusters " + std::to_string(topology.clusters()) + " != " + std::to_string(keys.size()));
+    if (keys.empty()) {
+        return;
+    }
+    const int64_t fastest = *keys.begin();
+    std::vector<int> prime;
+    std::vector<int> performance;
+    for (const genui::CpuCore &core : topology.cores()) {
+        const int32_t cluster = static_cast<int32_t>(std::distance(keys.begin(), keys.find(core.capacity)));
+        check(core.cluster == cluster, at + "cluster of cpu" + std::to_string(core.id));
+        if (core.capacity == fastest) {
+            prime.push_back(core.id);
+        }
+        if (core.capacity * 2 >= fastest) {
+            performance.push_back(core.id);
+        }
+    }
+    check(topology.select(CoreClass::kAll) == allowed, at + "select(kAll)");
+    check(topology.select(CoreClass::kPrime) == prime,
+          at + "select(kPrime) " + cpus_text(topology.select(CoreClass::kPrime)) + " != " + cpus_text(prime));
+    check(topology.select(CoreClass::kPerformance) == performance, at + "select(kPerformance)");
+    check(topology.fastest(1) == prime, at + "fastest(1)");
+    check(topology.fastest(static_cast<int>(allowed.size())) == allowed, at + "fastest(all)");
+
+    const genui::ThreadSet one = topology.thread_set(CoreClass::kAll, 1);
+    check(one.threads == 1 && one.cpus.size() == 1 && one.cpus[0] == prime[0],
+          at + "thread_set(kAll, 1) " + cpus_text(one.cpus));
+    const genui::ThreadSet all = topology.thread_set(CoreClass::kAll);
+    check(all.threads == static_cast<int32_t>(allowed.size()) && all.cpus == allowed, at + "thread_set(kAll)");
+    check(topology.describe().find(":cap=" + std::to_string(fastest) + "@") != std::string::npos,
+          at + "describe() \"" + topology.describe() + "\"");
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s work_dir\n", argv[0]);
+        return 1;
+    }
+    const std::string base = argv[1];
+    const std::vector<int> allowed = allowed_cpus();
+    if (allowed.empty() || allowed.back() >= kTreeCpus) {
+        std::fprintf(stderr, "cpus %s are outside the fake tree\n", cpus_text(allowed).c_str());
+        return 1;
+    }
+
+    const std::string capacity_root = write_tree(base, "capacity", true, true);
+    check_layout(capacity_root, allowed, true, "capacity");
+    check_layout(write_tree(base, "freq-only", false, true), allowed, false, "freq-only");
+
+    // Nothing readable: one class of capacity 0, every allowed core used.
+    const CpuTopology blind = CpuTopology::discover(write_tree(base, "unreadable", false, false));
+    check(blind.clusters() == 1 && blind.select(CoreClass::kPrime) == allowed, "unreadable: one class");
+    check(blind.thread_set(CoreClass::kPerformance).cpus == allowed, "unreadable: thread_set(kPerformance)");
+    check(CpuTopology::discover(base + "/missing").cores().size() == allowed.size(), "missing root");
+
+    check(genui::format_cpus({0, 2, 4, 5, 6, 7}) == "0,2,4-7", "format_cpus");
+    check(genui::format_cpus({}).empty(), "format_cpus(empty)");
+    check(!genui::pin_current_thread({}), "pin_current_thread(empty)");
+
+    // Pinning to the fastest class must shrink what discovery sees to it.
+    const std::vector<int> prime = CpuTopology::discover(capacity_root).select(CoreClass::kPrime);
+    check(genui::pin_current_thread(prime), "pin_current_thread" + cpus_text(prime));
+    check(allowed_cpus() == prime, "affinity after pinning");
+    check_layout(capacity_root, prime, true, "pinned");
+    genui::pin_current_thread(allowed);
+
+    std::printf("cpus %s: %d checks, %d failed\n", cpus_text(allowed).c_str(), checks, failures);
+    return failures == 0 ? 0 : 1;
+}
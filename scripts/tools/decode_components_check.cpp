@@ -0,0 +1,440 @@
+// Host behavior checks for the decode loop's model-independent parts, built
+// and run by scripts/check_decode_components.sh: HtmlStreamValidator,
+// PatternAutomaton and TokenMask, RepetitionDetector, utf8_safe_end and
+// MpscQueue. Nothing here needs llama.cpp or a model; the three vocabulary
+// calls VocabPieces::build makes are served from a small synthetic vocabulary.
+
+#include "html_validator.h"
+#include "kv_checkpoints.h"
+#include "mpsc_queue.h"
+#include "text_stream.h"
+#include "token_mask.h"
+#include "vocab_pieces.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace genui;
+
+int failures = 0;
+int checks = 0;
+
+void check(bool ok, const std::string &what) {
+    ++checks;
+    if (!ok) {
+        ++failures;
+        std::printf("FAILED: %s\n", what.c_str());
+    }
+}
+
+// Single bytes, then multi-byte pieces that straddle the banned rules.
+const char *const kPieces[] = {
+        "http", "https", "://", "//", "src=\"", "src='", "SRC=\"HT", "tp", "href=", "\"//cdn", "=\"",
+        "url(", "URL('", "@im", "port", "@import url(", "<li", "nk", "<link", "<script", " src", "fonts.",
+        "googleapis", "cdn", "<div>", "</div>", "style", " class=\"a\"", "img", "x", " ",
+};
+const char *const kEndOfTurn = "<|im_end|>";
+
+std::vector<std::string> &vocab() {
+    static std::vector<std::string> v = [] {
+        std::vector<std::string> built;
+        for (int c = 0; c < 256; ++c) {
+            built.emplace_back(1, static_cast<char>(c));
+        }
+        for (const char *piece : kPieces) {
+            built.emplace_back(piece);
+        }
+        built.emplace_back(kEndOfTurn);
+        return built;
+    }();
+    return v;
+}
+
+llama_token end_of_turn() {
+    return static_cast<llama_token>(vocab().size() - 1);
+}
+
+std::string folded(std::string text) {
+    for (char &c : text) {
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    return text;
+}
+
+// ---------------------------------------------------------------------------
+// HtmlStreamValidator
+
+struct Feed {
+    HtmlStreamValidator::Status status;
+    HtmlViolation violation;
+    size_t fed;
+};
+
+Feed feed_whole(const std::string &text, const PatternAutomaton *banned) {
+    HtmlStreamValidator validator(banned);
+    validator.feed(text.data(), text.size());
+    return {validator.status(), validator.violation(), validator.bytes_fed()};
+}
+
+Feed feed_bytes(const std::string &text, const PatternAutomaton *banned) {
+    HtmlStreamValidator validator(banned);
+    for (char c : text) {
+        if (validator.feed(&c, 1) != HtmlStreamValidator::Status::kOk) {
+            break;
+        }
+    }
+    return {validator.status(), validator.violation(), validator.bytes_fed()};
+}
+
+struct HtmlCase {
+    const char *name;
+    std::string text;
+    HtmlStreamValidator::Status status;
+    HtmlViolation violation;
+};
+
+void check_validator(const PatternAutomaton &banned) {
+    using Status = HtmlStreamValidator::Status;
+    std::string deep = "```html\n<html><body>";
+    for (int i = 0; i < HtmlStreamValidator::kMaxDepth; ++i) {
+        deep += "<div>";
+    }
+    const std::vector<HtmlCase> cases = {
+            {"fenced document", "Here it is:\n```html\n<!DOCTYPE html>\n<html><body><ul><li>a<li>b</ul></body></html>\n```",
+             Status::kComplete, HtmlViolation::kNone},
+            {"unfenced document", "<!DOCTYPE html><html><body><p>x</body></html>", Status::kComplete,
+             HtmlViolation::kNone},
+            {"implied end tags", "```html\n<html><body><table><tr><td>1<td>2</table><div><p>x</div></body></html>\n```",
+             Status::kComplete, HtmlViolation::kNone},
+            {"void and self-closing", "```html\n<html><body><br><img alt=x><hr/><input type=\"text\" /></body></html>\n```",
+             Status::kComplete, HtmlViolation::kNone},
+            {"raw text and comments", "```html\n<html><head><style>a<b{}</div></STYLE></head><body><!-- </body> -->"
+             "</body></html>\n```", Status::kComplete, HtmlViolation::kNone},
+            {"fence inside an element", "```html\n<html><body><pre>```js```</pre></body></html>\n```", Status::kComplete,
+             HtmlViolation::kNone},
+            {"prose without a fence", std::string(300, 'x'), Status::kViolation, HtmlViolation::kMissingFence},
+            {"no root", "```html\n<div>x</div>\n```", Status::kViolation, HtmlViolation::kMissingRoot},
+            {"text before the root", "```html\nhello <html>", Status::kViolation, HtmlViolation::kMissingRoot},
+            {"fence closed before the root", "```html\n\n```", Status::kViolation, HtmlViolation::kMissingRoot},
+            {"mismatched close", "```html\n<html><body><div><span></div>", Status::kViolation,
+             HtmlViolation::kUnbalancedTag},
+            {"stray close", "```html\n<html><body></section>", Status::kViolation, HtmlViolation::kUnbalancedTag},
+            {"too deep", deep, Status::kViolation, HtmlViolation::kTooDeep},
+            {"external image", "```html\n<html><body><img src=\"https://x/y.png\">", Status::kViolation,
+             HtmlViolation::kExternalReference},
+            {"protocol-relative font", "```html\n<html><head><style>@import url(//fonts.googleapis.com/x)",
+             Status::kViolation, HtmlViolation::kExternalReference},
+            {"upper-case script", "```html\n<html><body><SCRIPT SRC=\"//cdn.x/y.js\">", Status::kViolation,
+             HtmlViolation::kExternalReference},
+            {"inline svg namespace", "```html\n<html><body><svg xmlns=\"http://www.w3.org/2000/svg\"></svg>"
+             "</body></html>\n```", Status::kComplete, HtmlViolation::kNone},
+    };
+    for (const HtmlCase &c : cases) {
+        const Feed whole = feed_whole(c.text, &banned);
+        const Feed bytes = feed_bytes(c.text, &banned);
+        check(whole.status == c.status && whole.violation == c.violation,
+              std::string("validator: ") + c.name + " -> " + html_violation_name(whole.violation));
+        check(bytes.status == whole.status && bytes.violation == whole.violation && bytes.fed == whole.fed,
+              std::string("validator: ") + c.name + " byte by byte");
+    }
+    // Without the automaton external references are not the validator's business.
+    check(feed_whole("```html\n<html><body><img src=\"https://x/y.png\">", nullptr).status == Status::kOk,
+          "validator: no automaton, no reference check");
+
+    // A stream cut inside a tag is safe up to the tag and closes cleanly.
+    const std::string open = "```html\n<html><body><ul><li>one</li><li class=\"a";
+    HtmlStreamValidator validator(&banned);
+    validator.feed(open.data(), open.size());
+    check(validator.safe_length() == open.rfind("<li"), "validator: safe_length inside a tag");
+    check(validator.closing_suffix() == "</ul></body></html>\n```", "validator: closing_suffix");
+    const std::string repaired = open.substr(0, validator.safe_length()) + validator.closing_suffix();
+    check(feed_whole(repaired, &banned).status == Status::kComplete, "validator: repaired prefix completes");
+
+    // Boundaries count closes back to <body>/<head> depth (</style>, </head>,
+    // </section>, </div>); render points add the two </li>.
+    const std::string blocks = "```html\n<html><head><style>p{}</style></head><body><section><ul><li>a</li>"
+                               "<li>b</li></ul></section><div>c</div>";
+    HtmlStreamValidator counter(&banned);
+    counter.feed(blocks.data(), blocks.size());
+    check(counter.boundaries() == 4, "validator: boundaries " + std::to_string(counter.boundaries()));
+    check(counter.render_points() == 6, "validator: render points " + std::to_string(counter.render_points()));
+    check(counter.depth() == 2, "validator: depth");
+}
+
+// ---------------------------------------------------------------------------
+// PatternAutomaton and TokenMask
+
+// Whether feeding `piece` after `prefix` ends a banned rule inside the piece.
+bool completes_by_search(const std::vector<std::string> &rules, const std::string &prefix, const std::string &piece) {
+    const std::string text = folded(prefix + piece);
+    for (size_t end = prefix.size() + 1; end <= text.size(); ++end) {
+        for (const std::string &rule : rules) {
+            const std::string r = folded(rule);
+            if (r.size() <= end && text.compare(end - r.size(), r.size(), r) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+bool contains_rule(const std::vector<std::string> &rules, const std::string &text) {
+    return completes_by_search(rules, "", text);
+}
+
+void check_token_mask() {
+    const std::vector<std::string> &rules = TokenMask::default_rules();
+    PatternAutomaton automaton;
+    check(automaton.build(rules) && automaton.rule_count() == rules.size(), "automaton: build");
+    check(!PatternAutomaton().build({""}), "automaton: no rules");
+
+    int anchor = 0;
+    VocabPieces pieces;
+    TokenMask mask;
+    check(pieces.build(reinterpret_cast<const llama_model *>(&anchor)), "mask: vocabulary");
+    check(pieces.is_control(end_of_turn()) && pieces.is_turn_marker(end_of_turn()) &&
+          pieces.length(end_of_turn()) == 0, "mask: end-of-turn is a control token with no text");
+    check(mask.build(pieces, rules), "mask: build");
+
+    // Random safe prefixes from rule fragments; every token's bit must match
+    // a direct search of prefix + piece.
+    const char *const fragments[] = {"src=\"", "src='", "ht", "tp", "href=", "url(", "\"", "/", "@im", "<li",
+                                     "<scr", "ipt ", "fonts.", "cdn", "x", " ", "HT", "SRC="};
+    std::mt19937 rng(7);
+    int states_checked = 0;
+    int mismatches = 0;
+    for (int trial = 0; trial < 400; ++trial) {
+        std::string prefix;
+        const int parts = static_cast<int>(rng() % 6);
+        for (int i = 0; i < parts; ++i) {
+            prefix += fragments[rng() % (sizeof(fragments) / sizeof(fragments[0]))];
+        }
+        if (contains_rule(rules, prefix)) {
+            continue;
+        }
+        const int32_t state = mask.advance(mask.root(), prefix.data(), prefix.size());
+        const TokenBits &bits = mask.mask_for(state);
+        for (llama_token tok = 0; tok < pieces.size(); ++tok) {
+            const bool expected = completes_by_search(rules, prefix, pieces.piece(tok));
+            if (token_bit(bits, tok) != expected || mask.completes_rule(state, tok) != expected) {
+                if (++mismatches <= 5) {
+                    std::printf("  mask mismatch after \"%s\" for \"%s\"\n", prefix.c_str(),
+                                pieces.piece(tok).c_str());
+                }
+            }
+        }
+        ++states_checked;
+    }
+    check(mismatches == 0, "mask: " + std::to_string(mismatches) + " bits differ from a direct search");
+    check(states_checked > 100, "mask: states checked " + std::to_string(states_checked));
+
+    // Token-by-token advance agrees with feeding the text at once.
+    const std::string text = "<img SRC=\"HTtp";
+    int32_t state = mask.root();
+    for (char c : text) {
+        state = mask.advance(state, static_cast<llama_token>(static_cast<unsigned char>(c)));
+    }
+    check(state == mask.advance(mask.root(), text.data(), text.size()), "mask: advance by token");
+
+    std::vector<float> logits(static_cast<size_t>(pieces.size()), 1.0f);
+    mask.apply(logits.data(), mask.root());
+    size_t masked = 0;
+    for (llama_token tok = 0; tok < pieces.size(); ++tok) {
+        const bool inf = std::isinf(logits[tok]) && logits[tok] < 0;
+        masked += inf ? 1 : 0;
+        check(inf == token_bit(mask.mask_for(mask.root()), tok), "mask: apply " + pieces.piece(tok));
+    }
+    check(masked == mask.root_banned() && masked > 0, "mask: root bans " + std::to_string(masked));
+}
+
+// ---------------------------------------------------------------------------
+// RepetitionDetector
+
+// Pushes `period`-long cycles until the detector fires; returns the count.
+int tokens_until_loop(int period, int limit) {
+    RepetitionDetector detector;
+    for (int i = 0; i < limit; ++i) {
+        detector.push(1000 + i % period);
+        if (detector.looping()) {
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+void check_repetition() {
+    for (const int period : {1, 2, 3, 7, 16, 64}) {
+        const int reps = std::max(4, (RepetitionDetector::kMinLoopTokens + period - 1) / period);
+        const int expected = period * reps;
+        const int got = tokens_until_loop(period, 1000);
+        check(got == expected, "repetition: period " + std::to_string(period) + " fired after " +
+                               std::to_string(got) + ", expected " + std::to_string(expected));
+    }
+    check(tokens_until_loop(65, 2000) == -1, "repetition: period above kMaxPeriod");
+
+    RepetitionDetector detector;
+    for (int i = 0; i < 1000; ++i) {
+        detector.push(i);
+    }
+    check(!detector.looping(), "repetition: distinct tokens");
+    for (int i = 0; i < 64; ++i) {
+        detector.push(5);
+    }
+    check(detector.looping(), "repetition: loop after distinct tokens");
+    detector.reset();
+    detector.push(5);
+    check(!detector.looping(), "repetition: reset");
+}
+
+// ---------------------------------------------------------------------------
+// utf8_safe_end
+
+void check_utf8() {
+    // 1-, 2-, 3- and 4-byte sequences: "a", "é", "€", "😀".
+    const std::string text = "a\xC3\xA9\xE2\x82\xAC\xF0\x9F\x98\x80" "b\xE2\x82\xAC";
+    std::vector<size_t> boundaries;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        if (i == text.size() || (static_cast<unsigned char>(text[i]) & 0xC0) != 0x80) {
+            boundaries.push_back(i);
+        }
+    }
+    for (size_t begin = 0; begin <= text.size(); ++begin) {
+        for (size_t end = begin; end <= text.size(); ++end) {
+            const size_t got = utf8_safe_end(text.data(), begin, end);
+            size_t expected = *std::prev(std::upper_bound(boundaries.begin(), boundaries.end(), end));
+            expected = std::max(expected, begin);
+            // A cut that starts inside a sequence has no lead byte to go by.
+            if ((static_cast<unsigned char>(text[begin]) & 0xC0) == 0x80 && expected == begin && end > begin) {
+                continue;
+            }
+            check(got == expected, "utf8: [" + std::to_string(begin) + ", " + std::to_string(end) + ") -> " +
+                                   std::to_string(got) + ", expected " + std::to_string(expected));
+        }
+    }
+    const std::string stray = "ab\x80";
+    check(utf8_safe_end(stray.data(), 0, stray.size()) == stray.size(), "utf8: stray continuation passes");
+    const std::string invalid = "ab\xFF";
+    check(utf8_safe_end(invalid.data(), 0, invalid.size()) == invalid.size(), "utf8: invalid lead passes");
+}
+
+// ---------------------------------------------------------------------------
+// MpscQueue
+
+void check_queue() {
+    MpscQueue<std::unique_ptr<int>> single;
+    check(single.empty(), "queue: starts empty");
+    for (int i = 0; i < 5; ++i) {
+        single.push(std::make_unique<int>(i));
+    }
+    std::unique_ptr<int> value;
+    bool ordered = true;
+    for (int i = 0; i < 5; ++i) {
+        ordered = ordered && single.pop(value) && value && *value == i;
+    }
+    check(ordered && !single.pop(value) && single.empty(), "queue: FIFO with move-only values");
+    single.push(std::make_unique<int>(9));  // freed by the destructor
+
+    constexpr int kProducers = 6;
+    constexpr int kPerProducer = 20000;
+    MpscQueue<std::pair<int, int>> queue;
+    std::atomic<bool> go{false};
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&queue, &go, p] {
+            while (!go.load()) {
+                std::this_thread::yield();
+            }
+            for (int i = 0; i < kPerProducer; ++i) {
+                queue.push({p, i});
+                if (i % 64 == 0) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    std::vector<int> next(kProducers, 0);
+    int received = 0;
+    bool in_order = true;
+    go.store(true);
+    while (received < kProducers * kPerProducer) {
+        std::pair<int, int> item;
+        if (!queue.pop(item)) {
+            std::this_thread::yield();
+            continue;
+        }
+        in_order = in_order && item.first >= 0 && item.first < kProducers && item.second == next[item.first];
+        if (item.first >= 0 && item.first < kProducers) {
+            ++next[item.first];
+        }
+        ++received;
+    }
+    for (std::thread &producer : producers) {
+        producer.join();
+    }
+    std::pair<int, int> extra;
+    check(in_order, "queue: per-producer order under contention");
+    check(!queue.pop(extra) && queue.empty(), "queue: drained exactly");
+}
+
+}  // namespace
+
+// The vocabulary calls VocabPieces::build makes; as in llama.cpp, the control
+// token only has text when `special` is set.
+int32_t llama_n_vocab(const llama_model *) {
+    return static_cast<int32_t>(vocab().size());
+}
+
+enum llama_token_type llama_token_get_type(const llama_model *, llama_token token) {
+    return token == end_of_turn() ? LLAMA_TOKEN_TYPE_CONTROL : LLAMA_TOKEN_TYPE_NORMAL;
+}
+
+int32_t llama_token_to_piece(const llama_model *, llama_token token, char *buf, int32_t length, bool special) {
+    if (token == end_of_turn() && !special) {
+        return 0;
+    }
+    const std::string &piece = vocab()[static_cast<size_t>(token)];
+    const int32_t n = static_cast<int32_t>(piece.size());
+    if (n > length) {
+        return -n;
+    }
+    std::memcpy(buf, piece.data(), piece.size());
+    return n;
+}
+
+int main() {
+    PatternAutomaton banned;
+    banned.build(TokenMask::default_rules());
+
+    const struct {
+        const char *name;
+        void (*run)();
+    } groups[] = {
+            {"token mask", check_token_mask},
+            {"repetition detector", check_repetition},
+            {"utf8_safe_end", check_utf8},
+            {"mpsc queue", check_queue},
+    };
+    int before = failures;
+    int counted = checks;
+    check_validator(banned);
+    std::printf("%-20s %5d checks, %d failed\n", "html validator", checks - counted, failures - before);
+    for (const auto &group : groups) {
+        before = failures;
+        counted = checks;
+        group.run();
+        std::printf("%-20s %5d checks, %d failed\n", group.name, checks - counted, failures - before);
+    }
+    std::printf("%s\n", failures == 0 ? "ok" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,217 @@
+// Host check for the fused projection patch (scripts/patches/0003-*), built
+// and run by scripts/check_fused_projections.sh against a patched llama.cpp.
+// Loads the model twice in one process, with LLAMA_FUSED_PROJECTIONS=0 and =1,
+// and runs the same greedy generation on both graphs. The fused graph must
+// produce the same logits (the rows of each product are the same dot
+// products, only computed by one matmul) and therefore the same tokens. A
+// second pass times every layer through the eval callback, which the
+// scheduler calls after each layer output ("l_out-N") it asked for.
+
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr const char *kPrompt =
+    "<|im_start|>system\nYou generate compact HTML user interfaces.<|im_end|>\n"
+    "<|im_start|>user\nA login form with email, password and a remember-me switch.<|im_end|>\n"
+    "<|im_start|>assistant\n";
+
+// Layer boundaries in the decode graph, recorded when timing is on.
+struct LayerTimer {
+    bool enabled = false;
+    Clock::time_point last;
+    std::vector<double> total_ms;  // per layer, summed over the timed steps
+};
+
+static int layer_of(const char *name) {
+    return std::strncmp(name, "l_out-", 6) == 0 ? std::atoi(name + 6) : -1;
+}
+
+static bool eval_callback(ggml_tensor *t, bool ask, void *user_data) {
+    auto *timer = static_cast<LayerTimer *>(user_data);
+    if (!timer->enabled) {
+        return false;
+    }
+    const bool boundary = std::strcmp(t->name, "inp_embd") == 0 || layer_of(t->name) >= 0;
+    if (ask) {
+        return boundary;
+    }
+    const auto now = Clock::now();
+    const int layer = layer_of(t->name);
+    if (layer >= 0 && layer < static_cast<int>(timer->total_ms.size())) {
+        timer->total_ms[layer] += std::chrono::duration<double, std::milli>(now - timer->last).count();
+    }
+    timer->last = now;
+    return true;
+}
+
+struct Run {
+    std::vector<std::vector<float>> logits;  // prompt, then one row per decode step
+    std::vector<llama_token> tokens;
+    double decode_tps = 0.0;
+    std::vector<double> layer_ms;  // per layer and decode token
+    int fused_layers = 0;          // whose Q projection is a view of a fused matrix
+};
+
+static int argmax(const float *logits, int n_vocab) {
+    return static_cast<int>(std::max_element(logits, logits + n_vocab) - logits);
+}
+
+static bool run(const char *model_path, bool fused, int threads, int steps, int timed_steps, Run &out) {
+    setenv("LLAMA_FUSED_PROJECTIONS", fused ? "1" : "0", 1);
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    llama_model *model = llama_load_model_from_file(model_path, mparams);
+    if (!model) {
+        std::fprintf(stderr, "failed to load %s\n", model_path);
+        return false;
+    }
+
+    // A stock llama.cpp ignores LLAMA_FUSED_PROJECTIONS and would compare a
+    // graph with itself, so the fused run has to show the views.
+    char name[64];
+    for (int il = 0; il < llama_n_layer(model); ++il) {
+        std::snprintf(name, sizeof(name), "blk.%d.attn_q.weight", il);
+        const ggml_tensor *wq = llama_get_model_tensor(model, name);
+        out.fused_layers += wq && wq->view_src ? 1 : 0;
+    }
+
+    LayerTimer timer;
+    timer.total_ms.assign(llama_n_layer(model), 0.0);
+    llama_context_params cparams = llama_context_default_params();
+    cparams.seed = 1234;
+    cparams.n_ctx = 1024;
+    cparams.n_batch = 512;
+    cparams.n_threads = threads;
+    cparams.n_threads_batch = threads;
+    cparams.cb_eval = eval_callback;
+    cparams.cb_eval_user_data = &timer;
+    llama_context *ctx = llama_new_context_with_model(model, cparams);
+    if (!ctx) {
+        llama_free_model(model);
+        return false;
+    }
+
+    std::vector<llama_token> prompt(512);
+    const int n_prompt = llama_tokenize(model, kPrompt, static_cast<int>(std::strlen(kPrompt)), prompt.data(),
+                                        static_cast<int>(prompt.size()), true, true);
+    prompt.resize(std::max(n_prompt, 0));
+    const int n_vocab = llama_n_vocab(model);
+
+    // Pass 1: greedy generation, untimed per layer.
+    bool ok = !prompt.empty() && llama_decode(ctx, llama_batch_get_one(prompt.data(), n_prompt, 0, 0)) == 0;
+    const float *logits = llama_get_logits(ctx);
+    if (ok) {
+        out.logits.emplace_back(logits, logits + n_vocab);
+    }
+    llama_token token = ok ? argmax(logits, n_vocab) : 0;
+    const auto start = Clock::now();
+    for (int i = 0; ok && i < steps; ++i) {
+        out.tokens.push_back(token);
+        ok = llama_decode(ctx, llama_batch_get_one(&token, 1, n_prompt + i, 0)) == 0;
+        logits = llama_get_logits(ctx);
+        out.logits.emplace_back(logits, logits + n_vocab);
+        token = argmax(logits, n_vocab);
+    }
+    out.decode_tps = steps / std::chrono::duration<double>(Clock::now() - start).count();
+
+    // Pass 2: the same prompt again, with layer boundaries timed.
+    llama_kv_cache_clear(ctx);
+    ok = ok && llama_decode(ctx, llama_batch_get_one(prompt.data(), n_prompt, 0, 0)) == 0;
+    token = ok ? argmax(llama_get_logits(ctx), n_vocab) : 0;
+    timer.enabled = true;
+    for (int i = 0; ok && i < timed_steps; ++i) {
+        timer.last = Clock::now();
+        ok = llama_decode(ctx, llama_batch_get_one(&token, 1, n_prompt + i, 0)) == 0;
+        token = argmax(llama_get_logits(ctx), n_vocab);
+    }
+    for (double ms : timer.total_ms) {
+        out.layer_ms.push_back(ms / std::max(timed_steps, 1));
+    }
+
+    llama_free(ctx);
+    llama_free_model(model);
+    return ok;
+}
+
+static double max_abs_diff(const std::vector<float> &a, const std::vector<float> &b) {
+    double diff = 0.0;
+    for (size_t i = 0; i < a.size() && i < b.size(); ++i) {
+        diff = std::max(diff, static_cast<double>(std::fabs(a[i] - b[i])));
+    }
+    return diff;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s model.gguf [threads] [steps]\n", argv[0]);
+        return 1;
+    }
+    const int threads = argc > 2 ? std::atoi(argv[2]) : 4;
+    const int steps = argc > 3 ? std::atoi(argv[3]) : 64;
+    const int timed_steps = 32;
+    // Logits should match exactly; the tolerance only absorbs summation order
+    // differences if a kernel splits rows differently for a taller matrix.
+    const double tolerance = 1e-3;
+
+    llama_backend_init();
+    Run separate;
+    Run fused;
+    const bool ok = run(argv[1], false, threads, steps, timed_steps, separate)
+                    && run(argv[1], true, threads, steps, timed_steps, fused);
+    llama_backend_free();
+    if (!ok) {
+        std::fprintf(stderr, "decode failed\n");
+        return 1;
+    }
+
+    const double prompt_diff = max_abs_diff(separate.logits[0], fused.logits[0]);
+    double decode_diff = 0.0;
+    for (size_t i = 1; i < separate.logits.size() && i < fused.logits.size(); ++i) {
+        decode_diff = std::max(decode_diff, max_abs_diff(separate.logits[i], fused.logits[i]));
+    }
+    size_t same = 0;
+    while (same < separate.tokens.size() && same < fused.tokens.size() && separate.tokens[same] == fused.tokens[same]) {
+        ++same;
+    }
+
+    std::printf("threads=%d steps=%d fused layers=%d/%zu\n", threads, steps, fused.fused_layers,
+                fused.layer_ms.size());
+    if (separate.fused_layers != 0 || fused.fused_layers == 0) {
+        std::fprintf(stderr, "the transform did not switch (separate run %d fused layers, fused run %d); "
+                             "is scripts/patches/0003-* applied?\n", separate.fused_layers, fused.fused_layers);
+        return 1;
+    }
+    std::printf("equivalence: prompt max|dlogit|=%.3g, decode max|dlogit|=%.3g, greedy tokens %zu/%zu identical\n",
+                prompt_diff, decode_diff, same, separate.tokens.size());
+    std::printf("decode: separate %.2f tok/s, fused %.2f tok/s (%+.1f%%)\n", separate.decode_tps, fused.decode_tps,
+                (fused.decode_tps / separate.decode_tps - 1.0) * 100.0);
+    std::printf("%-6s %12s %12s %8s\n", "layer", "separate ms", "fused ms", "delta");
+    double separate_total = 0.0;
+    double fused_total = 0.0;
+    for (size_t il = 0; il < separate.layer_ms.size() && il < fused.layer_ms.size(); ++il) {
+        separate_total += separate.layer_ms[il];
+        fused_total += fused.layer_ms[il];
+        std::printf("%-6zu %12.3f %12.3f %+7.1f%%\n", il, separate.layer_ms[il], fused.layer_ms[il],
+                    (fused.layer_ms[il] / separate.layer_ms[il] - 1.0) * 100.0);
+    }
+    std::printf("%-6s %12.3f %12.3f %+7.1f%%\n", "all", separate_total, fused_total,
+                (fused_total / separate_total - 1.0) * 100.0);
+
+    const bool equivalent = prompt_diff <= tolerance && decode_diff <= tolerance && same == separate.tokens.size();
+    std::printf("%s\n", equivalent ? "ok" : "MISMATCH");
+    return equivalent ? 0 : 1;
+}
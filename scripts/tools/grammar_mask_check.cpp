@@ -0,0 +1,300 @@
+// Host check for GrammarMask (app/src/main/cpp/grammar_mask.*), built and run
+// by scripts/check_grammar_mask.sh against stock llama.cpp, whose host build
+// exports the grammar API the Android build hides. It walks a small corpus of
+// HTML documents, valid and invalid under html_grammar(), token by token
+// through both engines: at every step the tokens GrammarMask allows must be
+// the ones llama_sample_grammar leaves finite, and a document must be rejected
+// at the same token by both. Control tokens are compared apart: llama.cpp only
+// admits EOS, at accepting states, and GrammarMask admits every control token
+// there, so for them the check is that EOS and is_accepting() agree.
+//
+// It then times greedy generation from an HTML request twice, unconstrained
+// (plain argmax) and constrained by GrammarMask, and reports the token
+// selection cost per token next to the decode step, with llama_sample_grammar
+// timed on the same states for reference.
+
+#include "grammar_mask.h"
+#include "html_grammar.h"
+#include "vocab_pieces.h"
+
+#include "grammar-parser.h"
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Document {
+    const char *name;
+    bool valid;
+    const char *text;
+};
+
+const Document kCorpus[] = {
+    {"login form", true,
+     "```html\n<!DOCTYPE html>\n<html lang=\"en\">\n<head>\n<meta charset=\"utf-8\">\n<title>Login</title>\n"
+     "<style>body { font-family: sans-serif; } .row { display: flex; }</style>\n</head>\n"
+     "<body>\n<main class=\"card\">\n<h1>Sign in</h1>\n<form>\n"
+     "<label for=\"email\">Email</label>\n<input id=\"email\" type=\"email\" placeholder=\"you@example.com\">\n"
+     "<label for=\"pw\">Password</label>\n<input id=\"pw\" type=\"password\"/>\n"
+     "<div class=\"row\"><input type=\"checkbox\" checked> <span>Remember me</span></div>\n"
+     "<button type=\"submit\" data-action=\"login\">Continue</button>\n</form>\n</main>\n</body>\n</html>\n```"},
+    {"table with svg", true,
+     "```html\n<!doctype html>\n<html>\n<head><title>Stats</title></head>\n<body style=\"margin:0\">\n"
+     "<section><h2>Weekly</h2>\n<table><thead><tr><th>Day</th><th>Steps</th></tr></thead>\n"
+     "<tbody><tr><td>Mon</td><td>8,204</td></tr><tr><td>Tue</td><td>10,911</td></tr></tbody></table>\n"
+     "<svg viewBox=\"0 0 10 10\"><circle cx=\"5\" cy=\"5\" r=\"4\"/><text x=\"1\" y=\"9\">ok</text></svg>\n"
+     "<!-- summary -->\n<p>Average: <strong>9,557</strong> &amp; rising</p>\n"
+     "<button class='primary' data-action='refresh' disabled>Refresh</button>\n</section>\n</body>\n</html>\n```"},
+    {"script and details", true,
+     "```html\n<!DOCTYPE html>\n<html>\n<head>\n<script>const n = 1 < 2;</script>\n</head>\n<body>\n"
+     "<details open><summary>More</summary><ul><li>One</li><li>Two &gt; one</li></ul></details>\n"
+     "<progress value=\"3\" max=\"10\"></progress><br><hr/>\n</body>\n</html>\n```"},
+    {"button without data-action", false,
+     "```html\n<!DOCTYPE html>\n<html>\n<head></head>\n<body>\n<button type=\"button\">Go</button>\n"
+     "</body>\n</html>\n```"},
+    {"mismatched close", false,
+     "```html\n<!DOCTYPE html>\n<html>\n<head></head>\n<body>\n<div><span>text</div></span>\n</body>\n</html>\n```"},
+    {"unknown tag", false,
+     "```html\n<!DOCTYPE html>\n<html>\n<head></head>\n<body>\n<marquee>hi</marquee>\n</body>\n</html>\n```"},
+    {"missing doctype", false,
+     "```html\n<html>\n<head></head>\n<body></body>\n</html>\n```"},
+    {"attribute with <", false,
+     "```html\n<!DOCTYPE html>\n<html>\n<head></head>\n<body>\n<a href=\"<x>\">x</a>\n</body>\n</html>\n```"},
+};
+
+struct Result {
+    int tokens = 0;
+    int steps = 0;
+    int rejected_at = -1;     // token index llama.cpp rejected, -1 when none
+    int mismatches = 0;       // steps whose allowed sets differ
+    int eos_mismatches = 0;
+    bool accepting_at_end = false;
+};
+
+// Tokens llama_sample_grammar leaves finite from `grammar`.
+static std::vector<bool> llama_allowed(llama_context *ctx, const llama_grammar *grammar, int n_vocab) {
+    std::vector<llama_token_data> data(n_vocab);
+    for (int tok = 0; tok < n_vocab; ++tok) {
+        data[tok] = {tok, 0.0f, 0.0f};
+    }
+    llama_token_data_array candidates = {data.data(), data.size(), false};
+    llama_sample_grammar(ctx, &candidates, grammar);
+    std::vector<bool> allowed(n_vocab, false);
+    for (size_t i = 0; i < candidates.size; ++i) {
+        allowed[candidates.data[i].id] = std::isfinite(candidates.data[i].logit);
+    }
+    return allowed;
+}
+
+static Result walk(llama_context *ctx, const llama_model *model, grammar_parser::parse_state &parsed,
+                   genui::GrammarMask &mask, const genui::VocabPieces &pieces, const Document &doc,
+                   int max_reported) {
+    Result result;
+    const int n_vocab = llama_n_vocab(model);
+    const llama_token eos = llama_token_eos(model);
+    std::vector<llama_token> tokens(std::strlen(doc.text) + 8);
+    const int n = llama_tokenize(model, doc.text, static_cast<int>(std::strlen(doc.text)), tokens.data(),
+                                 static_cast<int>(tokens.size()), false, false);
+    tokens.resize(std::max(n, 0));
+    result.tokens = static_cast<int>(tokens.size());
+
+    std::vector<const llama_grammar_element *> rules = parsed.c_rules();
+    llama_grammar *grammar = llama_grammar_init(rules.data(), rules.size(), parsed.symbol_ids.at("root"));
+    genui::GrammarState state = mask.begin();
+
+    for (size_t i = 0; i <= tokens.size(); ++i) {
+        const std::vector<bool> expected = llama_allowed(ctx, grammar, n_vocab);
+        const genui::TokenBits &bits = mask.allowed(state);
+        bool differs = false;
+        for (llama_token tok = 0; tok < n_vocab; ++tok) {
+            if (pieces.is_control(tok) || tok == eos) {
+                continue;
+            }
+            if (expected[tok] != genui::token_bit(bits, tok)) {
+                differs = true;
+                if (result.mismatches < max_reported) {
+                    std::printf("  step %zu: token %d '%s' llama.cpp %s, GrammarMask %s\n", i, tok,
+                                pieces.piece(tok).c_str(), expected[tok] ? "allows" : "rejects",
+                                expected[tok] ? "rejects" : "allows");
+                }
+            }
+        }
+        result.mismatches += differs ? 1 : 0;
+        if (expected[eos] != mask.is_accepting(state)) {
+            ++result.eos_mismatches;
+        }
+        ++result.steps;
+        if (i == tokens.size()) {
+            result.accepting_at_end = expected[eos];
+            break;
+        }
+        if (!expected[tokens[i]]) {
+            result.rejected_at = static_cast<int>(i);
+            break;
+        }
+        llama_grammar_accept_token(ctx, grammar, tokens[i]);
+        state = mask.accept(state, tokens[i]);
+    }
+    llama_grammar_free(grammar);
+    return result;
+}
+
+struct Timing {
+    int tokens = 0;
+    double decode_ms = 0.0;     // llama_decode of the generated tokens
+    double select_ms = 0.0;     // argmax, or GrammarMask::argmax + accept
+    double reference_ms = 0.0;  // llama_sample_grammar + accept on the same states
+};
+
+const char kPrompt[] =
+        "<|im_start|>system\nYou write complete single-file HTML pages with inline CSS.<|im_end|>\n"
+        "<|im_start|>user\nA sign-in card with email, password and a remember-me switch.<|im_end|>\n"
+        "<|im_start|>assistant\n";
+
+double elapsed_ms(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - since).count();
+}
+
+// Greedy generation of up to `max_tokens` after kPrompt. With `mask` set each
+// token is the best one GrammarMask allows, and llama.cpp's grammar follows
+// along so its sampler can be timed on the same states.
+static Timing generate(llama_context *ctx, const llama_model *model, grammar_parser::parse_state &parsed,
+                       genui::GrammarMask *mask, const genui::VocabPieces &pieces, int max_tokens) {
+    Timing timing;
+    const int n_vocab = llama_n_vocab(model);
+    std::vector<llama_token> tokens(sizeof(kPrompt));
+    const int n = llama_tokenize(model, kPrompt, static_cast<int>(std::strlen(kPrompt)), tokens.data(),
+                                 static_cast<int>(tokens.size()), false, true);
+    tokens.resize(std::max(n, 0));
+    llama_kv_cache_clear(ctx);
+    if (tokens.empty() || llama_decode(ctx, llama_batch_get_one(tokens.data(), n, 0, 0)) != 0) {
+        return timing;
+    }
+
+    std::vector<const llama_grammar_element *> rules = parsed.c_rules();
+    llama_grammar *grammar = llama_grammar_init(rules.data(), rules.size(), parsed.symbol_ids.at("root"));
+    genui::GrammarState state = mask ? mask->begin() : genui::GrammarState();
+    std::vector<llama_token_data> data(n_vocab);
+    int32_t last = n - 1;
+    for (int i = 0; i < max_tokens; ++i) {
+        const float *logits = llama_get_logits_ith(ctx, last);
+        auto start = std::chrono::steady_clock::now();
+        llama_token next = 0;
+        if (mask) {
+            next = mask->argmax(logits, state);
+        } else {
+            next = static_cast<llama_token>(std::max_element(logits, logits + n_vocab) - logits);
+        }
+        timing.select_ms += elapsed_ms(start);
+        if (mask) {
+            for (int tok = 0; tok < n_vocab; ++tok) {
+                data[tok] = {tok, logits[tok], 0.0f};
+            }
+            llama_token_data_array candidates = {data.data(), data.size(), false};
+            start = std::chrono::steady_clock::now();
+            llama_sample_grammar(ctx, &candidates, grammar);
+            timing.reference_ms += elapsed_ms(start);
+        }
+        if (next < 0 || pieces.is_control(next) || llama_token_is_eog(model, next)) {
+            break;
+        }
+        if (mask) {
+            start = std::chrono::steady_clock::now();
+            state = mask->accept(state, next);
+            timing.select_ms += elapsed_ms(start);
+            start = std::chrono::steady_clock::now();
+            llama_grammar_accept_token(ctx, grammar, next);
+            timing.reference_ms += elapsed_ms(start);
+        }
+        start = std::chrono::steady_clock::now();
+        if (llama_decode(ctx, llama_batch_get_one(&next, 1, n + i, 0)) != 0) {
+            break;
+        }
+        timing.decode_ms += elapsed_ms(start);
+        last = 0;
+        ++timing.tokens;
+    }
+    llama_grammar_free(grammar);
+    return timing;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s model.gguf [reported mismatches] [generated tokens]\n", argv[0]);
+        return 1;
+    }
+    const int max_reported = argc > 2 ? std::atoi(argv[2]) : 8;
+    const int max_tokens = argc > 3 ? std::atoi(argv[3]) : 192;
+
+    llama_backend_init();
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    llama_model *model = llama_load_model_from_file(argv[1], mparams);
+    if (!model) {
+        std::fprintf(stderr, "failed to load %s\n", argv[1]);
+        return 1;
+    }
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = 512;
+    llama_context *ctx = llama_new_context_with_model(model, cparams);
+
+    genui::VocabPieces pieces;
+    genui::GrammarMask mask;
+    grammar_parser::parse_state parsed = grammar_parser::parse(genui::html_grammar().c_str());
+    if (!ctx || !pieces.build(model) || !mask.build(pieces, genui::html_grammar()) || parsed.rules.empty()) {
+        std::fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+
+    bool ok = true;
+    std::printf("%-28s %6s %6s %10s %12s %s\n", "document", "tokens", "steps", "mismatches", "eos", "outcome");
+    for (const Document &doc : kCorpus) {
+        const Result r = walk(ctx, model, parsed, mask, pieces, doc, max_reported);
+        const bool accepted = r.rejected_at < 0 && r.accepting_at_end;
+        std::string outcome = accepted ? "accepted" : r.rejected_at >= 0
+                                                          ? "rejected at token " + std::to_string(r.rejected_at)
+                                                          : "incomplete";
+        // The corpus labels only guard the corpus itself; agreement is what is checked.
+        if (accepted != doc.valid) {
+            outcome += " (labelled " + std::string(doc.valid ? "valid" : "invalid") + "!)";
+        }
+        std::printf("%-28s %6d %6d %10d %12s %s\n", doc.name, r.tokens, r.steps, r.mismatches,
+                    r.eos_mismatches ? "MISMATCH" : "agree", outcome.c_str());
+        ok = ok && r.mismatches == 0 && r.eos_mismatches == 0 && accepted == doc.valid;
+    }
+
+    const Timing plain = generate(ctx, model, parsed, nullptr, pieces, max_tokens);
+    mask.reset_stats();
+    const Timing constrained = generate(ctx, model, parsed, &mask, pieces, max_tokens);
+    const genui::GrammarMask::Stats &stats = mask.stats();
+    auto per_token = [](double ms, int tokens) { return tokens > 0 ? ms * 1000.0 / tokens : 0.0; };
+    std::printf("\n%-22s %6s %14s %14s\n", "greedy decoding", "tokens", "decode us/tok", "select us/tok");
+    std::printf("%-22s %6d %14.0f %14.1f\n", "unconstrained", plain.tokens, per_token(plain.decode_ms, plain.tokens),
+                per_token(plain.select_ms, plain.tokens));
+    std::printf("%-22s %6d %14.0f %14.1f\n", "GrammarMask", constrained.tokens,
+                per_token(constrained.decode_ms, constrained.tokens), per_token(constrained.select_ms, constrained.tokens));
+    std::printf("%-22s %6s %14s %14.1f\n", "llama_sample_grammar", "", "",
+                per_token(constrained.reference_ms, constrained.tokens));
+    const double overhead_us =
+            per_token(constrained.select_ms, constrained.tokens) - per_token(plain.select_ms, plain.tokens);
+    const double decode_us = per_token(constrained.decode_ms, constrained.tokens);
+    std::printf("grammar overhead %+.1f us/token (%.2f%% of a decode step); mask cache %zu hits, %zu misses\n",
+                overhead_us, decode_us > 0.0 ? 100.0 * overhead_us / decode_us : 0.0, stats.mask_hits,
+                stats.mask_misses);
+
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+    std::printf("%s\n", ok ? "ok" : "MISMATCH");
+    return ok ? 0 : 1;
+}
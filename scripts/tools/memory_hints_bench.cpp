@@ -0,0 +1,210 @@
+// Host benchmark for the memory hints (app/src/main/cpp/memory_hints.*), built
+// and run by scripts/bench_memory_hints.sh against stock llama.cpp. Each run
+// loads the model in one mode, prefills a prompt and times greedy decode
+// steps, counting data TLB loads and misses over the decode loop with
+// perf_event_open. The modes run in separate processes so one run's page
+// cache and huge pages do not leak into the next run's counters:
+//
+//   off     no hints; the model mapping as llama.cpp leaves it
+//   hints   huge pages and access phases on the mapping and the buffers
+//   copies  hints, plus huge-page copies of the matmul weights up to a budget
+
+#include "llama.h"
+#include "memory_hints.h"
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr const char *kPrompt =
+    "<|im_start|>system\nYou generate compact HTML user interfaces.<|im_end|>\n"
+    "<|im_start|>user\nA login form with email, password and a remember-me switch.<|im_end|>\n"
+    "<|im_start|>assistant\n";
+
+constexpr const char *kLayerWeights[] = {
+    "attn_q", "attn_k", "attn_v", "attn_output", "ffn_gate", "ffn_up", "ffn_down",
+};
+
+// A data TLB counter of this thread and the threads it starts afterwards,
+// which covers ggml's compute threads; -1 where perf events are unavailable.
+class TlbCounter {
+public:
+    explicit TlbCounter(uint64_t result) {
+        perf_event_attr attr {};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (result << 16);
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        error_ = fd_ < 0 ? errno : 0;
+    }
+    ~TlbCounter() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+    TlbCounter(const TlbCounter &) = delete;
+    TlbCounter &operator=(const TlbCounter &) = delete;
+
+    void start() const {
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    bool available() const { return fd_ >= 0; }
+    const char *error() const { return std::strerror(error_); }
+
+    int64_t stop() const {
+        uint64_t count = 0;
+        if (fd_ < 0 || ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0) != 0
+            || read(fd_, &count, sizeof(count)) != sizeof(count)) {
+            return -1;
+        }
+        return static_cast<int64_t>(count);
+    }
+
+private:
+    int fd_ = -1;
+    int error_ = 0;
+};
+
+static std::vector<ggml_tensor *> matmul_weights(llama_model *model) {
+    std::vector<ggml_tensor *> weights;
+    char name[64];
+    for (int32_t layer = 0; layer < llama_n_layer(model); ++layer) {
+        for (const char *weight : kLayerWeights) {
+            std::snprintf(name, sizeof(name), "blk.%d.%s.weight", layer, weight);
+            if (ggml_tensor *tensor = llama_get_model_tensor(model, name)) {
+                weights.push_back(tensor);
+            }
+        }
+    }
+    if (ggml_tensor *output = llama_get_model_tensor(model, "output.weight")) {
+        weights.push_back(output);
+    }
+    return weights;
+}
+
+static int argmax(const float *logits, int n_vocab) {
+    return static_cast<int>(std::max_element(logits, logits + n_vocab) - logits);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        std::fprintf(stderr, "usage: %s model.gguf off|hints|copies [threads] [steps] [copy MiB]\n", argv[0]);
+        return 1;
+    }
+    const std::string mode = argv[2];
+    const int threads = argc > 3 ? std::atoi(argv[3]) : 4;
+    const int steps = argc > 4 ? std::atoi(argv[4]) : 128;
+    const size_t copy_mib = argc > 5 ? static_cast<size_t>(std::atoll(argv[5])) : 256;
+    if (mode != "off" && mode != "hints" && mode != "copies") {
+        std::fprintf(stderr, "unknown mode %s\n", mode.c_str());
+        return 1;
+    }
+    const bool hinted = mode != "off";
+
+    llama_backend_init();
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    const auto load_start = Clock::now();
+    const genui::MappingSnapshot before_model = genui::MappingSnapshot::take();
+    llama_model *model = llama_load_model_from_file(argv[1], mparams);
+    if (!model) {
+        std::fprintf(stderr, "failed to load %s\n", argv[1]);
+        return 1;
+    }
+    genui::MemoryHints hints;
+    if (hinted) {
+        genui::MemoryHintOptions options;
+        options.hot_copy_bytes = mode == "copies" ? copy_mib << 20 : 0;
+        hints.attach(argv[1], options);
+        hints.advise_buffers(before_model.added());
+        hints.copy_hot_tensors(matmul_weights(model));
+    }
+
+    llama_context_params cparams = llama_context_default_params();
+    cparams.seed = 1234;
+    cparams.n_ctx = 2048;
+    cparams.n_batch = 512;
+    cparams.n_threads = threads;
+    cparams.n_threads_batch = threads;
+    const genui::MappingSnapshot before_context = genui::MappingSnapshot::take();
+    llama_context *ctx = llama_new_context_with_model(model, cparams);
+    if (!ctx) {
+        llama_free_model(model);
+        return 1;
+    }
+    if (hinted) {
+        hints.advise_buffers(before_context.added());
+    }
+
+    std::vector<llama_token> prompt(512);
+    const int n_prompt = llama_tokenize(model, kPrompt, static_cast<int>(std::strlen(kPrompt)), prompt.data(),
+                                        static_cast<int>(prompt.size()), true, true);
+    prompt.resize(std::max(n_prompt, 0));
+    const int n_vocab = llama_n_vocab(model);
+    bool ok = !prompt.empty() && llama_decode(ctx, llama_batch_get_one(prompt.data(), n_prompt, 0, 0)) == 0;
+    const double load_ms = std::chrono::duration<double, std::milli>(Clock::now() - load_start).count();
+    if (hinted) {
+        hints.enter_inference();
+    }
+    llama_token token = ok ? argmax(llama_get_logits(ctx), n_vocab) : 0;
+
+    // Opened before the decode steps start ggml's threads, so they inherit them.
+    TlbCounter loads(PERF_COUNT_HW_CACHE_RESULT_ACCESS);
+    TlbCounter misses(PERF_COUNT_HW_CACHE_RESULT_MISS);
+    loads.start();
+    misses.start();
+    const auto start = Clock::now();
+    for (int i = 0; ok && i < steps; ++i) {
+        ok = llama_decode(ctx, llama_batch_get_one(&token, 1, n_prompt + i, 0)) == 0;
+        token = argmax(llama_get_logits(ctx), n_vocab);
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    const int64_t n_misses = misses.stop();
+    const int64_t n_loads = loads.stop();
+
+    // Virtual machines often expose no TLB events; the tok/s column still holds.
+    std::printf("%-7s decode %.2f tok/s", mode.c_str(), steps / seconds);
+    if (!misses.available()) {
+        std::printf(", dTLB misses unavailable (%s)", misses.error());
+    } else {
+        std::printf(", dTLB misses %lld (%.0f per token)", static_cast<long long>(n_misses),
+                    static_cast<double>(n_misses) / steps);
+        if (loads.available() && n_loads > 0) {
+            std::printf(" of %lld loads (%.3f%%)", static_cast<long long>(n_loads), 100.0 * n_misses / n_loads);
+        }
+    }
+    std::printf(", load+prefill %.0f ms\n", load_ms);
+    if (hinted) {
+        std::printf("        %s\n", hints.stats().describe().c_str());
+    }
+
+    llama_free(ctx);
+    hints.clear();
+    llama_free_model(model);
+    llama_backend_free();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,208 @@
+// Host benchmark for the output stage (app/src/main/cpp/output_stage.*),
+// built and run by scripts/bench_output_stage.sh. It needs no llama.cpp or
+// model: the three vocabulary calls VocabPieces::build makes are stubbed with
+// a synthetic vocabulary (single bytes, common HTML chunks and an end-of-turn
+// control token), a generated ```html answer is tokenized greedily against
+// it, and the tokens are fed through an OutputStage the way the decode loop
+// does. llama_decode is stood in for by a sleep of a fixed length.
+//
+// Two schedules are timed over the same tokens:
+//   inline  - the decode thread waits for each token to clear the stage
+//             before the next decode, i.e. the old serial path plus the
+//             hand-off;
+//   staged  - the decode thread waits only for the previous token, as the
+//             decode loop does, so the stage's work overlaps the decode.
+// Reported per token: time the decode thread spends outside llama_decode,
+// the helper's processing time and the decode thread's wait on it.
+
+#include "output_stage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace genui;
+
+const char *const kChunks[] = {
+        "```html\n", "\n```", "<!DOCTYPE html>", "<html", "</html>", "<head>", "</head>", "<body>", "</body>",
+        "<style>", "</style>", "<div", "</div>", "<section", "</section>", "<ul>", "</ul>", "<li>", "</li>",
+        "<table>", "</table>", "<tr>", "</tr>", "<td>", "</td>", "<h2>", "</h2>", "<p>", "</p>", "<button",
+        "</button>", " class=\"", "\">", "\n  ", "\n    ", "\n      ", "color", "margin", "padding", ": ",
+        "px;", "Item ", "Row ", "Card ", "the ", "and ", "with ", "value", "total", "status", "active",
+};
+
+const char *const kEndOfTurn = "<|im_end|>";
+
+struct Vocab {
+    std::vector<std::string> pieces;
+    llama_token end_of_turn = -1;
+};
+
+Vocab &vocab() {
+    static Vocab v = [] {
+        Vocab built;
+        for (int c = 0; c < 256; ++c) {
+            built.pieces.emplace_back(1, static_cast<char>(c));
+        }
+        for (const char *chunk : kChunks) {
+            built.pieces.emplace_back(chunk);
+        }
+        built.end_of_turn = static_cast<llama_token>(built.pieces.size());
+        built.pieces.emplace_back(kEndOfTurn);
+        return built;
+    }();
+    return v;
+}
+
+// A valid answer with enough distinct content that the repetition detector
+// stays quiet: per card a heading, a list and a table row with numbers.
+std::string document(int cards) {
+    std::string doc = "```html\n<!DOCTYPE html>\n<html>\n<head>\n  <style>\n    .card { margin: 8px; padding: 4px; }"
+                      "\n  </style>\n</head>\n<body>";
+    for (int i = 0; i < cards; ++i) {
+        const std::string n = std::to_string(i);
+        doc += "\n  <section class=\"card\">\n    <h2>Card " + n + "</h2>\n    <ul>";
+        for (int j = 0; j < 3; ++j) {
+            doc += "\n      <li>Item " + n + "." + std::to_string(j) + " with value " +
+                   std::to_string((i * 37 + j * 11) % 1000) + "</li>";
+        }
+        doc += "\n    </ul>\n    <table>\n      <tr><td>Row " + n + "</td><td>total " + std::to_string(i * i) +
+               "</td><td>status active</td></tr>\n    </table>\n  </section>";
+    }
+    doc += "\n</body>\n</html>\n```";
+    return doc;
+}
+
+std::vector<llama_token> tokenize(const std::string &text) {
+    const Vocab &v = vocab();
+    std::vector<llama_token> tokens;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        llama_token best = static_cast<unsigned char>(text[pos]);
+        size_t best_len = 1;
+        for (size_t tok = 256; tok < v.pieces.size(); ++tok) {
+            const std::string &piece = v.pieces[tok];
+            if (static_cast<llama_token>(tok) != v.end_of_turn && piece.size() > best_len &&
+                text.compare(pos, piece.size(), piece) == 0) {
+                best = static_cast<llama_token>(tok);
+                best_len = piece.size();
+            }
+        }
+        tokens.push_back(best);
+        pos += best_len;
+    }
+    tokens.push_back(v.end_of_turn);
+    return tokens;
+}
+
+struct Result {
+    int32_t accepted = 0;
+    const char *stop_reason = nullptr;
+    double outside_decode_ms = 0.0;
+    OutputStage::Timing timing;
+};
+
+Result run(const VocabPieces &pieces, const PatternAutomaton &banned, const std::vector<llama_token> &tokens,
+           bool staged, std::chrono::microseconds decode_time) {
+    OutputStage stage(pieces, &banned, ValidationPolicy::kTruncate, 3, 2);
+    stage.start();
+    Result result;
+    double outside = 0.0;
+    llama_pos n_past = 64;
+    for (const llama_token tok : tokens) {
+        const auto begin = Clock::now();
+        StagedToken next;
+        next.token = tok;
+        next.n_past = ++n_past;
+        stage.submit(next);
+        stage.wait_processed(staged ? stage.submitted() - 1 : stage.submitted());
+        const bool done = stage.verdict() != StageVerdict::kContinue;
+        outside += std::chrono::duration<double, std::milli>(Clock::now() - begin).count();
+        if (done) {
+            break;
+        }
+        std::this_thread::sleep_for(decode_time);
+    }
+    stage.wait_idle();
+    result.accepted = stage.accepted();
+    result.stop_reason = stage.stop_reason();
+    result.outside_decode_ms = outside;
+    result.timing = stage.timing();
+    stage.finish();
+    return result;
+}
+
+}  // namespace
+
+// The vocabulary calls VocabPieces::build makes, served from the synthetic
+// vocabulary; with `special` unset the control token has no text, as in llama.cpp.
+int32_t llama_n_vocab(const llama_model *) {
+    return static_cast<int32_t>(vocab().pieces.size());
+}
+
+enum llama_token_type llama_token_get_type(const llama_model *, llama_token token) {
+    return token == vocab().end_of_turn ? LLAMA_TOKEN_TYPE_CONTROL : LLAMA_TOKEN_TYPE_NORMAL;
+}
+
+int32_t llama_token_to_piece(const llama_model *, llama_token token, char *buf, int32_t length, bool special) {
+    const std::string &piece = vocab().pieces[static_cast<size_t>(token)];
+    if (token == vocab().end_of_turn && !special) {
+        return 0;
+    }
+    const int32_t n = static_cast<int32_t>(piece.size());
+    if (n > length) {
+        return -n;
+    }
+    std::memcpy(buf, piece.data(), piece.size());
+    return n;
+}
+
+int main(int argc, char **argv) {
+    const int cards = argc > 1 ? std::atoi(argv[1]) : 40;
+    const int decode_us = argc > 2 ? std::atoi(argv[2]) : 20000;
+    const int reps = argc > 3 ? std::max(1, std::atoi(argv[3])) : 3;
+
+    int anchor = 0;
+    VocabPieces pieces;
+    if (!pieces.build(reinterpret_cast<const llama_model *>(&anchor))) {
+        std::fprintf(stderr, "failed to build the vocabulary table\n");
+        return 1;
+    }
+    PatternAutomaton banned;
+    banned.build(TokenMask::default_rules());
+
+    const std::string doc = document(cards);
+    const std::vector<llama_token> tokens = tokenize(doc);
+    std::printf("document: %zu bytes, %zu tokens (%zu in vocabulary), simulated decode %d us, best of %d\n",
+                doc.size(), tokens.size(), vocab().pieces.size(), decode_us, reps);
+
+    const std::chrono::microseconds decode_time(decode_us);
+    std::printf("%-8s %9s %-14s %18s %12s %12s\n", "mode", "accepted", "stop", "decode thread ms/t", "helper ms/t",
+                "wait ms/t");
+    for (const bool staged : {false, true}) {
+        Result best;
+        for (int r = 0; r < reps; ++r) {
+            const Result result = run(pieces, banned, tokens, staged, decode_time);
+            if (r == 0 || result.outside_decode_ms < best.outside_decode_ms) {
+                best = result;
+            }
+        }
+        const double per = best.timing.tokens > 0 ? 1.0 / static_cast<double>(best.timing.tokens) : 0.0;
+        std::printf("%-8s %9d %-14s %18.4f %12.4f %12.4f\n", staged ? "staged" : "inline", best.accepted,
+                    best.stop_reason ? best.stop_reason : "-", best.outside_decode_ms * per,
+                    best.timing.helper_ms * per, best.timing.wait_ms * per);
+        if (!best.stop_reason || std::strcmp(best.stop_reason, "closing fence") != 0) {
+            std::fprintf(stderr, "%s run did not end at the closing fence\n", staged ? "staged" : "inline");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,296 @@
+// Host benchmark for the weight repack kernels (app/src/main/cpp/
+// weight_repack_kernels.*), built and run by scripts/bench_repack_kernels.sh.
+// It needs no llama.cpp: random Q4_K and Q8_0 matrices with the projection
+// shapes of a Qwen2.5-Coder model are packed into the interleaved layout, the
+// packed groups are checked against a row-by-row dot product with ggml's
+// reference formulas, and one decode step's worth of matmuls (and a prefill
+// tile) is timed with each kernel set the CPU runs. It reports the packing
+// time and memory overhead WeightRepack pays at load and the kernel time per
+// token, not end-to-end tok/s through the patched ggml.
+
+#include "weight_repack_kernels.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using namespace genui::repack;
+
+struct Shape {
+    const char *name;
+    int rows;
+    int cols;
+};
+
+struct Model {
+    const char *name;
+    int layers;
+    std::vector<Shape> shapes;  // per layer: q, k, v, o, gate, up, down
+};
+
+static Model model(const std::string &name) {
+    if (name == "1.5b") {
+        return {"qwen2.5-coder-1.5b", 28,
+                {{"attn_q", 1536, 1536}, {"attn_k", 256, 1536}, {"attn_v", 256, 1536}, {"attn_output", 1536, 1536},
+                 {"ffn_gate", 8960, 1536}, {"ffn_up", 8960, 1536}, {"ffn_down", 1536, 8960}}};
+    }
+    return {"qwen2.5-coder-0.5b", 24,
+            {{"attn_q", 896, 896}, {"attn_k", 128, 896}, {"attn_v", 128, 896}, {"attn_output", 896, 896},
+             {"ffn_gate", 4864, 896}, {"ffn_up", 4864, 896}, {"ffn_down", 896, 4864}}};
+}
+
+static uint16_t float_to_half(float value) {
+    // Normal, positive values only, which is all the generator produces.
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return static_cast<uint16_t>((((bits >> 23) & 0xff) - 112) << 10 | ((bits >> 13) & 0x3ff));
+}
+
+static float half_to_float(uint16_t h) {
+    const uint32_t bits = (static_cast<uint32_t>((h >> 10) & 0x1f) + 112) << 23
+                          | static_cast<uint32_t>(h & 0x3ff) << 13;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void scale_min_k4(int j, const uint8_t *q, int &scale, int &min) {
+    if (j < 4) {
+        scale = q[j] & 63;
+        min = q[j + 4] & 63;
+    } else {
+        scale = (q[j + 4] & 0xf) | ((q[j - 4] >> 6) << 4);
+        min = (q[j + 4] >> 4) | ((q[j] >> 6) << 4);
+    }
+}
+
+// ggml's reference q4_K x q8_K and q8_0 x q8_0 dot products of one row.
+static float dot_q4_K(const BlockQ4K *x, const BlockQ8K *y, int nb) {
+    float sum = 0.0f;
+    for (int b = 0; b < nb; ++b) {
+        float block = 0.0f;
+        float mins = 0.0f;
+        for (int j = 0; j < 8; ++j) {
+            int scale;
+            int min;
+            scale_min_k4(j, x[b].scales, scale, min);
+            int32_t acc = 0;
+            for (int l = 0; l < 32; ++l) {
+                const uint8_t byte = x[b].qs[32 * (j / 2) + l];
+                acc += ((j % 2) ? byte >> 4 : byte & 0xf) * y[b].qs[32 * j + l];
+            }
+            block += static_cast<float>(scale * acc);
+            mins += static_cast<float>(min * (y[b].bsums[2 * j] + y[b].bsums[2 * j + 1]));
+        }
+        sum += y[b].d * (half_to_float(x[b].d) * block - half_to_float(x[b].dmin) * mins);
+    }
+    return sum;
+}
+
+static float dot_q8_0(const BlockQ80 *x, const BlockQ80 *y, int nb) {
+    float sum = 0.0f;
+    for (int b = 0; b < nb; ++b) {
+        int32_t acc = 0;
+        for (int l = 0; l < 32; ++l) {
+            acc += x[b].qs[l] * y[b].qs[l];
+        }
+        sum += half_to_float(x[b].d) * half_to_float(y[b].d) * static_cast<float>(acc);
+    }
+    return sum;
+}
+
+struct Matrix {
+    bool q4_K = true;
+    int rows = 0;
+    int nb = 0;  // blocks per row
+    std::vector<uint8_t> source;
+    std::vector<uint8_t> packed;
+    size_t group_bytes = 0;
+};
+
+static Matrix make_matrix(bool q4_K, int rows, int cols, std::mt19937 &rng) {
+    Matrix m;
+    m.q4_K = q4_K;
+    m.rows = rows;
+    m.nb = cols / (q4_K ? 256 : 32);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_real_distribution<float> scale(0.001f, 0.05f);
+    const size_t block = q4_K ? sizeof(BlockQ4K) : sizeof(BlockQ80);
+    m.source.resize(static_cast<size_t>(rows) * m.nb * block);
+    for (uint8_t &b : m.source) {
+        b = static_cast<uint8_t>(byte(rng));
+    }
+    for (size_t i = 0; i < static_cast<size_t>(rows) * m.nb; ++i) {
+        if (q4_K) {
+            auto *blk = reinterpret_cast<BlockQ4K *>(m.source.data()) + i;
+            blk->d = float_to_half(scale(rng));
+            blk->dmin = float_to_half(scale(rng));
+        } else {
+            reinterpret_cast<BlockQ80 *>(m.source.data())[i].d = float_to_half(scale(rng));
+        }
+    }
+    m.group_bytes = m.nb * (q4_K ? sizeof(BlockQ4Kx4) : sizeof(BlockQ80x4));
+    m.packed.resize(m.group_bytes * (rows / kRows));
+    return m;
+}
+
+static void pack(Matrix &m) {
+    for (int g = 0; g < m.rows / kRows; ++g) {
+        uint8_t *out = m.packed.data() + g * m.group_bytes;
+        if (m.q4_K) {
+            const BlockQ4K *rows[kRows];
+            for (int r = 0; r < kRows; ++r) {
+                rows[r] = reinterpret_cast<const BlockQ4K *>(m.source.data()) + (g * kRows + r) * m.nb;
+            }
+            pack_q4_K(rows, m.nb, reinterpret_cast<BlockQ4Kx4 *>(out));
+        } else {
+            const BlockQ80 *rows[kRows];
+            for (int r = 0; r < kRows; ++r) {
+                rows[r] = reinterpret_cast<const BlockQ80 *>(m.source.data()) + (g * kRows + r) * m.nb;
+            }
+            pack_q8_0(rows, m.nb, reinterpret_cast<BlockQ80x4 *>(out));
+        }
+    }
+}
+
+// `ncols` activation columns of the vec_dot type for a matrix with `nb` blocks per row.
+static std::vector<uint8_t> make_columns(bool q4_K, int nb, int ncols, std::mt19937 &rng) {
+    std::uniform_int_distribution<int> quant(-127, 127);
+    std::vector<uint8_t> data(static_cast<size_t>(ncols) * nb * (q4_K ? sizeof(BlockQ8K) : sizeof(BlockQ80)));
+    for (int i = 0; i < ncols * nb; ++i) {
+        if (q4_K) {
+            auto &y = reinterpret_cast<BlockQ8K *>(data.data())[i];
+            y.d = 0.01f;
+            for (int g = 0; g < 16; ++g) {
+                int sum = 0;
+                for (int l = 0; l < 16; ++l) {
+                    y.qs[16 * g + l] = static_cast<int8_t>(quant(rng));
+                    sum += y.qs[16 * g + l];
+                }
+                y.bsums[g] = static_cast<int16_t>(sum);
+            }
+        } else {
+            auto &y = reinterpret_cast<BlockQ80 *>(data.data())[i];
+            y.d = float_to_half(0.01f);
+            for (int8_t &q : y.qs) {
+                q = static_cast<int8_t>(quant(rng));
+            }
+        }
+    }
+    return data;
+}
+
+static void multiply(const Matrix &m, const Kernels &kernels, const std::vector<uint8_t> &columns, int ncols,
+                     float *dst) {
+    const GroupKernel kernel = m.q4_K ? kernels.q4_K : kernels.q8_0;
+    for (int g = 0; g < m.rows / kRows; ++g) {
+        kernel(m.packed.data() + g * m.group_bytes, m.nb, columns.data(), ncols, dst + g * kRows, m.rows);
+    }
+}
+
+// Largest |kernel - reference| relative to the largest |reference| of the matrix.
+static double check(const Matrix &m, const Kernels &kernels, const std::vector<uint8_t> &columns, int ncols) {
+    std::vector<float> out(static_cast<size_t>(m.rows) * ncols);
+    multiply(m, kernels, columns, ncols, out.data());
+    double worst = 0.0;
+    double scale = 0.0;
+    for (int c = 0; c < ncols; ++c) {
+        for (int r = 0; r < m.rows; ++r) {
+            float ref;
+            if (m.q4_K) {
+                ref = dot_q4_K(reinterpret_cast<const BlockQ4K *>(m.source.data()) + r * m.nb,
+                               reinterpret_cast<const BlockQ8K *>(columns.data()) + c * m.nb, m.nb);
+            } else {
+                ref = dot_q8_0(reinterpret_cast<const BlockQ80 *>(m.source.data()) + r * m.nb,
+                               reinterpret_cast<const BlockQ80 *>(columns.data()) + c * m.nb, m.nb);
+            }
+            worst = std::max(worst, std::fabs(static_cast<double>(out[c * m.rows + r]) - ref));
+            scale = std::max(scale, std::fabs(static_cast<double>(ref)));
+        }
+    }
+    return scale > 0.0 ? worst / scale : worst;
+}
+
+static double mib(size_t bytes) {
+    return static_cast<double>(bytes) / (1024.0 * 1024.0);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    const Model spec = model(argc > 1 ? argv[1] : "0.5b");
+    const bool q4_K = !(argc > 2 && std::strcmp(argv[2], "q8_0") == 0);
+    const int reps = argc > 3 ? std::max(1, std::atoi(argv[3])) : 5;
+    const int prefill_cols = 32;
+
+    std::vector<const Kernels *> sets = {&scalar_kernels()};
+    if (avx2_kernels() && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        sets.push_back(avx2_kernels());
+    }
+    if (dotprod_kernels()) {
+        sets.push_back(dotprod_kernels());
+    }
+
+    // One layer's matrices stand in for every layer: the work per layer is identical.
+    std::mt19937 rng(1234);
+    std::vector<Matrix> layer;
+    size_t source_bytes = 0;
+    size_t packed_bytes = 0;
+    double pack_ms = 0.0;
+    for (const Shape &shape : spec.shapes) {
+        layer.push_back(make_matrix(q4_K, shape.rows, shape.cols, rng));
+        const auto start = Clock::now();
+        pack(layer.back());
+        pack_ms += std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        source_bytes += layer.back().source.size();
+        packed_bytes += layer.back().packed.size();
+    }
+
+    std::printf("model=%s type=%s layers=%d (one layer timed, scaled by the layer count)\n", spec.name,
+                q4_K ? "q4_K" : "q8_0", spec.layers);
+    std::printf("repack: %.1f MiB -> %.1f MiB (%+.1f%%), %.0f ms single-threaded\n", mib(source_bytes) * spec.layers,
+                mib(packed_bytes) * spec.layers, (static_cast<double>(packed_bytes) / source_bytes - 1.0) * 100.0,
+                pack_ms * spec.layers);
+
+    bool ok = true;
+    std::printf("%-14s %10s %14s %14s\n", "kernels", "max rel err", "decode ms/tok", "prefill ms/tok");
+    for (const Kernels *kernels : sets) {
+        double err = 0.0;
+        double decode_ms = 0.0;
+        double prefill_ms = 0.0;
+        for (const Matrix &m : layer) {
+            const std::vector<uint8_t> one = make_columns(q4_K, m.nb, 1, rng);
+            const std::vector<uint8_t> many = make_columns(q4_K, m.nb, prefill_cols, rng);
+            err = std::max({err, check(m, *kernels, one, 1), check(m, *kernels, many, prefill_cols)});
+            std::vector<float> out(static_cast<size_t>(m.rows) * prefill_cols);
+            double best_decode = 1e30;
+            double best_prefill = 1e30;
+            for (int rep = 0; rep < reps; ++rep) {
+                auto start = Clock::now();
+                multiply(m, *kernels, one, 1, out.data());
+                best_decode = std::min(best_decode,
+                                       std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+                start = Clock::now();
+                multiply(m, *kernels, many, prefill_cols, out.data());
+                best_prefill = std::min(best_prefill,
+                                        std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+            }
+            decode_ms += best_decode;
+            prefill_ms += best_prefill / prefill_cols;
+        }
+        ok = ok && err < 1e-4;
+        std::printf("%-14s %10.2e %14.2f %14.2f\n", kernels->name, err, decode_ms * spec.layers,
+                    prefill_ms * spec.layers);
+    }
+    std::printf("%s\n", ok ? "ok" : "MISMATCH");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,144 @@
+// Host concurrency report for the continuous-batching Scheduler
+// (app/src/main/cpp/scheduler.*), built and run by scripts/bench_scheduler.sh
+// against stock llama.cpp. It sets up the context the way the bridge does
+// (8192 shared cells, kMaxSequences sequences, the token mask) and, for each
+// concurrency level from 1 to 8, submits that many distinct prompts at once
+// and waits for all of them. Each level reports the aggregate generated
+// tokens per second over its wall time, and per request the mean and worst
+// time to first token and total latency, all measured from submit.
+
+#include "cpu_topology.h"
+#include "scheduler.h"
+#include "token_mask.h"
+#include "vocab_pieces.h"
+
+#include "llama.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <string>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Distinct requests, so the scheduler's single-flight does not coalesce them.
+const char *const kScreens[] = {
+    "a login form with email, password and a remember-me switch",
+    "a settings page with three toggles and a save button",
+    "a weather card for three days with icons drawn in SVG",
+    "a shopping cart with two items, quantities and a checkout button",
+    "a music player with play, pause and a progress bar",
+    "a profile header with an avatar, name and follow button",
+    "a to-do list with four items and an add button",
+    "a pricing table with three plans",
+};
+
+static std::vector<llama_token> tokenize(const llama_model *model, const std::string &text) {
+    std::vector<llama_token> tokens(text.size() + 16);
+    const int n = llama_tokenize(model, text.c_str(), static_cast<int>(text.size()), tokens.data(),
+                                 static_cast<int>(tokens.size()), true, true);
+    tokens.resize(std::max(n, 0));
+    return tokens;
+}
+
+static std::string prompt_for(const char *screen) {
+    return std::string("<|im_start|>system\nYou generate compact HTML user interfaces.<|im_end|>\n"
+                       "<|im_start|>user\nCreate ") + screen + ".<|im_end|>\n<|im_start|>assistant\n";
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s model.gguf [threads] [max tokens]\n", argv[0]);
+        return 1;
+    }
+    const int threads = argc > 2 ? std::atoi(argv[2]) : 4;
+    const int max_tokens = argc > 3 ? std::atoi(argv[3]) : 128;
+
+    llama_backend_init();
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    llama_model *model = llama_load_model_from_file(argv[1], mparams);
+    if (!model) {
+        std::fprintf(stderr, "failed to load %s\n", argv[1]);
+        return 1;
+    }
+    llama_context_params cparams = llama_context_default_params();
+    cparams.seed = 1234;
+    cparams.n_ctx = 8192;
+    cparams.n_batch = 512;
+    cparams.n_seq_max = genui::Scheduler::kMaxSequences;
+    cparams.n_threads = threads;
+    cparams.n_threads_batch = threads;
+    llama_context *ctx = llama_new_context_with_model(model, cparams);
+
+    genui::VocabPieces pieces;
+    genui::TokenMask token_mask;
+    genui::GrammarMask grammar;
+    if (!ctx || !pieces.build(model) || !token_mask.build(pieces, genui::TokenMask::default_rules())) {
+        std::fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+
+    const genui::CpuTopology topology = genui::CpuTopology::discover();
+    genui::Scheduler::Resources resources;
+    resources.ctx = ctx;
+    resources.model = model;
+    resources.pieces = &pieces;
+    resources.token_mask = &token_mask;
+    resources.grammar = &grammar;
+    resources.batch_size = cparams.n_batch;
+    resources.prefill_threads = topology.thread_set(genui::CoreClass::kAll, threads);
+    resources.decode_threads = resources.prefill_threads;
+    genui::Scheduler scheduler(resources);
+    scheduler.start();
+
+    genui::GenerationParams params;
+    params.max_tokens = max_tokens;
+
+    std::printf("threads=%d max_tokens=%d\n", threads, max_tokens);
+    std::printf("%-11s %9s %11s %11s %11s %11s %11s\n", "concurrent", "tokens", "agg tok/s", "ttft mean", "ttft max",
+                "total mean", "total max");
+    bool ok = true;
+    for (int concurrent = 1; concurrent <= genui::Scheduler::kMaxSequences; ++concurrent) {
+        std::vector<std::future<genui::GenerationResult>> futures;
+        const auto start = Clock::now();
+        for (int i = 0; i < concurrent; ++i) {
+            futures.push_back(scheduler.submit(tokenize(model, prompt_for(kScreens[i])), params));
+        }
+        int64_t tokens = 0;
+        double ttft_sum = 0.0;
+        double ttft_max = 0.0;
+        double total_sum = 0.0;
+        double total_max = 0.0;
+        for (auto &future : futures) {
+            const genui::GenerationResult result = future.get();
+            if (result.text.rfind("[error]", 0) == 0) {
+                std::fprintf(stderr, "request failed: %s\n", result.text.c_str());
+                ok = false;
+            }
+            tokens += result.tokens;
+            ttft_sum += result.first_token_ms;
+            ttft_max = std::max(ttft_max, result.first_token_ms);
+            total_sum += result.total_ms;
+            total_max = std::max(total_max, result.total_ms);
+        }
+        const double wall = std::chrono::duration<double>(Clock::now() - start).count();
+        std::printf("%-11d %9lld %11.2f %8.0f ms %8.0f ms %8.0f ms %8.0f ms\n", concurrent,
+                    static_cast<long long>(tokens), tokens / wall, ttft_sum / concurrent, ttft_max,
+                    total_sum / concurrent, total_max);
+    }
+
+    scheduler.stop();
+    llama_free(ctx);
+    llama_free_model(model);
+    llama_backend_free();
+    return ok ? 0 : 1;
+}